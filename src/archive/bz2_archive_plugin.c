@@ -33,19 +33,76 @@
 #include <glib.h>
 #include <bzlib.h>
 
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "bz2"
+
 #ifdef HAVE_OLDER_BZIP2
 #define BZ2_bzDecompressInit bzDecompressInit
 #define BZ2_bzDecompress bzDecompress
 #endif
 
+/**
+ * The magic numbers which start a block and the end-of-stream
+ * trailer.  They are not byte aligned in the compressed data.
+ */
+static const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359ULL;
+static const uint64_t BZ2_EOS_MAGIC = 0x177245385090ULL;
+
+#define BZ2_NO_MAGIC G_MAXUINT64
+
+/**
+ * The start of a compressed block.  Decompression can be resumed
+ * here by passing the block to libbz2 after a fake stream header.
+ */
+struct bz2_checkpoint {
+	/**
+	 * The position of the block's magic number in the compressed
+	 * file, in bits.
+	 */
+	uint64_t bit;
+
+	/**
+	 * The uncompressed offset of the block's first byte.
+	 */
+	goffset offset;
+};
+
 struct bz2_archive_file {
 	struct archive_file base;
 
 	struct refcount ref;
 
+	/**
+	 * The path of the compressed file.  Each stream opens it
+	 * separately.
+	 */
+	char *path;
+
 	char *name;
 	bool reset;
-	struct input_stream *istream;
+
+	/**
+	 * Protects the following attributes, which are shared by all
+	 * streams of this archive.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * The block size character of the stream header ('1' to
+	 * '9'), or 0 if not yet known.
+	 */
+	char level;
+
+	/**
+	 * An array of struct bz2_checkpoint, sorted by position.  It
+	 * is filled while the file is being decompressed.
+	 */
+	GArray *checkpoints;
+
+	/**
+	 * The uncompressed size, or -1 if not yet known.
+	 */
+	goffset size;
 };
 
 struct bz2_input_stream {
@@ -53,10 +110,73 @@ struct bz2_input_stream {
 
 	struct bz2_archive_file *archive;
 
+	/**
+	 * The compressed file.
+	 */
+	struct input_stream *input;
+
 	bool eof;
 
+	/**
+	 * Has decompression been resumed from a checkpoint?  In this
+	 * case, the end-of-stream trailer is not passed to libbz2,
+	 * because its combined CRC covers the skipped blocks, too.
+	 * The CRC of each block is still verified.
+	 */
+	bool resumed;
+
+	/**
+	 * The position of the checkpoint decompression was resumed
+	 * from.
+	 */
+	uint64_t resumed_bit;
+
+	/**
+	 * The block size character parsed from the stream header.
+	 */
+	char level;
+
 	bz_stream bzstream;
 
+	/**
+	 * The position of the next bit to be passed to libbz2.
+	 */
+	uint64_t bit;
+
+	/**
+	 * Compressed data read from #input, starting at byte
+	 * #raw_position.
+	 */
+	goffset raw_position;
+	size_t raw_length;
+	bool raw_eof;
+
+	/**
+	 * The scanner looks for magic numbers ahead of the data which
+	 * is passed to libbz2.  This is the position of the next byte
+	 * to be scanned, the position of the first byte which was
+	 * scanned, and the last 64 bits scanned.
+	 */
+	goffset scan_position, scan_first;
+	uint64_t scan_bits;
+
+	/**
+	 * The position of the next magic number found by the scanner
+	 * (in bits), or #BZ2_NO_MAGIC.
+	 */
+	uint64_t magic;
+
+	/**
+	 * Is #magic the end-of-stream trailer?
+	 */
+	bool magic_eos;
+
+	unsigned char raw[5000];
+
+	/**
+	 * The data passed to libbz2: #raw shifted to byte alignment,
+	 * or the fake stream header.
+	 */
 	char buffer[5000];
 };
 
@@ -84,8 +204,6 @@ bz2_alloc(struct bz2_input_stream *data, GError **error_r)
 
 	ret = BZ2_bzDecompressInit(&data->bzstream, 0, 0);
 	if (ret != BZ_OK) {
-		g_free(data);
-
 		g_set_error(error_r, bz2_quark(), ret,
 			    "BZ2_bzDecompressInit() has failed");
 		return false;
@@ -100,10 +218,88 @@ bz2_destroy(struct bz2_input_stream *data)
 	BZ2_bzDecompressEnd(&data->bzstream);
 }
 
+/* checkpoint management */
+
+static void
+bz2_add_checkpoint(struct bz2_archive_file *context, char level,
+		   uint64_t bit, goffset offset)
+{
+	const struct bz2_checkpoint checkpoint = {
+		.bit = bit,
+		.offset = offset,
+	};
+	unsigned i;
+
+	g_mutex_lock(context->mutex);
+
+	if (context->level == 0)
+		context->level = level;
+
+	/* the checkpoints are usually appended */
+	i = context->checkpoints->len;
+	while (i > 0 && g_array_index(context->checkpoints,
+				      struct bz2_checkpoint, i - 1).bit >= bit)
+		--i;
+
+	if (i == context->checkpoints->len ||
+	    g_array_index(context->checkpoints,
+			  struct bz2_checkpoint, i).bit != bit)
+		g_array_insert_val(context->checkpoints, i, checkpoint);
+
+	g_mutex_unlock(context->mutex);
+}
+
+/**
+ * Finds the last checkpoint before the specified uncompressed offset.
+ */
+static bool
+bz2_find_checkpoint(struct bz2_archive_file *context, goffset offset,
+		    struct bz2_checkpoint *checkpoint_r)
+{
+	const struct bz2_checkpoint *checkpoints;
+	unsigned left = 0, right;
+
+	g_mutex_lock(context->mutex);
+
+	checkpoints = (const struct bz2_checkpoint *)
+		context->checkpoints->data;
+	right = context->checkpoints->len;
+	while (left < right) {
+		unsigned middle = (left + right) / 2;
+		if (checkpoints[middle].offset < offset)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	if (left > 0)
+		*checkpoint_r = checkpoints[left - 1];
+
+	g_mutex_unlock(context->mutex);
+
+	return left > 0;
+}
+
+static void
+bz2_remove_checkpoint(struct bz2_archive_file *context, uint64_t bit)
+{
+	g_mutex_lock(context->mutex);
+
+	for (unsigned i = 0; i < context->checkpoints->len; ++i) {
+		if (g_array_index(context->checkpoints,
+				  struct bz2_checkpoint, i).bit == bit) {
+			g_array_remove_index(context->checkpoints, i);
+			break;
+		}
+	}
+
+	g_mutex_unlock(context->mutex);
+}
+
 /* archive open && listing routine */
 
 static struct archive_file *
-bz2_open(const char *pathname, GError **error_r)
+bz2_open(const char *pathname, G_GNUC_UNUSED GError **error_r)
 {
 	struct bz2_archive_file *context;
 	int len;
@@ -112,13 +308,7 @@ bz2_open(const char *pathname, GError **error_r)
 	archive_file_init(&context->base, &bz2_archive_plugin);
 	refcount_init(&context->ref);
 
-	//open archive
-	context->istream = input_stream_open(pathname, error_r);
-	if (context->istream == NULL) {
-		g_free(context);
-		return NULL;
-	}
-
+	context->path = g_strdup(pathname);
 	context->name = g_path_get_basename(pathname);
 
 	//remove suffix
@@ -127,6 +317,12 @@ bz2_open(const char *pathname, GError **error_r)
 		context->name[len - 4] = 0; //remove .bz2 suffix
 	}
 
+	context->mutex = g_mutex_new();
+	context->level = 0;
+	context->checkpoints = g_array_new(false, false,
+					   sizeof(struct bz2_checkpoint));
+	context->size = -1;
+
 	return &context->base;
 }
 
@@ -159,34 +355,107 @@ bz2_close(struct archive_file *file)
 	if (!refcount_dec(&context->ref))
 		return;
 
+	g_free(context->path);
 	g_free(context->name);
 
-	input_stream_close(context->istream);
+	g_array_free(context->checkpoints, true);
+	g_mutex_free(context->mutex);
 	g_free(context);
 }
 
 /* single archive handling */
 
+/**
+ * Starts decompressing at the specified checkpoint, or at the
+ * beginning of the file if it is NULL.
+ */
+static bool
+bz2_restart(struct bz2_input_stream *bis,
+	    const struct bz2_checkpoint *checkpoint, GError **error_r)
+{
+	uint64_t bit = checkpoint != NULL ? checkpoint->bit : 0;
+
+	if (!input_stream_seek(bis->input, bit / 8, SEEK_SET, error_r))
+		return false;
+
+	bz2_destroy(bis);
+	if (!bz2_alloc(bis, error_r))
+		return false;
+
+	bis->eof = false;
+	bis->bit = bit;
+	bis->raw_position = bit / 8;
+	bis->raw_length = 0;
+	bis->raw_eof = false;
+	bis->magic = BZ2_NO_MAGIC;
+	bis->scan_bits = 0;
+
+	if (checkpoint != NULL) {
+		/* the block's own magic number begins in the first
+		   byte, skip it */
+		bis->scan_position = bis->scan_first = bit / 8 + 1;
+
+		bis->resumed = true;
+		bis->resumed_bit = bit;
+		bis->level = bis->archive->level;
+
+		bis->buffer[0] = 'B';
+		bis->buffer[1] = 'Z';
+		bis->buffer[2] = 'h';
+		bis->buffer[3] = bis->level;
+		bis->bzstream.next_in = bis->buffer;
+		bis->bzstream.avail_in = 4;
+
+		bis->base.offset = checkpoint->offset;
+	} else {
+		bis->scan_position = bis->scan_first = 0;
+		bis->resumed = false;
+		bis->base.offset = 0;
+	}
+
+	return true;
+}
+
 static struct input_stream *
 bz2_open_stream(struct archive_file *file, const char *path, GError **error_r)
 {
 	struct bz2_archive_file *context = (struct bz2_archive_file *) file;
 	struct bz2_input_stream *bis = g_new(struct bz2_input_stream, 1);
 
+	bis->input = input_stream_open(context->path, error_r);
+	if (bis->input == NULL) {
+		g_free(bis);
+		return NULL;
+	}
+
 	input_stream_init(&bis->base, &bz2_inputplugin, path);
 
 	bis->archive = context;
 
 	bis->base.ready = true;
-	bis->base.seekable = false;
+	bis->base.seekable = bis->input->seekable;
+
+	g_mutex_lock(context->mutex);
+	bis->base.size = context->size;
+	g_mutex_unlock(context->mutex);
 
 	if (!bz2_alloc(bis, error_r)) {
+		input_stream_close(bis->input);
 		input_stream_deinit(&bis->base);
 		g_free(bis);
 		return NULL;
 	}
 
 	bis->eof = false;
+	bis->resumed = false;
+	bis->level = 0;
+	bis->bit = 0;
+	bis->raw_position = 0;
+	bis->raw_length = 0;
+	bis->raw_eof = false;
+	bis->scan_position = bis->scan_first = 0;
+	bis->scan_bits = 0;
+	bis->magic = BZ2_NO_MAGIC;
 
 	refcount_inc(&context->ref);
 
@@ -199,6 +468,7 @@ bz2_is_close(struct input_stream *is)
 	struct bz2_input_stream *bis = (struct bz2_input_stream *)is;
 
 	bz2_destroy(bis);
+	input_stream_close(bis->input);
 
 	bz2_close(&bis->archive->base);
 
@@ -206,25 +476,138 @@ bz2_is_close(struct input_stream *is)
 	g_free(bis);
 }
 
+/**
+ * Reads more compressed data, discarding data which has been passed
+ * to libbz2 already.
+ */
+static bool
+bz2_read_raw(struct bz2_input_stream *bis, GError **error_r)
+{
+	size_t skip = bis->bit / 8 - bis->raw_position;
+	size_t nbytes;
+	GError *error = NULL;
+
+	if (skip > bis->raw_length)
+		skip = bis->raw_length;
+
+	memmove(bis->raw, bis->raw + skip, bis->raw_length - skip);
+	bis->raw_position += skip;
+	bis->raw_length -= skip;
+
+	nbytes = input_stream_read(bis->input, bis->raw + bis->raw_length,
+				   sizeof(bis->raw) - bis->raw_length,
+				   &error);
+	if (nbytes == 0) {
+		if (error != NULL) {
+			g_propagate_error(error_r, error);
+			return false;
+		}
+
+		bis->raw_eof = true;
+	}
+
+	bis->raw_length += nbytes;
+
+	if (bis->raw_position == 0 && bis->raw_length >= 4 &&
+	    memcmp(bis->raw, "BZh", 3) == 0 &&
+	    bis->raw[3] >= '1' && bis->raw[3] <= '9')
+		bis->level = bis->raw[3];
+
+	return true;
+}
+
+/**
+ * Scans the compressed data for the next magic number, unless one
+ * has already been found.
+ */
+static void
+bz2_scan(struct bz2_input_stream *bis)
+{
+	const goffset end = bis->raw_position + bis->raw_length;
+
+	while (bis->magic == BZ2_NO_MAGIC && bis->scan_position < end) {
+		bis->scan_bits = (bis->scan_bits << 8) |
+			bis->raw[bis->scan_position - bis->raw_position];
+
+		/* try all 8 alignments, earliest first */
+		for (int shift = 7; shift >= 0; --shift) {
+			uint64_t value = (bis->scan_bits >> shift) &
+				G_GUINT64_CONSTANT(0xffffffffffff);
+			goffset start = bis->scan_position * 8 + 8 - shift - 48;
+
+			if ((value == BZ2_BLOCK_MAGIC ||
+			     value == BZ2_EOS_MAGIC) &&
+			    start >= bis->scan_first * 8) {
+				bis->magic = start;
+				bis->magic_eos = value == BZ2_EOS_MAGIC;
+				break;
+			}
+		}
+
+		++bis->scan_position;
+	}
+}
+
+/**
+ * Has all data up to the magic number found by the scanner been
+ * passed to libbz2?  When libbz2 runs out of input at this point,
+ * it has emitted all data before the magic number.
+ *
+ * The end-of-stream trailer is only a stop when decompression was
+ * resumed from a checkpoint; otherwise libbz2 shall verify it.
+ */
+static bool
+bz2_at_magic(const struct bz2_input_stream *bis)
+{
+	return bis->magic != BZ2_NO_MAGIC && bis->bit > bis->magic &&
+		(!bis->magic_eos || bis->resumed);
+}
+
+/**
+ * Passes more compressed data to libbz2, up to the next magic
+ * number.  The data is shifted to byte alignment if decompression
+ * was resumed from a checkpoint.
+ */
 static bool
 bz2_fillbuffer(struct bz2_input_stream *bis, GError **error_r)
 {
-	size_t count;
+	const unsigned shift = bis->bit % 8;
 	bz_stream *bzstream;
+	size_t length = 0;
 
 	bzstream = &bis->bzstream;
 
 	if (bzstream->avail_in > 0)
 		return true;
 
-	count = input_stream_read(bis->archive->istream,
-				  bis->buffer, sizeof(bis->buffer),
-				  error_r);
-	if (count == 0)
-		return false;
+	while (length < sizeof(bis->buffer) && !bz2_at_magic(bis)) {
+		/* a magic number which begins in the next byte must
+		   be known before that byte is passed on */
+		const goffset needed = bis->bit / 8 + 8;
+		size_t i;
+		unsigned char value;
+
+		if (bis->raw_position + (goffset)bis->raw_length < needed &&
+		    !bis->raw_eof && !bz2_read_raw(bis, error_r))
+			return false;
+
+		bz2_scan(bis);
+
+		i = bis->bit / 8 - bis->raw_position;
+		if (i >= bis->raw_length)
+			/* end of file */
+			break;
+
+		value = bis->raw[i] << shift;
+		if (shift > 0 && i + 1 < bis->raw_length)
+			value |= bis->raw[i + 1] >> (8 - shift);
+
+		bis->buffer[length++] = value;
+		bis->bit += 8;
+	}
 
 	bzstream->next_in = bis->buffer;
-	bzstream->avail_in = count;
+	bzstream->avail_in = length;
 	return true;
 }
 
@@ -248,6 +631,12 @@ bz2_is_read(struct input_stream *is, void *ptr, size_t length,
 		if (!bz2_fillbuffer(bis, error_r))
 			return 0;
 
+		if (bzstream->avail_in == 0 && !bz2_at_magic(bis)) {
+			/* the file is truncated */
+			bis->eof = true;
+			break;
+		}
+
 		bz_result = BZ2_bzDecompress(bzstream);
 
 		if (bz_result == BZ_STREAM_END) {
@@ -260,11 +649,38 @@ bz2_is_read(struct input_stream *is, void *ptr, size_t length,
 				    "BZ2_bzDecompress() has failed");
 			return 0;
 		}
+
+		if (bzstream->avail_in == 0 && bzstream->avail_out > 0 &&
+		    bz2_at_magic(bis)) {
+			/* libbz2 has stopped before the magic number:
+			   everything before it has been decompressed */
+			goffset offset = is->offset +
+				(length - bzstream->avail_out);
+
+			if (bis->magic_eos) {
+				bis->eof = true;
+				break;
+			}
+
+			if (offset > 0 && bis->level != 0)
+				bz2_add_checkpoint(bis->archive, bis->level,
+						   bis->magic, offset);
+
+			bis->magic = BZ2_NO_MAGIC;
+		}
 	} while (bzstream->avail_out == length);
 
 	nbytes = length - bzstream->avail_out;
 	is->offset += nbytes;
 
+	if (bis->eof) {
+		g_mutex_lock(bis->archive->mutex);
+		bis->archive->size = is->offset;
+		g_mutex_unlock(bis->archive->mutex);
+
+		is->size = is->offset;
+	}
+
 	return nbytes;
 }
 
@@ -276,6 +692,101 @@ bz2_is_eof(struct input_stream *is)
 	return bis->eof;
 }
 
+/**
+ * Decompresses and discards data until the specified offset is
+ * reached.
+ */
+static bool
+bz2_skip(struct bz2_input_stream *bis, goffset offset, GError **error_r)
+{
+	char buffer[8192];
+
+	while (bis->base.offset < offset) {
+		size_t length = sizeof(buffer);
+		if ((goffset)length > offset - bis->base.offset)
+			length = offset - bis->base.offset;
+
+		if (bz2_is_read(&bis->base, buffer, length, error_r) == 0) {
+			if (bis->eof) {
+				g_set_error(error_r, bz2_quark(), 0,
+					    "Seek beyond end of file");
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+bz2_is_seek(struct input_stream *is, goffset offset, int whence,
+	    GError **error_r)
+{
+	struct bz2_input_stream *bis = (struct bz2_input_stream *)is;
+	struct bz2_checkpoint checkpoint;
+	GError *error = NULL;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+
+	case SEEK_CUR:
+		offset += is->offset;
+		break;
+
+	case SEEK_END:
+		if (is->size < 0) {
+			g_set_error(error_r, bz2_quark(), 0,
+				    "Size is unknown");
+			return false;
+		}
+
+		offset += is->size;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (offset < 0) {
+		g_set_error(error_r, bz2_quark(), 0, "Invalid offset");
+		return false;
+	}
+
+	while (true) {
+		bool found = bz2_find_checkpoint(bis->archive, offset,
+						 &checkpoint);
+
+		/* resume from the checkpoint unless the current
+		   position is closer */
+		if (offset < is->offset ||
+		    (found && checkpoint.offset > is->offset)) {
+			if (!bz2_restart(bis, found ? &checkpoint : NULL,
+					 error_r))
+				return false;
+		}
+
+		if (bz2_skip(bis, offset, &error))
+			return true;
+
+		if (!bis->resumed || bis->eof) {
+			g_propagate_error(error_r, error);
+			return false;
+		}
+
+		/* the scanner has found a false magic number inside
+		   a block; forget this checkpoint and start over */
+		g_debug("discarding checkpoint at bit %" G_GUINT64_FORMAT
+			": %s", bis->resumed_bit, error->message);
+		g_clear_error(&error);
+		bz2_remove_checkpoint(bis->archive, bis->resumed_bit);
+
+		if (!bz2_restart(bis, NULL, error_r))
+			return false;
+	}
+}
+
 /* exported structures */
 
 static const char *const bz2_extensions[] = {
@@ -287,6 +798,7 @@ static const struct input_plugin bz2_inputplugin = {
 	.close = bz2_is_close,
 	.read = bz2_is_read,
 	.eof = bz2_is_eof,
+	.seek = bz2_is_seek,
 };
 
 const struct archive_plugin bz2_archive_plugin = {
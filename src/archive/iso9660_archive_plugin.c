@@ -40,9 +40,30 @@ struct iso9660_archive_file {
 
 	struct refcount ref;
 
+	/**
+	 * Protects #iso, which is shared by all streams of this
+	 * archive.
+	 */
+	GMutex *mutex;
+
 	iso9660_t *iso;
 	GSList	*list;
 	GSList	*iter;
+
+	/**
+	 * Maps the path of each member (the strings in #list) to a
+	 * struct iso9660_member, so opening a member does not need
+	 * to walk the directories again.
+	 */
+	GHashTable *members;
+};
+
+/**
+ * The location of a file within the ISO image.
+ */
+struct iso9660_member {
+	lsn_t lsn;
+	uint32_t size;
 };
 
 static const struct input_plugin iso9660_input_plugin;
@@ -81,9 +102,16 @@ listdir_recur(const char *psz_path, struct iso9660_archive_file *context)
 				listdir_recur(pathname, context);
 			}
 		} else {
+			struct iso9660_member *member =
+				g_new(struct iso9660_member, 1);
+			member->lsn = statbuf->lsn;
+			member->size = statbuf->size;
+
 			//remove leading /
 			context->list = g_slist_prepend( context->list,
 				g_strdup(pathname + 1));
+			g_hash_table_insert(context->members,
+					    context->list->data, member);
 		}
 	}
 	_cdio_list_free (entlist, true);
@@ -103,11 +131,16 @@ iso9660_archive_open(const char *pathname, GError **error_r)
 	/* open archive */
 	context->iso = iso9660_open (pathname);
 	if (context->iso   == NULL) {
+		g_free(context);
 		g_set_error(error_r, iso9660_quark(), 0,
 			    "Failed to open ISO9660 file %s", pathname);
 		return NULL;
 	}
 
+	context->mutex = g_mutex_new();
+	context->members = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 NULL, g_free);
+
 	listdir_recur("/", context);
 
 	return &context->base;
@@ -148,6 +181,9 @@ iso9660_archive_close(struct archive_file *file)
 	if (!refcount_dec(&context->ref))
 		return;
 
+	/* the keys point into the list, free the table first */
+	g_hash_table_destroy(context->members);
+
 	if (context->list) {
 		//free list
 		for (tmp = context->list; tmp != NULL; tmp = g_slist_next(tmp))
@@ -156,6 +192,7 @@ iso9660_archive_close(struct archive_file *file)
 	}
 	//close archive
 	iso9660_close(context->iso);
+	g_mutex_free(context->mutex);
 
 	g_free(context);
 }
@@ -167,7 +204,7 @@ struct iso9660_input_stream {
 
 	struct iso9660_archive_file *archive;
 
-	iso9660_stat_t *statbuf;
+	struct iso9660_member member;
 	size_t max_blocks;
 };
 
@@ -177,27 +214,46 @@ iso9660_archive_open_stream(struct archive_file *file,
 {
 	struct iso9660_archive_file *context =
 		(struct iso9660_archive_file *)file;
+	const struct iso9660_member *member;
 	struct iso9660_input_stream *iis;
 
 	iis = g_new(struct iso9660_input_stream, 1);
 	input_stream_init(&iis->base, &iso9660_input_plugin, pathname);
 
 	iis->archive = context;
-	iis->statbuf = iso9660_ifs_stat_translate(context->iso, pathname);
-	if (iis->statbuf == NULL) {
-		g_free(iis);
-		g_set_error(error_r, iso9660_quark(), 0,
-			    "not found in the ISO file: %s", pathname);
-		return NULL;
+
+	member = g_hash_table_lookup(context->members, pathname);
+	if (member != NULL) {
+		iis->member = *member;
+	} else {
+		/* not listed verbatim; let libiso9660 translate the
+		   name */
+		iso9660_stat_t *statbuf;
+
+		g_mutex_lock(context->mutex);
+		statbuf = iso9660_ifs_stat_translate(context->iso, pathname);
+		g_mutex_unlock(context->mutex);
+
+		if (statbuf == NULL) {
+			input_stream_deinit(&iis->base);
+			g_free(iis);
+			g_set_error(error_r, iso9660_quark(), 0,
+				    "not found in the ISO file: %s", pathname);
+			return NULL;
+		}
+
+		iis->member.lsn = statbuf->lsn;
+		iis->member.size = statbuf->size;
+		g_free(statbuf);
 	}
 
 	iis->base.ready = true;
 	//we are not seekable
 	iis->base.seekable = false;
 
-	iis->base.size = iis->statbuf->size;
+	iis->base.size = iis->member.size;
 
-	iis->max_blocks = CEILING(iis->statbuf->size, ISO_BLOCKSIZE);
+	iis->max_blocks = CEILING(iis->member.size, ISO_BLOCKSIZE);
 
 	refcount_inc(&context->ref);
 
@@ -209,8 +265,6 @@ iso9660_input_close(struct input_stream *is)
 {
 	struct iso9660_input_stream *iis = (struct iso9660_input_stream *)is;
 
-	g_free(iis->statbuf);
-
 	iso9660_archive_close(&iis->archive->base);
 
 	input_stream_deinit(&iis->base);
@@ -224,7 +278,7 @@ iso9660_input_read(struct input_stream *is, void *ptr, size_t size, GError **err
 	struct iso9660_input_stream *iis = (struct iso9660_input_stream *)is;
 	int toread, readed = 0;
 	int no_blocks, cur_block;
-	size_t left_bytes = iis->statbuf->size - is->offset;
+	size_t left_bytes = iis->member.size - is->offset;
 
 	size = (size * ISO_BLOCKSIZE) / ISO_BLOCKSIZE;
 
@@ -239,8 +293,10 @@ iso9660_input_read(struct input_stream *is, void *ptr, size_t size, GError **err
 
 		cur_block = is->offset / ISO_BLOCKSIZE;
 
+		g_mutex_lock(iis->archive->mutex);
 		readed = iso9660_iso_seek_read (iis->archive->iso, ptr,
-			iis->statbuf->lsn + cur_block, no_blocks);
+			iis->member.lsn + cur_block, no_blocks);
+		g_mutex_unlock(iis->archive->mutex);
 
 		if (readed != no_blocks * ISO_BLOCKSIZE) {
 			g_set_error(error_r, iso9660_quark(), 0,
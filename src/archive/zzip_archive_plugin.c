@@ -37,6 +37,13 @@ struct zzip_archive {
 
 	struct refcount ref;
 
+	/**
+	 * Protects #dir.  The archive may be shared by streams in
+	 * several threads, and zziplib reads all members through one
+	 * file descriptor.
+	 */
+	GMutex *mutex;
+
 	ZZIP_DIR *dir;
 	GSList	*list;
 	GSList	*iter;
@@ -65,11 +72,14 @@ zzip_archive_open(const char *pathname, GError **error_r)
 	context->list = NULL;
 	context->dir = zzip_dir_open(pathname, NULL);
 	if (context->dir  == NULL) {
+		g_free(context);
 		g_set_error(error_r, zzip_quark(), 0,
 			    "Failed to open ZIP file %s", pathname);
 		return NULL;
 	}
 
+	context->mutex = g_mutex_new();
+
 	while (zzip_dir_read(context->dir, &dirent)) {
 		//add only files
 		if (dirent.st_size > 0) {
@@ -118,6 +128,7 @@ zzip_archive_close(struct archive_file *file)
 	}
 	//close archive
 	zzip_dir_close (context->dir);
+	g_mutex_free(context->mutex);
 
 	g_free(context);
 }
@@ -144,8 +155,13 @@ zzip_archive_open_stream(struct archive_file *file,
 	input_stream_init(&zis->base, &zzip_input_plugin, pathname);
 
 	zis->archive = context;
+
+	g_mutex_lock(context->mutex);
+
 	zis->file = zzip_file_open(context->dir, pathname, 0);
 	if (zis->file == NULL) {
+		g_mutex_unlock(context->mutex);
+		input_stream_deinit(&zis->base);
 		g_free(zis);
 		g_set_error(error_r, zzip_quark(), 0,
 			    "not found in the ZIP file: %s", pathname);
@@ -159,6 +175,8 @@ zzip_archive_open_stream(struct archive_file *file,
 	zzip_file_stat(zis->file, &z_stat);
 	zis->base.size = z_stat.st_size;
 
+	g_mutex_unlock(context->mutex);
+
 	refcount_inc(&context->ref);
 
 	return &zis->base;
@@ -169,7 +187,10 @@ zzip_input_close(struct input_stream *is)
 {
 	struct zzip_input_stream *zis = (struct zzip_input_stream *)is;
 
+	g_mutex_lock(zis->archive->mutex);
 	zzip_file_close(zis->file);
+	g_mutex_unlock(zis->archive->mutex);
+
 	zzip_archive_close(&zis->archive->base);
 	input_stream_deinit(&zis->base);
 	g_free(zis);
@@ -182,8 +203,11 @@ zzip_input_read(struct input_stream *is, void *ptr, size_t size,
 	struct zzip_input_stream *zis = (struct zzip_input_stream *)is;
 	int ret;
 
+	g_mutex_lock(zis->archive->mutex);
+
 	ret = zzip_file_read(zis->file, ptr, size);
 	if (ret < 0) {
+		g_mutex_unlock(zis->archive->mutex);
 		g_set_error(error_r, zzip_quark(), ret,
 			    "zzip_file_read() has failed");
 		return 0;
@@ -191,15 +215,15 @@ zzip_input_read(struct input_stream *is, void *ptr, size_t size,
 
 	is->offset = zzip_tell(zis->file);
 
+	g_mutex_unlock(zis->archive->mutex);
+
 	return ret;
 }
 
 static bool
 zzip_input_eof(struct input_stream *is)
 {
-	struct zzip_input_stream *zis = (struct zzip_input_stream *)is;
-
-	return (goffset)zzip_tell(zis->file) == is->size;
+	return is->offset == is->size;
 }
 
 static bool
@@ -207,14 +231,20 @@ zzip_input_seek(struct input_stream *is,
 		goffset offset, int whence, GError **error_r)
 {
 	struct zzip_input_stream *zis = (struct zzip_input_stream *)is;
-	zzip_off_t ofs = zzip_seek(zis->file, offset, whence);
-	if (ofs != -1) {
-		g_set_error(error_r, zzip_quark(), ofs,
+	zzip_off_t ofs;
+
+	g_mutex_lock(zis->archive->mutex);
+	ofs = zzip_seek(zis->file, offset, whence);
+	g_mutex_unlock(zis->archive->mutex);
+
+	if (ofs == -1) {
+		g_set_error(error_r, zzip_quark(), 0,
 			    "zzip_seek() has failed");
-		is->offset = ofs;
-		return true;
+		return false;
 	}
-	return false;
+
+	is->offset = ofs;
+	return true;
 }
 
 /* exported structures */
@@ -25,6 +25,7 @@
 #include "output_plugin.h"
 #include "output_all.h"
 #include "conf.h"
+#include "pcm_dither.h"
 #include "mpd_error.h"
 
 #include <glib.h>
@@ -43,10 +44,21 @@ void getOutputAudioFormat(const struct audio_format *inAudioFormat,
 
 void initAudioConfig(void)
 {
-	const struct config_param *param = config_get_param(CONF_AUDIO_OUTPUT_FORMAT);
+	const struct config_param *param = config_get_param(CONF_DITHER);
 	GError *error = NULL;
 	bool ret;
 
+	if (param != NULL) {
+		enum pcm_dither_mode mode;
+
+		if (!pcm_dither_mode_parse(param->value, &mode))
+			MPD_ERROR("invalid \"%s\" value at line %i: %s",
+				  CONF_DITHER, param->line, param->value);
+
+		pcm_dither_set_default_mode(mode);
+	}
+
+	param = config_get_param(CONF_AUDIO_OUTPUT_FORMAT);
 	if (param == NULL)
 		return;
 
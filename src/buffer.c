@@ -20,26 +20,141 @@
 #include "config.h"
 #include "buffer.h"
 #include "chunk.h"
+#include "audio_format.h"
+#include "locked_memory.h"
 #include "poison.h"
 
 #include <glib.h>
 
 #include <assert.h>
+#include <stdint.h>
+
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+/**
+ * Manage the free list with a lock-free stack.  The top of the stack
+ * is the index of the chunk (plus one, so 0 means "empty") combined
+ * with a generation counter in the upper 32 bits, which protects
+ * against the ABA problem.
+ */
+#define MUSIC_BUFFER_LOCKLESS
+#endif
 
 struct music_buffer {
 	struct music_chunk *chunks;
 	unsigned num_chunks;
 
+	/**
+	 * The memory-locked arena which holds the data of all chunks,
+	 * if "audio_buffer_lock" is enabled.  Its data pointer is
+	 * NULL otherwise.
+	 */
+	struct locked_memory arena;
+
+#ifdef MUSIC_BUFFER_LOCKLESS
+	volatile uint64_t available;
+#else
 	struct music_chunk *available;
 
 	/** a mutex which protects #available */
 	GMutex *mutex;
+#endif
 
 #ifndef NDEBUG
-	unsigned num_allocated;
+	volatile gint num_allocated;
 #endif
 };
 
+#ifdef MUSIC_BUFFER_LOCKLESS
+
+static inline uint64_t
+music_buffer_make_top(const struct music_buffer *buffer,
+		      const struct music_chunk *chunk, uint64_t old_top)
+{
+	uint64_t index = chunk != NULL ? chunk - buffer->chunks + 1 : 0;
+	uint64_t generation = (old_top >> 32) + 1;
+
+	return (generation << 32) | index;
+}
+
+static inline struct music_chunk *
+music_buffer_top_chunk(const struct music_buffer *buffer, uint64_t top)
+{
+	unsigned index = (unsigned)top;
+
+	return index > 0 ? &buffer->chunks[index - 1] : NULL;
+}
+
+/**
+ * Pops a chunk from the free list.
+ */
+static struct music_chunk *
+music_buffer_pop(struct music_buffer *buffer)
+{
+	uint64_t top, new_top;
+	struct music_chunk *chunk;
+
+	do {
+		top = buffer->available;
+
+		chunk = music_buffer_top_chunk(buffer, top);
+		if (chunk == NULL)
+			return NULL;
+
+		/* the chunk may be popped and modified by another
+		   thread right now; in that case, the generation
+		   has changed and the compare-and-swap fails */
+		new_top = music_buffer_make_top(buffer, chunk->next, top);
+	} while (!__sync_bool_compare_and_swap(&buffer->available,
+					       top, new_top));
+
+	return chunk;
+}
+
+/**
+ * Pushes a chunk to the free list.
+ */
+static void
+music_buffer_push(struct music_buffer *buffer, struct music_chunk *chunk)
+{
+	uint64_t top;
+
+	do {
+		top = buffer->available;
+		chunk->next = music_buffer_top_chunk(buffer, top);
+	} while (!__sync_bool_compare_and_swap(&buffer->available, top,
+					       music_buffer_make_top(buffer,
+								     chunk,
+								     top)));
+}
+
+#else
+
+static struct music_chunk *
+music_buffer_pop(struct music_buffer *buffer)
+{
+	g_mutex_lock(buffer->mutex);
+
+	struct music_chunk *chunk = buffer->available;
+	if (chunk != NULL)
+		buffer->available = chunk->next;
+
+	g_mutex_unlock(buffer->mutex);
+	return chunk;
+}
+
+static void
+music_buffer_push(struct music_buffer *buffer, struct music_chunk *chunk)
+{
+	g_mutex_lock(buffer->mutex);
+
+	chunk->next = buffer->available;
+	buffer->available = chunk;
+
+	g_mutex_unlock(buffer->mutex);
+}
+
+#endif
+
 struct music_buffer *
 music_buffer_new(unsigned num_chunks)
 {
@@ -53,18 +168,47 @@ music_buffer_new(unsigned num_chunks)
 	buffer->chunks = g_new(struct music_chunk, num_chunks);
 	buffer->num_chunks = num_chunks;
 
-	chunk = buffer->available = buffer->chunks;
-	poison_undefined(chunk, sizeof(*chunk));
+	size_t slot_size = 0;
+	buffer->arena.data = NULL;
+	if (locked_memory_enabled()) {
+		/* each chunk gets a slot which is large enough for
+		   192 kHz stereo 32 bit; larger formats fall back to
+		   heap memory */
+		struct audio_format max_format;
+		audio_format_init(&max_format, 192000, SAMPLE_FORMAT_S32, 2);
+		slot_size = music_chunk_size(&max_format);
+
+		locked_memory_alloc(&buffer->arena, slot_size * num_chunks);
+		g_debug("locked %lu KiB for the music buffer",
+			(unsigned long)(buffer->arena.size / 1024));
+	}
 
-	for (unsigned i = 1; i < num_chunks; ++i) {
-		chunk->next = &buffer->chunks[i];
-		chunk = chunk->next;
+	for (unsigned i = 0; i < num_chunks; ++i) {
+		chunk = &buffer->chunks[i];
 		poison_undefined(chunk, sizeof(*chunk));
-	}
 
-	chunk->next = NULL;
+		if (buffer->arena.data != NULL) {
+			chunk->data = (char *)buffer->arena.data +
+				i * slot_size;
+			chunk->capacity = slot_size;
+			chunk->locked = true;
+		} else {
+			/* the data buffers are allocated on demand,
+			   by music_chunk_reserve() */
+			chunk->data = NULL;
+			chunk->capacity = 0;
+			chunk->locked = false;
+		}
+
+		chunk->next = i + 1 < num_chunks ? chunk + 1 : NULL;
+	}
 
+#ifdef MUSIC_BUFFER_LOCKLESS
+	buffer->available = music_buffer_make_top(buffer, buffer->chunks, 0);
+#else
+	buffer->available = buffer->chunks;
 	buffer->mutex = g_mutex_new();
+#endif
 
 #ifndef NDEBUG
 	buffer->num_allocated = 0;
@@ -80,7 +224,17 @@ music_buffer_free(struct music_buffer *buffer)
 	assert(buffer->num_chunks > 0);
 	assert(buffer->num_allocated == 0);
 
+#ifndef MUSIC_BUFFER_LOCKLESS
 	g_mutex_free(buffer->mutex);
+#endif
+
+	for (unsigned i = 0; i < buffer->num_chunks; ++i)
+		if (!buffer->chunks[i].locked)
+			g_free(buffer->chunks[i].data);
+
+	if (buffer->arena.data != NULL)
+		locked_memory_free(&buffer->arena);
+
 	g_free(buffer->chunks);
 	g_free(buffer);
 }
@@ -94,21 +248,15 @@ music_buffer_size(const struct music_buffer *buffer)
 struct music_chunk *
 music_buffer_allocate(struct music_buffer *buffer)
 {
-	struct music_chunk *chunk;
-
-	g_mutex_lock(buffer->mutex);
-
-	chunk = buffer->available;
+	struct music_chunk *chunk = music_buffer_pop(buffer);
 	if (chunk != NULL) {
-		buffer->available = chunk->next;
 		music_chunk_init(chunk);
 
 #ifndef NDEBUG
-		++buffer->num_allocated;
+		g_atomic_int_inc(&buffer->num_allocated);
 #endif
 	}
 
-	g_mutex_unlock(buffer->mutex);
 	return chunk;
 }
 
@@ -121,17 +269,20 @@ music_buffer_return(struct music_buffer *buffer, struct music_chunk *chunk)
 	if (chunk->other != NULL)
 		music_buffer_return(buffer, chunk->other);
 
-	g_mutex_lock(buffer->mutex);
-
 	music_chunk_free(chunk);
+
+	/* the data buffer is kept for the next user */
+	char *data = chunk->data;
+	size_t capacity = chunk->capacity;
+	bool locked = chunk->locked;
 	poison_undefined(chunk, sizeof(*chunk));
+	chunk->data = data;
+	chunk->capacity = capacity;
+	chunk->locked = locked;
 
-	chunk->next = buffer->available;
-	buffer->available = chunk;
+	music_buffer_push(buffer, chunk);
 
 #ifndef NDEBUG
-	--buffer->num_allocated;
+	g_atomic_int_add(&buffer->num_allocated, -1);
 #endif
-
-	g_mutex_unlock(buffer->mutex);
 }
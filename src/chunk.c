@@ -22,6 +22,8 @@
 #include "audio_format.h"
 #include "tag.h"
 
+#include <glib.h>
+
 #include <assert.h>
 
 void
@@ -31,6 +33,7 @@ music_chunk_init(struct music_chunk *chunk)
 	chunk->length = 0;
 	chunk->tag = NULL;
 	chunk->replay_gain_serial = 0;
+	chunk->consumers = 0;
 }
 
 void
@@ -40,6 +43,39 @@ music_chunk_free(struct music_chunk *chunk)
 		tag_free(chunk->tag);
 }
 
+size_t
+music_chunk_size(const struct audio_format *audio_format)
+{
+	const size_t frame_size = audio_format_frame_size(audio_format);
+	size_t size = audio_format_time_to_size(audio_format)
+		* CHUNK_DURATION_MS / 1000;
+
+	if (size < CHUNK_SIZE_MIN)
+		size = CHUNK_SIZE_MIN;
+	else if (size > CHUNK_SIZE_MAX)
+		size = CHUNK_SIZE_MAX;
+
+	return size - size % frame_size;
+}
+
+void
+music_chunk_reserve(struct music_chunk *chunk, size_t size)
+{
+	assert(chunk->length == 0);
+
+	if (chunk->capacity >= size)
+		return;
+
+	if (!chunk->locked)
+		g_free(chunk->data);
+
+	/* a stream which does not fit into the locked arena slot gets
+	   heap memory */
+	chunk->data = g_malloc(size);
+	chunk->capacity = size;
+	chunk->locked = false;
+}
+
 #ifndef NDEBUG
 bool
 music_chunk_check_format(const struct music_chunk *chunk,
@@ -61,6 +97,7 @@ music_chunk_write(struct music_chunk *chunk,
 		  size_t *max_length_r)
 {
 	const size_t frame_size = audio_format_frame_size(audio_format);
+	const size_t size = music_chunk_size(audio_format);
 	size_t num_frames;
 
 	assert(music_chunk_check_format(chunk, audio_format));
@@ -72,9 +109,15 @@ music_chunk_write(struct music_chunk *chunk,
 
 		chunk->bit_rate = bit_rate;
 		chunk->times = data_time;
+
+		music_chunk_reserve(chunk, size);
 	}
 
-	num_frames = (sizeof(chunk->data) - chunk->length) / frame_size;
+	/* the buffer may be larger than needed (a locked arena slot,
+	   or left over from a previous stream); fill only as much as
+	   the audio format needs, to keep the duration of chunks
+	   constant */
+	num_frames = (size - chunk->length) / frame_size;
 	if (num_frames == 0)
 		return NULL;
 
@@ -93,10 +136,10 @@ music_chunk_expand(struct music_chunk *chunk,
 	const size_t frame_size = audio_format_frame_size(audio_format);
 
 	assert(chunk != NULL);
-	assert(chunk->length + length <= sizeof(chunk->data));
+	assert(chunk->length + length <= chunk->capacity);
 	assert(audio_format_equals(&chunk->audio_format, audio_format));
 
 	chunk->length += length;
 
-	return chunk->length + frame_size > sizeof(chunk->data);
+	return chunk->length + frame_size > music_chunk_size(audio_format);
 }
@@ -26,12 +26,31 @@
 #include "audio_format.h"
 #endif
 
+#include <glib.h>
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
 enum {
-	CHUNK_SIZE = 4096,
+	/**
+	 * The amount of audio each chunk should hold, in
+	 * milliseconds.  The capacity of a chunk is chosen from the
+	 * audio format of the stream, so the per-chunk overhead
+	 * (pipe operations, output wakeups, filter calls) does not
+	 * grow with the sample rate.
+	 */
+	CHUNK_DURATION_MS = 25,
+
+	/**
+	 * The lower limit for the capacity of a chunk, in bytes.
+	 */
+	CHUNK_SIZE_MIN = 4096,
+
+	/**
+	 * The upper limit for the capacity of a chunk, in bytes.
+	 */
+	CHUNK_SIZE_MAX = 256 * 1024,
 };
 
 struct audio_format;
@@ -57,7 +76,7 @@ struct music_chunk {
 	float mix_ratio;
 
 	/** number of bytes stored in this chunk */
-	uint16_t length;
+	uint32_t length;
 
 	/** current bit rate of the source file */
 	uint16_t bit_rate;
@@ -86,8 +105,31 @@ struct music_chunk {
 	 */
 	unsigned replay_gain_serial;
 
-	/** the data (probably PCM) */
-	char data[CHUNK_SIZE];
+	/**
+	 * The data (probably PCM).  This buffer is owned by the
+	 * chunk, and it survives music_buffer_return(); it only grows
+	 * when a stream needs larger chunks, see
+	 * music_chunk_reserve().
+	 */
+	char *data;
+
+	/** the allocated size of #data */
+	size_t capacity;
+
+	/**
+	 * Does #data point into the memory-locked arena of the
+	 * music_buffer?  Then it must not be freed.
+	 */
+	bool locked;
+
+	/**
+	 * A bit mask of the audio outputs which are not done with
+	 * this chunk yet: they have not played it, or they are still
+	 * positioned on it.  This is the only attribute which may be
+	 * modified while the chunk is in the pipe; see
+	 * music_chunk_acquire() and music_chunk_release().
+	 */
+	volatile gint consumers;
 
 #ifndef NDEBUG
 	struct audio_format audio_format;
@@ -100,12 +142,66 @@ music_chunk_init(struct music_chunk *chunk);
 void
 music_chunk_free(struct music_chunk *chunk);
 
+/**
+ * Returns the chunk capacity (in bytes) for a stream with the
+ * specified audio format: #CHUNK_DURATION_MS worth of whole frames,
+ * within #CHUNK_SIZE_MIN and #CHUNK_SIZE_MAX.
+ */
+G_GNUC_PURE
+size_t
+music_chunk_size(const struct audio_format *audio_format);
+
+/**
+ * Ensures that the data buffer of an empty chunk can hold at least
+ * the specified number of bytes.
+ */
+void
+music_chunk_reserve(struct music_chunk *chunk, size_t size);
+
 static inline bool
 music_chunk_is_empty(const struct music_chunk *chunk)
 {
 	return chunk->length == 0 && chunk->tag == NULL;
 }
 
+/**
+ * Sets bits in the consumer mask.
+ */
+static inline void
+music_chunk_acquire(const struct music_chunk *chunk, gint mask)
+{
+	volatile gint *consumers = (volatile gint *)&chunk->consumers;
+	gint old;
+
+	do {
+		old = g_atomic_int_get(consumers);
+		if ((old & mask) == mask)
+			return;
+	} while (!g_atomic_int_compare_and_exchange(consumers, old,
+						    old | mask));
+}
+
+/**
+ * Clears bits in the consumer mask.
+ *
+ * @return true if this call has cleared the last bit
+ */
+static inline bool
+music_chunk_release(const struct music_chunk *chunk, gint mask)
+{
+	volatile gint *consumers = (volatile gint *)&chunk->consumers;
+	gint old;
+
+	do {
+		old = g_atomic_int_get(consumers);
+		if ((old & mask) == 0)
+			return false;
+	} while (!g_atomic_int_compare_and_exchange(consumers, old,
+						    old & ~mask));
+
+	return (old & ~mask) == 0;
+}
+
 #ifndef NDEBUG
 /**
  * Checks if the audio format if the chunk is equal to the specified
@@ -56,6 +56,7 @@ static struct config_entry config_entries[] = {
 	{ .name = CONF_FOLLOW_OUTSIDE_SYMLINKS, false, false },
 	{ .name = CONF_DB_FILE, false, false },
 	{ .name = CONF_STICKER_FILE, false, false },
+	{ .name = CONF_SEEK_INDEX_FILE, false, false },
 	{ .name = CONF_LOG_FILE, false, false },
 	{ .name = CONF_PID_FILE, false, false },
 	{ .name = CONF_STATE_FILE, false, false },
@@ -78,8 +79,16 @@ static struct config_entry config_entries[] = {
 	{ .name = CONF_REPLAYGAIN_LIMIT, false, false },
 	{ .name = CONF_VOLUME_NORMALIZATION, false, false },
 	{ .name = CONF_SAMPLERATE_CONVERTER, false, false },
+	{ .name = CONF_DITHER, false, false },
 	{ .name = CONF_AUDIO_BUFFER_SIZE, false, false },
 	{ .name = CONF_BUFFER_BEFORE_PLAY, false, false },
+	{ .name = CONF_AUDIO_BUFFER_LOCK, false, false },
+	{ .name = CONF_DECODER_THREADS, false, false },
+	{ .name = CONF_SEEK_CACHE_SIZE, false, false },
+	{ .name = CONF_PREFETCH_SONGS, false, false },
+	{ .name = CONF_PREFETCH_SIZE, false, false },
+	{ .name = CONF_INPUT_CACHE_DIR, false, false },
+	{ .name = CONF_INPUT_CACHE_SIZE, false, false },
 	{ .name = CONF_HTTP_PROXY_HOST, false, false },
 	{ .name = CONF_HTTP_PROXY_PORT, false, false },
 	{ .name = CONF_HTTP_PROXY_USER, false, false },
@@ -95,6 +104,7 @@ static struct config_entry config_entries[] = {
 	{ .name = CONF_SAVE_ABSOLUTE_PATHS, false, false },
 	{ .name = CONF_DECODER, true, true },
 	{ .name = CONF_INPUT, true, true },
+	{ .name = CONF_THREAD_POLICY, true, true },
 	{ .name = CONF_GAPLESS_MP3_PLAYBACK, false, false },
 	{ .name = CONF_PLAYLIST_PLUGIN, true, true },
 	{ .name = CONF_AUTO_UPDATE, false, false },
@@ -143,7 +153,7 @@ config_new_param(const char *value, int line)
 	return ret;
 }
 
-static void
+void
 config_param_free(struct config_param *param)
 {
 	g_free(param->value);
@@ -29,6 +29,7 @@
 #define CONF_FOLLOW_OUTSIDE_SYMLINKS    "follow_outside_symlinks"
 #define CONF_DB_FILE                    "db_file"
 #define CONF_STICKER_FILE               "sticker_file"
+#define CONF_SEEK_INDEX_FILE            "seek_index_file"
 #define CONF_LOG_FILE                   "log_file"
 #define CONF_PID_FILE                   "pid_file"
 #define CONF_STATE_FILE                 "state_file"
@@ -51,8 +52,17 @@
 #define CONF_REPLAYGAIN_LIMIT           "replaygain_limit"
 #define CONF_VOLUME_NORMALIZATION       "volume_normalization"
 #define CONF_SAMPLERATE_CONVERTER       "samplerate_converter"
+#define CONF_DITHER                     "dither"
 #define CONF_AUDIO_BUFFER_SIZE          "audio_buffer_size"
 #define CONF_BUFFER_BEFORE_PLAY         "buffer_before_play"
+#define CONF_AUDIO_BUFFER_LOCK          "audio_buffer_lock"
+#define CONF_DECODER_THREADS            "decoder_threads"
+#define CONF_SEEK_CACHE_SIZE            "seek_cache_size"
+#define CONF_PREFETCH_SONGS             "prefetch_songs"
+#define CONF_PREFETCH_SIZE              "prefetch_size"
+#define CONF_INPUT_CACHE_DIR            "input_cache_directory"
+#define CONF_INPUT_CACHE_SIZE           "input_cache_size"
+#define CONF_THREAD_POLICY              "thread_policy"
 #define CONF_HTTP_PROXY_HOST            "http_proxy_host"
 #define CONF_HTTP_PROXY_PORT            "http_proxy_port"
 #define CONF_HTTP_PROXY_USER            "http_proxy_user"
@@ -207,6 +217,9 @@ config_get_block_bool(const struct config_param *param, const char *name,
 struct config_param *
 config_new_param(const char *value, int line);
 
+void
+config_param_free(struct config_param *param);
+
 bool
 config_add_block_param(struct config_param * param, const char *name,
 		       const char *value, int line, GError **error_r);
@@ -35,8 +35,6 @@ void
 flac_data_init(struct flac_data *data, struct decoder * decoder,
 	       struct input_stream *input_stream)
 {
-	pcm_buffer_init(&data->buffer);
-
 	data->unsupported = false;
 	data->initialized = false;
 	data->total_frames = 0;
@@ -52,8 +50,6 @@ flac_data_init(struct flac_data *data, struct decoder * decoder,
 void
 flac_data_deinit(struct flac_data *data)
 {
-	pcm_buffer_deinit(&data->buffer);
-
 	if (data->tag != NULL)
 		tag_free(data->tag);
 }
@@ -202,29 +198,42 @@ flac_common_write(struct flac_data *data, const FLAC__Frame * frame,
 		  const FLAC__int32 *const buf[],
 		  FLAC__uint64 nbytes)
 {
-	enum decoder_command cmd;
-	void *buffer;
+	enum decoder_command cmd = DECODE_COMMAND_NONE;
 	unsigned bit_rate;
 
 	if (!data->initialized && !flac_got_first_frame(data, &frame->header))
 		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 
-	size_t buffer_size = frame->header.blocksize * data->frame_size;
-	buffer = pcm_buffer_get(&data->buffer, buffer_size);
-
-	flac_convert(buffer, frame->header.channels,
-		     data->audio_format.format, buf,
-		     0, frame->header.blocksize);
-
 	if (nbytes > 0)
 		bit_rate = nbytes * 8 * frame->header.sample_rate /
 			(1000 * frame->header.blocksize);
 	else
 		bit_rate = 0;
 
-	cmd = decoder_data(data->decoder, data->input_stream,
-			   buffer, buffer_size,
-			   bit_rate);
+	/* convert the samples straight into the music pipe */
+	unsigned position = 0;
+	while (position < frame->header.blocksize) {
+		size_t length = (frame->header.blocksize - position) *
+			data->frame_size;
+		void *dest = decoder_data_begin(data->decoder,
+						data->input_stream, &length);
+		if (dest == NULL) {
+			cmd = decoder_get_command(data->decoder);
+			break;
+		}
+
+		unsigned end = position + length / data->frame_size;
+		flac_convert(dest, frame->header.channels,
+			     data->audio_format.format, buf,
+			     position, end);
+		position = end;
+
+		cmd = decoder_data_commit(data->decoder, data->input_stream,
+					  length, bit_rate);
+		if (cmd != DECODE_COMMAND_NONE)
+			break;
+	}
+
 	data->next_frame += frame->header.blocksize;
 	switch (cmd) {
 	case DECODE_COMMAND_NONE:
@@ -25,7 +25,6 @@
 #define MPD_FLAC_COMMON_H
 
 #include "decoder_api.h"
-#include "pcm_buffer.h"
 
 #include <glib.h>
 
@@ -36,8 +35,6 @@
 #define G_LOG_DOMAIN "flac"
 
 struct flac_data {
-	struct pcm_buffer buffer;
-
 	/**
 	 * The size of one frame in the output buffer.
 	 */
@@ -120,6 +120,26 @@ struct mp3_data {
 	enum muteframe mute_frame;
 	long *frame_offsets;
 	mad_timer_t *times;
+
+	/**
+	 * The number of the frame recorded in frame_offsets[0] and
+	 * times[0].  This is non-zero after a jump with the help of
+	 * the seek index, when the frames before are unknown.
+	 */
+	unsigned long first_frame;
+
+	/**
+	 * The time stamp of #first_frame [seconds].
+	 */
+	double first_frame_time;
+
+	/**
+	 * The byte offset of frame 0, i.e. the first audio frame
+	 * after the tags.  Used to rewind when a seek goes before
+	 * #first_frame_time.
+	 */
+	long start_offset;
+
 	unsigned long highest_frame;
 	unsigned long max_frames;
 	unsigned long current_frame;
@@ -142,6 +162,9 @@ mp3_data_init(struct mp3_data *data, struct decoder *decoder,
 	      struct input_stream *input_stream)
 {
 	data->mute_frame = MUTEFRAME_NONE;
+	data->first_frame = 0;
+	data->first_frame_time = 0;
+	data->start_offset = 0;
 	data->highest_frame = 0;
 	data->max_frames = 0;
 	data->frame_offsets = NULL;
@@ -925,9 +948,9 @@ mp3_time_to_frame(const struct mp3_data *data, double t)
 {
 	unsigned long i;
 
-	for (i = 0; i < data->highest_frame; ++i) {
+	for (i = data->first_frame; i < data->highest_frame; ++i) {
 		double frame_time =
-			mad_timer_count(data->times[i],
+			mad_timer_count(data->times[i - data->first_frame],
 					MAD_UNITS_MILLISECONDS) / 1000.;
 		if (frame_time >= t)
 			break;
@@ -943,28 +966,98 @@ mp3_update_timer_next_frame(struct mp3_data *data)
 		/* record this frame's properties in
 		   data->frame_offsets (for seeking) and
 		   data->times */
+		goffset offset = mp3_this_frame_offset(data);
+
 		data->bit_rate = (data->frame).header.bitrate;
 
-		if (data->current_frame >= data->max_frames)
+		if (data->current_frame - data->first_frame >= data->max_frames)
 			/* cap data->current_frame */
-			data->current_frame = data->max_frames - 1;
+			data->current_frame = data->first_frame +
+				data->max_frames - 1;
 		else
 			data->highest_frame++;
 
-		data->frame_offsets[data->current_frame] =
-			mp3_this_frame_offset(data);
+		data->frame_offsets[data->current_frame - data->first_frame] =
+			offset;
+		if (data->current_frame == 0)
+			data->start_offset = offset;
+
+		if (data->decoder != NULL)
+			decoder_seek_index_add(data->decoder,
+					       data->input_stream,
+					       mad_timer_count(data->timer,
+							       MAD_UNITS_MILLISECONDS) / 1000.0,
+					       offset);
 
 		mad_timer_add(&data->timer, (data->frame).header.duration);
-		data->times[data->current_frame] = data->timer;
+		data->times[data->current_frame - data->first_frame] =
+			data->timer;
 	} else
 		/* get the new timer value from data->times */
-		data->timer = data->times[data->current_frame];
+		data->timer = data->times[data->current_frame -
+					  data->first_frame];
 
 	data->current_frame++;
 	data->elapsed_time =
 		mad_timer_count(data->timer, MAD_UNITS_MILLISECONDS) / 1000.0;
 }
 
+/**
+ * Jumps to the last frame before the seek destination which is known
+ * from the persistent seek index.  The frame table recorded so far is
+ * discarded, and starts over at the new position.
+ *
+ * @return true on success, false if the seek index does not help
+ */
+static bool
+mp3_seek_index_jump(struct mp3_data *data, double where)
+{
+	const mad_timer_t duration = data->frame.header.duration;
+	double time;
+	goffset offset;
+	unsigned long frame;
+
+	if (!decoder_seek_index_lookup(data->decoder, data->input_stream,
+				       where, &time, &offset))
+		return false;
+
+	/* all frames have the same duration, so the frame number can
+	   be calculated from the time stamp */
+	frame = time / (duration.seconds +
+			(double)duration.fraction / MAD_TIMER_RESOLUTION) + 0.5;
+	if (frame >= data->first_frame && frame <= data->highest_frame)
+		/* the frame table is just as good */
+		return false;
+
+	if (!mp3_seek(data, offset))
+		return false;
+
+	data->timer = duration;
+	mad_timer_multiply(&data->timer, frame);
+
+	data->first_frame = data->highest_frame = data->current_frame = frame;
+	data->first_frame_time = time;
+	return true;
+}
+
+/**
+ * Rewinds to frame 0 after mp3_seek_index_jump() has discarded the
+ * frames before #first_frame.  The frame table starts over, and is
+ * rebuilt while skipping forward to the seek destination.
+ */
+static bool
+mp3_seek_start(struct mp3_data *data)
+{
+	if (!mp3_seek(data, data->start_offset))
+		return false;
+
+	mad_timer_reset(&data->timer);
+
+	data->first_frame = data->highest_frame = data->current_frame = 0;
+	data->first_frame_time = 0;
+	return true;
+}
+
 /**
  * Sends the synthesized current frame via decoder_data().
  */
@@ -1080,23 +1173,29 @@ mp3_read(struct mp3_data *data)
 	case MUTEFRAME_NONE:
 		cmd = mp3_synth_and_send(data);
 		if (cmd == DECODE_COMMAND_SEEK) {
+			double where = decoder_seek_where(decoder);
 			unsigned long j;
 
 			assert(data->input_stream->seekable);
 
-			j = mp3_time_to_frame(data,
-					      decoder_seek_where(decoder));
-			if (j < data->highest_frame) {
-				if (mp3_seek(data, data->frame_offsets[j])) {
+			j = mp3_time_to_frame(data, where);
+			if (j < data->highest_frame &&
+			    where >= data->first_frame_time) {
+				if (mp3_seek(data, data->frame_offsets[j - data->first_frame])) {
 					data->current_frame = j;
 					decoder_command_finished(decoder);
 				} else
 					decoder_seek_error(decoder);
-			} else {
-				data->seek_where = decoder_seek_where(decoder);
+			} else if (mp3_seek_index_jump(data, where) ||
+				   where >= data->first_frame_time ||
+				   mp3_seek_start(data)) {
+				/* skip the remaining frames up to the
+				   destination */
+				data->seek_where = where;
 				data->mute_frame = MUTEFRAME_SEEK;
 				decoder_command_finished(decoder);
-			}
+			} else
+				decoder_seek_error(decoder);
 		} else if (cmd != DECODE_COMMAND_NONE)
 			return false;
 	}
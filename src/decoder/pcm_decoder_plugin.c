@@ -38,6 +38,7 @@ pcm_stream_decode(struct decoder *decoder, struct input_stream *is)
 	GError *error = NULL;
 	enum decoder_command cmd;
 
+	const size_t frame_size = audio_format_frame_size(&audio_format);
 	double time_to_size = audio_format_time_to_size(&audio_format);
 
 	float total_time = -1;
@@ -47,18 +48,36 @@ pcm_stream_decode(struct decoder *decoder, struct input_stream *is)
 	decoder_initialized(decoder, &audio_format, is->seekable, total_time);
 
 	do {
-		char buffer[4096];
+		/* read straight into the music pipe */
+		size_t length = 4096;
+		char *dest = decoder_data_begin(decoder, is, &length);
+		if (dest == NULL) {
+			cmd = decoder_get_command(decoder);
+		} else {
+			size_t nbytes = decoder_read(decoder, is,
+						     dest, length);
 
-		size_t nbytes = decoder_read(decoder, is,
-					     buffer, sizeof(buffer));
+			/* complete the last frame */
+			while (nbytes % frame_size != 0) {
+				size_t n = decoder_read(decoder, is,
+							dest + nbytes,
+							frame_size -
+							nbytes % frame_size);
+				if (n == 0)
+					break;
 
-		if (nbytes == 0 && input_stream_eof(is))
-			break;
+				nbytes += n;
+			}
+
+			nbytes -= nbytes % frame_size;
+
+			/* commit even when there is no data, to
+			   finish the decoder_data_begin() call */
+			cmd = decoder_data_commit(decoder, is, nbytes, 0);
+			if (nbytes == 0 && input_stream_eof(is))
+				break;
+		}
 
-		cmd = nbytes > 0
-			? decoder_data(decoder, is,
-				       buffer, nbytes, 0)
-			: decoder_get_command(decoder);
 		if (cmd == DECODE_COMMAND_SEEK) {
 			goffset offset = (goffset)(time_to_size *
 						   decoder_seek_where(decoder));
@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "wavpack"
@@ -56,10 +57,14 @@ static struct {
 	{ "disc", TAG_DISC },
 };
 
-/** A pointer type for format converter function. */
+/**
+ * A pointer type for format converter function.  It converts the
+ * 32 bit samples returned by libwavpack to MPD's sample format,
+ * writing them to the music pipe.
+ */
 typedef void (*format_samples_t)(
 	int bytes_per_sample,
-	void *buffer, uint32_t count
+	const void *src, void *dest, uint32_t count
 );
 
 /*
@@ -68,20 +73,14 @@ typedef void (*format_samples_t)(
  * max 24-bit samples.
  */
 static void
-format_samples_int(int bytes_per_sample, void *buffer, uint32_t count)
+format_samples_int(int bytes_per_sample, const void *_src, void *dest,
+		   uint32_t count)
 {
-	int32_t *src = buffer;
+	const int32_t *src = _src;
 
 	switch (bytes_per_sample) {
 	case 1: {
-		int8_t *dst = buffer;
-		/*
-		 * The asserts like the following one are because we do the
-		 * formatting of samples within a single buffer. The size
-		 * of the output samples never can be greater than the size
-		 * of the input ones. Otherwise we would have an overflow.
-		 */
-		assert_static(sizeof(*dst) <= sizeof(*src));
+		int8_t *dst = dest;
 
 		/* pass through and align 8-bit samples */
 		while (count--) {
@@ -90,8 +89,7 @@ format_samples_int(int bytes_per_sample, void *buffer, uint32_t count)
 		break;
 	}
 	case 2: {
-		uint16_t *dst = buffer;
-		assert_static(sizeof(*dst) <= sizeof(*src));
+		uint16_t *dst = dest;
 
 		/* pass through and align 16-bit samples */
 		while (count--) {
@@ -102,7 +100,7 @@ format_samples_int(int bytes_per_sample, void *buffer, uint32_t count)
 
 	case 3:
 	case 4:
-		/* do nothing */
+		memcpy(dest, src, count * sizeof(*src));
 		break;
 	}
 }
@@ -111,12 +109,11 @@ format_samples_int(int bytes_per_sample, void *buffer, uint32_t count)
  * This function converts floating point sample data to 24-bit integer.
  */
 static void
-format_samples_float(G_GNUC_UNUSED int bytes_per_sample, void *buffer,
-		     uint32_t count)
+format_samples_float(G_GNUC_UNUSED int bytes_per_sample, const void *_src,
+		     void *dest, uint32_t count)
 {
-	int32_t *dst = buffer;
-	float *src = buffer;
-	assert_static(sizeof(*dst) <= sizeof(*src));
+	const float *src = _src;
+	int32_t *dst = dest;
 
 	while (count--) {
 		*dst++ = (int32_t)(*src++ + 0.5f);
@@ -223,17 +220,30 @@ wavpack_decode(struct decoder *decoder, WavpackContext *wpc, bool can_seek)
 		if (samples_got > 0) {
 			int bitrate = (int)(WavpackGetInstantBitrate(wpc) /
 			              1000 + 0.5);
-
-			format_samples(
-				bytes_per_sample, chunk,
-				samples_got * audio_format.channels
-			);
-
-			decoder_data(
-				decoder, NULL, chunk,
-				samples_got * output_sample_size,
-				bitrate
-			);
+			const int32_t *src = (const int32_t *)chunk;
+			size_t rest = samples_got * output_sample_size;
+
+			/* convert straight into the music pipe */
+			while (rest > 0) {
+				size_t length = rest;
+				void *dest = decoder_data_begin(decoder, NULL,
+								&length);
+				if (dest == NULL)
+					break;
+
+				unsigned count = length / output_sample_size *
+					audio_format.channels;
+				format_samples(bytes_per_sample, src, dest,
+					       count);
+
+				if (decoder_data_commit(decoder, NULL, length,
+							bitrate) !=
+				    DECODE_COMMAND_NONE)
+					break;
+
+				src += count;
+				rest -= length;
+			}
 		}
 	} while (samples_got > 0);
 }
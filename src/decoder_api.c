@@ -27,6 +27,7 @@
 #include "pipe.h"
 #include "chunk.h"
 #include "replay_gain_config.h"
+#include "seek_index.h"
 
 #include <glib.h>
 
@@ -96,6 +97,7 @@ decoder_command_finished(struct decoder *decoder)
 	assert(dc->command != DECODE_COMMAND_SEEK ||
 	       dc->seek_error || decoder->seeking);
 	assert(dc->pipe != NULL);
+	assert(!decoder->data_pending);
 
 	if (decoder->seeking) {
 		decoder->seeking = false;
@@ -142,6 +144,54 @@ void decoder_seek_error(struct decoder * decoder)
 	decoder_command_finished(decoder);
 }
 
+/**
+ * Returns the seek index of the current song, and opens it on the
+ * first call.
+ */
+static struct seek_index *
+decoder_get_seek_index(struct decoder *decoder, struct input_stream *is)
+{
+	if (decoder->seek_index == NULL && !decoder->seek_index_failed) {
+		decoder->seek_index = seek_index_open(is->uri);
+		decoder->seek_index_failed = decoder->seek_index == NULL;
+	}
+
+	return decoder->seek_index;
+}
+
+bool
+decoder_seek_index_lookup(struct decoder *decoder, struct input_stream *is,
+			  double where, double *time_r, goffset *offset_r)
+{
+	struct seek_index *index;
+	struct seek_point point;
+
+	assert(decoder != NULL);
+	assert(is != NULL);
+
+	index = decoder_get_seek_index(decoder, is);
+	if (index == NULL || !seek_index_lookup(index, where, &point))
+		return false;
+
+	*time_r = point.time;
+	*offset_r = point.offset;
+	return true;
+}
+
+void
+decoder_seek_index_add(struct decoder *decoder, struct input_stream *is,
+		       double time, goffset offset)
+{
+	struct seek_index *index;
+
+	assert(decoder != NULL);
+	assert(is != NULL);
+
+	index = decoder_get_seek_index(decoder, is);
+	if (index != NULL)
+		seek_index_add(index, time, offset);
+}
+
 size_t decoder_read(struct decoder *decoder,
 		    struct input_stream *is,
 		    void *buffer, size_t length)
@@ -156,6 +206,11 @@ size_t decoder_read(struct decoder *decoder,
 	       dc->state == DECODE_STATE_DECODE);
 	assert(is != NULL);
 	assert(buffer != NULL);
+	/* between decoder_data_begin() and decoder_data_commit(),
+	   only the stream passed to decoder_data_begin() may be
+	   read */
+	assert(decoder == NULL || !decoder->data_pending ||
+	       decoder->data_input_stream == is);
 
 	if (length == 0)
 		return 0;
@@ -193,6 +248,7 @@ decoder_timestamp(struct decoder *decoder, double t)
 {
 	assert(decoder != NULL);
 	assert(t >= 0);
+	assert(!decoder->data_pending);
 
 	decoder->timestamp = t;
 }
@@ -251,27 +307,21 @@ update_stream_tag(struct decoder *decoder, struct input_stream *is)
 	return true;
 }
 
-enum decoder_command
-decoder_data(struct decoder *decoder,
-	     struct input_stream *is,
-	     const void *_data, size_t length,
-	     uint16_t kbit_rate)
+/**
+ * Checks for a pending command and sends new stream tags; this must
+ * be done before PCM data is appended to the current chunk.
+ */
+static enum decoder_command
+decoder_data_prepare(struct decoder *decoder, struct input_stream *is)
 {
 	struct decoder_control *dc = decoder->dc;
-	const char *data = _data;
-	GError *error = NULL;
 	enum decoder_command cmd;
 
-	assert(dc->state == DECODE_STATE_DECODE);
-	assert(dc->pipe != NULL);
-	assert(length % audio_format_frame_size(&dc->in_audio_format) == 0);
-
 	decoder_lock(dc);
 	cmd = dc->command;
 	decoder_unlock(dc);
 
-	if (cmd == DECODE_COMMAND_STOP || cmd == DECODE_COMMAND_SEEK ||
-	    length == 0)
+	if (cmd == DECODE_COMMAND_STOP || cmd == DECODE_COMMAND_SEEK)
 		return cmd;
 
 	/* send stream tags */
@@ -293,6 +343,64 @@ decoder_data(struct decoder *decoder,
 			return cmd;
 	}
 
+	return DECODE_COMMAND_NONE;
+}
+
+/**
+ * Accounts for data which was written to the current chunk, and
+ * flushes it if it is full.
+ */
+static enum decoder_command
+decoder_chunk_expanded(struct decoder *decoder, struct music_chunk *chunk,
+		       size_t nbytes)
+{
+	struct decoder_control *dc = decoder->dc;
+
+	if (music_chunk_expand(chunk, &dc->out_audio_format, nbytes)) {
+		/* the chunk is full, flush it */
+		decoder_flush_chunk(decoder);
+		g_cond_signal(dc->client_cond);
+	}
+
+	decoder->timestamp += (double)nbytes /
+		audio_format_time_to_size(&dc->out_audio_format);
+
+	if (dc->song->end_ms > 0 &&
+	    decoder->timestamp >= dc->song->end_ms / 1000.0)
+		/* the end of this range has been reached: stop
+		   decoding */
+		return DECODE_COMMAND_STOP;
+
+	return DECODE_COMMAND_NONE;
+}
+
+enum decoder_command
+decoder_data(struct decoder *decoder,
+	     struct input_stream *is,
+	     const void *_data, size_t length,
+	     uint16_t kbit_rate)
+{
+	struct decoder_control *dc = decoder->dc;
+	const char *data = _data;
+	GError *error = NULL;
+	enum decoder_command cmd;
+
+	assert(dc->state == DECODE_STATE_DECODE);
+	assert(dc->pipe != NULL);
+	assert(length % audio_format_frame_size(&dc->in_audio_format) == 0);
+	assert(!decoder->data_pending);
+
+	if (length == 0) {
+		decoder_lock(dc);
+		cmd = dc->command;
+		decoder_unlock(dc);
+		return cmd;
+	}
+
+	cmd = decoder_data_prepare(decoder, is);
+	if (cmd != DECODE_COMMAND_NONE)
+		return cmd;
+
 	if (!audio_format_equals(&dc->in_audio_format, &dc->out_audio_format)) {
 		data = pcm_convert(&decoder->conv_state,
 				   &dc->in_audio_format, data, length,
@@ -311,7 +419,6 @@ decoder_data(struct decoder *decoder,
 		struct music_chunk *chunk;
 		char *dest;
 		size_t nbytes;
-		bool full;
 
 		chunk = decoder_get_chunk(decoder, is);
 		if (chunk == NULL) {
@@ -341,27 +448,109 @@ decoder_data(struct decoder *decoder,
 
 		/* expand the music pipe chunk */
 
-		full = music_chunk_expand(chunk, &dc->out_audio_format, nbytes);
-		if (full) {
-			/* the chunk is full, flush it */
-			decoder_flush_chunk(decoder);
-			g_cond_signal(dc->client_cond);
-		}
+		cmd = decoder_chunk_expanded(decoder, chunk, nbytes);
+		if (cmd != DECODE_COMMAND_NONE)
+			return cmd;
 
 		data += nbytes;
 		length -= nbytes;
+	}
 
-		decoder->timestamp += (double)nbytes /
-			audio_format_time_to_size(&dc->out_audio_format);
+	return DECODE_COMMAND_NONE;
+}
 
-		if (dc->song->end_ms > 0 &&
-		    decoder->timestamp >= dc->song->end_ms / 1000.0)
-			/* the end of this range has been reached:
-			   stop decoding */
-			return DECODE_COMMAND_STOP;
+void *
+decoder_data_begin(struct decoder *decoder, struct input_stream *is,
+		   size_t *length_r)
+{
+	struct decoder_control *dc = decoder->dc;
+	const size_t frame_size =
+		audio_format_frame_size(&dc->in_audio_format);
+	struct music_chunk *chunk;
+	char *dest;
+	size_t max_length;
+
+	assert(dc->state == DECODE_STATE_DECODE);
+	assert(dc->pipe != NULL);
+	assert(*length_r >= frame_size);
+	assert(!decoder->data_pending);
+
+	if (decoder_data_prepare(decoder, is) != DECODE_COMMAND_NONE)
+		return NULL;
+
+	*length_r -= *length_r % frame_size;
+
+	if (!audio_format_equals(&dc->in_audio_format, &dc->out_audio_format)) {
+		/* the data must be converted before it can be
+		   appended to the chunk; let the plugin write to a
+		   temporary buffer, which is converted by
+		   decoder_data_commit() */
+		decoder->data_staged = true;
+#ifndef NDEBUG
+		decoder->data_pending = true;
+		decoder->data_input_stream = is;
+#endif
+		return pcm_buffer_get(&decoder->data_buffer, *length_r);
 	}
 
-	return DECODE_COMMAND_NONE;
+	while (true) {
+		chunk = decoder_get_chunk(decoder, is);
+		if (chunk == NULL) {
+			assert(dc->command != DECODE_COMMAND_NONE);
+			return NULL;
+		}
+
+		dest = music_chunk_write(chunk, &dc->out_audio_format,
+					 decoder->timestamp -
+					 dc->song->start_ms / 1000.0,
+					 0, &max_length);
+		if (dest != NULL)
+			break;
+
+		/* the chunk is full, flush it */
+		decoder_flush_chunk(decoder);
+		g_cond_signal(dc->client_cond);
+	}
+
+	decoder->data_staged = false;
+#ifndef NDEBUG
+	decoder->data_pending = true;
+	decoder->data_input_stream = is;
+#endif
+
+	if (*length_r > max_length)
+		*length_r = max_length;
+
+	return dest;
+}
+
+enum decoder_command
+decoder_data_commit(struct decoder *decoder, struct input_stream *is,
+		    size_t length, uint16_t kbit_rate)
+{
+	struct decoder_control *dc = decoder->dc;
+	struct music_chunk *chunk = decoder->chunk;
+
+	assert(dc->state == DECODE_STATE_DECODE);
+	assert(length % audio_format_frame_size(&dc->in_audio_format) == 0);
+	assert(decoder->data_pending);
+	assert(decoder->data_input_stream == is);
+
+#ifndef NDEBUG
+	decoder->data_pending = false;
+#endif
+
+	if (decoder->data_staged)
+		return decoder_data(decoder, is, decoder->data_buffer.buffer,
+				    length, kbit_rate);
+
+	assert(chunk != NULL);
+
+	if (length == 0)
+		return decoder_get_command(decoder);
+
+	chunk->bit_rate = kbit_rate;
+	return decoder_chunk_expanded(decoder, chunk, length);
 }
 
 enum decoder_command
@@ -374,6 +563,7 @@ decoder_tag(G_GNUC_UNUSED struct decoder *decoder, struct input_stream *is,
 	assert(dc->state == DECODE_STATE_DECODE);
 	assert(dc->pipe != NULL);
 	assert(tag != NULL);
+	assert(!decoder->data_pending);
 
 	/* save the tag */
 
@@ -407,6 +597,7 @@ decoder_replay_gain(struct decoder *decoder,
 {
 	float return_db = 0;
 	assert(decoder != NULL);
+	assert(!decoder->data_pending);
 
 	if (replay_gain_info != NULL) {
 		static unsigned serial;
@@ -91,6 +91,37 @@ decoder_seek_where(struct decoder *decoder);
 void
 decoder_seek_error(struct decoder *decoder);
 
+/**
+ * Looks up the persistent seek index for the last known frame at or
+ * before the specified time.  This is useful for formats which
+ * cannot be seeked cheaply; see seek_index.h.
+ *
+ * @param decoder the decoder object
+ * @param is the input stream of the song; only local files are
+ * indexed
+ * @param where the seek destination [seconds]
+ * @param time_r the time stamp of the frame found [seconds]
+ * @param offset_r the byte offset of the frame found
+ * @return true if a frame was found
+ */
+bool
+decoder_seek_index_lookup(struct decoder *decoder, struct input_stream *is,
+			  double where, double *time_r, goffset *offset_r);
+
+/**
+ * Records the position of a frame in the persistent seek index.  The
+ * decoder plugin may call this for every frame it decodes; the index
+ * keeps only a few of them.
+ *
+ * @param decoder the decoder object
+ * @param is the input stream of the song
+ * @param time the time stamp of the frame [seconds]
+ * @param offset the byte offset of the frame
+ */
+void
+decoder_seek_index_add(struct decoder *decoder, struct input_stream *is,
+		       double time, goffset offset);
+
 /**
  * Blocking read from the input stream.
  *
@@ -131,6 +162,44 @@ decoder_data(struct decoder *decoder, struct input_stream *is,
 	     const void *data, size_t length,
 	     uint16_t kbit_rate);
 
+/**
+ * Obtains a buffer which the decoder plugin may write PCM data to,
+ * in the audio format passed to decoder_initialized().  If no
+ * conversion is necessary, the buffer is inside the current chunk
+ * of the music pipe, which saves the copy done by decoder_data().
+ * After writing, the plugin must call decoder_data_commit(), and no
+ * other decoder API function in between, except decoder_read() on
+ * the same input stream (to read raw data straight into the buffer).
+ *
+ * @param decoder the decoder object
+ * @param is an input stream which is buffering while we are waiting
+ * for the player
+ * @param length_r the number of bytes the plugin would like to
+ * write (at least one frame); returns the number of bytes it may
+ * write, a multiple of the frame size
+ * @return the buffer, or NULL if a command is pending (which can be
+ * queried with decoder_get_command())
+ */
+void *
+decoder_data_begin(struct decoder *decoder, struct input_stream *is,
+		   size_t *length_r);
+
+/**
+ * Appends the data written to the buffer returned by
+ * decoder_data_begin().
+ *
+ * @param decoder the decoder object
+ * @param is the input stream passed to decoder_data_begin()
+ * @param length the number of bytes written, a multiple of the
+ * frame size; may be 0
+ * @param kbit_rate the current bit rate
+ * @return the current command, or DECODE_COMMAND_NONE if there is no
+ * command pending
+ */
+enum decoder_command
+decoder_data_commit(struct decoder *decoder, struct input_stream *is,
+		    size_t length, uint16_t kbit_rate);
+
 /**
  * This function is called by the decoder plugin when it has
  * successfully decoded a tag.
@@ -24,6 +24,15 @@
 #include <glib.h>
 
 #include <assert.h>
+#include <string.h>
+
+/**
+ * When the decoder needs more data than the borrowed portion of the
+ * input stream provides, up to this many bytes are copied at a time
+ * from the stream to the end of the buffer, until the decoder has
+ * crossed the boundary.
+ */
+static const size_t DECODER_BUFFER_BRIDGE = 4096;
 
 struct decoder_buffer {
 	struct decoder *decoder;
@@ -39,6 +48,26 @@ struct decoder_buffer {
 	    buffer */
 	size_t consumed;
 
+	/**
+	 * The number of bytes at the end of the buffer which were
+	 * copied from input_stream_peek(), but which have not been
+	 * consumed from the input stream yet.  As soon as the decoder
+	 * has consumed everything before them, the buffer is
+	 * discarded and borrowing continues.
+	 */
+	size_t ahead;
+
+	/**
+	 * Data lent by input_stream_peek(), or NULL.  While this is
+	 * set, the buffer itself is empty, and decoder_buffer_read()
+	 * returns this pointer instead; this saves one copy of the
+	 * input.
+	 */
+	const unsigned char *borrowed;
+
+	/** the number of bytes at #borrowed */
+	size_t borrowed_length;
+
 	/** the actual buffer (dynamic size) */
 	unsigned char data[sizeof(size_t)];
 };
@@ -58,6 +87,8 @@ decoder_buffer_new(struct decoder *decoder, struct input_stream *is,
 	buffer->size = size;
 	buffer->length = 0;
 	buffer->consumed = 0;
+	buffer->ahead = 0;
+	buffer->borrowed = NULL;
 
 	return buffer;
 }
@@ -73,15 +104,32 @@ decoder_buffer_free(struct decoder_buffer *buffer)
 bool
 decoder_buffer_is_empty(const struct decoder_buffer *buffer)
 {
-	return buffer->consumed == buffer->length;
+	return buffer->borrowed == NULL &&
+		buffer->consumed == buffer->length;
 }
 
 bool
 decoder_buffer_is_full(const struct decoder_buffer *buffer)
 {
+	if (buffer->borrowed != NULL)
+		return buffer->borrowed_length >= buffer->size;
+
 	return buffer->consumed == 0 && buffer->length == buffer->size;
 }
 
+/**
+ * Borrows the next portion of the input stream.
+ */
+static void
+decoder_buffer_borrow(struct decoder_buffer *buffer)
+{
+	assert(buffer->length == 0);
+	assert(buffer->ahead == 0);
+
+	buffer->borrowed = input_stream_peek(buffer->is,
+					     &buffer->borrowed_length);
+}
+
 static void
 decoder_buffer_shift(struct decoder_buffer *buffer)
 {
@@ -92,6 +140,81 @@ decoder_buffer_shift(struct decoder_buffer *buffer)
 	buffer->consumed = 0;
 }
 
+/**
+ * Attempts to append data to the buffer without reading from the
+ * input stream: either by borrowing more data, or by copying the
+ * beginning of the borrowed data.
+ *
+ * @return true if data was added
+ */
+static bool
+decoder_buffer_fill_peek(struct decoder_buffer *buffer)
+{
+	const unsigned char *data;
+	size_t length;
+
+	data = input_stream_peek(buffer->is, &length);
+
+	if (buffer->borrowed != NULL) {
+		if (data != NULL && length > buffer->borrowed_length) {
+			/* more data has arrived */
+			buffer->borrowed = data;
+			buffer->borrowed_length = length;
+			return true;
+		}
+
+		if (data != NULL)
+			/* the most recent pointer is the one which is
+			   guaranteed to be valid */
+			buffer->borrowed = data;
+
+		/* no more data to borrow; move what we have into
+		   the buffer and wait for the input stream */
+		if (buffer->borrowed_length >= buffer->size)
+			return false;
+
+		assert(buffer->length == 0);
+
+		memcpy(buffer->data, buffer->borrowed,
+		       buffer->borrowed_length);
+		buffer->length = buffer->borrowed_length;
+		buffer->borrowed = NULL;
+		input_stream_consume(buffer->is, buffer->length);
+		return false;
+	}
+
+	if (data == NULL || length <= buffer->ahead) {
+		/* the stream has nothing more to lend right now;
+		   commit the copied data, and read() the rest */
+		if (buffer->ahead > 0) {
+			input_stream_consume(buffer->is, buffer->ahead);
+			buffer->ahead = 0;
+		}
+
+		return false;
+	}
+
+	if (buffer->length == 0) {
+		buffer->borrowed = data;
+		buffer->borrowed_length = length;
+		return true;
+	}
+
+	/* the decoder has left over a partial frame: copy just
+	   enough to complete it */
+
+	length -= buffer->ahead;
+	if (length > buffer->size - buffer->length)
+		length = buffer->size - buffer->length;
+	if (length > DECODER_BUFFER_BRIDGE)
+		length = DECODER_BUFFER_BRIDGE;
+
+	memcpy(buffer->data + buffer->length, data + buffer->ahead, length);
+	buffer->length += length;
+	buffer->ahead += length;
+	return true;
+}
+
 bool
 decoder_buffer_fill(struct decoder_buffer *buffer)
 {
@@ -100,7 +223,14 @@ decoder_buffer_fill(struct decoder_buffer *buffer)
 	if (buffer->consumed > 0)
 		decoder_buffer_shift(buffer);
 
-	if (buffer->length >= buffer->size)
+	if (buffer->borrowed == NULL && buffer->length >= buffer->size)
+		/* buffer is full */
+		return false;
+
+	if (decoder_buffer_fill_peek(buffer))
+		return true;
+
+	if (buffer->borrowed != NULL || buffer->length >= buffer->size)
 		/* buffer is full */
 		return false;
 
@@ -121,6 +251,11 @@ decoder_buffer_fill(struct decoder_buffer *buffer)
 const void *
 decoder_buffer_read(const struct decoder_buffer *buffer, size_t *length_r)
 {
+	if (buffer->borrowed != NULL) {
+		*length_r = buffer->borrowed_length;
+		return buffer->borrowed;
+	}
+
 	if (buffer->consumed >= buffer->length)
 		/* buffer is empty */
 		return NULL;
@@ -132,12 +267,31 @@ decoder_buffer_read(const struct decoder_buffer *buffer, size_t *length_r)
 void
 decoder_buffer_consume(struct decoder_buffer *buffer, size_t nbytes)
 {
+	if (buffer->borrowed != NULL) {
+		assert(nbytes <= buffer->borrowed_length);
+
+		input_stream_consume(buffer->is, nbytes);
+		decoder_buffer_borrow(buffer);
+		return;
+	}
+
 	/* just move the "consumed" pointer - decoder_buffer_shift()
 	   will do the real work later (called by
 	   decoder_buffer_fill()) */
 	buffer->consumed += nbytes;
 
 	assert(buffer->consumed <= buffer->length);
+
+	if (buffer->ahead > 0 &&
+	    buffer->length - buffer->consumed <= buffer->ahead) {
+		/* the decoder has crossed into the data copied from
+		   input_stream_peek(): drop the buffer and borrow
+		   again */
+		input_stream_consume(buffer->is, buffer->ahead -
+				     (buffer->length - buffer->consumed));
+		buffer->length = buffer->consumed = buffer->ahead = 0;
+		decoder_buffer_borrow(buffer);
+	}
 }
 
 bool
@@ -158,6 +312,10 @@ decoder_buffer_skip(struct decoder_buffer *buffer, size_t nbytes)
 			nbytes -= length;
 			if (nbytes == 0)
 				return true;
+
+			/* consuming may have borrowed more data from
+			   the input stream */
+			continue;
 		}
 
 		success = decoder_buffer_fill(buffer);
@@ -27,6 +27,10 @@
  * This objects handles buffered reads in decoder plugins easily.  You
  * create a buffer object, and use its high-level methods to fill and
  * read it.  It will automatically handle shifting the buffer.
+ *
+ * If the input stream supports input_stream_peek(), the data is
+ * borrowed from the stream instead of being copied into the buffer,
+ * whenever possible.
  */
 struct decoder_buffer;
 
@@ -58,7 +62,8 @@ bool
 decoder_buffer_is_full(const struct decoder_buffer *buffer);
 
 /**
- * Read data from the input_stream and append it to the buffer.
+ * Read data from the input_stream and append it to the buffer (or
+ * borrow more data from it).
  *
  * @return true if data was appended; false if there is no data
  * available (yet), end of file, I/O error or a decoder command was
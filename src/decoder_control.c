@@ -40,6 +40,8 @@ dc_new(GCond *client_cond)
 	dc->state = DECODE_STATE_STOP;
 	dc->command = DECODE_COMMAND_NONE;
 
+	dc->max_chunks = 0;
+
 	dc->replay_gain_db = 0;
 	dc->replay_gain_prev_db = 0;
 	dc->mixramp_start = NULL;
@@ -159,6 +161,15 @@ dc_quit(struct decoder_control *dc)
 	dc->thread = NULL;
 }
 
+void
+dc_set_max_chunks(struct decoder_control *dc, unsigned max_chunks)
+{
+	decoder_lock(dc);
+	dc->max_chunks = max_chunks;
+	decoder_signal(dc);
+	decoder_unlock(dc);
+}
+
 void
 dc_mixramp_start(struct decoder_control *dc, char *mixramp_start)
 {
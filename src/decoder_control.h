@@ -96,6 +96,15 @@ struct decoder_control {
 	 */
 	struct music_pipe *pipe;
 
+	/**
+	 * If non-zero, the decoder does not fill #pipe with more than
+	 * this number of chunks.  This is used for a decoder which
+	 * runs ahead on the next song, so it cannot take the whole
+	 * #buffer away from the decoder of the current song.
+	 * Protected by #mutex.
+	 */
+	unsigned max_chunks;
+
 	float replay_gain_db;
 	float replay_gain_prev_db;
 	char *mixramp_start;
@@ -245,6 +254,12 @@ dc_seek(struct decoder_control *dc, double where);
 void
 dc_quit(struct decoder_control *dc);
 
+/**
+ * Changes decoder_control.max_chunks, and wakes up the decoder.
+ */
+void
+dc_set_max_chunks(struct decoder_control *dc, unsigned max_chunks);
+
 void
 dc_mixramp_start(struct decoder_control *dc, char *mixramp_start);
 
@@ -72,6 +72,22 @@ need_chunks(struct decoder_control *dc, struct input_stream *is, bool do_wait)
 	return DECODE_COMMAND_NONE;
 }
 
+/**
+ * Has the decoder filled the pipe up to decoder_control.max_chunks?
+ */
+static bool
+decoder_pipe_full(struct decoder_control *dc)
+{
+	bool full;
+
+	decoder_lock(dc);
+	full = dc->max_chunks > 0 &&
+		music_pipe_size(dc->pipe) >= dc->max_chunks;
+	decoder_unlock(dc);
+
+	return full;
+}
+
 struct music_chunk *
 decoder_get_chunk(struct decoder *decoder, struct input_stream *is)
 {
@@ -84,7 +100,9 @@ decoder_get_chunk(struct decoder *decoder, struct input_stream *is)
 		return decoder->chunk;
 
 	do {
-		decoder->chunk = music_buffer_allocate(dc->buffer);
+		decoder->chunk = decoder_pipe_full(dc)
+			? NULL
+			: music_buffer_allocate(dc->buffer);
 		if (decoder->chunk != NULL) {
 			decoder->chunk->replay_gain_serial =
 				decoder->replay_gain_serial;
@@ -25,6 +25,7 @@
 #include "replay_gain_info.h"
 
 struct input_stream;
+struct seek_index;
 
 struct decoder {
 	struct decoder_control *dc;
@@ -54,6 +55,33 @@ struct decoder {
 	/** the chunk currently being written to */
 	struct music_chunk *chunk;
 
+	/**
+	 * The buffer returned by decoder_data_begin() when the data
+	 * needs to be converted.
+	 */
+	struct pcm_buffer data_buffer;
+
+	/**
+	 * Did the last decoder_data_begin() call return
+	 * #data_buffer, rather than a pointer into #chunk?
+	 */
+	bool data_staged;
+
+#ifndef NDEBUG
+	/**
+	 * Is a buffer returned by decoder_data_begin() being
+	 * written, i.e. decoder_data_commit() has not been called
+	 * yet?
+	 */
+	bool data_pending;
+
+	/**
+	 * The input stream passed to decoder_data_begin(); valid
+	 * while #data_pending is set.
+	 */
+	const struct input_stream *data_input_stream;
+#endif
+
 	struct replay_gain_info replay_gain_info;
 
 	/**
@@ -61,6 +89,18 @@ struct decoder {
 	 * has changed since the last check.
 	 */
 	unsigned replay_gain_serial;
+
+	/**
+	 * The seek index of the current song, opened on demand by
+	 * decoder_seek_index_lookup() and decoder_seek_index_add().
+	 */
+	struct seek_index *seek_index;
+
+	/**
+	 * Set when the current song cannot be indexed, to avoid
+	 * retrying seek_index_open() for each frame.
+	 */
+	bool seek_index_failed;
 };
 
 /**
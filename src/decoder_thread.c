@@ -26,6 +26,9 @@
 #include "decoder_api.h"
 #include "replay_gain_ape.h"
 #include "input_stream.h"
+#include "input_prefetch.h"
+#include "seek_index.h"
+#include "thread_policy.h"
 #include "pipe.h"
 #include "song.h"
 #include "tag.h"
@@ -70,10 +73,10 @@ decoder_command_finished_locked(struct decoder_control *dc)
 }
 
 /**
- * Opens the input stream with input_stream_open(), and waits until
- * the stream gets ready.  If a decoder STOP command is received
- * during that, it cancels the operation (but does not close the
- * stream).
+ * Opens the input stream with input_stream_open() (or obtains it from
+ * the prefetch thread), and waits until the stream gets ready.  If a
+ * decoder STOP command is received during that, it cancels the
+ * operation (but does not close the stream).
  *
  * Unlock the decoder before calling this function.
  *
@@ -86,7 +89,9 @@ decoder_input_stream_open(struct decoder_control *dc, const char *uri)
 	GError *error = NULL;
 	struct input_stream *is;
 
-	is = input_stream_open(uri, &error);
+	is = input_prefetch_take(uri);
+	if (is == NULL)
+		is = input_stream_open(uri, &error);
 	if (is == NULL) {
 		if (error != NULL) {
 			g_warning("%s", error->message);
@@ -394,6 +399,13 @@ decoder_run_song(struct decoder_control *dc,
 	decoder.stream_tag = NULL;
 	decoder.decoder_tag = NULL;
 	decoder.chunk = NULL;
+	decoder.seek_index = NULL;
+	decoder.seek_index_failed = false;
+	pcm_buffer_init(&decoder.data_buffer);
+	decoder.data_staged = false;
+#ifndef NDEBUG
+	decoder.data_pending = false;
+#endif
 
 	dc->state = DECODE_STATE_START;
 
@@ -408,6 +420,7 @@ decoder_run_song(struct decoder_control *dc,
 	decoder_unlock(dc);
 
 	pcm_convert_deinit(&decoder.conv_state);
+	pcm_buffer_deinit(&decoder.data_buffer);
 
 	/* flush the last chunk */
 
@@ -423,6 +436,9 @@ decoder_run_song(struct decoder_control *dc,
 	if (decoder.decoder_tag != NULL)
 		tag_free(decoder.decoder_tag);
 
+	if (decoder.seek_index != NULL)
+		seek_index_close(decoder.seek_index);
+
 	decoder_lock(dc);
 
 	dc->state = ret ? DECODE_STATE_STOP : DECODE_STATE_ERROR;
@@ -457,6 +473,8 @@ decoder_task(gpointer arg)
 {
 	struct decoder_control *dc = arg;
 
+	thread_policy_apply(THREAD_ROLE_DECODER);
+
 	decoder_lock(dc);
 
 	do {
@@ -0,0 +1,611 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "encoder_thread.h"
+#include "encoder_api.h"
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "encoder"
+
+/**
+ * How much PCM data (in seconds) may be queued before
+ * encoder_write() blocks?
+ */
+#define ENCODER_THREAD_QUEUE_SECONDS 2
+
+/**
+ * The size of the blocks in which the worker collects encoded data.
+ */
+#define ENCODER_THREAD_BLOCK_SIZE 4096
+
+enum encoder_thread_command {
+	ENCODER_THREAD_WRITE,
+	ENCODER_THREAD_FLUSH,
+	ENCODER_THREAD_TAG,
+};
+
+/**
+ * An item in the input queue.
+ */
+struct encoder_thread_item {
+	enum encoder_thread_command command;
+
+	/**
+	 * The tag for #ENCODER_THREAD_TAG.
+	 */
+	struct tag *tag;
+
+	/**
+	 * The length of the PCM data for #ENCODER_THREAD_WRITE.
+	 */
+	size_t length;
+
+	char data[];
+};
+
+/**
+ * A block of encoded data in the output queue.
+ */
+struct encoder_thread_block {
+	size_t length, position;
+
+	char data[ENCODER_THREAD_BLOCK_SIZE];
+};
+
+struct encoder_thread {
+	struct encoder base;
+
+	/**
+	 * The wrapped encoder.  While the worker thread is running,
+	 * only the worker may access it.
+	 */
+	struct encoder *inner;
+
+	/**
+	 * Protects all of the following attributes.  The condition
+	 * is signalled whenever one of the queues has changed.
+	 */
+	GMutex *mutex;
+	GCond *cond;
+
+	GThread *thread;
+
+	/**
+	 * A queue of #encoder_thread_item objects, waiting to be
+	 * processed by the worker.
+	 */
+	GQueue *input;
+
+	/**
+	 * The total length of PCM data in the input queue.
+	 */
+	size_t input_size;
+
+	/**
+	 * If input_size exceeds this value, encoder_write() blocks.
+	 */
+	size_t max_input_size;
+
+	/**
+	 * A queue of #encoder_thread_block objects, waiting to be
+	 * returned by encoder_read().
+	 */
+	GQueue *output;
+
+	/**
+	 * True while the worker is processing an item which has
+	 * already been removed from the input queue.
+	 */
+	bool busy;
+
+	/**
+	 * True if the worker thread shall exit.
+	 */
+	bool quit;
+
+	/**
+	 * An error which has occurred in the worker thread.  It is
+	 * returned by the next encoder_write(), encoder_flush() or
+	 * encoder_tag() call.
+	 */
+	GError *error;
+
+	/**
+	 * The number of PCM bytes fed into the wrapped encoder since
+	 * it was opened.
+	 */
+	guint64 total_input;
+
+	/**
+	 * The number of bytes per second of PCM input.
+	 */
+	double bytes_per_second;
+
+	/**
+	 * How often did encoder_write() block because the queue was
+	 * full?
+	 */
+	unsigned stalls;
+
+	/**
+	 * The CPU time consumed by the worker thread, determined
+	 * when it exits.
+	 */
+	double cpu_time;
+};
+
+extern const struct encoder_plugin encoder_thread_plugin;
+
+static inline GQuark
+encoder_thread_quark(void)
+{
+	return g_quark_from_static_string("encoder_thread");
+}
+
+/**
+ * Returns the CPU time consumed by the current thread, or a negative
+ * value if the platform cannot determine it.
+ */
+static double
+thread_cpu_time(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+
+	return -1;
+}
+
+static void
+encoder_thread_item_free(struct encoder_thread_item *item)
+{
+	if (item->tag != NULL)
+		tag_free(item->tag);
+	g_free(item);
+}
+
+static void
+encoder_thread_item_free_callback(gpointer data,
+				  G_GNUC_UNUSED gpointer user_data)
+{
+	encoder_thread_item_free(data);
+}
+
+static void
+encoder_thread_block_free_callback(gpointer data,
+				   G_GNUC_UNUSED gpointer user_data)
+{
+	g_free(data);
+}
+
+/**
+ * Moves everything the wrapped encoder has produced to the output
+ * queue.  The caller must not hold the mutex.
+ */
+static void
+encoder_thread_drain(struct encoder_thread *te)
+{
+	while (true) {
+		struct encoder_thread_block *block =
+			g_new(struct encoder_thread_block, 1);
+
+		block->length = encoder_read(te->inner, block->data,
+					     sizeof(block->data));
+		if (block->length == 0) {
+			g_free(block);
+			break;
+		}
+
+		block->position = 0;
+
+		g_mutex_lock(te->mutex);
+		g_queue_push_tail(te->output, block);
+		g_mutex_unlock(te->mutex);
+	}
+}
+
+/**
+ * Passes one item to the wrapped encoder.  Called by the worker
+ * thread without holding the mutex.
+ */
+static void
+encoder_thread_process(struct encoder_thread *te,
+		       const struct encoder_thread_item *item,
+		       GError **error_r)
+{
+	bool success = false;
+
+	switch (item->command) {
+	case ENCODER_THREAD_WRITE:
+		success = encoder_write(te->inner, item->data, item->length,
+					error_r);
+		te->total_input += item->length;
+		break;
+
+	case ENCODER_THREAD_FLUSH:
+		success = encoder_flush(te->inner, error_r);
+		break;
+
+	case ENCODER_THREAD_TAG:
+		success = encoder_tag(te->inner, item->tag, error_r);
+		break;
+	}
+
+	if (success)
+		encoder_thread_drain(te);
+}
+
+static gpointer
+encoder_thread_task(gpointer data)
+{
+	struct encoder_thread *te = data;
+
+	g_mutex_lock(te->mutex);
+
+	while (true) {
+		struct encoder_thread_item *item;
+
+		while (!te->quit && g_queue_is_empty(te->input))
+			g_cond_wait(te->cond, te->mutex);
+
+		if (te->quit)
+			break;
+
+		item = g_queue_pop_head(te->input);
+		te->busy = true;
+
+		/* after an error, the remaining input is discarded
+		   until the error has been reported */
+		const bool discard = te->error != NULL;
+
+		g_mutex_unlock(te->mutex);
+
+		GError *error = NULL;
+		if (!discard)
+			encoder_thread_process(te, item, &error);
+
+		const size_t length = item->length;
+		encoder_thread_item_free(item);
+
+		g_mutex_lock(te->mutex);
+
+		if (error != NULL) {
+			if (te->error == NULL)
+				te->error = error;
+			else
+				g_error_free(error);
+		}
+
+		te->input_size -= length;
+		te->busy = false;
+		g_cond_broadcast(te->cond);
+	}
+
+	g_mutex_unlock(te->mutex);
+
+	te->cpu_time = thread_cpu_time();
+
+	return NULL;
+}
+
+/**
+ * Returns the pending error from the worker thread.  Caller must hold
+ * the mutex.
+ */
+static bool
+encoder_thread_check_error(struct encoder_thread *te, GError **error_r)
+{
+	if (te->error == NULL)
+		return true;
+
+	g_propagate_error(error_r, te->error);
+	te->error = NULL;
+	return false;
+}
+
+/**
+ * Appends an item to the input queue and wakes up the worker.  Caller
+ * must hold the mutex.
+ */
+static void
+encoder_thread_push(struct encoder_thread *te,
+		    struct encoder_thread_item *item)
+{
+	g_queue_push_tail(te->input, item);
+	te->input_size += item->length;
+	g_cond_broadcast(te->cond);
+}
+
+/**
+ * Queues a command and waits until the worker has processed it (and
+ * everything which was queued before).
+ */
+static bool
+encoder_thread_barrier(struct encoder_thread *te,
+		       struct encoder_thread_item *item, GError **error_r)
+{
+	g_mutex_lock(te->mutex);
+
+	encoder_thread_push(te, item);
+
+	while (te->busy || !g_queue_is_empty(te->input))
+		g_cond_wait(te->cond, te->mutex);
+
+	bool success = encoder_thread_check_error(te, error_r);
+
+	g_mutex_unlock(te->mutex);
+
+	return success;
+}
+
+static struct encoder_thread_item *
+encoder_thread_item_new(enum encoder_thread_command command,
+			const void *data, size_t length)
+{
+	struct encoder_thread_item *item =
+		g_malloc(sizeof(*item) + length);
+
+	item->command = command;
+	item->tag = NULL;
+	item->length = length;
+	if (length > 0)
+		memcpy(item->data, data, length);
+
+	return item;
+}
+
+struct encoder *
+encoder_thread_new(struct encoder *inner)
+{
+	struct encoder_thread *te = g_new(struct encoder_thread, 1);
+
+	encoder_struct_init(&te->base, &encoder_thread_plugin);
+	te->inner = inner;
+	te->mutex = g_mutex_new();
+	te->cond = g_cond_new();
+	te->thread = NULL;
+
+	return &te->base;
+}
+
+struct encoder *
+encoder_thread_init(const struct encoder_plugin *plugin,
+		    const struct config_param *param, GError **error)
+{
+	struct encoder *encoder = encoder_init(plugin, param, error);
+	if (encoder == NULL)
+		return NULL;
+
+	if (param != NULL &&
+	    !config_get_block_bool(param, "encoder_thread", true))
+		return encoder;
+
+	return encoder_thread_new(encoder);
+}
+
+static void
+encoder_thread_finish(struct encoder *_encoder)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+
+	assert(te->thread == NULL);
+
+	encoder_finish(te->inner);
+	g_mutex_free(te->mutex);
+	g_cond_free(te->cond);
+	g_free(te);
+}
+
+static bool
+encoder_thread_open(struct encoder *_encoder,
+		    struct audio_format *audio_format,
+		    GError **error)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+
+	assert(te->thread == NULL);
+
+	if (!encoder_open(te->inner, audio_format, error))
+		return false;
+
+	te->input = g_queue_new();
+	te->input_size = 0;
+	te->bytes_per_second = audio_format_time_to_size(audio_format);
+	te->max_input_size = te->bytes_per_second *
+		ENCODER_THREAD_QUEUE_SECONDS;
+	te->output = g_queue_new();
+	te->busy = false;
+	te->quit = false;
+	te->error = NULL;
+	te->total_input = 0;
+	te->stalls = 0;
+	te->cpu_time = -1;
+
+	/* the encoder may have generated a header already; make it
+	   available to the caller right away */
+	encoder_thread_drain(te);
+
+	te->thread = g_thread_create(encoder_thread_task, te, true, error);
+	if (te->thread == NULL) {
+		g_queue_foreach(te->output,
+				encoder_thread_block_free_callback, NULL);
+		g_queue_free(te->output);
+		g_queue_free(te->input);
+		encoder_close(te->inner);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+encoder_thread_close(struct encoder *_encoder)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+
+	assert(te->thread != NULL);
+
+	g_mutex_lock(te->mutex);
+	te->quit = true;
+	g_cond_broadcast(te->cond);
+	g_mutex_unlock(te->mutex);
+
+	g_thread_join(te->thread);
+	te->thread = NULL;
+
+	g_queue_foreach(te->input, encoder_thread_item_free_callback, NULL);
+	g_queue_free(te->input);
+	g_queue_foreach(te->output, encoder_thread_block_free_callback, NULL);
+	g_queue_free(te->output);
+
+	if (te->error != NULL)
+		g_error_free(te->error);
+
+	encoder_close(te->inner);
+
+	if (te->cpu_time >= 0 && te->total_input > 0) {
+		double audio_time = te->total_input / te->bytes_per_second;
+
+		g_message("%s encoder used %.1fs of CPU time for "
+			  "%.1fs of audio (%.1f%%), queue full %u times",
+			  te->inner->plugin->name,
+			  te->cpu_time, audio_time,
+			  te->cpu_time * 100. / audio_time,
+			  te->stalls);
+	}
+}
+
+static bool
+encoder_thread_flush(struct encoder *_encoder, GError **error)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+
+	return encoder_thread_barrier(te,
+				      encoder_thread_item_new(ENCODER_THREAD_FLUSH,
+							      NULL, 0),
+				      error);
+}
+
+static bool
+encoder_thread_tag(struct encoder *_encoder, const struct tag *tag,
+		   GError **error)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+	struct encoder_thread_item *item =
+		encoder_thread_item_new(ENCODER_THREAD_TAG, NULL, 0);
+
+	item->tag = tag_dup(tag);
+
+	return encoder_thread_barrier(te, item, error);
+}
+
+static bool
+encoder_thread_write(struct encoder *_encoder,
+		     const void *data, size_t length,
+		     GError **error)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+	struct encoder_thread_item *item =
+		encoder_thread_item_new(ENCODER_THREAD_WRITE, data, length);
+
+	g_mutex_lock(te->mutex);
+
+	if (te->input_size >= te->max_input_size && te->error == NULL) {
+		/* the encoder is slower than real time: apply
+		   backpressure to the output thread */
+		++te->stalls;
+
+		do {
+			g_cond_wait(te->cond, te->mutex);
+		} while (te->input_size >= te->max_input_size &&
+			 te->error == NULL);
+	}
+
+	if (!encoder_thread_check_error(te, error)) {
+		g_mutex_unlock(te->mutex);
+		encoder_thread_item_free(item);
+		return false;
+	}
+
+	encoder_thread_push(te, item);
+
+	g_mutex_unlock(te->mutex);
+
+	return true;
+}
+
+static size_t
+encoder_thread_read(struct encoder *_encoder, void *dest, size_t length)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+	char *p = dest;
+	size_t nbytes = 0;
+
+	g_mutex_lock(te->mutex);
+
+	while (nbytes < length) {
+		struct encoder_thread_block *block =
+			g_queue_peek_head(te->output);
+		if (block == NULL)
+			break;
+
+		size_t n = block->length - block->position;
+		if (n > length - nbytes)
+			n = length - nbytes;
+
+		memcpy(p + nbytes, block->data + block->position, n);
+		nbytes += n;
+		block->position += n;
+
+		if (block->position == block->length)
+			g_free(g_queue_pop_head(te->output));
+	}
+
+	g_mutex_unlock(te->mutex);
+
+	return nbytes;
+}
+
+static const char *
+encoder_thread_get_mime_type(struct encoder *_encoder)
+{
+	struct encoder_thread *te = (struct encoder_thread *)_encoder;
+
+	return encoder_get_mime_type(te->inner);
+}
+
+const struct encoder_plugin encoder_thread_plugin = {
+	.name = "thread",
+	.finish = encoder_thread_finish,
+	.open = encoder_thread_open,
+	.close = encoder_thread_close,
+	.flush = encoder_thread_flush,
+	.tag = encoder_thread_tag,
+	.write = encoder_thread_write,
+	.read = encoder_thread_read,
+	.get_mime_type = encoder_thread_get_mime_type,
+};
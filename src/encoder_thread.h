@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * An encoder wrapper which runs another encoder in a worker thread.
+ * PCM data passed to encoder_write() is queued, and the worker
+ * encodes it asynchronously; encoder_read() returns whatever the
+ * worker has produced so far.  This way, an expensive encoder does
+ * not stall the output thread which feeds it.
+ */
+
+#ifndef MPD_ENCODER_THREAD_H
+#define MPD_ENCODER_THREAD_H
+
+#include <glib.h>
+
+struct encoder;
+struct encoder_plugin;
+struct config_param;
+
+/**
+ * Wraps an encoder object in a new one, which moves all of the
+ * encoding work into a worker thread.
+ *
+ * encoder_write() blocks only when the queue is full (i.e. the
+ * encoder is slower than real time).  encoder_flush() and
+ * encoder_tag() wait until the worker has processed all queued data,
+ * so their effects are visible to the following encoder_read() call,
+ * just like with the wrapped encoder.
+ *
+ * @param inner the encoder to be wrapped; it is freed by
+ * encoder_finish()
+ * @return the new encoder object
+ */
+struct encoder *
+encoder_thread_new(struct encoder *inner);
+
+/**
+ * Creates an encoder with encoder_init(), and wraps it with
+ * encoder_thread_new() unless the "encoder_thread" setting in the
+ * block disables that.
+ *
+ * @param plugin the encoder plugin
+ * @param param optional configuration
+ * @param error location to store the error occurring, or NULL to ignore errors.
+ * @return an encoder object on success, NULL on failure
+ */
+struct encoder *
+encoder_thread_init(const struct encoder_plugin *plugin,
+		    const struct config_param *param, GError **error);
+
+#endif
@@ -49,6 +49,10 @@
 #include <sys/inotify.h>
 #endif
 
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
+
 #ifndef WIN32
 
 static int
@@ -304,3 +308,27 @@ inotify_init_cloexec(void)
 }
 
 #endif
+
+#ifdef HAVE_EPOLL_CREATE
+
+int
+epoll_create_cloexec(void)
+{
+	int fd;
+
+#ifdef HAVE_EPOLL_CREATE1
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+
+	/* the size argument is ignored since Linux 2.6.8, but must
+	   be positive */
+	fd = epoll_create(16);
+	if (fd >= 0)
+		fd_set_cloexec(fd, true);
+
+	return fd;
+}
+
+#endif
@@ -127,4 +127,11 @@ recvmsg_cloexec(int sockfd, struct msghdr *msg, int flags);
 int
 inotify_init_cloexec(void);
 
+/**
+ * Wrapper for epoll_create(), which sets the CLOEXEC flag (atomically
+ * if supported by the OS).
+ */
+int
+epoll_create_cloexec(void);
+
 #endif
@@ -159,3 +159,15 @@ fifo_buffer_is_full(struct fifo_buffer *buffer)
 {
 	return buffer->start == 0 && buffer->end == buffer->size;
 }
+
+size_t
+fifo_buffer_space(const struct fifo_buffer *buffer)
+{
+	return buffer->size - (buffer->end - buffer->start);
+}
+
+size_t
+fifo_buffer_tail_space(const struct fifo_buffer *buffer)
+{
+	return buffer->size - buffer->end;
+}
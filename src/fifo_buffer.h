@@ -125,4 +125,21 @@ fifo_buffer_is_empty(struct fifo_buffer *buffer);
 bool
 fifo_buffer_is_full(struct fifo_buffer *buffer);
 
+/**
+ * Returns the number of bytes which can be appended to the buffer.
+ * This may take two fifo_buffer_write() calls, because the second
+ * one moves the buffer contents to the front.
+ */
+size_t
+fifo_buffer_space(const struct fifo_buffer *buffer);
+
+/**
+ * Returns the number of bytes which can be appended to a non-empty
+ * buffer without moving its contents.  As long as the caller writes
+ * no more than that, pointers returned by fifo_buffer_read() remain
+ * valid.
+ */
+size_t
+fifo_buffer_tail_space(const struct fifo_buffer *buffer);
+
 #endif
@@ -148,12 +148,35 @@ autoconvert_filter_filter(struct filter *_filter, const void *src,
 			     error_r);
 }
 
+static void
+autoconvert_filter_reset(struct filter *_filter)
+{
+	struct autoconvert_filter *filter =
+		(struct autoconvert_filter *)_filter;
+
+	filter_reset(filter->filter);
+}
+
+static const void *
+autoconvert_filter_flush(struct filter *_filter, size_t *dest_size_r,
+			 GError **error_r)
+{
+	struct autoconvert_filter *filter =
+		(struct autoconvert_filter *)_filter;
+
+	/* the convert filter doesn't buffer anything, and the
+	   underlying filter's output needs no conversion */
+	return filter_flush(filter->filter, dest_size_r, error_r);
+}
+
 static const struct filter_plugin autoconvert_filter_plugin = {
 	.name = "convert",
 	.finish = autoconvert_filter_finish,
 	.open = autoconvert_filter_open,
 	.close = autoconvert_filter_close,
 	.filter = autoconvert_filter_filter,
+	.reset = autoconvert_filter_reset,
+	.flush = autoconvert_filter_flush,
 };
 
 struct filter *
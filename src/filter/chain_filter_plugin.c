@@ -32,6 +32,11 @@ struct filter_chain {
 	struct filter base;
 
 	GSList *children;
+
+	/**
+	 * The data collected by chain_filter_flush().
+	 */
+	GByteArray *flushed;
 };
 
 static inline GQuark
@@ -48,6 +53,7 @@ chain_filter_init(G_GNUC_UNUSED const struct config_param *param,
 
 	filter_init(&chain->base, &chain_filter_plugin);
 	chain->children = NULL;
+	chain->flushed = g_byte_array_new();
 
 	return &chain->base;
 }
@@ -67,6 +73,7 @@ chain_filter_finish(struct filter *_filter)
 
 	g_slist_foreach(chain->children, chain_free_child, NULL);
 	g_slist_free(chain->children);
+	g_byte_array_free(chain->flushed, true);
 
 	g_free(chain);
 }
@@ -184,6 +191,56 @@ chain_filter_filter(struct filter *_filter,
 	return src;
 }
 
+static void
+chain_reset_child(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	struct filter *filter = data;
+
+	filter_reset(filter);
+}
+
+static void
+chain_filter_reset(struct filter *_filter)
+{
+	struct filter_chain *chain = (struct filter_chain *)_filter;
+
+	g_slist_foreach(chain->children, chain_reset_child, NULL);
+}
+
+static const void *
+chain_filter_flush(struct filter *_filter, size_t *dest_size_r,
+		   GError **error_r)
+{
+	struct filter_chain *chain = (struct filter_chain *)_filter;
+
+	g_byte_array_set_size(chain->flushed, 0);
+
+	for (GSList *i = chain->children; i != NULL; i = g_slist_next(i)) {
+		size_t size;
+		const void *data = filter_flush(i->data, &size, error_r);
+		if (data == NULL)
+			return NULL;
+
+		/* the remaining data of this filter is fed into the
+		   following ones */
+		for (GSList *j = g_slist_next(i); j != NULL && size > 0;
+		     j = g_slist_next(j)) {
+			data = filter_filter(j->data, data, size, &size,
+					     error_r);
+			if (data == NULL)
+				return NULL;
+		}
+
+		if (size > 0)
+			g_byte_array_append(chain->flushed, data, size);
+	}
+
+	*dest_size_r = chain->flushed->len;
+	return chain->flushed->len > 0
+		? (const void *)chain->flushed->data
+		: (const void *)filter_empty_buffer;
+}
+
 const struct filter_plugin chain_filter_plugin = {
 	.name = "chain",
 	.init = chain_filter_init,
@@ -191,6 +248,8 @@ const struct filter_plugin chain_filter_plugin = {
 	.open = chain_filter_open,
 	.close = chain_filter_close,
 	.filter = chain_filter_filter,
+	.reset = chain_filter_reset,
+	.flush = chain_filter_flush,
 };
 
 struct filter *
@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A look-ahead peak limiter.  It delays the signal by a few
+ * milliseconds, finds the peaks in the look-ahead window and ramps the
+ * gain down before they arrive, so the output never exceeds the
+ * configured threshold.  Combined with the replay gain filter (which
+ * runs before the filters configured in the "filters" setting of an
+ * audio output), this allows disabling "replaygain_limit" without
+ * clipping loud tracks.
+ *
+ * The signal is processed in blocks of #LIMITER_BLOCK frames: the
+ * gain envelope is computed once per block, and the gain is applied
+ * with a linear ramp in a loop without branches.
+ *
+ * Configuration:
+ *
+ *   threshold: the maximum output level in dBFS (default -1.0)
+ *   lookahead: the look-ahead time in milliseconds (default 5)
+ *   release: the release time in milliseconds (default 100)
+ *   true_peak: estimate inter-sample peaks (default yes)
+ */
+
+#include "config.h"
+#include "filter_plugin.h"
+#include "filter_internal.h"
+#include "filter_registry.h"
+#include "conf.h"
+#include "pcm_buffer.h"
+#include "audio_format.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "limiter"
+
+enum {
+	/**
+	 * The granularity of the gain envelope, in frames.
+	 */
+	LIMITER_BLOCK = 32,
+
+	/**
+	 * The upper bound for the look-ahead window, in blocks.
+	 */
+	LIMITER_MAX_LOOKAHEAD = 256,
+};
+
+struct limiter_filter {
+	struct filter base;
+
+	/**
+	 * The maximum output level (linear, 0..1).
+	 */
+	float threshold;
+
+	unsigned lookahead_ms, release_ms;
+
+	bool true_peak;
+
+	struct audio_format audio_format;
+
+	size_t frame_size, block_size;
+
+	/**
+	 * The threshold in sample units of the current format.
+	 */
+	float threshold_native;
+
+	/**
+	 * The length of the look-ahead window, in blocks.
+	 */
+	unsigned lookahead;
+
+	/**
+	 * The release coefficient per block.
+	 */
+	float release;
+
+	/**
+	 * The gain at the end of the previous output block.
+	 */
+	float gain;
+
+	/**
+	 * The delay line: input data which has not been output yet.
+	 */
+	char *delay;
+	size_t delay_length, delay_capacity;
+
+	/**
+	 * The required gain of each analyzed block in the delay line.
+	 */
+	float *required;
+	unsigned num_analyzed;
+
+	/**
+	 * Scratch buffer for the analysis of one block: the block
+	 * plus one frame before and two frames after it.
+	 */
+	float *samples;
+
+	/**
+	 * Scratch buffer for the gain of each sample of one block.
+	 */
+	float *gains;
+
+	struct pcm_buffer buffer;
+};
+
+static inline GQuark
+limiter_quark(void)
+{
+	return g_quark_from_static_string("limiter");
+}
+
+static struct filter *
+limiter_filter_init(const struct config_param *param, GError **error_r)
+{
+	const char *value =
+		config_get_block_string(param, "threshold", "-1.0");
+	char *endptr;
+	double threshold = g_ascii_strtod(value, &endptr);
+	if (endptr == value || *endptr != 0 ||
+	    threshold > 0 || threshold < -40) {
+		g_set_error(error_r, limiter_quark(), 0,
+			    "Invalid limiter threshold: %s", value);
+		return NULL;
+	}
+
+	struct limiter_filter *filter = g_new(struct limiter_filter, 1);
+	filter_init(&filter->base, &limiter_filter_plugin);
+
+	filter->threshold = pow(10, threshold / 20);
+	filter->lookahead_ms =
+		config_get_block_unsigned(param, "lookahead", 5);
+	filter->release_ms =
+		config_get_block_unsigned(param, "release", 100);
+	filter->true_peak =
+		config_get_block_bool(param, "true_peak", true);
+
+	return &filter->base;
+}
+
+static void
+limiter_filter_finish(struct filter *_filter)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+
+	g_free(filter);
+}
+
+static const struct audio_format *
+limiter_filter_open(struct filter *_filter, struct audio_format *audio_format,
+		    GError **error_r)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+
+	switch ((enum sample_format)audio_format->format) {
+	case SAMPLE_FORMAT_S8:
+	case SAMPLE_FORMAT_S16:
+	case SAMPLE_FORMAT_S24_P32:
+	case SAMPLE_FORMAT_S32:
+		break;
+
+	default:
+		g_set_error(error_r, limiter_quark(), 0,
+			    "Sample format not supported by the limiter");
+		return NULL;
+	}
+
+	audio_format->reverse_endian = false;
+	filter->audio_format = *audio_format;
+
+	filter->frame_size = audio_format_frame_size(audio_format);
+	filter->block_size = filter->frame_size * LIMITER_BLOCK;
+
+	unsigned bits = audio_format_sample_size(audio_format) * 8;
+	if (audio_format->format == SAMPLE_FORMAT_S24_P32)
+		bits = 24;
+
+	filter->threshold_native =
+		filter->threshold * (float)(1u << (bits - 1));
+
+	unsigned lookahead_frames = (unsigned)
+		((uint64_t)filter->lookahead_ms * audio_format->sample_rate
+		 / 1000);
+	filter->lookahead = (lookahead_frames + LIMITER_BLOCK - 1)
+		/ LIMITER_BLOCK;
+	if (filter->lookahead < 1)
+		filter->lookahead = 1;
+	else if (filter->lookahead > LIMITER_MAX_LOOKAHEAD)
+		filter->lookahead = LIMITER_MAX_LOOKAHEAD;
+
+	filter->release = filter->release_ms > 0
+		? 1 - exp(-(double)LIMITER_BLOCK * 1000 /
+			  ((double)filter->release_ms *
+			   audio_format->sample_rate))
+		: 1;
+
+	filter->gain = 1;
+
+	filter->delay = NULL;
+	filter->delay_length = filter->delay_capacity = 0;
+	filter->required = NULL;
+	filter->num_analyzed = 0;
+
+	filter->samples = g_new(float,
+				(LIMITER_BLOCK + 3) * audio_format->channels);
+	filter->gains = g_new(float, LIMITER_BLOCK * audio_format->channels);
+
+	pcm_buffer_init(&filter->buffer);
+
+	return &filter->audio_format;
+}
+
+static void
+limiter_filter_close(struct filter *_filter)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+
+	pcm_buffer_deinit(&filter->buffer);
+	g_free(filter->gains);
+	g_free(filter->samples);
+	g_free(filter->required);
+	g_free(filter->delay);
+}
+
+static void
+limiter_load_8(float *dest, const int8_t *src, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = src[i];
+}
+
+static void
+limiter_load_16(float *dest, const int16_t *src, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = src[i];
+}
+
+static void
+limiter_load_32(float *dest, const int32_t *src, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = src[i];
+}
+
+/**
+ * Converts frames from the delay line to floating point (in sample
+ * units), for the analysis.
+ */
+static void
+limiter_load(const struct limiter_filter *filter, float *dest,
+	     size_t frame, unsigned num_frames)
+{
+	const void *src = filter->delay + frame * filter->frame_size;
+	unsigned n = num_frames * filter->audio_format.channels;
+
+	switch ((enum sample_format)filter->audio_format.format) {
+	case SAMPLE_FORMAT_S8:
+		limiter_load_8(dest, src, n);
+		break;
+
+	case SAMPLE_FORMAT_S16:
+		limiter_load_16(dest, src, n);
+		break;
+
+	case SAMPLE_FORMAT_S24_P32:
+	case SAMPLE_FORMAT_S32:
+		limiter_load_32(dest, src, n);
+		break;
+
+	default:
+		assert(false);
+	}
+}
+
+static float
+limiter_sample_peak(const float *x, unsigned n)
+{
+	float peak = 0;
+
+	for (unsigned i = 0; i < n; ++i) {
+		float a = fabsf(x[i]);
+		peak = a > peak ? a : peak;
+	}
+
+	return peak;
+}
+
+/**
+ * Estimates the inter-sample peaks by interpolating the point between
+ * each two samples (4 point cubic interpolation, i.e. 2x
+ * oversampling).  The buffer must contain one frame before and two
+ * frames after the specified range.
+ */
+static float
+limiter_true_peak(const float *x, unsigned n, unsigned channels)
+{
+	const float *prev = x - channels, *next = x + channels,
+		*next2 = x + 2 * channels;
+	float peak = 0;
+
+	for (unsigned i = 0; i < n; ++i) {
+		float mid = (9 * (x[i] + next[i]) - (prev[i] + next2[i]))
+			* (1.0f / 16);
+		float a = fabsf(mid);
+		peak = a > peak ? a : peak;
+	}
+
+	return peak;
+}
+
+/**
+ * Calculates the gain which is required to keep the specified block
+ * below the threshold.
+ */
+static float
+limiter_block_required(struct limiter_filter *filter, unsigned block)
+{
+	const unsigned channels = filter->audio_format.channels;
+	const size_t first = (size_t)block * LIMITER_BLOCK;
+	const unsigned pad = filter->true_peak ? 2 : 0;
+
+	/* x points to the first frame of the block, with one frame
+	   of history before it */
+	float *x = filter->samples + channels;
+
+	if (first > 0)
+		limiter_load(filter, filter->samples, first - 1,
+			     LIMITER_BLOCK + 1 + pad);
+	else {
+		limiter_load(filter, x, 0, LIMITER_BLOCK + pad);
+		memcpy(filter->samples, x, channels * sizeof(*x));
+	}
+
+	float peak = limiter_sample_peak(x, LIMITER_BLOCK * channels);
+	if (filter->true_peak) {
+		float true_peak = limiter_true_peak(x,
+						    LIMITER_BLOCK * channels,
+						    channels);
+		if (true_peak > peak)
+			peak = true_peak;
+	}
+
+	return peak > filter->threshold_native
+		? filter->threshold_native / peak
+		: 1;
+}
+
+/**
+ * Calculates the gain at the end of the next output block.  The gain
+ * recovers exponentially, but it must not exceed the line which
+ * reaches the required gain of each block in the look-ahead window
+ * at the beginning of that block.
+ *
+ * @param required the required gains of the output block and the
+ * look-ahead window
+ */
+static float
+limiter_envelope(struct limiter_filter *filter, const float *required)
+{
+	float g0 = filter->gain;
+	if (required[0] < g0)
+		/* this happens only at the beginning of the stream,
+		   with a peak in the first block */
+		g0 = filter->gain = required[0];
+
+	float g1 = g0 + (1 - g0) * filter->release;
+	if (required[0] < g1)
+		g1 = required[0];
+
+	for (unsigned m = 1; m <= filter->lookahead; ++m) {
+		float limit = g0 + (required[m] - g0) / m;
+		if (limit < g1)
+			g1 = limit;
+	}
+
+	return g1;
+}
+
+static void
+limiter_apply_8(int8_t *dest, const int8_t *src, const float *gains,
+		unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = (int8_t)(src[i] * gains[i]);
+}
+
+static void
+limiter_apply_16(int16_t *dest, const int16_t *src, const float *gains,
+		 unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = (int16_t)(src[i] * gains[i]);
+}
+
+static void
+limiter_apply_24(int32_t *dest, const int32_t *src, const float *gains,
+		 unsigned n)
+{
+	/* 24 bit samples are exact in single precision */
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = (int32_t)(src[i] * gains[i]);
+}
+
+static void
+limiter_apply_32(int32_t *dest, const int32_t *src, const float *gains,
+		 unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = (int32_t)((double)src[i] * gains[i]);
+}
+
+/**
+ * Multiplies the specified number of samples with the gains in
+ * #filter->gains.
+ */
+static void
+limiter_apply(const struct limiter_filter *filter, void *dest,
+	      const void *src, unsigned n)
+{
+	switch ((enum sample_format)filter->audio_format.format) {
+	case SAMPLE_FORMAT_S8:
+		limiter_apply_8(dest, src, filter->gains, n);
+		break;
+
+	case SAMPLE_FORMAT_S16:
+		limiter_apply_16(dest, src, filter->gains, n);
+		break;
+
+	case SAMPLE_FORMAT_S24_P32:
+		limiter_apply_24(dest, src, filter->gains, n);
+		break;
+
+	case SAMPLE_FORMAT_S32:
+		limiter_apply_32(dest, src, filter->gains, n);
+		break;
+
+	default:
+		assert(false);
+	}
+}
+
+/**
+ * Applies a linear gain ramp from #filter->gain to the specified
+ * value to one block.  Rounding towards zero ensures that the result
+ * never exceeds the threshold.
+ */
+static void
+limiter_block_output(struct limiter_filter *filter, unsigned block,
+		     float g1, void *dest)
+{
+	const unsigned channels = filter->audio_format.channels;
+	const unsigned n = LIMITER_BLOCK * channels;
+	const void *src = filter->delay + block * filter->block_size;
+	const float g0 = filter->gain;
+
+	filter->gain = g1;
+
+	if (g0 >= 1 && g1 >= 1) {
+		/* optimized special case: unity gain */
+		memcpy(dest, src, filter->block_size);
+		return;
+	}
+
+	const float step = (g1 - g0) / LIMITER_BLOCK;
+	const float max = g0 > g1 ? g0 : g1;
+	float *gains = filter->gains;
+
+	for (unsigned f = 0; f < LIMITER_BLOCK; ++f) {
+		float g = g0 + step * (f + 1);
+		g = g < max ? g : max;
+
+		for (unsigned c = 0; c < channels; ++c)
+			*gains++ = g;
+	}
+
+	limiter_apply(filter, dest, src, n);
+}
+
+/**
+ * Appends data to the delay line.
+ */
+static void
+limiter_append(struct limiter_filter *filter, const void *src, size_t size)
+{
+	if (filter->delay_length + size > filter->delay_capacity) {
+		filter->delay_capacity = (filter->delay_length + size) * 2;
+		filter->delay = g_realloc(filter->delay,
+					  filter->delay_capacity);
+		filter->required = g_realloc(filter->required,
+					     (filter->delay_capacity /
+					      filter->block_size + 1) *
+					     sizeof(*filter->required));
+	}
+
+	memcpy(filter->delay + filter->delay_length, src, size);
+	filter->delay_length += size;
+}
+
+static const void *
+limiter_filter_filter(struct filter *_filter,
+		      const void *src, size_t src_size,
+		      size_t *dest_size_r, G_GNUC_UNUSED GError **error_r)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+
+	limiter_append(filter, src, src_size);
+
+	/* analyze all complete blocks (plus the frames needed for
+	   the inter-sample peak estimation) */
+
+	const size_t num_frames = filter->delay_length / filter->frame_size;
+	const unsigned pad = filter->true_peak ? 2 : 0;
+
+	while ((size_t)(filter->num_analyzed + 1) * LIMITER_BLOCK + pad
+	       <= num_frames) {
+		filter->required[filter->num_analyzed] =
+			limiter_block_required(filter, filter->num_analyzed);
+		++filter->num_analyzed;
+	}
+
+	/* output all blocks with a complete look-ahead window */
+
+	if (filter->num_analyzed <= filter->lookahead) {
+		*dest_size_r = 0;
+		return src;
+	}
+
+	const unsigned n = filter->num_analyzed - filter->lookahead;
+	const size_t dest_size = n * filter->block_size;
+	char *dest = pcm_buffer_get(&filter->buffer, dest_size);
+
+	for (unsigned i = 0; i < n; ++i)
+		limiter_block_output(filter, i,
+				     limiter_envelope(filter,
+						      filter->required + i),
+				     dest + i * filter->block_size);
+
+	/* remove them from the delay line */
+
+	filter->delay_length -= dest_size;
+	memmove(filter->delay, filter->delay + dest_size,
+		filter->delay_length);
+
+	filter->num_analyzed -= n;
+	memmove(filter->required, filter->required + n,
+		filter->num_analyzed * sizeof(*filter->required));
+
+	*dest_size_r = dest_size;
+	return dest;
+}
+
+static void
+limiter_filter_reset(struct filter *_filter)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+
+	/* forget the delay line and the gain envelope; the next
+	   data is not related to it */
+	filter->delay_length = 0;
+	filter->num_analyzed = 0;
+	filter->gain = 1;
+}
+
+/**
+ * Outputs the rest of the delay line at the end of the stream.  There
+ * is no more look-ahead; the current gain is kept, unless a peak in
+ * the remaining data requires an even lower gain.
+ */
+static const void *
+limiter_filter_flush(struct filter *_filter, size_t *dest_size_r,
+		     G_GNUC_UNUSED GError **error_r)
+{
+	struct limiter_filter *filter = (struct limiter_filter *)_filter;
+	const unsigned channels = filter->audio_format.channels;
+	const size_t num_frames = filter->delay_length / filter->frame_size;
+	const size_t dest_size = num_frames * filter->frame_size;
+	float gain = filter->gain;
+
+	if (num_frames == 0) {
+		limiter_filter_reset(_filter);
+		*dest_size_r = 0;
+		return filter_empty_buffer;
+	}
+
+	for (size_t frame = 0; frame < num_frames; frame += LIMITER_BLOCK) {
+		const unsigned block = frame / LIMITER_BLOCK;
+		float required;
+
+		if (block < filter->num_analyzed)
+			required = filter->required[block];
+		else {
+			unsigned n = LIMITER_BLOCK;
+			if (n > num_frames - frame)
+				n = num_frames - frame;
+
+			limiter_load(filter, filter->samples, frame, n);
+			float peak = limiter_sample_peak(filter->samples,
+							 n * channels);
+			required = peak > filter->threshold_native
+				? filter->threshold_native / peak
+				: 1;
+		}
+
+		if (required < gain)
+			gain = required;
+	}
+
+	char *dest = pcm_buffer_get(&filter->buffer, dest_size);
+
+	if (gain >= 1)
+		memcpy(dest, filter->delay, dest_size);
+	else {
+		for (unsigned i = 0; i < LIMITER_BLOCK * channels; ++i)
+			filter->gains[i] = gain;
+
+		for (size_t frame = 0; frame < num_frames;
+		     frame += LIMITER_BLOCK) {
+			unsigned n = LIMITER_BLOCK;
+			if (n > num_frames - frame)
+				n = num_frames - frame;
+
+			const size_t offset = frame * filter->frame_size;
+			limiter_apply(filter, dest + offset,
+				      filter->delay + offset, n * channels);
+		}
+	}
+
+	limiter_filter_reset(_filter);
+
+	*dest_size_r = dest_size;
+	return dest;
+}
+
+const struct filter_plugin limiter_filter_plugin = {
+	.name = "limiter",
+	.init = limiter_filter_init,
+	.finish = limiter_filter_finish,
+	.open = limiter_filter_open,
+	.close = limiter_filter_close,
+	.filter = limiter_filter_filter,
+	.reset = limiter_filter_reset,
+	.flush = limiter_filter_flush,
+};
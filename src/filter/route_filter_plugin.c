@@ -37,6 +37,20 @@
  *
  * If multiple sources are copied to the same destination channel, only
  * one of them takes effect.
+ *
+ * Optionally, a gain may be appended to each pair, separated by a
+ * colon.  If at least one gain is specified, the routes form a mixing
+ * matrix, and all sources routed to the same destination channel are
+ * summed up.  Pairs without an explicit gain have a gain of 1.0.
+ *
+ * Example: \\
+ * routes "0>0, 1>1, 2>0:0.5, 2>1:0.5, 3>0:0.7, 4>1:0.7"\\
+ * downmixes 5 channels (front-left, front-right, center, rear-left,
+ * rear-right) to stereo.
+ *
+ * The route map is compiled into a list of copy (or mix) operations
+ * when the filter is opened, so the per-frame loop has no bounds
+ * checks, and there are specialized loops for each sample size.
  */
 
 #include "config.h"
@@ -47,11 +61,42 @@
 #include "filter_internal.h"
 #include "filter_registry.h"
 #include "pcm_buffer.h"
+#include "pcm_volume.h"
+#include "pcm_utils.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 
+enum {
+	/**
+	 * The maximum gain of one route.  This limit guarantees
+	 * that the 32 bit accumulator of the 16 bit mixing loop
+	 * cannot overflow.
+	 */
+	ROUTE_MAX_GAIN = 4,
+};
+
+/**
+ * One copy operation: copy the sample of an input channel to an
+ * output channel.
+ */
+struct route_copy {
+	uint8_t dest, source;
+};
+
+/**
+ * One mix operation: add the sample of an input channel multiplied
+ * with a gain to an output channel.
+ */
+struct route_gain {
+	uint8_t dest, source;
+
+	/**
+	 * The gain, where #PCM_VOLUME_1 is 1.0.
+	 */
+	int gain;
+};
 
 struct route_filter {
 
@@ -82,6 +127,13 @@ struct route_filter {
 	 */
 	signed char* sources;
 
+	/**
+	 * The gain matrix, or NULL if no gain was configured.  The
+	 * gain from input channel i to output channel o is stored at
+	 * index (o * min_input_channels + i).
+	 */
+	float *gains;
+
 	/**
 	 * The actual input format of our signal, once opened
 	 */
@@ -104,6 +156,29 @@ struct route_filter {
 	 */
 	size_t output_frame_size;
 
+	/**
+	 * The copy operations compiled by route_filter_open() (only
+	 * if #gains is NULL).  Output channels without a valid
+	 * source are not listed here.
+	 */
+	struct route_copy copies[8];
+
+	unsigned num_copies;
+
+	/**
+	 * Are there output channels which are not listed in
+	 * #copies, and must be filled with silence?
+	 */
+	bool silence;
+
+	/**
+	 * The mix operations compiled by route_filter_open() (only
+	 * if #gains is not NULL), sorted by input channel.
+	 */
+	struct route_gain *mix;
+
+	unsigned num_mix;
+
 	/**
 	 * The output buffer used last time around, can be reused if the size doesn't differ.
 	 */
@@ -111,6 +186,51 @@ struct route_filter {
 
 };
 
+/**
+ * Parse one "a>b" or "a>b:gain" token of the "routes" setting.
+ */
+static bool
+route_parse_copy(const struct config_param *param, const char *token,
+		 int *source_r, int *dest_r, float *gain_r,
+		 GError **error_r)
+{
+	// Split the a>b string into source and destination
+	gchar **sd = g_strsplit(token, ">", 2);
+	if (g_strv_length(sd) != 2) {
+		g_set_error(error_r, config_quark(), 1,
+			"Invalid copy around %d in routes spec: %s",
+			param->line, token);
+		g_strfreev(sd);
+		return false;
+	}
+
+	char *endptr;
+	bool valid_gain = true;
+	*source_r = strtol(sd[0], NULL, 10);
+	*dest_r = strtol(sd[1], &endptr, 10);
+	*gain_r = 1.0;
+
+	if (*endptr == ':') {
+		const char *gain = endptr + 1;
+
+		*gain_r = g_ascii_strtod(gain, &endptr);
+		valid_gain = endptr != gain && *endptr == 0;
+	}
+
+	g_strfreev(sd);
+
+	if (!valid_gain ||
+	    *source_r < 0 || *source_r >= 255 || *dest_r < 0 ||
+	    *gain_r < 0 || *gain_r > ROUTE_MAX_GAIN) {
+		g_set_error(error_r, config_quark(), 1,
+			"Invalid copy around %d in routes spec: %s",
+			param->line, token);
+		return false;
+	}
+
+	return true;
+}
+
 /**
  * Parse the "routes" section, a string on the form
  *  a>b, c>d, e>f, ...
@@ -133,6 +253,7 @@ route_filter_parse(const struct config_param *param,
 
 	gchar **tokens;
 	int number_of_copies;
+	bool have_gains = false;
 
 	// A cowardly default, just passthrough stereo
 	const char *routes =
@@ -140,6 +261,8 @@ route_filter_parse(const struct config_param *param,
 
 	filter->min_input_channels = 0;
 	filter->min_output_channels = 0;
+	filter->sources = NULL;
+	filter->gains = NULL;
 
 	tokens = g_strsplit(routes, ",", 255);
 	number_of_copies = g_strv_length(tokens);
@@ -147,27 +270,18 @@ route_filter_parse(const struct config_param *param,
 	// Start by figuring out a few basic things about the routing set
 	for (int c=0; c<number_of_copies; ++c) {
 
-		// String and int representations of the source/destination
-		gchar **sd;
 		int source, dest;
+		float gain;
 
 		// Squeeze whitespace
 		g_strstrip(tokens[c]);
 
-		// Split the a>b string into source and destination
-		sd = g_strsplit(tokens[c], ">", 2);
-		if (g_strv_length(sd) != 2) {
-			g_set_error(error_r, config_quark(), 1,
-				"Invalid copy around %d in routes spec: %s",
-				param->line, tokens[c]);
-			g_strfreev(sd);
+		if (!route_parse_copy(param, tokens[c],
+				      &source, &dest, &gain, error_r)) {
 			g_strfreev(tokens);
 			return false;
 		}
 
-		source = strtol(sd[0], NULL, 10);
-		dest = strtol(sd[1], NULL, 10);
-
 		// Keep track of the highest channel numbers seen
 		// as either in- or outputs
 		if (source >= filter->min_input_channels)
@@ -175,7 +289,8 @@ route_filter_parse(const struct config_param *param,
 		if (dest   >= filter->min_output_channels)
 			filter->min_output_channels = dest + 1;
 
-		g_strfreev(sd);
+		if (strchr(tokens[c], ':') != NULL)
+			have_gains = true;
 	}
 
 	if (!audio_valid_channel_count(filter->min_output_channels)) {
@@ -193,31 +308,25 @@ route_filter_parse(const struct config_param *param,
 	for (int i=0; i<filter->min_output_channels; ++i)
 		filter->sources[i] = -1;
 
+	if (have_gains)
+		filter->gains = g_new0(float, filter->min_output_channels *
+				       filter->min_input_channels);
+
 	// Run through the spec again, and save the
 	// actual mapping output <- input
 	for (int c=0; c<number_of_copies; ++c) {
 
-		// String and int representations of the source/destination
-		gchar **sd;
 		int source, dest;
+		float gain;
 
-		// Split the a>b string into source and destination
-		sd = g_strsplit(tokens[c], ">", 2);
-		if (g_strv_length(sd) != 2) {
-			g_set_error(error_r, config_quark(), 1,
-				"Invalid copy around %d in routes spec: %s",
-				param->line, tokens[c]);
-			g_strfreev(sd);
-			g_strfreev(tokens);
-			return false;
-		}
-
-		source = strtol(sd[0], NULL, 10);
-		dest = strtol(sd[1], NULL, 10);
+		route_parse_copy(param, tokens[c], &source, &dest, &gain,
+				 NULL);
 
 		filter->sources[dest] = source;
 
-		g_strfreev(sd);
+		if (filter->gains != NULL)
+			filter->gains[dest * filter->min_input_channels +
+				      source] += gain;
 	}
 
 	g_strfreev(tokens);
@@ -227,13 +336,17 @@ route_filter_parse(const struct config_param *param,
 
 static struct filter *
 route_filter_init(const struct config_param *param,
-		 G_GNUC_UNUSED GError **error_r)
+		 GError **error_r)
 {
 	struct route_filter *filter = g_new(struct route_filter, 1);
 	filter_init(&filter->base, &route_filter_plugin);
 
 	// Allocate and set the filter->sources[] array
-	route_filter_parse(param, filter, error_r);
+	if (!route_filter_parse(param, filter, error_r)) {
+		g_free(filter->sources);
+		g_free(filter);
+		return NULL;
+	}
 
 	return &filter->base;
 }
@@ -243,16 +356,81 @@ route_filter_finish(struct filter *_filter)
 {
 	struct route_filter *filter = (struct route_filter *)_filter;
 
+	g_free(filter->gains);
 	g_free(filter->sources);
 	g_free(filter);
 }
 
+/**
+ * Compile the route map into a list of copy operations for the
+ * actual number of input channels.
+ */
+static void
+route_filter_compile_copies(struct route_filter *filter)
+{
+	filter->num_copies = 0;
+	filter->silence = false;
+
+	for (unsigned c = 0; c < filter->min_output_channels; ++c) {
+		if (filter->sources[c] == -1 ||
+		    (unsigned)filter->sources[c] >= filter->input_format.channels) {
+			// No source for this destination output
+			filter->silence = true;
+			continue;
+		}
+
+		struct route_copy *copy =
+			&filter->copies[filter->num_copies++];
+		copy->dest = c;
+		copy->source = filter->sources[c];
+	}
+}
+
+/**
+ * Compile the gain matrix into a list of mix operations for the
+ * actual number of input channels, skipping all zero gains.
+ */
+static void
+route_filter_compile_mix(struct route_filter *filter)
+{
+	filter->mix = g_new(struct route_gain,
+			    filter->min_output_channels *
+			    filter->min_input_channels);
+	filter->num_mix = 0;
+
+	/* sorted by input channel, so the loop reads each input
+	   frame sequentially */
+	for (unsigned i = 0; i < filter->min_input_channels &&
+		     i < filter->input_format.channels; ++i) {
+		for (unsigned o = 0; o < filter->min_output_channels; ++o) {
+			float gain = filter->gains[o * filter->min_input_channels + i];
+			if (gain <= 0)
+				continue;
+
+			if (gain > ROUTE_MAX_GAIN)
+				gain = ROUTE_MAX_GAIN;
+
+			struct route_gain *g = &filter->mix[filter->num_mix++];
+			g->dest = o;
+			g->source = i;
+			g->gain = pcm_float_to_volume(gain);
+		}
+	}
+}
+
 static const struct audio_format *
 route_filter_open(struct filter *_filter, struct audio_format *audio_format,
-		  G_GNUC_UNUSED GError **error_r)
+		  GError **error_r)
 {
 	struct route_filter *filter = (struct route_filter *)_filter;
 
+	if (filter->gains != NULL &&
+	    audio_format->format == SAMPLE_FORMAT_S24) {
+		g_set_error(error_r, audio_format_quark(), 0,
+			    "Packed 24 bit samples cannot be mixed");
+		return NULL;
+	}
+
 	// Copy the input format for later reference
 	filter->input_format = *audio_format;
 	filter->input_frame_size =
@@ -267,6 +445,13 @@ route_filter_open(struct filter *_filter, struct audio_format *audio_format,
 	filter->output_frame_size =
 		audio_format_frame_size(&filter->output_format);
 
+	if (filter->gains != NULL)
+		route_filter_compile_mix(filter);
+	else {
+		filter->mix = NULL;
+		route_filter_compile_copies(filter);
+	}
+
 	// This buffer grows as needed
 	pcm_buffer_init(&filter->output_buffer);
 
@@ -278,9 +463,259 @@ route_filter_close(struct filter *_filter)
 {
 	struct route_filter *filter = (struct route_filter *)_filter;
 
+	g_free(filter->mix);
 	pcm_buffer_deinit(&filter->output_buffer);
 }
 
+static void
+route_copy_8(int8_t *dest, unsigned dest_channels,
+	     const int8_t *src, unsigned src_channels,
+	     const struct route_copy *copies, unsigned num_copies,
+	     unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		for (unsigned i = 0; i < num_copies; ++i)
+			dest[copies[i].dest] = src[copies[i].source];
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+static void
+route_copy_16(int16_t *dest, unsigned dest_channels,
+	      const int16_t *src, unsigned src_channels,
+	      const struct route_copy *copies, unsigned num_copies,
+	      unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		for (unsigned i = 0; i < num_copies; ++i)
+			dest[copies[i].dest] = src[copies[i].source];
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+/**
+ * Optimized special case for routing any number of 16 bit channels
+ * to stereo.
+ */
+static void
+route_copy_16_to_2(int16_t *dest, const int16_t *src, unsigned src_channels,
+		   unsigned left, unsigned right, unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		*dest++ = src[left];
+		*dest++ = src[right];
+		src += src_channels;
+	}
+}
+
+static void
+route_copy_24(uint8_t *dest, unsigned dest_channels,
+	      const uint8_t *src, unsigned src_channels,
+	      const struct route_copy *copies, unsigned num_copies,
+	      unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		for (unsigned i = 0; i < num_copies; ++i)
+			memcpy(dest + copies[i].dest * 3,
+			       src + copies[i].source * 3, 3);
+
+		dest += dest_channels * 3;
+		src += src_channels * 3;
+	}
+}
+
+static void
+route_copy_32(int32_t *dest, unsigned dest_channels,
+	      const int32_t *src, unsigned src_channels,
+	      const struct route_copy *copies, unsigned num_copies,
+	      unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		for (unsigned i = 0; i < num_copies; ++i)
+			dest[copies[i].dest] = src[copies[i].source];
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+/**
+ * Optimized special case for routing any number of 32 bit channels
+ * to stereo.
+ */
+static void
+route_copy_32_to_2(int32_t *dest, const int32_t *src, unsigned src_channels,
+		   unsigned left, unsigned right, unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		*dest++ = src[left];
+		*dest++ = src[right];
+		src += src_channels;
+	}
+}
+
+/**
+ * Mixes 8 bit channels.  The sums are scaled back with an arithmetic
+ * shift, which rounds to the nearest value the same way for positive
+ * and negative samples (a division would round negative sums towards
+ * zero).
+ */
+static void
+route_mix_8(int8_t *dest, unsigned dest_channels,
+	    const int8_t *src, unsigned src_channels,
+	    const struct route_gain *mix, unsigned num_mix,
+	    unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		int32_t sum[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+		for (unsigned i = 0; i < num_mix; ++i)
+			sum[mix[i].dest] += src[mix[i].source] * mix[i].gain;
+
+		for (unsigned c = 0; c < dest_channels; ++c)
+			dest[c] = pcm_range((sum[c] + PCM_VOLUME_1 / 2)
+					    >> PCM_VOLUME_BITS, 8);
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+static void
+route_mix_16(int16_t *dest, unsigned dest_channels,
+	     const int16_t *src, unsigned src_channels,
+	     const struct route_gain *mix, unsigned num_mix,
+	     unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		int32_t sum[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+		for (unsigned i = 0; i < num_mix; ++i)
+			sum[mix[i].dest] += src[mix[i].source] * mix[i].gain;
+
+		for (unsigned c = 0; c < dest_channels; ++c)
+			dest[c] = pcm_range((sum[c] + PCM_VOLUME_1 / 2)
+					    >> PCM_VOLUME_BITS, 16);
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+static void
+route_mix_32(int32_t *dest, unsigned dest_channels,
+	     const int32_t *src, unsigned src_channels,
+	     const struct route_gain *mix, unsigned num_mix,
+	     unsigned bits, unsigned num_frames)
+{
+	while (num_frames-- > 0) {
+		int64_t sum[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+		for (unsigned i = 0; i < num_mix; ++i)
+			sum[mix[i].dest] +=
+				(int64_t)src[mix[i].source] * mix[i].gain;
+
+		for (unsigned c = 0; c < dest_channels; ++c)
+			dest[c] = pcm_range_64((sum[c] + PCM_VOLUME_1 / 2)
+					       >> PCM_VOLUME_BITS, bits);
+
+		dest += dest_channels;
+		src += src_channels;
+	}
+}
+
+static void
+route_filter_copy(const struct route_filter *filter,
+		  void *dest, const void *src, unsigned num_frames)
+{
+	const unsigned src_channels = filter->input_format.channels;
+	const unsigned dest_channels = filter->output_format.channels;
+	const struct route_copy *copies = filter->copies;
+	const bool stereo = dest_channels == 2 && filter->num_copies == 2;
+
+	if (filter->silence)
+		memset(dest, 0, num_frames * filter->output_frame_size);
+
+	switch (filter->input_format.format) {
+	case SAMPLE_FORMAT_UNDEFINED:
+		assert(false);
+		break;
+
+	case SAMPLE_FORMAT_S8:
+		route_copy_8(dest, dest_channels, src, src_channels,
+			     copies, filter->num_copies, num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S16:
+		if (stereo)
+			route_copy_16_to_2(dest, src, src_channels,
+					   filter->sources[0],
+					   filter->sources[1], num_frames);
+		else
+			route_copy_16(dest, dest_channels, src, src_channels,
+				      copies, filter->num_copies,
+				      num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S24:
+		route_copy_24(dest, dest_channels, src, src_channels,
+			      copies, filter->num_copies, num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S24_P32:
+	case SAMPLE_FORMAT_S32:
+		if (stereo)
+			route_copy_32_to_2(dest, src, src_channels,
+					   filter->sources[0],
+					   filter->sources[1], num_frames);
+		else
+			route_copy_32(dest, dest_channels, src, src_channels,
+				      copies, filter->num_copies,
+				      num_frames);
+		break;
+	}
+}
+
+static void
+route_filter_mix(const struct route_filter *filter,
+		 void *dest, const void *src, unsigned num_frames)
+{
+	const unsigned src_channels = filter->input_format.channels;
+	const unsigned dest_channels = filter->output_format.channels;
+
+	switch (filter->input_format.format) {
+	case SAMPLE_FORMAT_UNDEFINED:
+	case SAMPLE_FORMAT_S24:
+		/* rejected by route_filter_open() */
+		assert(false);
+		break;
+
+	case SAMPLE_FORMAT_S8:
+		route_mix_8(dest, dest_channels, src, src_channels,
+			    filter->mix, filter->num_mix, num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S16:
+		route_mix_16(dest, dest_channels, src, src_channels,
+			     filter->mix, filter->num_mix, num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S24_P32:
+		route_mix_32(dest, dest_channels, src, src_channels,
+			     filter->mix, filter->num_mix, 24, num_frames);
+		break;
+
+	case SAMPLE_FORMAT_S32:
+		route_mix_32(dest, dest_channels, src, src_channels,
+			     filter->mix, filter->num_mix, 32, num_frames);
+		break;
+	}
+}
+
 static const void *
 route_filter_filter(struct filter *_filter,
 		   const void *src, size_t src_size,
@@ -289,53 +724,20 @@ route_filter_filter(struct filter *_filter,
 	struct route_filter *filter = (struct route_filter *)_filter;
 
 	size_t number_of_frames = src_size / filter->input_frame_size;
+	void *dest;
 
-	size_t bytes_per_frame_per_channel =
-		audio_format_sample_size(&filter->input_format);
-
-	// A moving pointer that always refers to channel 0 in the input, at the currently handled frame
-	const uint8_t *base_source = src;
-
-	// A moving pointer that always refers to the currently filled channel of the currently handled frame, in the output
-	uint8_t *chan_destination;
-
-	// Grow our reusable buffer, if needed, and set the moving pointer
+	// Grow our reusable buffer, if needed
 	*dest_size_r = number_of_frames * filter->output_frame_size;
-	chan_destination = pcm_buffer_get(&filter->output_buffer, *dest_size_r);
-
+	dest = pcm_buffer_get(&filter->output_buffer, *dest_size_r);
 
 	// Perform our copy operations, with N input channels and M output channels
-	for (unsigned int s=0; s<number_of_frames; ++s) {
-
-		// Need to perform one copy per output channel
-		for (unsigned int c=0; c<filter->min_output_channels; ++c) {
-			if (filter->sources[c] == -1 ||
-			    (unsigned)filter->sources[c] >= filter->input_format.channels) {
-				// No source for this destination output,
-				// give it zeroes as input
-				memset(chan_destination,
-					0x00,
-					bytes_per_frame_per_channel);
-			} else {
-				// Get the data from channel sources[c]
-				// and copy it to the output
-				const uint8_t *data = base_source +
-					(filter->sources[c] * bytes_per_frame_per_channel);
-				memcpy(chan_destination,
-					  data,
-					  bytes_per_frame_per_channel);
-			}
-			// Move on to the next output channel
-			chan_destination += bytes_per_frame_per_channel;
-		}
-
-
-		// Go on to the next N input samples
-		base_source += filter->input_frame_size;
-	}
+	if (filter->mix != NULL)
+		route_filter_mix(filter, dest, src, number_of_frames);
+	else
+		route_filter_copy(filter, dest, src, number_of_frames);
 
 	// Here it is, ladies and gentlemen! Rerouted data!
-	return (void *) filter->output_buffer.buffer;
+	return dest;
 }
 
 const struct filter_plugin route_filter_plugin = {
@@ -29,6 +29,8 @@
 
 #include <assert.h>
 
+const char filter_empty_buffer[1];
+
 struct filter *
 filter_new(const struct filter_plugin *plugin,
 	   const struct config_param *param, GError **error_r)
@@ -114,3 +116,28 @@ filter_filter(struct filter *filter, const void *src, size_t src_size,
 
 	return filter->plugin->filter(filter, src, src_size, dest_size_r, error_r);
 }
+
+void
+filter_reset(struct filter *filter)
+{
+	assert(filter != NULL);
+
+	if (filter->plugin->reset != NULL)
+		filter->plugin->reset(filter);
+}
+
+const void *
+filter_flush(struct filter *filter, size_t *dest_size_r, GError **error_r)
+{
+	assert(filter != NULL);
+	assert(dest_size_r != NULL);
+	assert(error_r == NULL || *error_r == NULL);
+
+	if (filter->plugin->flush == NULL) {
+		/* this filter doesn't buffer anything */
+		*dest_size_r = 0;
+		return filter_empty_buffer;
+	}
+
+	return filter->plugin->flush(filter, dest_size_r, error_r);
+}
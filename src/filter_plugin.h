@@ -72,6 +72,20 @@ struct filter_plugin {
 			      const void *src, size_t src_size,
 			      size_t *dest_buffer_r,
 			      GError **error_r);
+
+	/**
+	 * Discards all data which is buffered inside the filter,
+	 * e.g. after a seek.  Optional.
+	 */
+	void (*reset)(struct filter *filter);
+
+	/**
+	 * Returns the data which is still buffered inside the filter
+	 * at the end of the stream.  Optional.  If nothing is
+	 * buffered, it returns #filter_empty_buffer.
+	 */
+	const void *(*flush)(struct filter *filter, size_t *dest_size_r,
+			     GError **error_r);
 };
 
 /**
@@ -147,4 +161,35 @@ filter_filter(struct filter *filter, const void *src, size_t src_size,
 	      size_t *dest_size_r,
 	      GError **error_r);
 
+/**
+ * Discards all data which is buffered inside the filter.  This is
+ * called when the audio data is interrupted (seek, cancel).
+ *
+ * @param filter the filter object
+ */
+void
+filter_reset(struct filter *filter);
+
+/**
+ * An empty buffer which is returned by filter_flush() when nothing is
+ * buffered, because NULL means "error".
+ */
+extern const char filter_empty_buffer[];
+
+/**
+ * Returns the data which is still buffered inside the filter.  This
+ * is called at the end of the stream; afterwards, the filter is
+ * empty.
+ *
+ * @param filter the filter object
+ * @param dest_size_r the size of the returned buffer (may be 0)
+ * @param error location to store the error occurring, or NULL to
+ * ignore errors.
+ * @return the destination buffer on success (will be invalidated by
+ * filter_close() or filter_filter()); #filter_empty_buffer if
+ * nothing was buffered; NULL on error
+ */
+const void *
+filter_flush(struct filter *filter, size_t *dest_size_r, GError **error_r);
+
 #endif
@@ -28,6 +28,7 @@ const struct filter_plugin *const filter_plugins[] = {
 	&null_filter_plugin,
 	&route_filter_plugin,
 	&normalize_filter_plugin,
+	&limiter_filter_plugin,
 	&volume_filter_plugin,
 	&replay_gain_filter_plugin,
 	NULL,
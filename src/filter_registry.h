@@ -31,6 +31,7 @@ extern const struct filter_plugin chain_filter_plugin;
 extern const struct filter_plugin convert_filter_plugin;
 extern const struct filter_plugin route_filter_plugin;
 extern const struct filter_plugin normalize_filter_plugin;
+extern const struct filter_plugin limiter_filter_plugin;
 extern const struct filter_plugin volume_filter_plugin;
 extern const struct filter_plugin replay_gain_filter_plugin;
 
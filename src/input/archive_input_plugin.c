@@ -22,9 +22,242 @@
 #include "archive_api.h"
 #include "archive_list.h"
 #include "input_plugin.h"
+#include "conf.h"
 
 #include <glib.h>
 
+#include <sys/stat.h>
+#include <assert.h>
+#include <string.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "input_archive"
+
+/**
+ * An archive which is kept open after a member has been opened, so
+ * the next member can be opened without parsing the archive's
+ * directory again.  The entry owns one reference to the
+ * #archive_file; each stream holds its own.
+ */
+struct archive_cache_entry {
+	const struct archive_plugin *plugin;
+
+	char *path;
+
+	/**
+	 * The modification time and size of the archive when it was
+	 * opened.  If they have changed, the entry is discarded.
+	 */
+	time_t mtime;
+	off_t size;
+
+	struct archive_file *file;
+
+	/**
+	 * The number of threads which are opening a stream from this
+	 * archive outside of the lock.  While it is non-zero, the
+	 * entry is not freed.
+	 */
+	unsigned refs;
+
+	/**
+	 * Has this entry been removed from #archive_cache?  It will
+	 * be freed when #refs drops to zero.
+	 */
+	bool removed;
+};
+
+/**
+ * The maximum number of archives in the cache.  0 disables the
+ * cache.
+ */
+static unsigned archive_cache_size;
+
+/**
+ * Protects #archive_cache.
+ */
+static GMutex *archive_cache_mutex;
+
+/**
+ * The cached archives, the most recently used one first.
+ */
+static GQueue *archive_cache;
+
+static void
+archive_cache_entry_free(struct archive_cache_entry *entry)
+{
+	archive_file_close(entry->file);
+	g_free(entry->path);
+	g_free(entry);
+}
+
+/**
+ * Discards an entry which has been removed from #archive_cache.  If
+ * it is still in use, it will be freed by archive_cache_release().
+ * Caller must lock the mutex.
+ */
+static void
+archive_cache_discard(struct archive_cache_entry *entry)
+{
+	if (entry->refs > 0)
+		entry->removed = true;
+	else
+		archive_cache_entry_free(entry);
+}
+
+/**
+ * Releases a reference obtained from archive_cache_lookup() or
+ * archive_cache_add().  Caller must lock the mutex.
+ */
+static void
+archive_cache_release(struct archive_cache_entry *entry)
+{
+	assert(entry->refs > 0);
+
+	if (--entry->refs == 0 && entry->removed)
+		archive_cache_entry_free(entry);
+}
+
+/**
+ * Looks up an archive in the cache, moves it to the front, and
+ * obtains a reference to it.  Entries for the same path which are
+ * out of date are discarded.  Caller must lock the mutex.
+ */
+static struct archive_cache_entry *
+archive_cache_lookup(const struct archive_plugin *plugin, const char *path,
+		     const struct stat *st)
+{
+	for (GList *i = archive_cache->head; i != NULL; i = i->next) {
+		struct archive_cache_entry *entry = i->data;
+
+		if (entry->plugin != plugin || strcmp(entry->path, path) != 0)
+			continue;
+
+		g_queue_delete_link(archive_cache, i);
+
+		if (entry->mtime != st->st_mtime ||
+		    entry->size != st->st_size) {
+			g_debug("archive %s has been modified", path);
+			archive_cache_discard(entry);
+			return NULL;
+		}
+
+		g_queue_push_head(archive_cache, entry);
+		++entry->refs;
+		return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Adds a newly opened archive to the cache, and closes the least
+ * recently used ones if the cache is full.  Returns the new entry
+ * with a reference.  Caller must lock the mutex.
+ */
+static struct archive_cache_entry *
+archive_cache_add(const struct archive_plugin *plugin, const char *path,
+		  const struct stat *st, struct archive_file *file)
+{
+	struct archive_cache_entry *entry = g_new(struct archive_cache_entry, 1);
+
+	entry->plugin = plugin;
+	entry->path = g_strdup(path);
+	entry->mtime = st->st_mtime;
+	entry->size = st->st_size;
+	entry->file = file;
+	entry->refs = 1;
+	entry->removed = false;
+
+	g_queue_push_head(archive_cache, entry);
+
+	while (g_queue_get_length(archive_cache) > archive_cache_size)
+		archive_cache_discard(g_queue_pop_tail(archive_cache));
+
+	return entry;
+}
+
+static bool
+input_archive_init(const struct config_param *param,
+		   G_GNUC_UNUSED GError **error_r)
+{
+	archive_cache_size = config_get_block_unsigned(param, "cache_size", 4);
+	archive_cache_mutex = g_mutex_new();
+	archive_cache = g_queue_new();
+	return true;
+}
+
+static void
+input_archive_finish(void)
+{
+	struct archive_cache_entry *entry;
+
+	while ((entry = g_queue_pop_head(archive_cache)) != NULL) {
+		assert(entry->refs == 0);
+		archive_cache_entry_free(entry);
+	}
+
+	g_queue_free(archive_cache);
+	g_mutex_free(archive_cache_mutex);
+}
+
+/**
+ * Opens a member of an archive, using a cached archive handle if
+ * possible.
+ */
+static struct input_stream *
+archive_cache_open_stream(const struct archive_plugin *plugin,
+			  const char *archive, const char *filename,
+			  GError **error_r)
+{
+	struct archive_file *file;
+	struct input_stream *is;
+	struct stat st;
+
+	if (archive_cache_size == 0 || stat(archive, &st) < 0) {
+		file = archive_file_open(plugin, archive, error_r);
+		if (file == NULL)
+			return NULL;
+
+		is = archive_file_open_stream(file, filename, error_r);
+		archive_file_close(file);
+		return is;
+	}
+
+	/* parsing the archive and opening the stream may take a
+	   while; the lock is held only while the cache is modified,
+	   and the entry's reference keeps it alive meanwhile */
+	g_mutex_lock(archive_cache_mutex);
+	struct archive_cache_entry *entry =
+		archive_cache_lookup(plugin, archive, &st);
+	g_mutex_unlock(archive_cache_mutex);
+
+	if (entry == NULL) {
+		file = archive_file_open(plugin, archive, error_r);
+		if (file == NULL)
+			return NULL;
+
+		/* check again: another thread may have added the
+		   same archive meanwhile */
+		g_mutex_lock(archive_cache_mutex);
+		entry = archive_cache_lookup(plugin, archive, &st);
+		if (entry == NULL)
+			entry = archive_cache_add(plugin, archive, &st, file);
+		g_mutex_unlock(archive_cache_mutex);
+
+		if (entry->file != file)
+			archive_file_close(file);
+	}
+
+	is = archive_file_open_stream(entry->file, filename, error_r);
+
+	g_mutex_lock(archive_cache_mutex);
+	archive_cache_release(entry);
+	g_mutex_unlock(archive_cache_mutex);
+
+	return is;
+}
+
 /**
  * select correct archive plugin to handle the input stream
  * may allow stacking of archive plugins. for example for handling
@@ -37,7 +270,6 @@ static struct input_stream *
 input_archive_open(const char *pathname, GError **error_r)
 {
 	const struct archive_plugin *arplug;
-	struct archive_file *file;
 	char *archive, *filename, *suffix, *pname;
 	struct input_stream *is;
 
@@ -60,13 +292,8 @@ input_archive_open(const char *pathname, GError **error_r)
 		return NULL;
 	}
 
-	file = archive_file_open(arplug, archive, error_r);
-	if (file == NULL)
-		return NULL;
-
 	//setup fileops
-	is = archive_file_open_stream(file, filename, error_r);
-	archive_file_close(file);
+	is = archive_cache_open_stream(arplug, archive, filename, error_r);
 	g_free(pname);
 
 	return is;
@@ -74,5 +301,7 @@ input_archive_open(const char *pathname, GError **error_r)
 
 const struct input_plugin input_plugin_archive = {
 	.name = "archive",
+	.init = input_archive_init,
+	.finish = input_archive_finish,
 	.open = input_archive_open,
 };
@@ -0,0 +1,1091 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "input/cache_input_plugin.h"
+#include "input_plugin.h"
+#include "conf.h"
+#include "fd_util.h"
+#include "open.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "input_cache"
+
+#define CACHE_INDEX_NAME "index"
+
+#define CACHE_FORMAT_PREFIX "input_cache_format: "
+#define CACHE_URI_PREFIX "uri: "
+#define CACHE_VERSION_PREFIX "version: "
+#define CACHE_SIZE_PREFIX "size: "
+#define CACHE_FILE_PREFIX "file: "
+#define CACHE_RANGE_PREFIX "range: "
+#define CACHE_END "end"
+
+enum {
+	CACHE_FORMAT = 1,
+
+	/** the default value of "input_cache_size" [MiB] */
+	DEFAULT_CACHE_SIZE = 256,
+};
+
+struct cache_range {
+	goffset start, end;
+};
+
+/**
+ * A resource in the cache.  Its data is stored in a sparse file in
+ * the cache directory, at the same offsets as in the resource.
+ */
+struct cache_entry {
+	char *uri;
+
+	/**
+	 * The version of the resource (see input_stream.version) and
+	 * its size.  If either changes, the entry is discarded.
+	 */
+	char *version;
+	goffset size;
+
+	/** the number in the name of the data file */
+	unsigned id;
+
+	/**
+	 * An array of struct cache_range: the parts of the resource
+	 * which have been stored in the data file.  Sorted, without
+	 * overlapping or adjacent ranges.
+	 */
+	GArray *ranges;
+
+	/** the sum of the lengths of all ranges */
+	goffset cached;
+
+	/** the number of streams using this entry */
+	unsigned refs;
+
+	/**
+	 * Set when the entry is removed from the cache while it is
+	 * still being used.  The last stream deletes the data file.
+	 */
+	bool obsolete;
+};
+
+struct input_cache {
+	struct input_stream base;
+
+	/**
+	 * The underlying stream.  It is closed (NULL) if the cache
+	 * holds the whole resource.
+	 */
+	struct input_stream *input;
+
+	/**
+	 * Has it been decided whether this stream is cached?  This
+	 * happens as soon as the underlying stream is ready.
+	 */
+	bool decided;
+
+	/**
+	 * Shall data received from the underlying stream be stored?
+	 * This is cleared after a write error.
+	 */
+	bool store;
+
+	/** the cache entry, or NULL if this stream is not cached */
+	struct cache_entry *entry;
+
+	/** the data file of #entry */
+	int fd;
+};
+
+static char *cache_directory;
+
+/** the maximum value of #cache_total_size */
+static goffset cache_max_size;
+
+/**
+ * This mutex protects the variables below, and the attributes
+ * "ranges", "cached", "refs" and "obsolete" of all entries.
+ */
+static GMutex *cache_mutex;
+
+/** maps URIs to struct cache_entry objects */
+static GHashTable *cache_entries;
+
+/**
+ * All entries in #cache_entries, the least recently used one
+ * first.
+ */
+static GQueue *cache_lru;
+
+/** the sum of the "cached" attribute of all entries */
+static goffset cache_total_size;
+
+/** the id of the next new entry */
+static unsigned cache_next_id;
+
+static inline GQuark
+cache_quark(void)
+{
+	return g_quark_from_static_string("input_cache");
+}
+
+static struct cache_entry *
+cache_entry_new(const char *uri, const char *version, goffset size,
+		unsigned id)
+{
+	struct cache_entry *entry = g_new(struct cache_entry, 1);
+
+	entry->uri = g_strdup(uri);
+	entry->version = g_strdup(version);
+	entry->size = size;
+	entry->id = id;
+	entry->ranges = g_array_new(false, false, sizeof(struct cache_range));
+	entry->cached = 0;
+	entry->refs = 0;
+	entry->obsolete = false;
+
+	return entry;
+}
+
+static void
+cache_entry_free(struct cache_entry *entry)
+{
+	g_free(entry->uri);
+	g_free(entry->version);
+	g_array_free(entry->ranges, true);
+	g_free(entry);
+}
+
+static char *
+cache_entry_path(const struct cache_entry *entry)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "%08x.data", entry->id);
+	return g_build_filename(cache_directory, name, NULL);
+}
+
+/**
+ * Deletes the data file, and frees the entry.
+ */
+static void
+cache_entry_delete(struct cache_entry *entry)
+{
+	char *path = cache_entry_path(entry);
+
+	if (unlink(path) < 0 && errno != ENOENT)
+		g_warning("Failed to delete %s: %s", path, g_strerror(errno));
+
+	g_free(path);
+	cache_entry_free(entry);
+}
+
+static inline const struct cache_range *
+cache_entry_range(const struct cache_entry *entry, unsigned i)
+{
+	return &g_array_index(entry->ranges, struct cache_range, i);
+}
+
+/**
+ * Returns the position of the first range which ends after the
+ * specified offset.
+ */
+static unsigned
+cache_entry_upper_bound(const struct cache_entry *entry, goffset offset)
+{
+	unsigned low = 0, high = entry->ranges->len;
+
+	while (low < high) {
+		unsigned middle = (low + high) / 2;
+
+		if (cache_entry_range(entry, middle)->end <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/**
+ * Checks whether the data at the specified offset is cached.
+ *
+ * @param end_r if the data is cached, the end of its range is stored
+ * here; if not, the start of the next cached range (or the size of
+ * the resource)
+ */
+static bool
+cache_entry_lookup(const struct cache_entry *entry, goffset offset,
+		   goffset *end_r)
+{
+	unsigned i = cache_entry_upper_bound(entry, offset);
+	const struct cache_range *range;
+
+	if (i == entry->ranges->len) {
+		*end_r = entry->size;
+		return false;
+	}
+
+	range = cache_entry_range(entry, i);
+	if (range->start <= offset) {
+		*end_r = range->end;
+		return true;
+	}
+
+	*end_r = range->start;
+	return false;
+}
+
+/**
+ * Marks a range as stored, merging it with overlapping and adjacent
+ * ranges.
+ *
+ * @return the number of bytes which were not cached before
+ */
+static goffset
+cache_entry_add(struct cache_entry *entry, goffset start, goffset end)
+{
+	struct cache_range range = { .start = start, .end = end };
+	unsigned i = cache_entry_upper_bound(entry, start - 1), j;
+	goffset old = 0, delta;
+
+	assert(start < end);
+	assert(end <= entry->size);
+
+	for (j = i; j < entry->ranges->len; ++j) {
+		const struct cache_range *r = cache_entry_range(entry, j);
+
+		if (r->start > end)
+			break;
+
+		if (r->start < range.start)
+			range.start = r->start;
+		if (r->end > range.end)
+			range.end = r->end;
+
+		old += r->end - r->start;
+	}
+
+	if (j > i)
+		g_array_remove_range(entry->ranges, i, j - i);
+	g_array_insert_val(entry->ranges, i, range);
+
+	delta = range.end - range.start - old;
+	entry->cached += delta;
+	return delta;
+}
+
+static bool
+cache_entry_is_complete(const struct cache_entry *entry)
+{
+	return entry->cached == entry->size;
+}
+
+/**
+ * Adds an entry to the cache.  Caller must lock the mutex.
+ */
+static void
+cache_insert(struct cache_entry *entry)
+{
+	assert(g_hash_table_lookup(cache_entries, entry->uri) == NULL);
+
+	g_hash_table_insert(cache_entries, entry->uri, entry);
+	g_queue_push_tail(cache_lru, entry);
+	cache_total_size += entry->cached;
+}
+
+/**
+ * Removes an entry from the cache, and deletes it unless it is still
+ * being used.  Caller must lock the mutex.
+ */
+static void
+cache_remove(struct cache_entry *entry)
+{
+	g_hash_table_remove(cache_entries, entry->uri);
+	g_queue_remove(cache_lru, entry);
+	cache_total_size -= entry->cached;
+
+	if (entry->refs == 0)
+		cache_entry_delete(entry);
+	else
+		entry->obsolete = true;
+}
+
+/**
+ * Discards the least recently used entries which are not being used
+ * until the cache fits into the configured size.  Caller must lock
+ * the mutex.
+ */
+static void
+cache_evict(void)
+{
+	GList *i = cache_lru->head;
+
+	while (cache_total_size > cache_max_size && i != NULL) {
+		struct cache_entry *entry = i->data;
+
+		i = i->next;
+
+		if (entry->refs == 0) {
+			g_debug("evicting %s", entry->uri);
+			cache_remove(entry);
+		}
+	}
+}
+
+/**
+ * Releases an entry which was used by a stream.  Caller must lock
+ * the mutex.
+ */
+static void
+cache_release(struct cache_entry *entry)
+{
+	assert(entry->refs > 0);
+
+	if (--entry->refs == 0) {
+		if (entry->obsolete)
+			cache_entry_delete(entry);
+		else
+			cache_evict();
+	}
+}
+
+/**
+ * Reads one line from the index file, and strips the newline
+ * character.  Returns NULL on end of file, or if the line is too
+ * long.
+ */
+static char *
+cache_read_line(FILE *fp, char *buffer, size_t size)
+{
+	char *newline;
+
+	if (fgets(buffer, size, fp) == NULL)
+		return NULL;
+
+	newline = strchr(buffer, '\n');
+	if (newline == NULL)
+		return feof(fp) ? buffer : NULL;
+
+	*newline = 0;
+	return buffer;
+}
+
+/**
+ * Checks a loaded entry, and adds it to the cache.  Entries whose
+ * data file is missing or too short are deleted.
+ */
+static void
+cache_load_entry(struct cache_entry *entry)
+{
+	char *path = cache_entry_path(entry);
+	struct stat st;
+	bool valid = entry->ranges->len > 0 && entry->version != NULL &&
+		g_hash_table_lookup(cache_entries, entry->uri) == NULL &&
+		stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		(goffset)st.st_size >=
+		cache_entry_range(entry, entry->ranges->len - 1)->end;
+
+	g_free(path);
+
+	if (entry->id >= cache_next_id)
+		cache_next_id = entry->id + 1;
+
+	if (valid)
+		cache_insert(entry);
+	else
+		cache_entry_delete(entry);
+}
+
+static bool
+cache_load(FILE *fp)
+{
+	char buffer[4096], *line, *endptr;
+	struct cache_entry *entry = NULL;
+	bool success = false;
+
+	line = cache_read_line(fp, buffer, sizeof(buffer));
+	if (line == NULL || !g_str_has_prefix(line, CACHE_FORMAT_PREFIX) ||
+	    atoi(line + sizeof(CACHE_FORMAT_PREFIX) - 1) != CACHE_FORMAT)
+		goto out;
+
+	while ((line = cache_read_line(fp, buffer, sizeof(buffer))) != NULL) {
+		if (g_str_has_prefix(line, CACHE_URI_PREFIX)) {
+			if (entry != NULL)
+				goto out;
+
+			line += sizeof(CACHE_URI_PREFIX) - 1;
+			entry = cache_entry_new(line, NULL, 0, 0);
+		} else if (entry == NULL) {
+			goto out;
+		} else if (g_str_has_prefix(line, CACHE_VERSION_PREFIX)) {
+			line += sizeof(CACHE_VERSION_PREFIX) - 1;
+			g_free(entry->version);
+			entry->version = g_strdup(line);
+		} else if (g_str_has_prefix(line, CACHE_SIZE_PREFIX)) {
+			line += sizeof(CACHE_SIZE_PREFIX) - 1;
+			entry->size = g_ascii_strtoll(line, NULL, 10);
+		} else if (g_str_has_prefix(line, CACHE_FILE_PREFIX)) {
+			line += sizeof(CACHE_FILE_PREFIX) - 1;
+			entry->id = (unsigned)strtoul(line, NULL, 16);
+		} else if (g_str_has_prefix(line, CACHE_RANGE_PREFIX)) {
+			goffset start, end;
+
+			line += sizeof(CACHE_RANGE_PREFIX) - 1;
+			start = g_ascii_strtoll(line, &endptr, 10);
+			if (endptr == line || *endptr != ' ')
+				goto out;
+
+			end = g_ascii_strtoll(endptr + 1, NULL, 10);
+			if (start < 0 || end <= start || end > entry->size)
+				goto out;
+
+			cache_entry_add(entry, start, end);
+		} else if (strcmp(line, CACHE_END) == 0) {
+			cache_load_entry(entry);
+			entry = NULL;
+		} else
+			goto out;
+	}
+
+	success = entry == NULL;
+
+out:
+	if (entry != NULL)
+		cache_entry_free(entry);
+	return success;
+}
+
+static void
+cache_save(void)
+{
+	char *path = g_build_filename(cache_directory, CACHE_INDEX_NAME, NULL);
+	char *tmp = g_strconcat(path, ".tmp", NULL);
+	FILE *fp;
+
+	g_debug("Saving cache index %s", path);
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		g_warning("failed to create %s: %s", tmp, strerror(errno));
+		goto out;
+	}
+
+	fprintf(fp, CACHE_FORMAT_PREFIX "%u\n", CACHE_FORMAT);
+
+	for (GList *i = cache_lru->head; i != NULL; i = i->next) {
+		const struct cache_entry *entry = i->data;
+
+		fprintf(fp, CACHE_URI_PREFIX "%s\n", entry->uri);
+		fprintf(fp, CACHE_VERSION_PREFIX "%s\n", entry->version);
+		fprintf(fp, CACHE_SIZE_PREFIX "%lli\n",
+			(long long)entry->size);
+		fprintf(fp, CACHE_FILE_PREFIX "%08x\n", entry->id);
+
+		for (unsigned j = 0; j < entry->ranges->len; ++j) {
+			const struct cache_range *range =
+				cache_entry_range(entry, j);
+
+			fprintf(fp, CACHE_RANGE_PREFIX "%lli %lli\n",
+				(long long)range->start,
+				(long long)range->end);
+		}
+
+		fprintf(fp, CACHE_END "\n");
+	}
+
+	/* always close the stream, even after a write error */
+	bool failed = ferror(fp) != 0;
+	failed = fclose(fp) != 0 || failed;
+
+	if (failed) {
+		g_warning("failed to write %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+	} else if (rename(tmp, path) < 0)
+		g_warning("failed to rename %s: %s", tmp, strerror(errno));
+
+out:
+	g_free(tmp);
+	g_free(path);
+}
+
+/**
+ * Checks whether the file name looks like a data file name, and
+ * parses the id.
+ */
+static bool
+cache_parse_file_name(const char *name, unsigned *id_r)
+{
+	char *endptr;
+
+	if (strlen(name) != 13 || strcmp(name + 8, ".data") != 0 ||
+	    !g_ascii_isxdigit(*name))
+		return false;
+
+	*id_r = (unsigned)strtoul(name, &endptr, 16);
+	return endptr == name + 8;
+}
+
+/**
+ * Deletes data files which are not referenced by the index.  They
+ * are left over when MPD was not shut down properly.
+ */
+static void
+cache_delete_orphans(void)
+{
+	GHashTable *ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GDir *dir;
+	const char *name;
+	unsigned id;
+
+	for (GList *i = cache_lru->head; i != NULL; i = i->next) {
+		const struct cache_entry *entry = i->data;
+
+		g_hash_table_insert(ids, GUINT_TO_POINTER(entry->id),
+				    GUINT_TO_POINTER(1));
+	}
+
+	dir = g_dir_open(cache_directory, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			if (!cache_parse_file_name(name, &id) ||
+			    g_hash_table_lookup(ids, GUINT_TO_POINTER(id)) != NULL)
+				continue;
+
+			char *path = g_build_filename(cache_directory, name,
+						      NULL);
+			g_debug("deleting orphaned file %s", path);
+			unlink(path);
+			g_free(path);
+
+			if (id >= cache_next_id)
+				cache_next_id = id + 1;
+		}
+
+		g_dir_close(dir);
+	}
+
+	g_hash_table_destroy(ids);
+}
+
+void
+input_cache_global_init(void)
+{
+	const char *path = config_get_path(CONF_INPUT_CACHE_DIR);
+	char *index_path;
+	FILE *fp;
+
+	assert(cache_directory == NULL);
+
+	if (path == NULL)
+		return;
+
+	if (g_mkdir_with_parents(path, 0755) < 0) {
+		g_warning("Failed to create %s: %s", path, g_strerror(errno));
+		return;
+	}
+
+	cache_directory = g_strdup(path);
+	cache_max_size = (goffset)config_get_positive(CONF_INPUT_CACHE_SIZE,
+						      DEFAULT_CACHE_SIZE)
+		* 1024 * 1024;
+	cache_mutex = g_mutex_new();
+	cache_entries = g_hash_table_new(g_str_hash, g_str_equal);
+	cache_lru = g_queue_new();
+	cache_total_size = 0;
+	cache_next_id = 1;
+
+	index_path = g_build_filename(cache_directory, CACHE_INDEX_NAME, NULL);
+	fp = fopen(index_path, "r");
+	if (fp != NULL) {
+		if (!cache_load(fp))
+			g_warning("%s is corrupt, ignoring the rest of it",
+				  index_path);
+
+		fclose(fp);
+	} else if (errno != ENOENT)
+		g_warning("failed to open %s: %s",
+			  index_path, strerror(errno));
+
+	g_free(index_path);
+
+	cache_delete_orphans();
+
+	/* the configured size may have been reduced */
+	cache_evict();
+}
+
+void
+input_cache_global_finish(void)
+{
+	struct cache_entry *entry;
+
+	if (cache_directory == NULL)
+		return;
+
+	cache_save();
+
+	while ((entry = g_queue_pop_head(cache_lru)) != NULL) {
+		assert(entry->refs == 0);
+		cache_entry_free(entry);
+	}
+
+	g_queue_free(cache_lru);
+	g_hash_table_destroy(cache_entries);
+	g_mutex_free(cache_mutex);
+	g_free(cache_directory);
+	cache_directory = NULL;
+}
+
+/**
+ * Copy public attributes from the underlying input stream.  Only
+ * used as long as this stream is not cached.
+ */
+static void
+copy_attributes(struct input_cache *c)
+{
+	struct input_stream *dest = &c->base;
+	const struct input_stream *src = c->input;
+
+	assert(c->entry == NULL);
+
+	dest->ready = src->ready;
+	dest->seekable = src->seekable;
+	dest->size = src->size;
+	dest->offset = src->offset;
+
+	if (src->mime != NULL &&
+	    (dest->mime == NULL || strcmp(dest->mime, src->mime) != 0)) {
+		g_free(dest->mime);
+		dest->mime = g_strdup(src->mime);
+	}
+}
+
+/**
+ * Called when the underlying stream has become ready: look up the
+ * cache entry, or create a new one.
+ */
+static void
+input_cache_decide(struct input_cache *c)
+{
+	const struct input_stream *input = c->input;
+	struct cache_entry *entry;
+	char *path;
+	bool complete;
+
+	assert(!c->decided);
+	assert(input->ready);
+
+	c->decided = true;
+
+	if (input->size <= 0 || input->size > cache_max_size ||
+	    input->version == NULL)
+		/* can't cache live streams, resources which don't fit,
+		   and resources which can't be validated */
+		return;
+
+	g_mutex_lock(cache_mutex);
+
+	entry = g_hash_table_lookup(cache_entries, c->base.uri);
+	if (entry != NULL && (entry->size != input->size ||
+			      strcmp(entry->version, input->version) != 0)) {
+		g_debug("%s has been modified", entry->uri);
+		cache_remove(entry);
+		entry = NULL;
+	}
+
+	if (entry == NULL) {
+		entry = cache_entry_new(c->base.uri, input->version,
+					input->size, cache_next_id++);
+		cache_insert(entry);
+	} else {
+		/* mark it as recently used */
+		g_queue_remove(cache_lru, entry);
+		g_queue_push_tail(cache_lru, entry);
+	}
+
+	++entry->refs;
+
+	g_mutex_unlock(cache_mutex);
+
+	path = cache_entry_path(entry);
+	c->fd = open_cloexec(path, O_RDWR|O_CREAT|O_BINARY, 0666);
+	if (c->fd < 0) {
+		g_warning("Failed to open %s: %s", path, g_strerror(errno));
+		g_free(path);
+
+		g_mutex_lock(cache_mutex);
+		cache_release(entry);
+		g_mutex_unlock(cache_mutex);
+		return;
+	}
+
+	g_free(path);
+
+	c->entry = entry;
+	c->store = true;
+
+	g_mutex_lock(cache_mutex);
+	complete = cache_entry_is_complete(entry);
+	g_mutex_unlock(cache_mutex);
+
+	if (complete) {
+		/* everything is on the local disk; the server is not
+		   needed anymore */
+		g_debug("serving %s from the cache", entry->uri);
+
+		input_stream_close(c->input);
+		c->input = NULL;
+		c->base.seekable = true;
+	} else
+		c->base.seekable = input->seekable;
+}
+
+static void
+input_cache_close(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	if (c->entry != NULL) {
+		close(c->fd);
+
+		g_mutex_lock(cache_mutex);
+		cache_release(c->entry);
+		g_mutex_unlock(cache_mutex);
+	}
+
+	if (c->input != NULL)
+		input_stream_close(c->input);
+
+	input_stream_deinit(&c->base);
+	g_free(c);
+}
+
+static struct tag *
+input_cache_tag(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	return c->input != NULL
+		? input_stream_tag(c->input)
+		: NULL;
+}
+
+static int
+input_cache_buffer(struct input_stream *is, GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+	int ret;
+
+	if (c->entry != NULL)
+		/* data is read on demand */
+		return 0;
+
+	ret = input_stream_buffer(c->input, error_r);
+	copy_attributes(c);
+
+	if (!c->decided && c->input->ready)
+		input_cache_decide(c);
+
+	return ret;
+}
+
+/**
+ * Reads cached data from the data file.
+ */
+static size_t
+input_cache_read_file(struct input_cache *c, void *ptr, size_t size,
+		      GError **error_r)
+{
+	ssize_t nbytes;
+
+	if (lseek(c->fd, (off_t)c->base.offset, SEEK_SET) < 0 ||
+	    (nbytes = read(c->fd, ptr, size)) < 0) {
+		g_set_error(error_r, cache_quark(), errno,
+			    "Failed to read from the cache: %s",
+			    g_strerror(errno));
+		return 0;
+	}
+
+	if (nbytes == 0) {
+		g_set_error(error_r, cache_quark(), 0,
+			    "Cache file is truncated");
+		return 0;
+	}
+
+	c->base.offset += nbytes;
+	return (size_t)nbytes;
+}
+
+/**
+ * Stores data received from the underlying stream in the data file.
+ */
+static void
+input_cache_store(struct input_cache *c, goffset offset,
+		  const void *data, size_t length)
+{
+	if (!c->store)
+		return;
+
+	if (lseek(c->fd, (off_t)offset, SEEK_SET) < 0 ||
+	    write(c->fd, data, length) != (ssize_t)length) {
+		g_warning("Failed to write to the cache: %s",
+			  g_strerror(errno));
+		c->store = false;
+		return;
+	}
+
+	g_mutex_lock(cache_mutex);
+
+	goffset delta = cache_entry_add(c->entry, offset, offset + length);
+	if (!c->entry->obsolete) {
+		cache_total_size += delta;
+		cache_evict();
+	}
+
+	g_mutex_unlock(cache_mutex);
+}
+
+/**
+ * Moves the underlying stream forward to the current offset without
+ * seeking, by reading (and storing) the data in between.  This is
+ * used for streams which are not seekable.  The buffer is used as
+ * scratch space.
+ */
+static bool
+input_cache_skip_input(struct input_cache *c, void *buffer, size_t size,
+		       GError **error_r)
+{
+	const goffset offset = c->base.offset;
+
+	assert(c->input->offset < offset);
+
+	while (c->input->offset < offset) {
+		const goffset start = c->input->offset;
+		size_t nbytes = size;
+		if ((goffset)nbytes > offset - start)
+			nbytes = (size_t)(offset - start);
+
+		nbytes = input_stream_read(c->input, buffer, nbytes, error_r);
+		if (nbytes == 0)
+			return false;
+
+		input_cache_store(c, start, buffer, nbytes);
+	}
+
+	return true;
+}
+
+/**
+ * Reads data which is not cached yet from the underlying stream,
+ * and stores it in the data file.
+ */
+static size_t
+input_cache_read_input(struct input_cache *c, void *ptr, size_t size,
+		       GError **error_r)
+{
+	struct input_stream *is = &c->base;
+	GError *error = NULL;
+	size_t nbytes;
+
+	assert(c->input != NULL);
+
+	if (c->input->offset < is->offset && !c->input->seekable) {
+		if (!input_cache_skip_input(c, ptr, size, error_r))
+			return 0;
+	} else if (c->input->offset != is->offset &&
+		   !input_stream_seek(c->input, is->offset, SEEK_SET, &error)) {
+		if (error != NULL)
+			g_propagate_error(error_r, error);
+		else
+			g_set_error(error_r, cache_quark(), 0,
+				    "Failed to seek to %lli",
+				    (long long)is->offset);
+		return 0;
+	}
+
+	nbytes = input_stream_read(c->input, ptr, size, error_r);
+	if (nbytes == 0)
+		return 0;
+
+	input_cache_store(c, is->offset, ptr, nbytes);
+
+	is->offset += nbytes;
+	return nbytes;
+}
+
+static size_t
+input_cache_read(struct input_stream *is, void *ptr, size_t size,
+		 GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+	goffset end;
+	bool cached;
+
+	if (!c->decided && c->input->ready)
+		input_cache_decide(c);
+
+	if (c->entry == NULL) {
+		size_t nbytes = input_stream_read(c->input, ptr, size,
+						  error_r);
+		copy_attributes(c);
+
+		if (!c->decided && c->input->ready)
+			input_cache_decide(c);
+
+		return nbytes;
+	}
+
+	if (is->offset >= is->size)
+		return 0;
+
+	g_mutex_lock(cache_mutex);
+	cached = cache_entry_lookup(c->entry, is->offset, &end);
+	g_mutex_unlock(cache_mutex);
+
+	if ((goffset)size > end - is->offset)
+		size = (size_t)(end - is->offset);
+
+	return cached
+		? input_cache_read_file(c, ptr, size, error_r)
+		: input_cache_read_input(c, ptr, size, error_r);
+}
+
+static bool
+input_cache_eof(struct input_stream *is)
+{
+	struct input_cache *c = (struct input_cache *)is;
+
+	if (c->entry == NULL)
+		return input_stream_eof(c->input);
+
+	/* also check the underlying stream, in case the server has
+	   sent less than it announced */
+	return is->offset >= is->size ||
+		(c->input != NULL && c->input->offset == is->offset &&
+		 input_stream_eof(c->input));
+}
+
+static bool
+input_cache_seek(struct input_stream *is, goffset offset, int whence,
+		 GError **error_r)
+{
+	struct input_cache *c = (struct input_cache *)is;
+	goffset end;
+	bool cached;
+
+	if (!c->decided && c->input->ready)
+		input_cache_decide(c);
+
+	if (c->entry == NULL) {
+		bool success = input_stream_seek(c->input, offset, whence,
+						 error_r);
+		copy_attributes(c);
+		return success;
+	}
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+
+	case SEEK_CUR:
+		offset += is->offset;
+		break;
+
+	case SEEK_END:
+		offset += is->size;
+		break;
+
+	default:
+		offset = -1;
+	}
+
+	if (offset < 0 || offset > is->size) {
+		g_set_error(error_r, cache_quark(), 0,
+			    "Invalid seek offset");
+		return false;
+	}
+
+	if (!is->seekable) {
+		/* only the cached ranges and everything from the
+		   current position of the underlying stream on are
+		   reachable; skipping forward is done by reading */
+		g_mutex_lock(cache_mutex);
+		cached = cache_entry_lookup(c->entry, offset, &end);
+		g_mutex_unlock(cache_mutex);
+
+		if (!cached && offset < c->input->offset) {
+			g_set_error(error_r, cache_quark(), 0,
+				    "Stream is not seekable");
+			return false;
+		}
+	}
+
+	/* the underlying stream is seeked when data is missing */
+	is->offset = offset;
+	return true;
+}
+
+static const struct input_plugin cache_input_plugin = {
+	.close = input_cache_close,
+	.tag = input_cache_tag,
+	.buffer = input_cache_buffer,
+	.read = input_cache_read,
+	.eof = input_cache_eof,
+	.seek = input_cache_seek,
+};
+
+struct input_stream *
+input_cache_open(struct input_stream *is)
+{
+	struct input_cache *c;
+
+	assert(is != NULL);
+
+	if (cache_directory == NULL || is->uri == NULL ||
+	    (!g_str_has_prefix(is->uri, "http://") &&
+	     !g_str_has_prefix(is->uri, "https://")))
+		return is;
+
+	c = g_new(struct input_cache, 1);
+	input_stream_init(&c->base, &cache_input_plugin, is->uri);
+	c->input = is;
+	c->decided = false;
+	c->store = false;
+	c->entry = NULL;
+	c->fd = -1;
+
+	copy_attributes(c);
+
+	if (is->ready)
+		input_cache_decide(c);
+
+	return &c->base;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A wrapper for remote input streams which stores the received data
+ * in a directory on the local disk.  When a resource is opened again
+ * (same URI, size and version), the data which has been received
+ * before is read from the disk, and only the missing ranges are
+ * requested from the server.  The total size of the cache is bounded;
+ * the least recently used resources are discarded.
+ */
+
+#ifndef MPD_INPUT_CACHE_H
+#define MPD_INPUT_CACHE_H
+
+#include "check.h"
+
+struct input_stream;
+
+/**
+ * Loads the cache index from the directory configured with
+ * "input_cache_directory".  Does nothing if that is not configured.
+ */
+void
+input_cache_global_init(void);
+
+/**
+ * Saves the cache index and frees all memory.
+ */
+void
+input_cache_global_finish(void);
+
+/**
+ * Wraps the specified stream if it can be cached.  Returns the
+ * original stream if the cache is disabled or the stream is not
+ * remote.
+ */
+struct input_stream *
+input_cache_open(struct input_stream *is);
+
+#endif
@@ -23,14 +23,20 @@
 #include "conf.h"
 #include "tag.h"
 #include "icy_metadata.h"
+#include "fifo_buffer.h"
 #include "glib_compat.h"
 
+#ifndef WIN32
+#include "fd_util.h"
+#endif
+
 #include <assert.h>
 
 #if defined(WIN32)
 	#include <winsock2.h>
 #else
 	#include <sys/select.h>
+	#include <unistd.h>
 #endif
 
 #include <string.h>
@@ -43,18 +49,16 @@
 #define G_LOG_DOMAIN "input_curl"
 
 /**
- * Buffers created by input_curl_writefunction().
+ * The default size of the per-stream buffer in kilobytes.
  */
-struct buffer {
-	/** size of the payload */
-	size_t size;
-
-	/** how much has been consumed yet? */
-	size_t consumed;
+static const unsigned CURL_DEFAULT_BUFFER_SIZE = 512;
 
-	/** the payload */
-	unsigned char data[sizeof(long)];
-};
+/**
+ * The smallest allowed buffer size.  It must be larger than the
+ * chunks passed by libcurl to input_curl_writefunction(), or a
+ * paused transfer could never be resumed.
+ */
+static const size_t CURL_MIN_BUFFER_SIZE = 4 * CURL_MAX_WRITE_SIZE;
 
 struct input_curl {
 	struct input_stream base;
@@ -64,20 +68,47 @@ struct input_curl {
 	char *url, *range;
 	struct curl_slist *request_headers;
 
-	/** the curl handles */
+	/** the curl handle */
 	CURL *easy;
-	CURLM *multi;
-
-	/** list of buffers, where input_curl_writefunction() appends
-	    to, and input_curl_read() reads from them */
-	GQueue *buffers;
 
-	/** has something been added to the buffers list? */
+	/**
+	 * Signalled by the I/O thread when data has been received,
+	 * or when the transfer is finished.
+	 */
+	GCond *cond;
+
+	/**
+	 * The ring buffer, where input_curl_writefunction() appends
+	 * to, and input_curl_read() reads from.
+	 */
+	struct fifo_buffer *buffer;
+
+	/**
+	 * True if the transfer has been paused because the buffer
+	 * was full.  The I/O thread resumes it as soon as half of the
+	 * buffer is free again.
+	 */
+	bool paused;
+
+	/**
+	 * True while the reader holds a pointer into the buffer,
+	 * obtained by input_curl_peek().  The I/O thread must not
+	 * move the buffer contents then.
+	 */
+	bool borrowed;
+
+	/** has something been added to the buffer? */
 	bool buffered;
 
 	/** did libcurl tell us the we're at the end of the response body? */
 	bool eof;
 
+	/**
+	 * An error which occurred in the I/O thread; it is returned
+	 * by the next input_curl_read() or input_curl_buffer() call.
+	 */
+	GError *postponed_error;
+
 	/** error message provided by libcurl */
 	char error[CURL_ERROR_SIZE];
 
@@ -92,6 +123,44 @@ struct input_curl {
 	struct tag *tag;
 };
 
+/**
+ * All transfers are performed by one I/O thread, which owns the
+ * CURLM handle.  The mutex protects the CURLM handle, all CURL
+ * handles and all #input_curl objects; libcurl callbacks are invoked
+ * while the I/O thread holds it.
+ */
+static struct {
+	GMutex *mutex;
+
+	GThread *thread;
+
+	CURLM *multi;
+
+	/**
+	 * A list of all #input_curl objects which have an active
+	 * transfer.
+	 */
+	GSList *streams;
+
+#ifndef WIN32
+	/**
+	 * A pipe which is used to wake up the I/O thread.
+	 */
+	int wake_fds[2];
+
+	/**
+	 * True if a byte has been written to the wake pipe, which was
+	 * not yet consumed by the I/O thread.
+	 */
+	bool wake_pending;
+#endif
+
+	/**
+	 * True if the I/O thread shall exit.
+	 */
+	bool quit;
+} curl;
+
 /** libcurl should accept "ICY 200 OK" */
 static struct curl_slist *http_200_aliases;
 
@@ -99,15 +168,216 @@ static struct curl_slist *http_200_aliases;
 static const char *proxy, *proxy_user, *proxy_password;
 static unsigned proxy_port;
 
+/** the size of each stream's buffer in bytes */
+static size_t buffer_size;
+
 static inline GQuark
 curl_quark(void)
 {
 	return g_quark_from_static_string("curl");
 }
 
+/**
+ * Wakes up the I/O thread.  Caller must hold the mutex.
+ */
+static void
+input_curl_wake(void)
+{
+#ifndef WIN32
+	if (curl.wake_pending)
+		return;
+
+	static const char dummy = 0;
+	if (write(curl.wake_fds[1], &dummy, sizeof(dummy)) > 0)
+		curl.wake_pending = true;
+#endif
+}
+
+/**
+ * Resumes all paused transfers whose buffer is half empty.  Called
+ * by the I/O thread.
+ */
+static void
+input_curl_resume_paused(void)
+{
+	for (GSList *i = curl.streams; i != NULL; i = g_slist_next(i)) {
+		struct input_curl *c = i->data;
+
+		if (c->paused && !c->borrowed &&
+		    fifo_buffer_space(c->buffer) >= buffer_size / 2) {
+			c->paused = false;
+			curl_easy_pause(c->easy, CURLPAUSE_CONT);
+		}
+	}
+}
+
+/**
+ * Evaluates the messages of the CURLM handle, and marks finished
+ * transfers.  Called by the I/O thread.
+ */
+static void
+input_curl_multi_info_read(void)
+{
+	CURLMsg *msg;
+	int msgs_in_queue;
+
+	while ((msg = curl_multi_info_read(curl.multi,
+					   &msgs_in_queue)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		struct input_curl *c = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &c);
+		assert(c != NULL);
+
+		c->eof = true;
+		c->base.ready = true;
+
+		if (msg->data.result != CURLE_OK &&
+		    c->postponed_error == NULL)
+			g_set_error(&c->postponed_error, curl_quark(),
+				    msg->data.result,
+				    "curl failed: %s", c->error);
+
+		g_cond_broadcast(c->cond);
+	}
+}
+
+/**
+ * Fails all active transfers, after the CURLM handle has reported an
+ * error.
+ */
+static void
+input_curl_abort_all(CURLMcode mcode)
+{
+	for (GSList *i = curl.streams; i != NULL; i = g_slist_next(i)) {
+		struct input_curl *c = i->data;
+
+		if (c->eof)
+			continue;
+
+		c->eof = true;
+		c->base.ready = true;
+
+		if (c->postponed_error == NULL)
+			g_set_error(&c->postponed_error, curl_quark(), mcode,
+				    "curl_multi_perform() failed: %s",
+				    curl_multi_strerror(mcode));
+
+		g_cond_broadcast(c->cond);
+	}
+}
+
+/**
+ * Determines the select() timeout for the I/O thread.
+ *
+ * @return false if the I/O thread shall wait without a timeout
+ */
+static bool
+input_curl_get_timeout(struct timeval *timeout)
+{
+#ifndef WIN32
+	if (curl.streams == NULL)
+		/* idle: sleep until the next stream is opened */
+		return false;
+#endif
+
+	timeout->tv_sec = 1;
+	timeout->tv_usec = 0;
+
+#if LIBCURL_VERSION_NUM >= 0x070f04
+	long timeout2;
+	if (curl_multi_timeout(curl.multi, &timeout2) == CURLM_OK &&
+	    timeout2 >= 0 && timeout2 < 1000) {
+		timeout->tv_sec = 0;
+		timeout->tv_usec = timeout2 * 1000;
+	}
+#endif
+
+#ifdef WIN32
+	/* there is no wake pipe on WIN32; poll for new requests */
+	if (timeout->tv_sec > 0 || curl.streams == NULL) {
+		timeout->tv_sec = 0;
+		timeout->tv_usec = 100000;
+	}
+#endif
+
+	return true;
+}
+
+static gpointer
+input_curl_io_thread(G_GNUC_UNUSED gpointer data)
+{
+	g_mutex_lock(curl.mutex);
+
+	while (!curl.quit) {
+		fd_set rfds, wfds, efds;
+		int max_fd, running_handles;
+		CURLMcode mcode;
+
+		input_curl_resume_paused();
+
+		do {
+			mcode = curl_multi_perform(curl.multi,
+						   &running_handles);
+		} while (mcode == CURLM_CALL_MULTI_PERFORM);
+
+		if (mcode != CURLM_OK)
+			input_curl_abort_all(mcode);
+
+		input_curl_multi_info_read();
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+
+		mcode = curl_multi_fdset(curl.multi, &rfds, &wfds, &efds,
+					 &max_fd);
+		if (mcode != CURLM_OK)
+			max_fd = -1;
+
+#ifndef WIN32
+		FD_SET(curl.wake_fds[0], &rfds);
+		if (curl.wake_fds[0] > max_fd)
+			max_fd = curl.wake_fds[0];
+#endif
+
+		struct timeval timeout;
+		const bool has_timeout = input_curl_get_timeout(&timeout);
+
+		g_mutex_unlock(curl.mutex);
+
+#ifdef WIN32
+		if (max_fd < 0)
+			/* winsock's select() needs at least one socket */
+			g_usleep(timeout.tv_usec);
+		else
+#endif
+		if (select(max_fd + 1, &rfds, &wfds, &efds,
+			   has_timeout ? &timeout : NULL) < 0 &&
+		    errno != EINTR && errno != EBADF)
+			g_warning("select() failed: %s", g_strerror(errno));
+
+		g_mutex_lock(curl.mutex);
+
+#ifndef WIN32
+		if (curl.wake_pending) {
+			char buffer[64];
+			while (read(curl.wake_fds[0], buffer,
+				    sizeof(buffer)) > 0) {}
+			curl.wake_pending = false;
+		}
+#endif
+	}
+
+	g_mutex_unlock(curl.mutex);
+
+	return NULL;
+}
+
 static bool
 input_curl_init(const struct config_param *param,
-		G_GNUC_UNUSED GError **error_r)
+		GError **error_r)
 {
 	CURLcode code = curl_global_init(CURL_GLOBAL_ALL);
 	if (code != CURLE_OK) {
@@ -133,36 +403,88 @@ input_curl_init(const struct config_param *param,
 						   "");
 	}
 
+	buffer_size = (size_t)config_get_block_unsigned(param, "buffer_size",
+							CURL_DEFAULT_BUFFER_SIZE)
+		* 1024;
+	if (buffer_size < CURL_MIN_BUFFER_SIZE)
+		buffer_size = CURL_MIN_BUFFER_SIZE;
+
+	curl.multi = curl_multi_init();
+	if (curl.multi == NULL) {
+		g_set_error(error_r, curl_quark(), 0,
+			    "curl_multi_init() failed");
+		goto fail_global;
+	}
+
+#ifndef WIN32
+	if (pipe_cloexec_nonblock(curl.wake_fds) < 0) {
+		g_set_error(error_r, curl_quark(), errno,
+			    "Failed to create pipe: %s", g_strerror(errno));
+		goto fail_multi;
+	}
+
+	curl.wake_pending = false;
+#endif
+
+	curl.mutex = g_mutex_new();
+	curl.streams = NULL;
+	curl.quit = false;
+
+	curl.thread = g_thread_create(input_curl_io_thread, NULL, true,
+				      error_r);
+	if (curl.thread == NULL)
+		goto fail_mutex;
+
 	return true;
-}
 
-static void
-input_curl_finish(void)
-{
+fail_mutex:
+	g_mutex_free(curl.mutex);
+#ifndef WIN32
+	close(curl.wake_fds[0]);
+	close(curl.wake_fds[1]);
+fail_multi:
+#endif
+	curl_multi_cleanup(curl.multi);
+fail_global:
 	curl_slist_free_all(http_200_aliases);
-
+	http_200_aliases = NULL;
 	curl_global_cleanup();
+	return false;
 }
 
 static void
-buffer_free_callback(gpointer data, G_GNUC_UNUSED gpointer user_data)
+input_curl_finish(void)
 {
-	struct buffer *buffer = data;
+	g_mutex_lock(curl.mutex);
+	curl.quit = true;
+	input_curl_wake();
+	g_mutex_unlock(curl.mutex);
+
+	g_thread_join(curl.thread);
 
-	assert(buffer->consumed <= buffer->size);
+	g_mutex_free(curl.mutex);
+#ifndef WIN32
+	close(curl.wake_fds[0]);
+	close(curl.wake_fds[1]);
+#endif
+	curl_multi_cleanup(curl.multi);
+
+	curl_slist_free_all(http_200_aliases);
 
-	g_free(data);
+	curl_global_cleanup();
 }
 
 /**
  * Frees the current "libcurl easy" handle, and everything associated
- * with it.
+ * with it.  Caller must hold the mutex.
  */
 static void
 input_curl_easy_free(struct input_curl *c)
 {
 	if (c->easy != NULL) {
-		curl_multi_remove_handle(c->multi, c->easy);
+		curl.streams = g_slist_remove(curl.streams, c);
+
+		curl_multi_remove_handle(curl.multi, c->easy);
 		curl_easy_cleanup(c->easy);
 		c->easy = NULL;
 	}
@@ -173,8 +495,14 @@ input_curl_easy_free(struct input_curl *c)
 	g_free(c->range);
 	c->range = NULL;
 
-	g_queue_foreach(c->buffers, buffer_free_callback, NULL);
-	g_queue_clear(c->buffers);
+	fifo_buffer_clear(c->buffer);
+	c->paused = false;
+	c->borrowed = false;
+
+	if (c->postponed_error != NULL) {
+		g_error_free(c->postponed_error);
+		c->postponed_error = NULL;
+	}
 }
 
 /**
@@ -183,16 +511,16 @@ input_curl_easy_free(struct input_curl *c)
 static void
 input_curl_free(struct input_curl *c)
 {
+	g_mutex_lock(curl.mutex);
+	input_curl_easy_free(c);
+	g_mutex_unlock(curl.mutex);
+
 	if (c->tag != NULL)
 		tag_free(c->tag);
 	g_free(c->meta_name);
 
-	input_curl_easy_free(c);
-
-	if (c->multi != NULL)
-		curl_multi_cleanup(c->multi);
-
-	g_queue_free(c->buffers);
+	fifo_buffer_free(c->buffer);
+	g_cond_free(c->cond);
 
 	g_free(c->url);
 	input_stream_deinit(&c->base);
@@ -203,200 +531,95 @@ static struct tag *
 input_curl_tag(struct input_stream *is)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	struct tag *tag = c->tag;
 
+	g_mutex_lock(curl.mutex);
+	struct tag *tag = c->tag;
 	c->tag = NULL;
-	return tag;
-}
+	g_mutex_unlock(curl.mutex);
 
-static bool
-input_curl_multi_info_read(struct input_curl *c, GError **error_r)
-{
-	CURLMsg *msg;
-	int msgs_in_queue;
-
-	while ((msg = curl_multi_info_read(c->multi,
-					   &msgs_in_queue)) != NULL) {
-		if (msg->msg == CURLMSG_DONE) {
-			c->eof = true;
-			c->base.ready = true;
-
-			if (msg->data.result != CURLE_OK) {
-				g_set_error(error_r, curl_quark(),
-					    msg->data.result,
-					    "curl failed: %s", c->error);
-				return false;
-			}
-		}
-	}
-
-	return true;
+	return tag;
 }
 
 /**
- * Wait for the libcurl socket.
+ * Waits until the I/O thread signals this stream, but not longer
+ * than the specified number of milliseconds.  Caller must hold the
+ * mutex.
  *
- * @return -1 on error, 0 if no data is available yet, 1 if data is
- * available
+ * @return false on timeout
  */
-static int
-input_curl_select(struct input_curl *c, GError **error_r)
+static bool
+input_curl_wait(struct input_curl *c, unsigned timeout_ms)
 {
-	fd_set rfds, wfds, efds;
-	int max_fd, ret;
-	CURLMcode mcode;
-	struct timeval timeout = {
-		.tv_sec = 1,
-		.tv_usec = 0,
-	};
-
-	assert(!c->eof);
-
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_ZERO(&efds);
-
-	mcode = curl_multi_fdset(c->multi, &rfds, &wfds, &efds, &max_fd);
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_fdset() failed: %s",
-			    curl_multi_strerror(mcode));
-		return -1;
-	}
-
-#if LIBCURL_VERSION_NUM >= 0x070f04
-	long timeout2;
-	mcode = curl_multi_timeout(c->multi, &timeout2);
-	if (mcode != CURLM_OK) {
-		g_warning("curl_multi_timeout() failed: %s\n",
-			  curl_multi_strerror(mcode));
-		return -1;
-	}
-
-	if (timeout2 >= 0) {
-		if (timeout2 > 10000)
-			timeout2 = 10000;
-
-		timeout.tv_sec = timeout2 / 1000;
-		timeout.tv_usec = (timeout2 % 1000) * 1000;
-	}
-#endif
+	GTimeVal deadline;
 
-	ret = select(max_fd + 1, &rfds, &wfds, &efds, &timeout);
-	if (ret < 0)
-		g_set_error(error_r, g_quark_from_static_string("errno"),
-			    errno,
-			    "select() failed: %s\n", g_strerror(errno));
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, timeout_ms * 1000);
 
-	return ret;
+	return g_cond_timed_wait(c->cond, curl.mutex, &deadline);
 }
 
+/**
+ * Returns the postponed error from the I/O thread.  Caller must hold
+ * the mutex.
+ */
 static bool
-fill_buffer(struct input_stream *is, GError **error_r)
+input_curl_check_error(struct input_curl *c, GError **error_r)
 {
-	struct input_curl *c = (struct input_curl *)is;
-	CURLMcode mcode = CURLM_CALL_MULTI_PERFORM;
-
-	while (!c->eof && g_queue_is_empty(c->buffers)) {
-		int running_handles;
-		bool bret;
-
-		if (mcode != CURLM_CALL_MULTI_PERFORM) {
-			/* if we're still here, there is no input yet
-			   - wait for input */
-			int ret = input_curl_select(c, error_r);
-			if (ret <= 0)
-				/* no data yet or error */
-				return false;
-		}
-
-		mcode = curl_multi_perform(c->multi, &running_handles);
-		if (mcode != CURLM_OK && mcode != CURLM_CALL_MULTI_PERFORM) {
-			g_set_error(error_r, curl_quark(), mcode,
-				    "curl_multi_perform() failed: %s",
-				    curl_multi_strerror(mcode));
-			c->eof = true;
-			is->ready = true;
-			return false;
-		}
-
-		bret = input_curl_multi_info_read(c, error_r);
-		if (!bret)
-			return false;
-	}
+	if (c->postponed_error == NULL)
+		return true;
 
-	return !g_queue_is_empty(c->buffers);
+	g_propagate_error(error_r, c->postponed_error);
+	c->postponed_error = NULL;
+	return false;
 }
 
 /**
- * Mark a part of the buffer object as consumed.
+ * Called after data has been removed from the buffer: lets the I/O
+ * thread resume the transfer if it has been paused.  Caller must hold
+ * the mutex.
  */
-static struct buffer *
-consume_buffer(struct buffer *buffer, size_t length)
+static void
+input_curl_consumed(struct input_curl *c)
 {
-	assert(buffer != NULL);
-	assert(buffer->consumed < buffer->size);
-
-	buffer->consumed += length;
-	if (buffer->consumed < buffer->size)
-		return buffer;
-
-	assert(buffer->consumed == buffer->size);
-
-	g_free(buffer);
-
-	return NULL;
+	if (c->paused && fifo_buffer_space(c->buffer) >= buffer_size / 2)
+		input_curl_wake();
 }
 
+/**
+ * Copies data from the buffer, and strips the icy-metadata.  Caller
+ * must hold the mutex.
+ */
 static size_t
-read_from_buffer(struct icy_metadata *icy_metadata, GQueue *buffers,
-		 void *dest0, size_t length)
+read_from_buffer(struct input_curl *c, void *dest0, size_t length)
 {
-	struct buffer *buffer = g_queue_pop_head(buffers);
 	uint8_t *dest = dest0;
 	size_t nbytes = 0;
 
-	assert(buffer->size > 0);
-	assert(buffer->consumed < buffer->size);
-
-	if (length > buffer->size - buffer->consumed)
-		length = buffer->size - buffer->consumed;
+	while (length > 0) {
+		size_t available;
+		const uint8_t *src = fifo_buffer_read(c->buffer, &available);
+		if (src == NULL)
+			break;
 
-	while (true) {
-		size_t chunk;
+		if (available > length)
+			available = length;
 
-		chunk = icy_data(icy_metadata, length);
+		size_t chunk = icy_data(&c->icy_metadata, available);
 		if (chunk > 0) {
-			memcpy(dest, buffer->data + buffer->consumed,
-			       chunk);
-			buffer = consume_buffer(buffer, chunk);
+			memcpy(dest, src, chunk);
+			fifo_buffer_consume(c->buffer, chunk);
 
 			nbytes += chunk;
 			dest += chunk;
 			length -= chunk;
-
-			if (length == 0)
-				break;
-
-			assert(buffer != NULL);
+			continue;
 		}
 
-		chunk = icy_meta(icy_metadata, buffer->data + buffer->consumed,
-				 length);
-		if (chunk > 0) {
-			buffer = consume_buffer(buffer, chunk);
-
-			length -= chunk;
-
-			if (length == 0)
-				break;
-
-			assert(buffer != NULL);
-		}
+		chunk = icy_meta(&c->icy_metadata, src, available);
+		fifo_buffer_consume(c->buffer, chunk);
 	}
 
-	if (buffer != NULL)
-		g_queue_push_head(buffers, buffer);
+	input_curl_consumed(c);
 
 	return nbytes;
 }
@@ -423,26 +646,32 @@ input_curl_read(struct input_stream *is, void *ptr, size_t size,
 		GError **error_r)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	bool success;
 	size_t nbytes = 0;
-	char *dest = ptr;
 
-	do {
-		/* fill the buffer */
+	g_mutex_lock(curl.mutex);
 
-		success = fill_buffer(is, error_r);
-		if (!success)
-			return 0;
+	c->borrowed = false;
 
-		/* send buffer contents */
+	do {
+		/* wait for data from the I/O thread; give up after a
+		   while, so the decoder can check for commands */
 
-		while (size > 0 && !g_queue_is_empty(c->buffers)) {
-			size_t copy = read_from_buffer(&c->icy_metadata, c->buffers,
-						       dest + nbytes, size);
+		while (fifo_buffer_is_empty(c->buffer) && !c->eof)
+			if (!input_curl_wait(c, 1000))
+				break;
 
-			nbytes += copy;
-			size -= copy;
+		if (fifo_buffer_is_empty(c->buffer)) {
+			if (!input_curl_check_error(c, error_r)) {
+				g_mutex_unlock(curl.mutex);
+				return 0;
+			}
+
+			break;
 		}
+
+		/* the buffer may consist of icy-metadata only, so this
+		   may return 0 */
+		nbytes = read_from_buffer(c, ptr, size);
 	} while (nbytes == 0);
 
 	if (icy_defined(&c->icy_metadata))
@@ -450,9 +679,70 @@ input_curl_read(struct input_stream *is, void *ptr, size_t size,
 
 	is->offset += (goffset)nbytes;
 
+	g_mutex_unlock(curl.mutex);
+
 	return nbytes;
 }
 
+static const void *
+input_curl_peek(struct input_stream *is, size_t *length_r)
+{
+	struct input_curl *c = (struct input_curl *)is;
+	const uint8_t *p;
+	size_t length;
+
+	g_mutex_lock(curl.mutex);
+
+	/* skip icy-metadata, only the payload is lent to the
+	   caller */
+	while ((p = fifo_buffer_read(c->buffer, &length)) != NULL &&
+	       icy_defined(&c->icy_metadata) &&
+	       c->icy_metadata.data_rest == 0)
+		fifo_buffer_consume(c->buffer,
+				    icy_meta(&c->icy_metadata, p, length));
+
+	if (p != NULL) {
+		if (icy_defined(&c->icy_metadata) &&
+		    length > c->icy_metadata.data_rest)
+			length = c->icy_metadata.data_rest;
+
+		c->borrowed = true;
+		*length_r = length;
+	} else
+		input_curl_consumed(c);
+
+	if (icy_defined(&c->icy_metadata))
+		copy_icy_tag(c);
+
+	g_mutex_unlock(curl.mutex);
+
+	return p;
+}
+
+static void
+input_curl_consume(struct input_stream *is, size_t nbytes)
+{
+	struct input_curl *c = (struct input_curl *)is;
+
+	g_mutex_lock(curl.mutex);
+
+	assert(c->borrowed);
+	c->borrowed = false;
+
+	if (nbytes > 0) {
+		/* input_curl_peek() has limited the length to the
+		   icy payload, so this consumes all of it */
+		icy_data(&c->icy_metadata, nbytes);
+
+		fifo_buffer_consume(c->buffer, nbytes);
+		is->offset += (goffset)nbytes;
+	}
+
+	input_curl_consumed(c);
+
+	g_mutex_unlock(curl.mutex);
+}
+
 static void
 input_curl_close(struct input_stream *is)
 {
@@ -466,45 +756,36 @@ input_curl_eof(G_GNUC_UNUSED struct input_stream *is)
 {
 	struct input_curl *c = (struct input_curl *)is;
 
-	return c->eof && g_queue_is_empty(c->buffers);
+	g_mutex_lock(curl.mutex);
+	bool eof = c->eof && fifo_buffer_is_empty(c->buffer);
+	g_mutex_unlock(curl.mutex);
+
+	return eof;
 }
 
 static int
 input_curl_buffer(struct input_stream *is, GError **error_r)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	CURLMcode mcode;
-	int running_handles;
-	bool ret;
-
-	c->buffered = false;
 
-	if (!is->ready && !c->eof)
-		/* not ready yet means the caller is waiting in a busy
-		   loop; relax that by calling select() on the
-		   socket */
-		if (input_curl_select(c, error_r) < 0)
-			return -1;
+	g_mutex_lock(curl.mutex);
 
-	do {
-		mcode = curl_multi_perform(c->multi, &running_handles);
-	} while (mcode == CURLM_CALL_MULTI_PERFORM &&
-		 g_queue_is_empty(c->buffers));
+	if (!c->buffered && !c->eof)
+		/* callers invoke this method in a loop; wait for the
+		   I/O thread instead of busy looping */
+		input_curl_wait(c, 1000);
 
-	if (mcode != CURLM_OK && mcode != CURLM_CALL_MULTI_PERFORM) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_perform() failed: %s",
-			    curl_multi_strerror(mcode));
-		c->eof = true;
-		is->ready = true;
+	if (!input_curl_check_error(c, error_r)) {
+		g_mutex_unlock(curl.mutex);
 		return -1;
 	}
 
-	ret = input_curl_multi_info_read(c, error_r);
-	if (!ret)
-		return -1;
+	int ret = c->buffered;
+	c->buffered = false;
+
+	g_mutex_unlock(curl.mutex);
 
-	return c->buffered;
+	return ret;
 }
 
 /** called by curl when new data is available */
@@ -518,6 +799,17 @@ input_curl_headerfunction(void *ptr, size_t size, size_t nmemb, void *stream)
 	size *= nmemb;
 	end = header + size;
 
+	if (size >= 5 && memcmp(header, "HTTP/", 5) == 0) {
+		/* a new response begins (e.g. after a redirect); the
+		   validator of the previous one does not apply to it */
+		if (!c->base.ready) {
+			g_free(c->base.version);
+			c->base.version = NULL;
+		}
+
+		return size;
+	}
+
 	value = memchr(header, ':', size);
 	if (value == NULL || (size_t)(value - header) >= sizeof(name))
 		return size;
@@ -552,8 +844,21 @@ input_curl_headerfunction(void *ptr, size_t size, size_t nmemb, void *stream)
 
 		c->base.size = c->base.offset + g_ascii_strtoull(buffer, NULL, 10);
 	} else if (g_ascii_strcasecmp(name, "content-type") == 0) {
-		g_free(c->base.mime);
-		c->base.mime = g_strndup(value, end - value);
+		/* once the stream is ready, the decoder thread may be
+		   using the MIME type; don't free it */
+		if (!c->base.ready) {
+			g_free(c->base.mime);
+			c->base.mime = g_strndup(value, end - value);
+		}
+	} else if (g_ascii_strcasecmp(name, "etag") == 0 ||
+		   (g_ascii_strcasecmp(name, "last-modified") == 0 &&
+		    c->base.version == NULL)) {
+		/* the ETag is preferred, because it is more precise
+		   than the modification time */
+		if (!c->base.ready) {
+			g_free(c->base.version);
+			c->base.version = g_strndup(value, end - value);
+		}
 	} else if (g_ascii_strcasecmp(name, "icy-name") == 0 ||
 		   g_ascii_strcasecmp(name, "ice-name") == 0 ||
 		   g_ascii_strcasecmp(name, "x-audiocast-name") == 0) {
@@ -596,24 +901,52 @@ static size_t
 input_curl_writefunction(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	struct input_curl *c = (struct input_curl *)stream;
-	struct buffer *buffer;
+	const char *src = ptr;
 
 	size *= nmemb;
 	if (size == 0)
 		return 0;
 
-	buffer = g_malloc(sizeof(*buffer) - sizeof(buffer->data) + size);
-	buffer->size = size;
-	buffer->consumed = 0;
-	memcpy(buffer->data, ptr, size);
-	g_queue_push_tail(c->buffers, buffer);
+	size_t space = c->borrowed
+		/* the reader holds a pointer into the buffer, don't
+		   move its contents */
+		? fifo_buffer_tail_space(c->buffer)
+		: fifo_buffer_space(c->buffer);
+	if (space < size) {
+		/* the buffer is full: pause the transfer until the
+		   reader has caught up; libcurl will pass the same
+		   data again after that */
+		c->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	size_t remaining = size;
+	do {
+		size_t max_length;
+		void *dest = fifo_buffer_write(c->buffer, &max_length);
+		assert(dest != NULL);
+
+		if (max_length > remaining)
+			max_length = remaining;
+
+		memcpy(dest, src, max_length);
+		fifo_buffer_append(c->buffer, max_length);
+
+		src += max_length;
+		remaining -= max_length;
+	} while (remaining > 0);
 
 	c->buffered = true;
 	c->base.ready = true;
+	g_cond_broadcast(c->cond);
 
 	return size;
 }
 
+/**
+ * Creates a new CURL handle, and adds it to the I/O thread.  Caller
+ * must hold the mutex.
+ */
 static bool
 input_curl_easy_init(struct input_curl *c, GError **error_r)
 {
@@ -621,6 +954,7 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 	CURLMcode mcode;
 
 	c->eof = false;
+	c->buffered = false;
 
 	c->easy = curl_easy_init();
 	if (c->easy == NULL) {
@@ -629,14 +963,7 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 		return false;
 	}
 
-	mcode = curl_multi_add_handle(c->multi, c->easy);
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_add_handle() failed: %s",
-			    curl_multi_strerror(mcode));
-		return false;
-	}
-
+	curl_easy_setopt(c->easy, CURLOPT_PRIVATE, c);
 	curl_easy_setopt(c->easy, CURLOPT_USERAGENT,
 			 "Music Player Daemon " VERSION);
 	curl_easy_setopt(c->easy, CURLOPT_HEADERFUNCTION,
@@ -670,6 +997,8 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 		g_set_error(error_r, curl_quark(), code,
 			    "curl_easy_setopt() failed: %s",
 			    curl_easy_strerror(code));
+		curl_easy_cleanup(c->easy);
+		c->easy = NULL;
 		return false;
 	}
 
@@ -678,6 +1007,25 @@ input_curl_easy_init(struct input_curl *c, GError **error_r)
 					       "Icy-Metadata: 1");
 	curl_easy_setopt(c->easy, CURLOPT_HTTPHEADER, c->request_headers);
 
+	if (c->base.offset > 0) {
+		/* send the "Range" header */
+		c->range = g_strdup_printf("%lld-", (long long)c->base.offset);
+		curl_easy_setopt(c->easy, CURLOPT_RANGE, c->range);
+	}
+
+	mcode = curl_multi_add_handle(curl.multi, c->easy);
+	if (mcode != CURLM_OK) {
+		g_set_error(error_r, curl_quark(), mcode,
+			    "curl_multi_add_handle() failed: %s",
+			    curl_multi_strerror(mcode));
+		curl_easy_cleanup(c->easy);
+		c->easy = NULL;
+		return false;
+	}
+
+	curl.streams = g_slist_prepend(curl.streams, c);
+	input_curl_wake();
+
 	return true;
 }
 
@@ -689,28 +1037,10 @@ input_curl_reinit(struct input_stream *is)
 	assert(c->base.plugin == &input_plugin_curl);
 	assert(c->easy != NULL);
 
+	g_mutex_lock(curl.mutex);
 	curl_easy_setopt(c->easy, CURLOPT_WRITEHEADER, is);
 	curl_easy_setopt(c->easy, CURLOPT_WRITEDATA, is);
-}
-
-static bool
-input_curl_send_request(struct input_curl *c, GError **error_r)
-{
-	CURLMcode mcode;
-	int running_handles;
-
-	do {
-		mcode = curl_multi_perform(c->multi, &running_handles);
-	} while (mcode == CURLM_CALL_MULTI_PERFORM);
-
-	if (mcode != CURLM_OK) {
-		g_set_error(error_r, curl_quark(), mcode,
-			    "curl_multi_perform() failed: %s",
-			    curl_multi_strerror(mcode));
-		return false;
-	}
-
-	return true;
+	g_mutex_unlock(curl.mutex);
 }
 
 static bool
@@ -718,7 +1048,6 @@ input_curl_seek(struct input_stream *is, goffset offset, int whence,
 		GError **error_r)
 {
 	struct input_curl *c = (struct input_curl *)is;
-	bool ret;
 
 	assert(is->ready);
 
@@ -754,27 +1083,30 @@ input_curl_seek(struct input_stream *is, goffset offset, int whence,
 	if (offset < 0)
 		return false;
 
+	g_mutex_lock(curl.mutex);
+
+	c->borrowed = false;
+
 	/* check if we can fast-forward the buffer */
 
-	while (offset > is->offset && !g_queue_is_empty(c->buffers)) {
-		struct buffer *buffer;
+	while (offset > is->offset) {
 		size_t length;
+		if (fifo_buffer_read(c->buffer, &length) == NULL)
+			break;
 
-		buffer = (struct buffer *)g_queue_pop_head(c->buffers);
-
-		length = buffer->size - buffer->consumed;
 		if (offset - is->offset < (goffset)length)
 			length = offset - is->offset;
 
-		buffer = consume_buffer(buffer, length);
-		if (buffer != NULL)
-			g_queue_push_head(c->buffers, buffer);
-
+		fifo_buffer_consume(c->buffer, length);
 		is->offset += length;
 	}
 
-	if (offset == is->offset)
+	input_curl_consumed(c);
+
+	if (offset == is->offset) {
+		g_mutex_unlock(curl.mutex);
 		return true;
+	}
 
 	/* close the old connection and open a new one */
 
@@ -786,32 +1118,20 @@ input_curl_seek(struct input_stream *is, goffset offset, int whence,
 		   triggering a "416 Requested Range Not Satisfiable"
 		   response */
 		c->eof = true;
+		g_mutex_unlock(curl.mutex);
 		return true;
 	}
 
-	ret = input_curl_easy_init(c, error_r);
-	if (!ret)
-		return false;
-
-	/* send the "Range" header */
-
-	if (is->offset > 0) {
-		c->range = g_strdup_printf("%lld-", (long long)is->offset);
-		curl_easy_setopt(c->easy, CURLOPT_RANGE, c->range);
-	}
+	bool success = input_curl_easy_init(c, error_r);
+	g_mutex_unlock(curl.mutex);
 
-	ret = input_curl_send_request(c, error_r);
-	if (!ret)
-		return false;
-
-	return input_curl_multi_info_read(c, error_r);
+	return success;
 }
 
 static struct input_stream *
 input_curl_open(const char *url, GError **error_r)
 {
 	struct input_curl *c;
-	bool ret;
 
 	if (strncmp(url, "http://", 7) != 0)
 		return NULL;
@@ -820,33 +1140,17 @@ input_curl_open(const char *url, GError **error_r)
 	input_stream_init(&c->base, &input_plugin_curl, url);
 
 	c->url = g_strdup(url);
-	c->buffers = g_queue_new();
-
-	c->multi = curl_multi_init();
-	if (c->multi == NULL) {
-		g_set_error(error_r, curl_quark(), 0,
-			    "curl_multi_init() failed");
-		input_curl_free(c);
-		return NULL;
-	}
+	c->cond = g_cond_new();
+	c->buffer = fifo_buffer_new(buffer_size);
 
 	icy_clear(&c->icy_metadata);
 	c->tag = NULL;
 
-	ret = input_curl_easy_init(c, error_r);
-	if (!ret) {
-		input_curl_free(c);
-		return NULL;
-	}
-
-	ret = input_curl_send_request(c, error_r);
-	if (!ret) {
-		input_curl_free(c);
-		return NULL;
-	}
+	g_mutex_lock(curl.mutex);
+	bool success = input_curl_easy_init(c, error_r);
+	g_mutex_unlock(curl.mutex);
 
-	ret = input_curl_multi_info_read(c, error_r);
-	if (!ret) {
+	if (!success) {
 		input_curl_free(c);
 		return NULL;
 	}
@@ -864,6 +1168,8 @@ const struct input_plugin input_plugin_curl = {
 	.tag = input_curl_tag,
 	.buffer = input_curl_buffer,
 	.read = input_curl_read,
+	.peek = input_curl_peek,
+	.consume = input_curl_consume,
 	.eof = input_curl_eof,
 	.seek = input_curl_seek,
 };
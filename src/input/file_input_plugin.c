@@ -20,10 +20,15 @@
 #include "config.h" /* must be first for large file support */
 #include "input/file_input_plugin.h"
 #include "input_plugin.h"
+#include "conf.h"
 #include "fd_util.h"
 #include "open.h"
 
 #include <sys/stat.h>
+#include <assert.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -32,18 +37,136 @@
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "input_file"
 
+/**
+ * The amount of data announced to the kernel with a "will need" hint
+ * ahead of the current offset.  A new hint is issued when half of it
+ * has been consumed.
+ */
+static const goffset FILE_HINT_SIZE = 1024 * 1024;
+
 struct file_input_stream {
 	struct input_stream base;
 
+	/**
+	 * The file descriptor, or -1 if the file has been mapped
+	 * into memory.
+	 */
 	int fd;
+
+#ifdef HAVE_MMAP
+	/**
+	 * The whole file mapped into memory, or NULL if this stream
+	 * uses read().
+	 */
+	const unsigned char *map;
+#endif
+
+	/**
+	 * The end of the range which was announced to the kernel with
+	 * the most recent "will need" hint.
+	 */
+	goffset hinted;
 };
 
+/**
+ * Shall files be mapped into memory instead of being read with
+ * read()?  Configured with the "mmap" setting.
+ */
+static bool file_mmap;
+
 static inline GQuark
 file_quark(void)
 {
 	return g_quark_from_static_string("file");
 }
 
+static bool
+input_file_init(const struct config_param *param,
+		G_GNUC_UNUSED GError **error_r)
+{
+	file_mmap = config_get_block_bool(param, "mmap", false);
+
+#ifndef HAVE_MMAP
+	if (file_mmap)
+		g_warning("mmap() is not available on this platform");
+#endif
+
+	return true;
+}
+
+/**
+ * Tell the kernel that we are going to need the data after the
+ * current offset soon, unless we have already done that recently.
+ */
+static void
+file_will_need(struct file_input_stream *fis)
+{
+	goffset start = fis->base.offset, length;
+
+	if (start + FILE_HINT_SIZE / 2 < fis->hinted ||
+	    start >= fis->base.size)
+		return;
+
+	length = fis->base.size - start;
+	if (length > FILE_HINT_SIZE)
+		length = FILE_HINT_SIZE;
+
+	fis->hinted = start + length;
+
+#ifdef HAVE_MMAP
+	if (fis->map != NULL) {
+#ifdef MADV_WILLNEED
+		/* madvise() wants a page aligned address */
+		goffset mask = (goffset)sysconf(_SC_PAGESIZE) - 1;
+		goffset aligned = start & ~mask;
+
+		madvise((void *)(fis->map + aligned),
+			(size_t)(length + start - aligned), MADV_WILLNEED);
+#endif
+		return;
+	}
+#endif
+
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fis->fd, (off_t)start, (off_t)length,
+		      POSIX_FADV_WILLNEED);
+#endif
+}
+
+#ifdef HAVE_MMAP
+
+/**
+ * Attempts to map the file into memory.  On success, the file
+ * descriptor is closed, because it is not needed anymore.  On
+ * failure, the stream keeps using read().
+ */
+static void
+file_map(struct file_input_stream *fis)
+{
+	void *p;
+
+	if (fis->base.size <= 0 || (guint64)fis->base.size > G_MAXSIZE)
+		return;
+
+	p = mmap(NULL, (size_t)fis->base.size, PROT_READ, MAP_SHARED,
+		 fis->fd, 0);
+	if (p == MAP_FAILED) {
+		g_debug("Failed to map \"%s\": %s",
+			fis->base.uri, g_strerror(errno));
+		return;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	madvise(p, (size_t)fis->base.size, MADV_SEQUENTIAL);
+#endif
+
+	fis->map = p;
+	close(fis->fd);
+	fis->fd = -1;
+}
+
+#endif
+
 static struct input_stream *
 input_file_open(const char *filename, GError **error_r)
 {
@@ -91,6 +214,15 @@ input_file_open(const char *filename, GError **error_r)
 	fis->base.ready = true;
 
 	fis->fd = fd;
+#ifdef HAVE_MMAP
+	fis->map = NULL;
+
+	if (file_mmap)
+		file_map(fis);
+#endif
+
+	fis->hinted = 0;
+	file_will_need(fis);
 
 	return &fis->base;
 }
@@ -101,14 +233,43 @@ input_file_seek(struct input_stream *is, goffset offset, int whence,
 {
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 
-	offset = (goffset)lseek(fis->fd, (off_t)offset, whence);
-	if (offset < 0) {
-		g_set_error(error_r, file_quark(), errno,
-			    "Failed to seek: %s", g_strerror(errno));
-		return false;
+#ifdef HAVE_MMAP
+	if (fis->map != NULL) {
+		switch (whence) {
+		case SEEK_SET:
+			break;
+
+		case SEEK_CUR:
+			offset += is->offset;
+			break;
+
+		case SEEK_END:
+			offset += is->size;
+			break;
+
+		default:
+			offset = -1;
+		}
+
+		if (offset < 0 || offset > is->size) {
+			g_set_error(error_r, file_quark(), EINVAL,
+				    "Failed to seek: %s", g_strerror(EINVAL));
+			return false;
+		}
+	} else
+#endif
+	{
+		offset = (goffset)lseek(fis->fd, (off_t)offset, whence);
+		if (offset < 0) {
+			g_set_error(error_r, file_quark(), errno,
+				    "Failed to seek: %s", g_strerror(errno));
+			return false;
+		}
 	}
 
 	is->offset = offset;
+	fis->hinted = 0;
+	file_will_need(fis);
 	return true;
 }
 
@@ -119,6 +280,18 @@ input_file_read(struct input_stream *is, void *ptr, size_t size,
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 	ssize_t nbytes;
 
+#ifdef HAVE_MMAP
+	if (fis->map != NULL) {
+		if ((goffset)size > is->size - is->offset)
+			size = (size_t)(is->size - is->offset);
+
+		memcpy(ptr, fis->map + is->offset, size);
+		is->offset += size;
+		file_will_need(fis);
+		return size;
+	}
+#endif
+
 	nbytes = read(fis->fd, ptr, size);
 	if (nbytes < 0) {
 		g_set_error(error_r, file_quark(), errno,
@@ -127,15 +300,54 @@ input_file_read(struct input_stream *is, void *ptr, size_t size,
 	}
 
 	is->offset += nbytes;
+	file_will_need(fis);
 	return (size_t)nbytes;
 }
 
+static const void *
+input_file_peek(struct input_stream *is, size_t *length_r)
+{
+#ifdef HAVE_MMAP
+	struct file_input_stream *fis = (struct file_input_stream *)is;
+
+	if (fis->map == NULL || is->offset >= is->size)
+		return NULL;
+
+	*length_r = (size_t)(is->size - is->offset);
+	return fis->map + is->offset;
+#else
+	(void)is;
+	(void)length_r;
+	return NULL;
+#endif
+}
+
+static void
+input_file_consume(struct input_stream *is, size_t nbytes)
+{
+	struct file_input_stream *fis = (struct file_input_stream *)is;
+
+#ifdef HAVE_MMAP
+	assert(fis->map != NULL);
+#endif
+	assert(nbytes <= (size_t)(is->size - is->offset));
+
+	is->offset += nbytes;
+	file_will_need(fis);
+}
+
 static void
 input_file_close(struct input_stream *is)
 {
 	struct file_input_stream *fis = (struct file_input_stream *)is;
 
-	close(fis->fd);
+#ifdef HAVE_MMAP
+	if (fis->map != NULL)
+		munmap((void *)fis->map, (size_t)is->size);
+	else
+#endif
+		close(fis->fd);
+
 	input_stream_deinit(&fis->base);
 	g_free(fis);
 }
@@ -148,9 +360,12 @@ input_file_eof(struct input_stream *is)
 
 const struct input_plugin input_plugin_file = {
 	.name = "file",
+	.init = input_file_init,
 	.open = input_file_open,
 	.close = input_file_close,
 	.read = input_file_read,
+	.peek = input_file_peek,
+	.consume = input_file_consume,
 	.eof = input_file_eof,
 	.seek = input_file_seek,
 };
@@ -47,6 +47,13 @@ struct input_rewind {
 	 */
 	size_t tail;
 
+	/**
+	 * The pointer which was returned by the last
+	 * input_rewind_peek() call on the underlying stream.
+	 * input_rewind_consume() appends from it to the buffer.
+	 */
+	const char *peeked;
+
 	/**
 	 * The size of this buffer is the maximum number of bytes
 	 * which can be rewinded cheaply without passing the "seek"
@@ -168,6 +175,52 @@ input_rewind_read(struct input_stream *is, void *ptr, size_t size,
 	}
 }
 
+static const void *
+input_rewind_peek(struct input_stream *is, size_t *length_r)
+{
+	struct input_rewind *r = (struct input_rewind *)is;
+
+	if (reading_from_buffer(r)) {
+		assert(r->head == (size_t)is->offset);
+
+		*length_r = r->tail - r->head;
+		return r->buffer + r->head;
+	}
+
+	r->peeked = input_stream_peek(r->input, length_r);
+	return r->peeked;
+}
+
+static void
+input_rewind_consume(struct input_stream *is, size_t nbytes)
+{
+	struct input_rewind *r = (struct input_rewind *)is;
+
+	if (reading_from_buffer(r)) {
+		assert(nbytes <= r->tail - r->head);
+
+		r->head += nbytes;
+		is->offset += nbytes;
+		return;
+	}
+
+	assert(r->peeked != NULL);
+
+	if (r->input->offset + (goffset)nbytes > (goffset)sizeof(r->buffer))
+		/* disable buffering */
+		r->tail = 0;
+	else if (r->tail == (size_t)is->offset) {
+		/* append to buffer */
+
+		memcpy(r->buffer + r->tail, r->peeked, nbytes);
+		r->tail += nbytes;
+	}
+
+	r->peeked = NULL;
+	input_stream_consume(r->input, nbytes);
+	copy_attributes(r);
+}
+
 static bool
 input_rewind_eof(struct input_stream *is)
 {
@@ -213,6 +266,8 @@ static const struct input_plugin rewind_input_plugin = {
 	.tag = input_rewind_tag,
 	.buffer = input_rewind_buffer,
 	.read = input_rewind_read,
+	.peek = input_rewind_peek,
+	.consume = input_rewind_consume,
 	.eof = input_rewind_eof,
 	.seek = input_rewind_seek,
 };
@@ -232,6 +287,7 @@ input_rewind_open(struct input_stream *is)
 	c = g_new(struct input_rewind, 1);
 	input_stream_init(&c->base, &rewind_input_plugin, is->uri);
 	c->tail = 0;
+	c->peeked = NULL;
 	c->input = is;
 
 	return &c->base;
@@ -55,6 +55,30 @@ struct input_plugin {
 	int (*buffer)(struct input_stream *is, GError **error_r);
 	size_t (*read)(struct input_stream *is, void *ptr, size_t size,
 		       GError **error_r);
+
+	/**
+	 * Lends a pointer to the data at the current offset, without
+	 * copying or consuming it.  The pointer is valid until the
+	 * next consume(), read(), seek() or close() call.  This
+	 * method is optional; it should only be implemented by
+	 * plugins which can provide the data without blocking.
+	 *
+	 * @param length_r the number of bytes available at the
+	 * returned pointer is stored here
+	 * @return a pointer to the data, or NULL if none is available
+	 * right now
+	 */
+	const void *(*peek)(struct input_stream *is, size_t *length_r);
+
+	/**
+	 * Marks data returned by peek() as consumed, and advances the
+	 * offset.  Mandatory if peek() is implemented.
+	 *
+	 * @param nbytes the number of bytes to consume; must not be
+	 * larger than the length returned by the last peek() call
+	 */
+	void (*consume)(struct input_stream *is, size_t nbytes);
+
 	bool (*eof)(struct input_stream *is);
 	bool (*seek)(struct input_stream *is, goffset offset, int whence,
 		     GError **error_r);
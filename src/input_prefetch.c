@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "input_prefetch.h"
+#include "input_plugin.h"
+#include "input_stream.h"
+#include "conf.h"
+#include "mpd_error.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "prefetch"
+
+enum {
+	DEFAULT_PREFETCH_SONGS = 1,
+
+	/** the default number of bytes read in advance, in KiB */
+	DEFAULT_PREFETCH_SIZE = 128,
+};
+
+enum prefetch_state {
+	/** waiting for the thread */
+	PREFETCH_PENDING,
+
+	/** the thread is opening the stream */
+	PREFETCH_RUNNING,
+
+	/** finished; #stream is NULL if that has failed */
+	PREFETCH_DONE,
+};
+
+struct prefetch_entry {
+	char *uri;
+
+	enum prefetch_state state;
+
+	/**
+	 * Set by input_prefetch_schedule() when a running entry is
+	 * not wanted anymore.  It has been removed from the list
+	 * already, and the thread frees it when it's done.
+	 */
+	bool obsolete;
+
+	/**
+	 * Set by input_prefetch_take(): the decoder is waiting for
+	 * this stream, don't read ahead any further.
+	 */
+	bool hurry;
+
+	struct input_stream *stream;
+};
+
+/**
+ * Wraps a stream whose first bytes have been read already, and
+ * serves these from a buffer.
+ */
+struct input_prefetched {
+	struct input_stream base;
+
+	struct input_stream *input;
+
+	/**
+	 * The first #length bytes of the stream.  The underlying
+	 * stream is positioned at the end of this buffer unless a
+	 * seek beyond it has occurred.
+	 */
+	char *buffer;
+	size_t length;
+};
+
+static unsigned prefetch_songs;
+static size_t prefetch_size;
+
+static GMutex *prefetch_mutex;
+static GCond *prefetch_cond;
+static GThread *prefetch_thread;
+static bool prefetch_quit;
+
+/**
+ * All entries which are wanted, in playback order.
+ */
+static GQueue *prefetch_entries;
+
+static void
+copy_attributes(struct input_prefetched *p)
+{
+	struct input_stream *dest = &p->base;
+	const struct input_stream *src = p->input;
+
+	dest->ready = src->ready;
+	dest->seekable = src->seekable;
+	dest->size = src->size;
+
+	if (src->mime != NULL &&
+	    (dest->mime == NULL || strcmp(dest->mime, src->mime) != 0)) {
+		g_free(dest->mime);
+		dest->mime = g_strdup(src->mime);
+	}
+}
+
+static void
+input_prefetched_close(struct input_stream *is)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	input_stream_close(p->input);
+
+	g_free(p->buffer);
+	input_stream_deinit(&p->base);
+	g_free(p);
+}
+
+static struct tag *
+input_prefetched_tag(struct input_stream *is)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	return input_stream_tag(p->input);
+}
+
+static int
+input_prefetched_buffer(struct input_stream *is, GError **error_r)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	int ret = input_stream_buffer(p->input, error_r);
+	copy_attributes(p);
+	return ret;
+}
+
+static size_t
+input_prefetched_read(struct input_stream *is, void *ptr, size_t size,
+		      GError **error_r)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	if (is->offset < (goffset)p->length) {
+		/* buffered read */
+
+		size_t remaining = p->length - (size_t)is->offset;
+		if (size > remaining)
+			size = remaining;
+
+		memcpy(ptr, p->buffer + is->offset, size);
+		is->offset += size;
+		return size;
+	}
+
+	if (p->input->offset != is->offset &&
+	    !input_stream_seek(p->input, is->offset, SEEK_SET, error_r))
+		return 0;
+
+	size_t nbytes = input_stream_read(p->input, ptr, size, error_r);
+	copy_attributes(p);
+	is->offset = p->input->offset;
+	return nbytes;
+}
+
+static const void *
+input_prefetched_peek(struct input_stream *is, size_t *length_r)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	if (is->offset < (goffset)p->length) {
+		*length_r = p->length - (size_t)is->offset;
+		return p->buffer + is->offset;
+	}
+
+	if (p->input->offset != is->offset)
+		/* the underlying stream must be seeked first; let
+		   input_prefetched_read() do that */
+		return NULL;
+
+	return input_stream_peek(p->input, length_r);
+}
+
+static void
+input_prefetched_consume(struct input_stream *is, size_t nbytes)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	if (is->offset < (goffset)p->length) {
+		assert(nbytes <= p->length - (size_t)is->offset);
+
+		is->offset += nbytes;
+		return;
+	}
+
+	input_stream_consume(p->input, nbytes);
+	copy_attributes(p);
+	is->offset = p->input->offset;
+}
+
+static bool
+input_prefetched_eof(struct input_stream *is)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	if (is->offset < (goffset)p->length)
+		return false;
+
+	if (p->input->offset == is->offset)
+		return input_stream_eof(p->input);
+
+	return is->size >= 0 && is->offset >= is->size;
+}
+
+static bool
+input_prefetched_seek(struct input_stream *is, goffset offset, int whence,
+		      GError **error_r)
+{
+	struct input_prefetched *p = (struct input_prefetched *)is;
+
+	if (whence == SEEK_CUR) {
+		offset += is->offset;
+		whence = SEEK_SET;
+	}
+
+	if (whence == SEEK_SET && offset >= 0 &&
+	    offset <= (goffset)p->length) {
+		/* buffered seek */
+		is->offset = offset;
+		return true;
+	}
+
+	bool success = input_stream_seek(p->input, offset, whence, error_r);
+	copy_attributes(p);
+	if (success)
+		is->offset = p->input->offset;
+	return success;
+}
+
+static const struct input_plugin prefetched_input_plugin = {
+	.close = input_prefetched_close,
+	.tag = input_prefetched_tag,
+	.buffer = input_prefetched_buffer,
+	.read = input_prefetched_read,
+	.peek = input_prefetched_peek,
+	.consume = input_prefetched_consume,
+	.eof = input_prefetched_eof,
+	.seek = input_prefetched_seek,
+};
+
+static struct input_stream *
+input_prefetched_new(struct input_stream *is, char *buffer, size_t length)
+{
+	struct input_prefetched *p = g_new(struct input_prefetched, 1);
+
+	assert(is->offset == (goffset)length);
+
+	input_stream_init(&p->base, &prefetched_input_plugin, is->uri);
+	p->input = is;
+	p->buffer = buffer;
+	p->length = length;
+	copy_attributes(p);
+
+	return &p->base;
+}
+
+static void
+prefetch_entry_free(struct prefetch_entry *entry)
+{
+	if (entry->stream != NULL)
+		input_stream_close(entry->stream);
+
+	g_free(entry->uri);
+	g_free(entry);
+}
+
+/**
+ * Shall the thread stop working on this entry?  Caller must not hold
+ * the mutex.
+ */
+static bool
+prefetch_entry_aborted(const struct prefetch_entry *entry)
+{
+	g_mutex_lock(prefetch_mutex);
+	bool aborted = entry->obsolete || entry->hurry || prefetch_quit;
+	g_mutex_unlock(prefetch_mutex);
+
+	return aborted;
+}
+
+/**
+ * Opens the stream, waits until it is ready and reads the first
+ * #prefetch_size bytes.  Runs in the prefetch thread without holding
+ * the mutex.
+ */
+static struct input_stream *
+prefetch_open(const struct prefetch_entry *entry)
+{
+	GError *error = NULL;
+	struct input_stream *is = input_stream_open(entry->uri, &error);
+	if (is == NULL) {
+		if (error != NULL) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+		}
+
+		return NULL;
+	}
+
+	while (!is->ready) {
+		if (input_stream_buffer(is, &error) < 0) {
+			g_warning("%s", error->message);
+			g_error_free(error);
+			input_stream_close(is);
+			return NULL;
+		}
+
+		if (prefetch_entry_aborted(entry))
+			/* the decoder waits for this stream; it will
+			   wait for "ready" itself */
+			return input_prefetched_new(is, NULL, 0);
+	}
+
+	if (is->size < 0) {
+		/* this is a live stream: buffering it now would make
+		   the input plugin download it into memory until the
+		   song starts */
+		g_debug("not prefetching live stream %s", entry->uri);
+		input_stream_close(is);
+		return NULL;
+	}
+
+	size_t size = prefetch_size;
+	if (is->size < (goffset)size)
+		size = (size_t)is->size;
+
+	char *buffer = g_malloc(size);
+	size_t length = 0;
+
+	while (length < size && !input_stream_eof(is) &&
+	       !prefetch_entry_aborted(entry)) {
+		size_t nbytes = input_stream_read(is, buffer + length,
+						  size - length, &error);
+		if (nbytes == 0) {
+			if (error != NULL) {
+				g_warning("%s", error->message);
+				g_error_free(error);
+				g_free(buffer);
+				input_stream_close(is);
+				return NULL;
+			}
+
+			break;
+		}
+
+		length += nbytes;
+	}
+
+	g_debug("prefetched %lu bytes of %s",
+		(unsigned long)length, entry->uri);
+
+	return input_prefetched_new(is, buffer, length);
+}
+
+static gpointer
+prefetch_task(G_GNUC_UNUSED gpointer arg)
+{
+	g_mutex_lock(prefetch_mutex);
+
+	while (!prefetch_quit) {
+		struct prefetch_entry *entry = NULL;
+
+		for (GList *i = prefetch_entries->head; i != NULL; i = i->next) {
+			struct prefetch_entry *e = i->data;
+			if (e->state == PREFETCH_PENDING) {
+				entry = e;
+				break;
+			}
+		}
+
+		if (entry == NULL) {
+			g_cond_wait(prefetch_cond, prefetch_mutex);
+			continue;
+		}
+
+		entry->state = PREFETCH_RUNNING;
+		g_mutex_unlock(prefetch_mutex);
+
+		struct input_stream *is = prefetch_open(entry);
+
+		g_mutex_lock(prefetch_mutex);
+		entry->stream = is;
+		entry->state = PREFETCH_DONE;
+		g_cond_broadcast(prefetch_cond);
+
+		if (entry->obsolete) {
+			g_mutex_unlock(prefetch_mutex);
+			prefetch_entry_free(entry);
+			g_mutex_lock(prefetch_mutex);
+		}
+	}
+
+	g_mutex_unlock(prefetch_mutex);
+	return NULL;
+}
+
+void
+input_prefetch_global_init(void)
+{
+	prefetch_songs = config_get_unsigned(CONF_PREFETCH_SONGS,
+					     DEFAULT_PREFETCH_SONGS);
+	if (prefetch_songs > PREFETCH_MAX_SONGS)
+		MPD_ERROR("\"%s\" must not be larger than %u",
+			  CONF_PREFETCH_SONGS, PREFETCH_MAX_SONGS);
+
+	prefetch_size = config_get_positive(CONF_PREFETCH_SIZE,
+					    DEFAULT_PREFETCH_SIZE) * 1024;
+
+	prefetch_mutex = g_mutex_new();
+	prefetch_cond = g_cond_new();
+	prefetch_entries = g_queue_new();
+}
+
+void
+input_prefetch_global_finish(void)
+{
+	if (prefetch_thread != NULL) {
+		g_mutex_lock(prefetch_mutex);
+		prefetch_quit = true;
+		g_cond_broadcast(prefetch_cond);
+		g_mutex_unlock(prefetch_mutex);
+
+		g_thread_join(prefetch_thread);
+		prefetch_thread = NULL;
+	}
+
+	struct prefetch_entry *entry;
+	while ((entry = g_queue_pop_head(prefetch_entries)) != NULL)
+		prefetch_entry_free(entry);
+	g_queue_free(prefetch_entries);
+
+	g_cond_free(prefetch_cond);
+	g_mutex_free(prefetch_mutex);
+}
+
+unsigned
+input_prefetch_songs(void)
+{
+	return prefetch_songs;
+}
+
+/**
+ * Is it worth prefetching this URI?
+ */
+static bool
+prefetch_wanted(const char *uri)
+{
+	/* local files can be opened instantly, but files inside
+	   archives must be opened with the archive plugin */
+	return !g_path_is_absolute(uri) ||
+		!g_file_test(uri, G_FILE_TEST_IS_REGULAR);
+}
+
+static struct prefetch_entry *
+prefetch_find(const char *uri)
+{
+	for (GList *i = prefetch_entries->head; i != NULL; i = i->next) {
+		struct prefetch_entry *entry = i->data;
+		if (strcmp(entry->uri, uri) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+void
+input_prefetch_schedule(char *const*uris, unsigned n)
+{
+	GQueue *entries;
+	GSList *garbage = NULL;
+
+	if (prefetch_songs == 0)
+		return;
+
+	entries = g_queue_new();
+
+	g_mutex_lock(prefetch_mutex);
+
+	/* move entries which are still wanted to the new list, in
+	   the new order */
+	for (unsigned i = 0; i < n && i < prefetch_songs; ++i) {
+		if (uris[i] == NULL || !prefetch_wanted(uris[i]))
+			continue;
+
+		struct prefetch_entry *entry = prefetch_find(uris[i]);
+		if (entry != NULL) {
+			g_queue_remove(prefetch_entries, entry);
+		} else {
+			entry = g_new(struct prefetch_entry, 1);
+			entry->uri = g_strdup(uris[i]);
+			entry->state = PREFETCH_PENDING;
+			entry->obsolete = false;
+			entry->hurry = false;
+			entry->stream = NULL;
+		}
+
+		g_queue_push_tail(entries, entry);
+	}
+
+	/* dispose the others */
+	struct prefetch_entry *entry;
+	while ((entry = g_queue_pop_head(prefetch_entries)) != NULL) {
+		if (entry->state == PREFETCH_RUNNING)
+			entry->obsolete = true;
+		else
+			garbage = g_slist_prepend(garbage, entry);
+	}
+
+	g_queue_free(prefetch_entries);
+	prefetch_entries = entries;
+
+	if (prefetch_thread == NULL && !g_queue_is_empty(prefetch_entries)) {
+		GError *error = NULL;
+		prefetch_thread = g_thread_create(prefetch_task, NULL,
+						  true, &error);
+		if (prefetch_thread == NULL)
+			MPD_ERROR("Failed to spawn prefetch task: %s",
+				  error->message);
+	}
+
+	g_cond_broadcast(prefetch_cond);
+	g_mutex_unlock(prefetch_mutex);
+
+	/* closing a stream may block; do it without holding the
+	   lock */
+	for (GSList *i = garbage; i != NULL; i = i->next)
+		prefetch_entry_free(i->data);
+	g_slist_free(garbage);
+}
+
+struct input_stream *
+input_prefetch_take(const char *uri)
+{
+	if (prefetch_songs == 0)
+		return NULL;
+
+	g_mutex_lock(prefetch_mutex);
+
+	struct prefetch_entry *entry = prefetch_find(uri);
+	if (entry == NULL) {
+		g_mutex_unlock(prefetch_mutex);
+		return NULL;
+	}
+
+	/* after removing it from the list, input_prefetch_schedule()
+	   cannot mark it obsolete, and the thread will not free it */
+	g_queue_remove(prefetch_entries, entry);
+
+	if (entry->state == PREFETCH_PENDING) {
+		/* not started yet: the caller is faster at opening it
+		   itself */
+		g_mutex_unlock(prefetch_mutex);
+		prefetch_entry_free(entry);
+		return NULL;
+	}
+
+	entry->hurry = true;
+	while (entry->state != PREFETCH_DONE)
+		g_cond_wait(prefetch_cond, prefetch_mutex);
+
+	g_mutex_unlock(prefetch_mutex);
+
+	struct input_stream *is = entry->stream;
+	entry->stream = NULL;
+	prefetch_entry_free(entry);
+
+	if (is != NULL)
+		g_debug("using prefetched stream %s", uri);
+
+	return is;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * Opens the input streams of the songs which are going to be played
+ * next in a background thread, and reads the first few kilobytes, so
+ * the decoder can start instantly at the song border.
+ */
+
+#ifndef MPD_INPUT_PREFETCH_H
+#define MPD_INPUT_PREFETCH_H
+
+#include "check.h"
+
+#include <glib.h>
+#include <stdbool.h>
+
+struct input_stream;
+
+/**
+ * The maximum value of the "prefetch_songs" setting.
+ */
+#define PREFETCH_MAX_SONGS 2
+
+/**
+ * Loads the configuration.  The thread is started on demand by
+ * input_prefetch_schedule().
+ */
+void
+input_prefetch_global_init(void);
+
+/**
+ * Stops the thread and closes all prefetched streams.
+ */
+void
+input_prefetch_global_finish(void);
+
+/**
+ * How many songs shall be prefetched?  Returns 0 if prefetching is
+ * disabled.
+ */
+G_GNUC_PURE
+unsigned
+input_prefetch_songs(void);
+
+/**
+ * Replaces the list of URIs to be prefetched.  Streams which have
+ * already been prefetched, but are not in the new list, are closed.
+ * Local regular files are ignored, because opening them is cheap.
+ *
+ * @param uris an array of file system paths or URIs
+ * @param n the number of elements in the array
+ */
+void
+input_prefetch_schedule(char *const*uris, unsigned n);
+
+/**
+ * Returns the prefetched stream for the specified URI, and removes it
+ * from the prefetch list.  If the stream is being opened right now,
+ * this function waits until it is ready.  The caller is responsible
+ * for closing the stream.
+ *
+ * @return the stream, which has been rewound to the beginning, or
+ * NULL if this URI has not been prefetched (or if that has failed)
+ */
+struct input_stream *
+input_prefetch_take(const char *uri);
+
+#endif
@@ -21,6 +21,7 @@
 #include "input_stream.h"
 #include "input_registry.h"
 #include "input_plugin.h"
+#include "input/cache_input_plugin.h"
 #include "input/rewind_input_plugin.h"
 
 #include <glib.h>
@@ -53,7 +54,10 @@ input_stream_open(const char *url, GError **error_r)
 			assert(is->plugin->read != NULL);
 			assert(is->plugin->eof != NULL);
 			assert(!is->seekable || is->plugin->seek != NULL);
+			assert(is->plugin->peek == NULL ||
+			       is->plugin->consume != NULL);
 
+			is = input_cache_open(is);
 			is = input_rewind_open(is);
 
 			return is;
@@ -97,6 +101,26 @@ input_stream_read(struct input_stream *is, void *ptr, size_t size,
 	return is->plugin->read(is, ptr, size, error_r);
 }
 
+const void *
+input_stream_peek(struct input_stream *is, size_t *length_r)
+{
+	assert(is != NULL);
+	assert(length_r != NULL);
+
+	return is->plugin->peek != NULL
+		? is->plugin->peek(is, length_r)
+		: NULL;
+}
+
+void
+input_stream_consume(struct input_stream *is, size_t nbytes)
+{
+	assert(is != NULL);
+	assert(is->plugin->consume != NULL);
+
+	is->plugin->consume(is, nbytes);
+}
+
 void input_stream_close(struct input_stream *is)
 {
 	is->plugin->close(is);
@@ -69,6 +69,13 @@ struct input_stream {
 	 * the MIME content type of the resource, or NULL if unknown
 	 */
 	char *mime;
+
+	/**
+	 * An opaque string which identifies this version of the
+	 * resource (e.g. the HTTP "ETag" header), or NULL if unknown.
+	 * It is used to detect modified resources.
+	 */
+	char *version;
 };
 
 static inline void
@@ -82,6 +89,7 @@ input_stream_init(struct input_stream *is, const struct input_plugin *plugin,
 	is->size = -1;
 	is->offset = 0;
 	is->mime = NULL;
+	is->version = NULL;
 }
 
 static inline void
@@ -89,6 +97,7 @@ input_stream_deinit(struct input_stream *is)
 {
 	g_free(is->uri);
 	g_free(is->mime);
+	g_free(is->version);
 }
 
 /**
@@ -155,4 +164,31 @@ size_t
 input_stream_read(struct input_stream *is, void *ptr, size_t size,
 		  GError **error_r);
 
+/**
+ * Borrows a pointer to the data at the current offset, without
+ * copying it and without advancing the offset.  After parsing it,
+ * the caller marks the used portion with input_stream_consume().
+ * Not all plugins support this; the caller must be prepared to fall
+ * back to input_stream_read().
+ *
+ * @param is the input_stream object
+ * @param length_r the number of bytes available is stored here
+ * @return a pointer which is valid until the next
+ * input_stream_consume(), input_stream_read(), input_stream_seek()
+ * or input_stream_close() call, or NULL if the plugin cannot provide
+ * one right now
+ */
+const void *
+input_stream_peek(struct input_stream *is, size_t *length_r);
+
+/**
+ * Consumes data which was borrowed with input_stream_peek().
+ *
+ * @param is the input_stream object
+ * @param nbytes the number of bytes to consume; must not be larger
+ * than the length returned by input_stream_peek()
+ */
+void
+input_stream_consume(struct input_stream *is, size_t nbytes);
+
 #endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "locked_memory.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_MLOCK
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "locked_memory"
+
+/**
+ * The size of a huge page on most platforms.  Huge page mappings
+ * must be a multiple of this.
+ */
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static bool locked_memory_use;
+static bool locked_memory_huge_pages;
+
+/** has a failure to lock already been logged? */
+static volatile gint locked_memory_warned;
+
+void
+locked_memory_configure(bool enabled, bool huge_pages)
+{
+	locked_memory_use = enabled;
+	locked_memory_huge_pages = enabled && huge_pages;
+}
+
+bool
+locked_memory_enabled(void)
+{
+	return locked_memory_use;
+}
+
+#ifdef HAVE_MLOCK
+
+static inline size_t
+round_up(size_t size, size_t alignment)
+{
+	return ((size - 1) | (alignment - 1)) + 1;
+}
+
+static void *
+locked_memory_map(size_t size, int flags)
+{
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|flags, -1, 0);
+	return p != MAP_FAILED ? p : NULL;
+}
+
+#endif
+
+void
+locked_memory_alloc(struct locked_memory *m, size_t size)
+{
+	assert(size > 0);
+
+#ifdef HAVE_MLOCK
+	m->data = NULL;
+
+#ifdef MAP_HUGETLB
+	if (locked_memory_huge_pages && size >= HUGE_PAGE_SIZE / 2) {
+		m->size = round_up(size, HUGE_PAGE_SIZE);
+		m->data = locked_memory_map(m->size, MAP_HUGETLB);
+		if (m->data == NULL)
+			g_debug("no huge pages for %lu bytes: %s",
+				(unsigned long)m->size, g_strerror(errno));
+	}
+#endif
+
+	if (m->data == NULL) {
+		m->size = round_up(size, sysconf(_SC_PAGESIZE));
+		m->data = locked_memory_map(m->size, 0);
+		if (m->data == NULL)
+			g_error("mmap(%lu) failed: %s",
+				(unsigned long)m->size, g_strerror(errno));
+
+#ifdef MADV_HUGEPAGE
+		if (locked_memory_huge_pages)
+			/* ask for transparent huge pages instead */
+			madvise(m->data, m->size, MADV_HUGEPAGE);
+#endif
+	}
+
+	m->mapped = true;
+
+	if (mlock(m->data, m->size) < 0 &&
+	    g_atomic_int_compare_and_exchange(&locked_memory_warned, 0, 1))
+		g_warning("Failed to lock %lu bytes of audio buffer "
+			  "into memory: %s; consider raising RLIMIT_MEMLOCK",
+			  (unsigned long)m->size, g_strerror(errno));
+
+	/* fault in all pages now, not during playback; this is
+	   necessary if mlock() has failed */
+	memset(m->data, 0, m->size);
+#else
+	m->size = size;
+	m->data = g_malloc0(size);
+	m->mapped = false;
+#endif
+}
+
+void
+locked_memory_free(struct locked_memory *m)
+{
+#ifdef HAVE_MLOCK
+	if (m->mapped) {
+		munmap(m->data, m->size);
+		return;
+	}
+#endif
+
+	g_free(m->data);
+}
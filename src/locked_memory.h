@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Allocation of memory which is locked into RAM, so the buffers used
+ * during playback are never swapped out, and do not cause page
+ * faults after a long pause.  This is configured with the
+ * "audio_buffer_lock" setting.
+ */
+
+#ifndef MPD_LOCKED_MEMORY_H
+#define MPD_LOCKED_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct locked_memory {
+	void *data;
+
+	/** the size of the mapping, rounded up to the page size */
+	size_t size;
+
+	/** was this allocated with mmap() (rather than g_malloc())? */
+	bool mapped;
+};
+
+/**
+ * Configures whether buffers shall be allocated with
+ * locked_memory_alloc().  This must be called before the player
+ * thread is started.
+ *
+ * @param huge_pages attempt to use huge pages, which reduce TLB
+ * misses
+ */
+void
+locked_memory_configure(bool enabled, bool huge_pages);
+
+/**
+ * Shall the playback buffers be locked?
+ */
+bool
+locked_memory_enabled(void);
+
+/**
+ * Allocates a zero-filled, memory-locked buffer, and faults in all of
+ * its pages.  If the memory cannot be locked (e.g. because
+ * RLIMIT_MEMLOCK is too low), a warning is logged, and the buffer is
+ * allocated anyway.
+ */
+void
+locked_memory_alloc(struct locked_memory *m, size_t size);
+
+void
+locked_memory_free(struct locked_memory *m);
+
+#endif
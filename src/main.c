@@ -38,6 +38,9 @@
 #include "player_control.h"
 #include "stats.h"
 #include "sig_handlers.h"
+#include "seek_index.h"
+#include "thread_policy.h"
+#include "locked_memory.h"
 #include "audio.h"
 #include "output_all.h"
 #include "volume.h"
@@ -46,6 +49,8 @@
 #include "replay_gain_config.h"
 #include "decoder_list.h"
 #include "input_init.h"
+#include "input_prefetch.h"
+#include "input/cache_input_plugin.h"
 #include "playlist_list.h"
 #include "state_file.h"
 #include "tag.h"
@@ -88,6 +93,16 @@
 enum {
 	DEFAULT_BUFFER_SIZE = 2048,
 	DEFAULT_BUFFER_BEFORE_PLAY = 10,
+	DEFAULT_DECODER_THREADS = 2,
+
+	/** the default size of the seek cache in KiB */
+	DEFAULT_SEEK_CACHE_SIZE = 4096,
+
+	/**
+	 * The byte rate of CD audio.  A buffer size in KiB is
+	 * converted to a duration with this rate.
+	 */
+	CD_BYTE_RATE = 44100 * 2 * 2,
 };
 
 GThread *main_task;
@@ -214,6 +229,34 @@ static void winsock_init(void)
 #endif
 }
 
+/**
+ * Parses the "audio_buffer_size" setting.  The value is a duration
+ * with the suffix "ms" or "s", or (without a suffix) a size in KiB,
+ * which is interpreted as CD audio.
+ *
+ * @return the duration in milliseconds, or a negative value on error
+ */
+static double
+buffer_time_parse(const char *value)
+{
+	char *endptr;
+	double result = g_ascii_strtod(value, &endptr);
+	if (endptr == value || result <= 0)
+		return -1;
+
+	while (g_ascii_isspace(*endptr))
+		++endptr;
+
+	if (*endptr == 0)
+		return result * 1024 * 1000 / CD_BYTE_RATE;
+	else if (strcmp(endptr, "ms") == 0)
+		return result;
+	else if (strcmp(endptr, "s") == 0)
+		return result * 1000;
+	else
+		return -1;
+}
+
 /**
  * Initialize the decoder and player core, including the music pipe.
  */
@@ -222,26 +265,39 @@ initialize_decoder_and_player(void)
 {
 	const struct config_param *param;
 	char *test;
-	size_t buffer_size;
+	double buffer_time;
 	float perc;
 	unsigned buffered_chunks;
 	unsigned buffered_before_play;
 
 	param = config_get_param(CONF_AUDIO_BUFFER_SIZE);
 	if (param != NULL) {
-		buffer_size = strtol(param->value, &test, 10);
-		if (*test != '\0' || buffer_size <= 0)
-			MPD_ERROR("buffer size \"%s\" is not a positive integer, "
-				  "line %i\n", param->value, param->line);
+		buffer_time = buffer_time_parse(param->value);
+		if (buffer_time <= 0)
+			MPD_ERROR("buffer size \"%s\" is not a positive "
+				  "size (KiB) or duration (ms, s), line %i\n",
+				  param->value, param->line);
 	} else
-		buffer_size = DEFAULT_BUFFER_SIZE;
-
-	buffer_size *= 1024;
+		buffer_time = DEFAULT_BUFFER_SIZE * 1024.0 * 1000 / CD_BYTE_RATE;
 
-	buffered_chunks = buffer_size / CHUNK_SIZE;
+	/* each chunk holds CHUNK_DURATION_MS of audio, regardless of
+	   the audio format */
+	buffered_chunks = buffer_time / CHUNK_DURATION_MS;
+	if (buffered_chunks == 0)
+		buffered_chunks = 1;
 
 	if (buffered_chunks >= 1 << 15)
-		MPD_ERROR("buffer size \"%li\" is too big\n", (long)buffer_size);
+		MPD_ERROR("buffer size \"%.0f ms\" is too big\n", buffer_time);
+
+	const char *buffer_lock =
+		config_get_string(CONF_AUDIO_BUFFER_LOCK, "no");
+	if (strcmp(buffer_lock, "hugepages") == 0)
+		locked_memory_configure(true, true);
+	else if (strcmp(buffer_lock, "yes") == 0)
+		locked_memory_configure(true, false);
+	else if (strcmp(buffer_lock, "no") != 0)
+		MPD_ERROR("\"%s\" must be \"yes\", \"no\" or "
+			  "\"hugepages\"", CONF_AUDIO_BUFFER_LOCK);
 
 	param = config_get_param(CONF_BUFFER_BEFORE_PLAY);
 	if (param != NULL) {
@@ -259,6 +315,21 @@ initialize_decoder_and_player(void)
 		buffered_before_play = buffered_chunks;
 
 	global_player_control = pc_new(buffered_chunks, buffered_before_play);
+
+	global_player_control->decoders =
+		config_get_positive(CONF_DECODER_THREADS,
+				    DEFAULT_DECODER_THREADS);
+	if (global_player_control->decoders > PLAYER_MAX_DECODERS)
+		MPD_ERROR("\"%s\" must not be larger than %u",
+			  CONF_DECODER_THREADS, PLAYER_MAX_DECODERS);
+
+	/* the cache must be able to hold at least one chunk */
+	size_t seek_cache_size =
+		config_get_unsigned(CONF_SEEK_CACHE_SIZE,
+				    DEFAULT_SEEK_CACHE_SIZE) * 1024;
+	if (seek_cache_size > 0 && seek_cache_size < CHUNK_SIZE_MAX)
+		seek_cache_size = CHUNK_SIZE_MAX;
+	global_player_control->seek_cache_size = seek_cache_size;
 }
 
 /**
@@ -364,6 +435,11 @@ int mpd_main(int argc, char *argv[])
 
 	glue_sticker_init();
 
+	seek_index_global_init(config_get_path(CONF_SEEK_INDEX_FILE));
+
+	if (!thread_policy_global_init(&error))
+		MPD_ERROR("%s", error->message);
+
 	command_init();
 	initialize_decoder_and_player();
 	volume_init();
@@ -378,6 +454,8 @@ int mpd_main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	input_cache_global_init();
+	input_prefetch_global_init();
 	playlist_list_global_init();
 
 	daemonize(options.daemon);
@@ -451,10 +529,14 @@ int mpd_main(int argc, char *argv[])
 	sticker_global_finish();
 #endif
 
+	seek_index_global_finish();
+
 	g_cond_free(main_cond);
 	event_pipe_deinit();
 
 	playlist_list_global_finish();
+	input_prefetch_global_finish();
+	input_cache_global_finish();
 	input_stream_global_finish();
 	audio_output_all_finish();
 	volume_finish();
@@ -464,6 +546,7 @@ int mpd_main(int argc, char *argv[])
 	pc_free(global_player_control);
 	command_finish();
 	update_global_finish();
+	thread_policy_global_finish();
 	decoder_plugin_deinit_all();
 #ifdef ENABLE_ARCHIVE
 	archive_plugin_deinit_all();
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * An output plugin for HTTP Live Streaming.  It encodes the audio
+ * to MPEG, cuts it into segments of a fixed duration, and maintains
+ * a rolling M3U8 playlist.  All files are written to a directory,
+ * which is supposed to be exported by a regular web server (or a
+ * CDN); MPD itself does not keep any per-listener state.
+ */
+
+#include "config.h"
+#include "output_api.h"
+#include "encoder_plugin.h"
+#include "encoder_list.h"
+#include "encoder_thread.h"
+#include "fd_util.h"
+#include "open.h"
+#include "timer.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "hls"
+
+/**
+ * A finished segment, which is (or was) listed in the playlist.
+ */
+struct hls_segment {
+	unsigned sequence;
+
+	/**
+	 * The exact duration in seconds, calculated from the number
+	 * of MPEG frames.
+	 */
+	double duration;
+
+	/**
+	 * Is this the first segment after the output was reopened?
+	 */
+	bool discontinuity;
+};
+
+struct hls_output {
+	/**
+	 * The configured encoder plugin.
+	 */
+	struct encoder *encoder;
+
+	/**
+	 * The directory where segments and the playlist are written.
+	 */
+	const char *path;
+
+	/**
+	 * The base name of all files.
+	 */
+	const char *name;
+
+	/**
+	 * The maximum duration of a segment in seconds.
+	 */
+	unsigned segment_time;
+
+	/**
+	 * The number of segments listed in the playlist.  The same
+	 * number of older segments is kept on disk for clients which
+	 * have loaded an older version of the playlist.
+	 */
+	unsigned playlist_size;
+
+	Timer *timer;
+
+	/**
+	 * The sequence number of the next segment.
+	 */
+	unsigned sequence;
+
+	/**
+	 * The file descriptor of the current segment, or -1 if there
+	 * is none.
+	 */
+	int fd;
+
+	/**
+	 * The duration of the current segment so far.
+	 */
+	double duration;
+
+	/**
+	 * Shall the next segment be marked as a discontinuity?
+	 */
+	bool discontinuity;
+
+	/**
+	 * The finished #hls_segment objects, the oldest first.
+	 */
+	GQueue *segments;
+
+	/**
+	 * Encoded data which was read from the encoder, but has not
+	 * been written yet, because it does not contain a complete
+	 * MPEG frame.
+	 */
+	size_t pending_length;
+	unsigned char pending[32768];
+};
+
+/**
+ * The quark used for GError.domain.
+ */
+static inline GQuark
+hls_output_quark(void)
+{
+	return g_quark_from_static_string("hls_output");
+}
+
+struct mpeg_frame {
+	size_t size;
+	unsigned samples;
+	unsigned sample_rate;
+};
+
+/**
+ * Parses an MPEG audio frame header.
+ *
+ * @return false if this is not a valid frame header
+ */
+static bool
+mpeg_frame_parse(const unsigned char *p, struct mpeg_frame *frame)
+{
+	static const unsigned short bitrates[5][15] = {
+		/* MPEG 1, layer I */
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		/* MPEG 1, layer II */
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		/* MPEG 1, layer III */
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+		/* MPEG 2/2.5, layer I */
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		/* MPEG 2/2.5, layers II and III */
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+	};
+
+	static const unsigned sample_rates[3] = { 44100, 48000, 32000 };
+
+	if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return false;
+
+	/* 3 = MPEG 1, 2 = MPEG 2, 0 = MPEG 2.5 */
+	const unsigned version = (p[1] >> 3) & 0x3;
+	/* 3 = layer I, 2 = layer II, 1 = layer III */
+	const unsigned layer = (p[1] >> 1) & 0x3;
+	const unsigned bitrate_index = p[2] >> 4;
+	const unsigned sample_rate_index = (p[2] >> 2) & 0x3;
+	const unsigned padding = (p[2] >> 1) & 0x1;
+
+	if (version == 1 || layer == 0 || bitrate_index == 0 ||
+	    bitrate_index == 15 || sample_rate_index == 3)
+		return false;
+
+	const bool mpeg1 = version == 3;
+	const unsigned table = mpeg1
+		? 3 - layer
+		: (layer == 3 ? 3 : 4);
+	const unsigned bitrate = bitrates[table][bitrate_index] * 1000;
+
+	frame->sample_rate = sample_rates[sample_rate_index];
+	if (version == 2)
+		frame->sample_rate /= 2;
+	else if (version == 0)
+		frame->sample_rate /= 4;
+
+	if (layer == 3) {
+		frame->samples = 384;
+		frame->size = (12 * bitrate / frame->sample_rate + padding) * 4;
+	} else {
+		frame->samples = layer == 1 && !mpeg1 ? 576 : 1152;
+		frame->size = frame->samples / 8 * bitrate / frame->sample_rate
+			+ padding;
+	}
+
+	return true;
+}
+
+static void *
+hls_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
+		const struct config_param *param, GError **error_r)
+{
+	const char *encoder_name;
+	const struct encoder_plugin *encoder_plugin;
+
+	/* read configuration */
+
+	encoder_name = config_get_block_string(param, "encoder", "lame");
+	encoder_plugin = encoder_plugin_get(encoder_name);
+	if (encoder_plugin == NULL) {
+		g_set_error(error_r, hls_output_quark(), 0,
+			    "No such encoder: %s", encoder_name);
+		return NULL;
+	}
+
+	const char *path = config_get_block_string(param, "path", NULL);
+	if (path == NULL) {
+		g_set_error(error_r, hls_output_quark(), 0,
+			    "'path' not configured");
+		return NULL;
+	}
+
+	unsigned segment_time =
+		config_get_block_unsigned(param, "segment_time", 10);
+	if (segment_time == 0) {
+		g_set_error(error_r, hls_output_quark(), 0,
+			    "'segment_time' must be positive");
+		return NULL;
+	}
+
+	unsigned playlist_size =
+		config_get_block_unsigned(param, "playlist_size", 5);
+	if (playlist_size == 0) {
+		g_set_error(error_r, hls_output_quark(), 0,
+			    "'playlist_size' must be positive");
+		return NULL;
+	}
+
+	/* initialize encoder */
+
+	struct encoder *encoder = encoder_thread_init(encoder_plugin, param,
+						      error_r);
+	if (encoder == NULL)
+		return NULL;
+
+	const char *mime_type = encoder_get_mime_type(encoder);
+	if (mime_type == NULL || strcmp(mime_type, "audio/mpeg") != 0) {
+		g_set_error(error_r, hls_output_quark(), 0,
+			    "Encoder '%s' does not produce MPEG audio",
+			    encoder_name);
+		encoder_finish(encoder);
+		return NULL;
+	}
+
+	struct hls_output *hls = g_new(struct hls_output, 1);
+	hls->encoder = encoder;
+	hls->path = path;
+	hls->name = config_get_block_string(param, "name", "stream");
+	hls->segment_time = segment_time;
+	hls->playlist_size = playlist_size;
+
+	/* start numbering with the current time, so file names are
+	   not reused (and served from a stale cache) after a
+	   restart */
+	hls->sequence = (unsigned)time(NULL);
+
+	hls->segments = g_queue_new();
+	hls->discontinuity = false;
+
+	return hls;
+}
+
+static void
+hls_segment_free_callback(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	g_free(data);
+}
+
+static void
+hls_output_finish(void *data)
+{
+	struct hls_output *hls = data;
+
+	encoder_finish(hls->encoder);
+	g_queue_foreach(hls->segments, hls_segment_free_callback, NULL);
+	g_queue_free(hls->segments);
+	g_free(hls);
+}
+
+/**
+ * Returns the allocated path name of the specified segment.
+ */
+static char *
+hls_output_segment_path(const struct hls_output *hls, unsigned sequence)
+{
+	char *name = g_strdup_printf("%s-%u.mp3", hls->name, sequence);
+	char *path = g_build_filename(hls->path, name, NULL);
+	g_free(name);
+	return path;
+}
+
+/**
+ * Writes the playlist to a temporary file, and replaces the old one
+ * atomically.
+ */
+static bool
+hls_output_write_playlist(const struct hls_output *hls, GError **error_r)
+{
+	char *name = g_strconcat(hls->name, ".m3u8", NULL);
+	char *path = g_build_filename(hls->path, name, NULL);
+	char *tmp = g_strconcat(path, ".tmp", NULL);
+	g_free(name);
+
+	FILE *file = fopen(tmp, "w");
+	if (file == NULL) {
+		g_set_error(error_r, hls_output_quark(), errno,
+			    "Failed to create '%s': %s",
+			    tmp, g_strerror(errno));
+		g_free(tmp);
+		g_free(path);
+		return false;
+	}
+
+	/* list the newest segments */
+	GList *i = hls->segments->tail;
+	for (unsigned n = 1; n < hls->playlist_size && i->prev != NULL; ++n)
+		i = i->prev;
+
+	const struct hls_segment *first = i->data;
+	fprintf(file, "#EXTM3U\n"
+		"#EXT-X-VERSION:3\n"
+		"#EXT-X-TARGETDURATION:%u\n"
+		"#EXT-X-MEDIA-SEQUENCE:%u\n",
+		hls->segment_time, first->sequence);
+
+	for (; i != NULL; i = i->next) {
+		const struct hls_segment *segment = i->data;
+
+		if (segment->discontinuity)
+			fputs("#EXT-X-DISCONTINUITY\n", file);
+
+		fprintf(file, "#EXTINF:%.3f,\n%s-%u.mp3\n",
+			segment->duration, hls->name, segment->sequence);
+	}
+
+	bool success = fclose(file) == 0;
+	if (success)
+		success = rename(tmp, path) == 0;
+
+	if (!success) {
+		g_set_error(error_r, hls_output_quark(), errno,
+			    "Failed to write '%s': %s",
+			    path, g_strerror(errno));
+		unlink(tmp);
+	}
+
+	g_free(tmp);
+	g_free(path);
+	return success;
+}
+
+static bool
+hls_output_open_segment(struct hls_output *hls, GError **error_r)
+{
+	assert(hls->fd < 0);
+
+	char *path = hls_output_segment_path(hls, hls->sequence);
+	hls->fd = open_cloexec(path, O_CREAT|O_WRONLY|O_TRUNC|O_BINARY,
+			       0666);
+	if (hls->fd < 0) {
+		g_set_error(error_r, hls_output_quark(), errno,
+			    "Failed to create '%s': %s",
+			    path, g_strerror(errno));
+		g_free(path);
+		return false;
+	}
+
+	g_free(path);
+	hls->duration = 0;
+	return true;
+}
+
+/**
+ * Closes the current segment, adds it to the playlist and deletes
+ * segments which are too old.
+ */
+static bool
+hls_output_finish_segment(struct hls_output *hls, GError **error_r)
+{
+	assert(hls->fd >= 0);
+
+	close(hls->fd);
+	hls->fd = -1;
+
+	struct hls_segment *segment = g_new(struct hls_segment, 1);
+	segment->sequence = hls->sequence++;
+	segment->duration = hls->duration;
+	segment->discontinuity = hls->discontinuity;
+	hls->discontinuity = false;
+	g_queue_push_tail(hls->segments, segment);
+
+	while (g_queue_get_length(hls->segments) > 2 * hls->playlist_size) {
+		segment = g_queue_pop_head(hls->segments);
+
+		char *path = hls_output_segment_path(hls, segment->sequence);
+		unlink(path);
+		g_free(path);
+		g_free(segment);
+	}
+
+	return hls_output_write_playlist(hls, error_r);
+}
+
+static bool
+hls_output_write(struct hls_output *hls, const unsigned char *data,
+		 size_t length, GError **error_r)
+{
+	assert(length == 0 || hls->fd >= 0);
+
+	while (length > 0) {
+		ssize_t nbytes = write(hls->fd, data, length);
+		if (nbytes > 0) {
+			data += nbytes;
+			length -= (size_t)nbytes;
+		} else if (nbytes == 0) {
+			/* shouldn't happen for files */
+			g_set_error(error_r, hls_output_quark(), 0,
+				    "write() returned 0");
+			return false;
+		} else if (errno != EINTR) {
+			g_set_error(error_r, hls_output_quark(), errno,
+				    "Failed to write segment: %s",
+				    g_strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Splits the pending data into MPEG frames, and writes the complete
+ * ones to the current segment.  A new segment is started before a
+ * frame which would make the current one longer than
+ * "segment_time".
+ */
+static bool
+hls_output_consume(struct hls_output *hls, GError **error_r)
+{
+	const unsigned char *p = hls->pending;
+	const unsigned char *const end = p + hls->pending_length;
+	const unsigned char *start = p;
+
+	while (end - p >= 4) {
+		struct mpeg_frame frame;
+
+		if (!mpeg_frame_parse(p, &frame)) {
+			/* skip garbage between frames */
+			if (!hls_output_write(hls, start, p - start, error_r))
+				return false;
+
+			start = ++p;
+			continue;
+		}
+
+		if ((size_t)(end - p) < frame.size)
+			/* incomplete frame */
+			break;
+
+		const double duration =
+			(double)frame.samples / frame.sample_rate;
+
+		if (hls->fd >= 0 &&
+		    hls->duration + duration > hls->segment_time) {
+			if (!hls_output_write(hls, start, p - start,
+					      error_r) ||
+			    !hls_output_finish_segment(hls, error_r))
+				return false;
+
+			start = p;
+		}
+
+		if (hls->fd < 0 && !hls_output_open_segment(hls, error_r))
+			return false;
+
+		hls->duration += duration;
+		p += frame.size;
+	}
+
+	if (!hls_output_write(hls, start, p - start, error_r))
+		return false;
+
+	hls->pending_length = end - p;
+	memmove(hls->pending, p, hls->pending_length);
+	return true;
+}
+
+/**
+ * Reads all available data from the encoder, and writes it to the
+ * segment files.
+ */
+static bool
+hls_output_encoder_to_file(struct hls_output *hls, GError **error_r)
+{
+	while (true) {
+		size_t nbytes =
+			encoder_read(hls->encoder,
+				     hls->pending + hls->pending_length,
+				     sizeof(hls->pending) - hls->pending_length);
+		if (nbytes == 0)
+			return true;
+
+		hls->pending_length += nbytes;
+
+		if (!hls_output_consume(hls, error_r))
+			return false;
+	}
+}
+
+static bool
+hls_output_open(void *data, struct audio_format *audio_format,
+		GError **error_r)
+{
+	struct hls_output *hls = data;
+
+	if (!encoder_open(hls->encoder, audio_format, error_r))
+		return false;
+
+	hls->timer = timer_new(audio_format);
+	hls->fd = -1;
+	hls->pending_length = 0;
+
+	/* segments of the previous session may still be listed in
+	   the playlist; tell clients that the stream has restarted */
+	hls->discontinuity = !g_queue_is_empty(hls->segments);
+
+	return true;
+}
+
+static void
+hls_output_close(void *data)
+{
+	struct hls_output *hls = data;
+	GError *error = NULL;
+
+	/* flush the encoder and publish the last segment */
+
+	if (encoder_flush(hls->encoder, NULL) &&
+	    hls_output_encoder_to_file(hls, &error) &&
+	    hls->fd >= 0)
+		hls_output_finish_segment(hls, &error);
+
+	if (error != NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+	}
+
+	if (hls->fd >= 0)
+		close(hls->fd);
+
+	encoder_close(hls->encoder);
+	timer_free(hls->timer);
+}
+
+static unsigned
+hls_output_delay(void *data)
+{
+	struct hls_output *hls = data;
+
+	return hls->timer->started
+		? timer_delay(hls->timer)
+		: 0;
+}
+
+static size_t
+hls_output_play(void *data, const void *chunk, size_t size,
+		GError **error_r)
+{
+	struct hls_output *hls = data;
+
+	if (!encoder_write(hls->encoder, chunk, size, error_r) ||
+	    !hls_output_encoder_to_file(hls, error_r))
+		return 0;
+
+	if (!hls->timer->started)
+		timer_start(hls->timer);
+	timer_add(hls->timer, size);
+
+	return size;
+}
+
+static bool
+hls_output_pause(void *data)
+{
+	/* keep the live stream going with silence, so the playlist
+	   does not go stale */
+	static const char silence[1020];
+
+	return hls_output_play(data, silence, sizeof(silence), NULL) > 0;
+}
+
+const struct audio_output_plugin hls_output_plugin = {
+	.name = "hls",
+	.init = hls_output_init,
+	.finish = hls_output_finish,
+	.open = hls_output_open,
+	.close = hls_output_close,
+	.delay = hls_output_delay,
+	.play = hls_output_play,
+	.pause = hls_output_pause,
+};
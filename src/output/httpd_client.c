@@ -23,11 +23,22 @@
 #include "fifo_buffer.h"
 #include "page.h"
 #include "icy_server.h"
+#include "encoder_plugin.h"
 #include "glib_compat.h"
 
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef WIN32
+#include <ws2tcpip.h>
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "httpd_output"
@@ -39,22 +50,22 @@ struct httpd_client {
 	struct httpd_output *httpd;
 
 	/**
-	 * The TCP socket.
+	 * The stream which was selected by the request path.  NULL
+	 * while the request line has not been received yet.
 	 */
-	GIOChannel *channel;
+	struct httpd_stream *stream;
 
 	/**
-	 * The GLib main loop source id for reading from the socket,
-	 * and to detect errors.
+	 * The TCP socket.
 	 */
-	guint read_source_id;
+	int fd;
 
 	/**
-	 * The GLib main loop source id for writing to the socket.  If
-	 * 0, then there is no event source currently (because there
-	 * are no queued pages).
+	 * False if the last write to the socket has returned EAGAIN.
+	 * The I/O thread sets it again when the socket becomes
+	 * writable.
 	 */
-	guint write_source_id;
+	bool writable;
 
 	/**
 	 * For buffered reading.  This pointer is only valid while the
@@ -81,6 +92,11 @@ struct httpd_client {
 	 */
 	GQueue *pages;
 
+	/**
+	 * The total size of all pages in #pages.
+	 */
+	size_t queue_size;
+
 	/**
 	 * The #page which is currently being sent to the client.
 	 */
@@ -144,22 +160,24 @@ void
 httpd_client_free(struct httpd_client *client)
 {
 	if (client->state == RESPONSE) {
-		if (client->write_source_id != 0)
-			g_source_remove(client->write_source_id);
-
 		if (client->current_page != NULL)
 			page_unref(client->current_page);
 
 		g_queue_foreach(client->pages, httpd_client_unref_page, NULL);
 		g_queue_free(client->pages);
-	} else
+	}
+
+	if (client->input != NULL)
 		fifo_buffer_free(client->input);
 
 	if (client->metadata)
 		page_unref (client->metadata);
 
-	g_source_remove(client->read_source_id);
-	g_io_channel_unref(client->channel);
+#ifndef WIN32
+	close(client->fd);
+#else
+	closesocket(client->fd);
+#endif
 	g_free(client);
 }
 
@@ -180,11 +198,11 @@ static void
 httpd_client_begin_response(struct httpd_client *client)
 {
 	client->state = RESPONSE;
-	client->write_source_id = 0;
 	client->pages = g_queue_new();
+	client->queue_size = 0;
 	client->current_page = NULL;
 
-	httpd_output_send_header(client->httpd, client);
+	httpd_output_send_header(client->stream, client);
 }
 
 /**
@@ -202,6 +220,15 @@ httpd_client_handle_line(struct httpd_client *client, const char *line)
 			return false;
 		}
 
+		/* select the stream by the path, ignoring the query
+		   string */
+		char *path = g_strndup(line + 4, strcspn(line + 4, " ?"));
+		client->stream = httpd_output_find_stream(client->httpd, path);
+		g_free(path);
+
+		++client->stream->num_clients;
+		client->metadata_supported = !client->stream->encoder_tags;
+
 		line = strchr(line + 5, ' ');
 		if (line == NULL || strncmp(line + 1, "HTTP/", 5) != 0) {
 			/* HTTP/0.9 without request headers */
@@ -267,9 +294,7 @@ static bool
 httpd_client_send_response(struct httpd_client *client)
 {
 	char buffer[1024];
-	GError *error = NULL;
-	GIOStatus status;
-	gsize bytes_written;
+	ssize_t nbytes;
 
 	assert(client->state == RESPONSE);
 
@@ -281,7 +306,7 @@ httpd_client_send_response(struct httpd_client *client)
 			   "Pragma: no-cache\r\n"
 			   "Cache-Control: no-cache, no-store\r\n"
 			   "\r\n",
-			   client->httpd->content_type);
+			   client->stream->content_type);
 	} else {
 		gchar *metadata_header;
 
@@ -289,7 +314,7 @@ httpd_client_send_response(struct httpd_client *client)
 			client->httpd->name,
 			client->httpd->genre,
 			client->httpd->website,
-			client->httpd->content_type,
+			client->stream->content_type,
 			client->metaint);
 
 		g_strlcpy(buffer, metadata_header, sizeof(buffer));
@@ -297,34 +322,20 @@ httpd_client_send_response(struct httpd_client *client)
 		g_free(metadata_header);
 	}
 
-	status = g_io_channel_write_chars(client->channel,
-					  buffer, strlen(buffer),
-					  &bytes_written, &error);
-
-	switch (status) {
-	case G_IO_STATUS_NORMAL:
-	case G_IO_STATUS_AGAIN:
-		return true;
-
-	case G_IO_STATUS_EOF:
-		/* client has disconnected */
-
-		httpd_client_close(client);
+	/* the socket buffer of a new connection is empty, so the
+	   response headers are sent with one call */
+	nbytes = send(client->fd, buffer, strlen(buffer), 0);
+	if (nbytes < 0) {
+		g_warning("failed to write to client: %s", g_strerror(errno));
 		return false;
+	}
 
-	case G_IO_STATUS_ERROR:
-		/* I/O error */
-
-		g_warning("failed to write to client: %s", error->message);
-		g_error_free(error);
-
-		httpd_client_close(client);
+	if ((size_t)nbytes < strlen(buffer)) {
+		g_warning("failed to write response headers to client");
 		return false;
 	}
 
-	/* unreachable */
-	httpd_client_close(client);
-	return false;
+	return true;
 }
 
 /**
@@ -350,6 +361,7 @@ httpd_client_received(struct httpd_client *client)
 			}
 
 			fifo_buffer_free(client->input);
+			client->input = NULL;
 
 			return httpd_client_send_response(client);
 		}
@@ -358,14 +370,15 @@ httpd_client_received(struct httpd_client *client)
 	return true;
 }
 
+/**
+ * Reads from the socket until it would block.
+ */
 static bool
 httpd_client_read(struct httpd_client *client)
 {
 	char *p;
 	size_t max_length;
-	GError *error = NULL;
-	GIOStatus status;
-	gsize bytes_read;
+	ssize_t nbytes;
 
 	if (client->state == RESPONSE) {
 		/* the client has already sent the request, and he
@@ -374,89 +387,54 @@ httpd_client_read(struct httpd_client *client)
 		return false;
 	}
 
-	p = fifo_buffer_write(client->input, &max_length);
-	if (p == NULL) {
-		g_warning("buffer overflow");
-		return false;
-	}
-
-	status = g_io_channel_read_chars(client->channel, p, max_length,
-					 &bytes_read, &error);
-	switch (status) {
-	case G_IO_STATUS_NORMAL:
-		fifo_buffer_append(client->input, bytes_read);
-		return httpd_client_received(client);
-
-	case G_IO_STATUS_AGAIN:
-		/* try again later, after select() */
-		return true;
-
-	case G_IO_STATUS_EOF:
-		/* peer disconnected */
-		return false;
-
-	case G_IO_STATUS_ERROR:
-		/* I/O error */
-		g_warning("failed to read from client: %s",
-			  error->message);
-		g_error_free(error);
-		return false;
-	}
+	do {
+		p = fifo_buffer_write(client->input, &max_length);
+		if (p == NULL) {
+			g_warning("buffer overflow");
+			return false;
+		}
 
-	/* unreachable */
-	return false;
-}
+		nbytes = recv(client->fd, p, max_length, 0);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
 
-static gboolean
-httpd_client_in_event(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
-		      gpointer data)
-{
-	struct httpd_client *client = data;
-	struct httpd_output *httpd = client->httpd;
-	bool ret;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				/* try again after the next event */
+				return true;
 
-	g_mutex_lock(httpd->mutex);
+			g_warning("failed to read from client: %s",
+				  g_strerror(errno));
+			return false;
+		}
 
-	if (condition == G_IO_IN && httpd_client_read(client)) {
-		ret = true;
-	} else {
-		httpd_client_close(client);
-		ret = false;
-	}
+		if (nbytes == 0)
+			/* peer disconnected */
+			return false;
 
-	g_mutex_unlock(httpd->mutex);
+		fifo_buffer_append(client->input, nbytes);
+		if (!httpd_client_received(client))
+			return false;
+	} while (client->state != RESPONSE);
 
-	return ret;
+	return true;
 }
 
 struct httpd_client *
-httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported)
+httpd_client_new(struct httpd_output *httpd, int fd)
 {
 	struct httpd_client *client = g_new(struct httpd_client, 1);
 
 	client->httpd = httpd;
+	client->stream = NULL;
 
-#ifndef G_OS_WIN32
-	client->channel = g_io_channel_unix_new(fd);
-#else
-	client->channel = g_io_channel_win32_new_socket(fd);
-#endif
-
-	/* GLib is responsible for closing the file descriptor */
-	g_io_channel_set_close_on_unref(client->channel, true);
-	/* NULL encoding means the stream is binary safe */
-	g_io_channel_set_encoding(client->channel, NULL, NULL);
-	/* we prefer to do buffering */
-	g_io_channel_set_buffered(client->channel, false);
-
-	client->read_source_id = g_io_add_watch(client->channel,
-						G_IO_IN|G_IO_ERR|G_IO_HUP,
-						httpd_client_in_event, client);
+	client->fd = fd;
+	client->writable = true;
 
 	client->input = fifo_buffer_new(4096);
 	client->state = REQUEST;
 
-	client->metadata_supported = metadata_supported;
+	client->metadata_supported = false;
 	client->metadata_requested = false;
 	client->metadata_sent = true;
 	client->metaint = 8192; /*TODO: just a std value */
@@ -467,25 +445,25 @@ httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported)
 	return client;
 }
 
-static void
-httpd_client_add_page_size(gpointer data, gpointer user_data)
+int
+httpd_client_get_fd(const struct httpd_client *client)
 {
-	struct page *page = data;
-	size_t *size = user_data;
+	return client->fd;
+}
 
-	*size += page->size;
+struct httpd_stream *
+httpd_client_get_stream(const struct httpd_client *client)
+{
+	return client->stream;
 }
 
 size_t
 httpd_client_queue_size(const struct httpd_client *client)
 {
-	size_t size = 0;
-
 	if (client->state != RESPONSE)
 		return 0;
 
-	g_queue_foreach(client->pages, httpd_client_add_page_size, &size);
-	return size;
+	return client->queue_size;
 }
 
 void
@@ -496,191 +474,239 @@ httpd_client_cancel(struct httpd_client *client)
 
 	g_queue_foreach(client->pages, httpd_client_unref_page, NULL);
 	g_queue_clear(client->pages);
-
-	if (client->write_source_id != 0 && client->current_page == NULL) {
-		g_source_remove(client->write_source_id);
-		client->write_source_id = 0;
-	}
+	client->queue_size = 0;
 }
 
-static GIOStatus
-write_page_to_channel(GIOChannel *channel,
-		      const struct page *page, size_t position,
-		      gsize *bytes_written_r, GError **error)
+/**
+ * Is an Icy-Metadata block due before the next byte of stream data?
+ */
+static bool
+httpd_client_metadata_due(const struct httpd_client *client)
 {
-	assert(channel != NULL);
-	assert(page != NULL);
-	assert(position < page->size);
-
-	return g_io_channel_write_chars(channel,
-					(const gchar*)page->data + position,
-					page->size - position,
-					bytes_written_r, error);
+	return client->metadata_requested &&
+		client->metadata_fill >= client->metaint;
 }
 
-static GIOStatus
-write_n_bytes_to_channel(GIOChannel *channel, const struct page *page,
-			 size_t position, gint n,
-			 gsize *bytes_written_r, GError **error)
+/**
+ * Returns the Icy-Metadata block which is sent next: the current
+ * metadata page if it has not been sent yet, or else an empty block.
+ */
+static const unsigned char *
+httpd_client_metadata_block(const struct httpd_client *client, bool sent,
+			    size_t *size_r)
 {
-	GIOStatus status;
+	static const unsigned char empty_metadata = 0;
 
-	assert(channel != NULL);
-	assert(page != NULL);
-	assert(position < page->size);
+	if (!sent) {
+		assert(client->metadata != NULL);
 
-	if (n == -1) {
-		status =  write_page_to_channel (channel, page, position,
-						 bytes_written_r, error);
-	} else {
-		status = g_io_channel_write_chars(channel,
-						  (const gchar*)page->data + position,
-						  n, bytes_written_r, error);
+		*size_r = client->metadata->size;
+		return client->metadata->data;
 	}
 
-	return status;
+	*size_r = sizeof(empty_metadata);
+	return &empty_metadata;
 }
 
-static gint
-bytes_left_till_metadata (struct httpd_client *client)
+static bool
+httpd_client_has_pending(const struct httpd_client *client)
 {
-	assert(client != NULL);
-
-	if (client->metadata_requested &&
-	    client->current_page->size - client->current_position
-	    > client->metaint - client->metadata_fill)
-		return client->metaint - client->metadata_fill;
-
-	return -1;
+	return client->state == RESPONSE &&
+		(client->current_page != NULL ||
+		 !g_queue_is_empty(client->pages) ||
+		 httpd_client_metadata_due(client));
 }
 
-static gboolean
-httpd_client_out_event(GIOChannel *source,
-		       G_GNUC_UNUSED GIOCondition condition, gpointer data)
+bool
+httpd_client_wants_write(const struct httpd_client *client)
 {
-	struct httpd_client *client = data;
-	struct httpd_output *httpd = client->httpd;
-	GError *error = NULL;
-	GIOStatus status;
-	gsize bytes_written;
-	gint bytes_to_write;
+	return !client->writable && httpd_client_has_pending(client);
+}
 
-	g_mutex_lock(httpd->mutex);
+/**
+ * Fills the #iovec array with the data which is sent next: the
+ * queued pages, split at Icy-Metadata boundaries with the metadata
+ * blocks in between.  This does not modify the client;
+ * httpd_client_consume() does that after the data has been written.
+ *
+ * @return the number of #iovec elements which were filled
+ */
+static unsigned
+httpd_client_fill_iov(const struct httpd_client *client,
+		      struct iovec *iov, unsigned max_iov)
+{
+	const struct page *page = client->current_page;
+	size_t position = client->current_position;
+	const GList *next = client->pages->head;
+	guint fill = client->metadata_fill;
+	size_t metadata_position = client->metadata_current_position;
+	bool metadata_sent = client->metadata_sent;
+	unsigned n = 0;
+
+	while (n < max_iov) {
+		if (client->metadata_requested && fill >= client->metaint) {
+			size_t size;
+			const unsigned char *metadata =
+				httpd_client_metadata_block(client,
+							    metadata_sent,
+							    &size);
+
+			iov[n].iov_base = (void *)(metadata +
+						   metadata_position);
+			iov[n].iov_len = size - metadata_position;
+			++n;
+
+			fill = 0;
+			metadata_position = 0;
+			metadata_sent = true;
+			continue;
+		}
 
-	assert(condition == G_IO_OUT);
-	assert(client->state == RESPONSE);
+		if (page == NULL) {
+			if (next == NULL)
+				break;
 
-	if (client->write_source_id == 0) {
-		/* another thread has removed the event source while
-		   this thread was waiting for httpd->mutex */
-		g_mutex_unlock(httpd->mutex);
-		return false;
-	}
-
-	if (client->current_page == NULL) {
-		client->current_page = g_queue_pop_head(client->pages);
-		client->current_position = 0;
-	}
+			page = next->data;
+			next = g_list_next(next);
+			position = 0;
+		}
 
-	bytes_to_write = bytes_left_till_metadata(client);
+		size_t length = page->size - position;
+		if (client->metadata_requested &&
+		    length > client->metaint - fill)
+			length = client->metaint - fill;
 
-	if (bytes_to_write == 0) {
-		gint metadata_to_write;
+		iov[n].iov_base = (void *)(page->data + position);
+		iov[n].iov_len = length;
+		++n;
 
-		metadata_to_write = client->metadata_current_position;
+		position += length;
+		if (client->metadata_requested)
+			fill += length;
 
-		if (!client->metadata_sent) {
-			status = write_page_to_channel(source,
-						       client->metadata,
-						       metadata_to_write,
-						       &bytes_written, &error);
+		if (position >= page->size)
+			page = NULL;
+	}
 
-			client->metadata_current_position += bytes_written;
+	return n;
+}
 
-			if (client->metadata->size
-			    - client->metadata_current_position == 0) {
-				client->metadata_fill = 0;
-				client->metadata_current_position = 0;
-				client->metadata_sent = true;
+/**
+ * Marks the specified number of bytes as sent.  This walks through
+ * the same data as httpd_client_fill_iov().
+ */
+static void
+httpd_client_consume(struct httpd_client *client, size_t nbytes)
+{
+	while (nbytes > 0) {
+		if (httpd_client_metadata_due(client)) {
+			size_t size;
+			httpd_client_metadata_block(client,
+						    client->metadata_sent,
+						    &size);
+
+			size_t rest = size - client->metadata_current_position;
+			if (nbytes < rest) {
+				client->metadata_current_position += nbytes;
+				return;
 			}
-		} else {
-			struct page *empty_meta;
-			guchar empty_data = 0;
 
-			empty_meta = page_new_copy(&empty_data, 1);
-
-			status = write_page_to_channel(source,
-						       empty_meta,
-						       metadata_to_write,
-						       &bytes_written, &error);
+			nbytes -= rest;
+			client->metadata_fill = 0;
+			client->metadata_current_position = 0;
+			client->metadata_sent = true;
+			continue;
+		}
 
-			client->metadata_current_position += bytes_written;
+		if (client->current_page == NULL) {
+			client->current_page = g_queue_pop_head(client->pages);
+			client->current_position = 0;
 
-			if (empty_meta->size
-			    - client->metadata_current_position == 0) {
-				client->metadata_fill = 0;
-				client->metadata_current_position = 0;
-			}
+			assert(client->current_page != NULL);
+			assert(client->queue_size >=
+			       client->current_page->size);
+			client->queue_size -= client->current_page->size;
 		}
 
-		bytes_written = 0;
-	} else {
-		status = write_n_bytes_to_channel(source, client->current_page,
-						  client->current_position, bytes_to_write,
-						  &bytes_written, &error);
-	}
-
-	switch (status) {
-	case G_IO_STATUS_NORMAL:
-		client->current_position += bytes_written;
-		assert(client->current_position <= client->current_page->size);
+		size_t length = client->current_page->size -
+			client->current_position;
+		if (client->metadata_requested &&
+		    length > client->metaint - client->metadata_fill)
+			length = client->metaint - client->metadata_fill;
+		if (length > nbytes)
+			length = nbytes;
 
+		client->current_position += length;
 		if (client->metadata_requested)
-			client->metadata_fill += bytes_written;
+			client->metadata_fill += length;
+		nbytes -= length;
 
 		if (client->current_position >= client->current_page->size) {
 			page_unref(client->current_page);
 			client->current_page = NULL;
+		}
+	}
+}
 
-			if (g_queue_is_empty(client->pages)) {
-				/* all pages are sent: remove the
-				   event source */
-				client->write_source_id = 0;
-
-				g_mutex_unlock(httpd->mutex);
-				return false;
+/**
+ * Writes queued data until the socket would block, batching many
+ * pages into one writev() call.
+ */
+static bool
+httpd_client_write(struct httpd_client *client)
+{
+	struct iovec iov[64];
+
+	while (client->writable) {
+		unsigned n = httpd_client_fill_iov(client, iov,
+						   G_N_ELEMENTS(iov));
+		if (n == 0)
+			/* all pages are sent */
+			break;
+
+		ssize_t nbytes = writev(client->fd, iov, n);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* wait until the I/O thread reports
+				   that the socket is writable */
+				client->writable = false;
+				break;
 			}
-		}
 
-		g_mutex_unlock(httpd->mutex);
-		return true;
+			g_warning("failed to write to client: %s",
+				  g_strerror(errno));
+			return false;
+		}
 
-	case G_IO_STATUS_AGAIN:
-		g_mutex_unlock(httpd->mutex);
-		return true;
+		httpd_client_consume(client, nbytes);
+	}
 
-	case G_IO_STATUS_EOF:
-		/* client has disconnected */
+	return true;
+}
 
+void
+httpd_client_flush(struct httpd_client *client)
+{
+	if (httpd_client_has_pending(client) && !httpd_client_write(client))
 		httpd_client_close(client);
-		g_mutex_unlock(httpd->mutex);
-		return false;
-
-	case G_IO_STATUS_ERROR:
-		/* I/O error */
-
-		g_warning("failed to write to client: %s", error->message);
-		g_error_free(error);
+}
 
+void
+httpd_client_event(struct httpd_client *client,
+		   bool readable, bool writable, bool error)
+{
+	if (error || (readable && !httpd_client_read(client))) {
 		httpd_client_close(client);
-		g_mutex_unlock(httpd->mutex);
-		return false;
+		return;
 	}
 
-	/* unreachable */
-	httpd_client_close(client);
-	g_mutex_unlock(httpd->mutex);
-	return false;
+	if (writable)
+		client->writable = true;
+
+	httpd_client_flush(client);
 }
 
 void
@@ -692,11 +718,7 @@ httpd_client_send(struct httpd_client *client, struct page *page)
 
 	page_ref(page);
 	g_queue_push_tail(client->pages, page);
-
-	if (client->write_source_id == 0)
-		client->write_source_id =
-			g_io_add_watch(client->channel, G_IO_OUT,
-				       httpd_client_out_event, client);
+	client->queue_size += page->size;
 }
 
 void
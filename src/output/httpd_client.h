@@ -26,16 +26,18 @@
 
 struct httpd_client;
 struct httpd_output;
+struct httpd_stream;
 struct page;
 
 /**
- * Creates a new #httpd_client object
+ * Creates a new #httpd_client object.  The caller is responsible for
+ * registering the socket with the I/O thread.
  *
  * @param httpd the HTTP output device
- * @param fd the socket file descriptor
+ * @param fd the non-blocking socket file descriptor
  */
 struct httpd_client *
-httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported);
+httpd_client_new(struct httpd_output *httpd, int fd);
 
 /**
  * Frees memory and resources allocated by the #httpd_client object.
@@ -44,6 +46,47 @@ httpd_client_new(struct httpd_output *httpd, int fd, bool metadata_supported);
 void
 httpd_client_free(struct httpd_client *client);
 
+/**
+ * Returns the socket file descriptor.
+ */
+G_GNUC_PURE
+int
+httpd_client_get_fd(const struct httpd_client *client);
+
+/**
+ * Returns the stream selected by the client, or NULL if the request
+ * line has not been received yet.
+ */
+G_GNUC_PURE
+struct httpd_stream *
+httpd_client_get_stream(const struct httpd_client *client);
+
+/**
+ * Does this client have pending data, but its socket is not
+ * writable?  Then the I/O thread has to wait for the socket to become
+ * writable again.
+ */
+G_GNUC_PURE
+bool
+httpd_client_wants_write(const struct httpd_client *client);
+
+/**
+ * Handles a socket event.  This is called by the I/O thread, while
+ * holding httpd_output.mutex.  The client may be closed and freed by
+ * this function.
+ */
+void
+httpd_client_event(struct httpd_client *client,
+		   bool readable, bool writable, bool error);
+
+/**
+ * Writes as many queued pages as the socket accepts.  This is called
+ * by the I/O thread, while holding httpd_output.mutex.  The client
+ * may be closed and freed by this function.
+ */
+void
+httpd_client_flush(struct httpd_client *client);
+
 /**
  * Returns the total size of this client's page queue.
  */
@@ -57,7 +100,8 @@ void
 httpd_client_cancel(struct httpd_client *client);
 
 /**
- * Appends a page to the client's queue.
+ * Appends a page to the client's queue.  It is written by the I/O
+ * thread after the next httpd_io_wakeup() call.
  */
 void
 httpd_client_send(struct httpd_client *client, struct page *page);
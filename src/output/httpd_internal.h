@@ -30,21 +30,34 @@
 #include <glib.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct httpd_client;
 
-struct httpd_output {
+/**
+ * One encoded stream of the httpd output.  All streams are fed with
+ * the same PCM data; a client selects one by the path in its request
+ * line.
+ */
+struct httpd_stream {
 	/**
-	 * True if the audio output is open and accepts client
-	 * connections.
+	 * The path which selects this stream, e.g. "/low.mp3".  NULL
+	 * for the default stream, which serves all other paths.
 	 */
-	bool open;
+	char *path;
 
 	/**
 	 * The configured encoder plugin.
 	 */
 	struct encoder *encoder;
 
+	/**
+	 * Does the encoder plugin embed tags in the stream?  If not,
+	 * tags are sent as Icy-Metadata.  This is determined from
+	 * the plugin, because #encoder may be a wrapper.
+	 */
+	bool encoder_tags;
+
 	/**
 	 * Number of bytes which were fed into the encoder, without
 	 * ever receiving new output.  This is used to estimate
@@ -59,8 +72,56 @@ struct httpd_output {
 	const char *content_type;
 
 	/**
-	 * This mutex protects the listener socket and the client
-	 * list.
+	 * The header page, which is sent to every client on connect.
+	 */
+	struct page *header;
+
+	/**
+	 * Finds the first frame boundary in a buffer of encoder
+	 * output, and returns its offset (or the buffer length if
+	 * there is none).  NULL if the content type is not supported
+	 * by the backlog.
+	 */
+	size_t (*find_sync)(const unsigned char *p, size_t length);
+
+	/**
+	 * The most recent pages (#httpd_backlog_page), which are sent
+	 * to new clients right after the header, so their buffer
+	 * fills immediately ("burst on connect").  The first page
+	 * always starts on a frame boundary.
+	 */
+	GQueue *backlog;
+
+	/**
+	 * The total size of all pages in #backlog.
+	 */
+	size_t backlog_size;
+
+	/**
+	 * The number of clients which have selected this stream.
+	 */
+	unsigned num_clients;
+};
+
+struct httpd_output {
+	/**
+	 * True if the audio output is open and accepts client
+	 * connections.
+	 */
+	bool open;
+
+	/**
+	 * The streams.  The first one is the default stream, which
+	 * is configured by the audio_output block itself; the others
+	 * are configured with "stream_NAME" parameters.
+	 */
+	struct httpd_stream *streams;
+
+	unsigned num_streams;
+
+	/**
+	 * This mutex protects the listener socket, the client list
+	 * and the clients.
 	 */
 	GMutex *mutex;
 
@@ -71,20 +132,40 @@ struct httpd_output {
 	Timer *timer;
 
 	/**
-	 * The listener socket.
+	 * The I/O thread which serves all clients.  It exists while
+	 * the output is open.
 	 */
-	struct server_socket *server_socket;
+	struct httpd_io *io;
 
 	/**
-	 * The header page, which is sent to every client on connect.
+	 * The listener socket.
 	 */
-	struct page *header;
+	struct server_socket *server_socket;
 
 	/**
 	 * The metadata, which is sent to every client.
 	 */
 	struct page *metadata;
 
+	/**
+	 * The configured duration of the backlog in seconds.  0
+	 * disables it.
+	 */
+	unsigned burst_time;
+
+	/**
+	 * The number of PCM bytes which were fed into the encoders
+	 * since they were opened.  This is used to timestamp the
+	 * backlog pages.
+	 */
+	uint64_t input_position;
+
+	/**
+	 * The duration of the backlog, converted to a number of PCM
+	 * bytes.
+	 */
+	uint64_t backlog_max_input;
+
 	/**
 	 * The configured name.
 	 */
@@ -125,11 +206,20 @@ httpd_output_remove_client(struct httpd_output *httpd,
 			   struct httpd_client *client);
 
 /**
- * Sends the encoder header to the client.  This is called right after
- * the response headers have been sent.
+ * Returns the stream for the specified request path (without the
+ * query string).  Falls back to the default stream if no stream has
+ * this path.
+ */
+G_GNUC_PURE
+struct httpd_stream *
+httpd_output_find_stream(struct httpd_output *httpd, const char *path);
+
+/**
+ * Sends the encoder header and the backlog to the client.  This is
+ * called right after the response headers have been sent.
  */
 void
-httpd_output_send_header(struct httpd_output *httpd,
+httpd_output_send_header(struct httpd_stream *stream,
 			 struct httpd_client *client);
 
 #endif
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "httpd_io.h"
+#include "httpd_internal.h"
+#include "httpd_client.h"
+#include "fd_util.h"
+
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "httpd_output"
+
+/**
+ * The maximum number of events handled with one epoll_wait() call.
+ */
+#define HTTPD_IO_MAX_EVENTS 256
+
+struct httpd_io {
+	struct httpd_output *httpd;
+
+	GThread *thread;
+
+	/**
+	 * A pipe which is used to wake up the I/O thread.
+	 */
+	int wake_fds[2];
+
+#ifdef HAVE_EPOLL_CREATE
+	int epoll_fd;
+#else
+	/**
+	 * The array passed to poll().  The first element is the wake
+	 * pipe, the following ones are the client sockets.
+	 */
+	GArray *pollfds;
+
+	/**
+	 * The clients belonging to the pollfds elements (starting at
+	 * index 1).
+	 */
+	GPtrArray *poll_clients;
+#endif
+
+	/**
+	 * True if a byte has been written to the wake pipe, which was
+	 * not yet consumed by the I/O thread.  Protected by
+	 * httpd_output.mutex.
+	 */
+	bool wake_pending;
+
+	/**
+	 * True if the I/O thread shall exit.  Protected by
+	 * httpd_output.mutex.
+	 */
+	bool quit;
+};
+
+static inline GQuark
+httpd_io_quark(void)
+{
+	return g_quark_from_static_string("httpd_io");
+}
+
+/**
+ * Consumes all bytes in the wake pipe.
+ */
+static void
+httpd_io_drain(struct httpd_io *io)
+{
+	char buffer[256];
+
+	while (read(io->wake_fds[0], buffer, sizeof(buffer)) > 0) {}
+}
+
+/**
+ * Handles a wakeup: writes pending pages to all clients.  The caller
+ * must hold httpd_output.mutex.
+ *
+ * @return false if the I/O thread shall exit
+ */
+static bool
+httpd_io_woken(struct httpd_io *io)
+{
+	httpd_io_drain(io);
+	io->wake_pending = false;
+
+	if (io->quit)
+		return false;
+
+	GList *i = io->httpd->clients;
+	while (i != NULL) {
+		/* the client may remove itself from the list */
+		struct httpd_client *client = i->data;
+		i = g_list_next(i);
+
+		httpd_client_flush(client);
+	}
+
+	return true;
+}
+
+#ifdef HAVE_EPOLL_CREATE
+
+static gpointer
+httpd_io_task(gpointer data)
+{
+	struct httpd_io *io = data;
+	struct httpd_output *httpd = io->httpd;
+	struct epoll_event events[HTTPD_IO_MAX_EVENTS];
+
+	while (true) {
+		int n = epoll_wait(io->epoll_fd, events,
+				   G_N_ELEMENTS(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			g_warning("epoll_wait() failed: %s",
+				  g_strerror(errno));
+			break;
+		}
+
+		bool woken = false;
+
+		g_mutex_lock(httpd->mutex);
+
+		for (int i = 0; i < n; ++i) {
+			struct httpd_client *client = events[i].data.ptr;
+			uint32_t e = events[i].events;
+
+			if (client == NULL) {
+				/* the wake pipe; handle it after the
+				   client events */
+				woken = true;
+				continue;
+			}
+
+			httpd_client_event(client, (e & EPOLLIN) != 0,
+					   (e & EPOLLOUT) != 0,
+					   (e & (EPOLLERR|EPOLLHUP)) != 0);
+		}
+
+		bool quit = woken && !httpd_io_woken(io);
+
+		g_mutex_unlock(httpd->mutex);
+
+		if (quit)
+			break;
+	}
+
+	return NULL;
+}
+
+#else
+
+static void
+httpd_io_add_pollfd(struct httpd_io *io, int fd, short events)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = events,
+		.revents = 0,
+	};
+
+	g_array_append_val(io->pollfds, pfd);
+}
+
+static gpointer
+httpd_io_task(gpointer data)
+{
+	struct httpd_io *io = data;
+	struct httpd_output *httpd = io->httpd;
+
+	while (true) {
+		/* collect the sockets; the client objects stay valid
+		   while the mutex is released, because only this
+		   thread frees them */
+
+		g_mutex_lock(httpd->mutex);
+
+		g_array_set_size(io->pollfds, 0);
+		g_ptr_array_set_size(io->poll_clients, 0);
+		httpd_io_add_pollfd(io, io->wake_fds[0], POLLIN);
+
+		for (GList *i = httpd->clients; i != NULL;
+		     i = g_list_next(i)) {
+			struct httpd_client *client = i->data;
+
+			httpd_io_add_pollfd(io, httpd_client_get_fd(client),
+					    httpd_client_wants_write(client)
+					    ? POLLIN|POLLOUT : POLLIN);
+			g_ptr_array_add(io->poll_clients, client);
+		}
+
+		g_mutex_unlock(httpd->mutex);
+
+		struct pollfd *pfds = (struct pollfd *)io->pollfds->data;
+		int n = poll(pfds, io->pollfds->len, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			g_warning("poll() failed: %s", g_strerror(errno));
+			break;
+		}
+
+		g_mutex_lock(httpd->mutex);
+
+		for (unsigned i = 1; i < io->pollfds->len; ++i) {
+			short e = pfds[i].revents;
+			if (e == 0)
+				continue;
+
+			httpd_client_event(g_ptr_array_index(io->poll_clients,
+							     i - 1),
+					   (e & POLLIN) != 0,
+					   (e & POLLOUT) != 0,
+					   (e & (POLLERR|POLLHUP|POLLNVAL)) != 0);
+		}
+
+		bool quit = pfds[0].revents != 0 && !httpd_io_woken(io);
+
+		g_mutex_unlock(httpd->mutex);
+
+		if (quit)
+			break;
+	}
+
+	return NULL;
+}
+
+#endif
+
+struct httpd_io *
+httpd_io_new(struct httpd_output *httpd, GError **error_r)
+{
+	struct httpd_io *io = g_new(struct httpd_io, 1);
+
+	io->httpd = httpd;
+	io->wake_pending = false;
+	io->quit = false;
+
+	if (pipe_cloexec_nonblock(io->wake_fds) < 0) {
+		g_set_error(error_r, httpd_io_quark(), errno,
+			    "Failed to create pipe: %s", g_strerror(errno));
+		g_free(io);
+		return NULL;
+	}
+
+#ifdef HAVE_EPOLL_CREATE
+	io->epoll_fd = epoll_create_cloexec();
+	if (io->epoll_fd < 0) {
+		g_set_error(error_r, httpd_io_quark(), errno,
+			    "epoll_create() failed: %s", g_strerror(errno));
+		close(io->wake_fds[0]);
+		close(io->wake_fds[1]);
+		g_free(io);
+		return NULL;
+	}
+
+	/* the wake pipe is identified by a NULL pointer */
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+
+	epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->wake_fds[0], &event);
+#else
+	io->pollfds = g_array_new(false, false, sizeof(struct pollfd));
+	io->poll_clients = g_ptr_array_new();
+#endif
+
+	io->thread = g_thread_create(httpd_io_task, io, true, error_r);
+	if (io->thread == NULL) {
+#ifdef HAVE_EPOLL_CREATE
+		close(io->epoll_fd);
+#else
+		g_array_free(io->pollfds, true);
+		g_ptr_array_free(io->poll_clients, true);
+#endif
+		close(io->wake_fds[0]);
+		close(io->wake_fds[1]);
+		g_free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+void
+httpd_io_free(struct httpd_io *io)
+{
+	g_mutex_lock(io->httpd->mutex);
+	io->quit = true;
+	httpd_io_wakeup(io);
+	g_mutex_unlock(io->httpd->mutex);
+
+	g_thread_join(io->thread);
+
+#ifdef HAVE_EPOLL_CREATE
+	close(io->epoll_fd);
+#else
+	g_array_free(io->pollfds, true);
+	g_ptr_array_free(io->poll_clients, true);
+#endif
+	close(io->wake_fds[0]);
+	close(io->wake_fds[1]);
+	g_free(io);
+}
+
+bool
+httpd_io_add(struct httpd_io *io, int fd, struct httpd_client *client,
+	     GError **error_r)
+{
+	assert(client != NULL);
+
+#ifdef HAVE_EPOLL_CREATE
+	/* edge-triggered: the client reads and writes until the
+	   socket returns EAGAIN, and only then waits for the next
+	   event */
+	struct epoll_event event = {
+		.events = EPOLLIN|EPOLLOUT|EPOLLET,
+		.data.ptr = client,
+	};
+
+	if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		g_set_error(error_r, httpd_io_quark(), errno,
+			    "epoll_ctl() failed: %s", g_strerror(errno));
+		return false;
+	}
+#else
+	(void)fd;
+	(void)error_r;
+
+	/* let the I/O thread rebuild its pollfd array */
+	httpd_io_wakeup(io);
+#endif
+
+	return true;
+}
+
+void
+httpd_io_wakeup(struct httpd_io *io)
+{
+	if (io->wake_pending)
+		return;
+
+	io->wake_pending = true;
+
+	G_GNUC_UNUSED ssize_t nbytes = write(io->wake_fds[1], "", 1);
+}
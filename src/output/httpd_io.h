@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * The I/O thread of the "httpd" audio output plugin.  It waits for
+ * socket events of all clients (with epoll if available) and writes
+ * the queued pages, so the main thread is not burdened with the
+ * listeners.
+ */
+
+#ifndef MPD_OUTPUT_HTTPD_IO_H
+#define MPD_OUTPUT_HTTPD_IO_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+struct httpd_output;
+struct httpd_client;
+
+/**
+ * Creates the I/O object and starts its thread.
+ */
+struct httpd_io *
+httpd_io_new(struct httpd_output *httpd, GError **error_r);
+
+/**
+ * Stops the I/O thread and frees the object.  The caller must not
+ * hold httpd_output.mutex.  After this function returns, no client is
+ * accessed by the I/O thread anymore.
+ */
+void
+httpd_io_free(struct httpd_io *io);
+
+/**
+ * Registers a new client socket.  The caller must hold
+ * httpd_output.mutex.
+ */
+bool
+httpd_io_add(struct httpd_io *io, int fd, struct httpd_client *client,
+	     GError **error_r);
+
+/**
+ * Wakes up the I/O thread, which then writes the pending pages of
+ * all clients.  Repeated calls before the thread has woken up are
+ * coalesced.  The caller must hold httpd_output.mutex.
+ */
+void
+httpd_io_wakeup(struct httpd_io *io);
+
+#endif
@@ -20,16 +20,20 @@
 #include "config.h"
 #include "httpd_internal.h"
 #include "httpd_client.h"
+#include "httpd_io.h"
 #include "output_api.h"
 #include "encoder_plugin.h"
 #include "encoder_list.h"
+#include "encoder_thread.h"
 #include "socket_util.h"
 #include "page.h"
 #include "icy_server.h"
 #include "fd_util.h"
 #include "server_socket.h"
+#include "audio_format.h"
 
 #include <assert.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -43,6 +47,22 @@
 #undef G_LOG_DOMAIN
 #define G_LOG_DOMAIN "httpd_output"
 
+/**
+ * The maximum size of the backlog.  It must be well below the queue
+ * size which makes httpd_client_check_queue() drop a client.
+ */
+#define HTTPD_BACKLOG_MAX_SIZE (128 * 1024)
+
+struct httpd_backlog_page {
+	struct page *page;
+
+	/**
+	 * The value of httpd_output.input_position when this page
+	 * was read from the encoder.
+	 */
+	uint64_t input_position;
+};
+
 /**
  * The quark used for GError.domain.
  */
@@ -56,6 +76,156 @@ static void
 httpd_listen_in_event(int fd, const struct sockaddr *address,
 		      size_t address_length, int uid, void *ctx);
 
+static size_t
+ogg_find_sync(const unsigned char *p, size_t length)
+{
+	for (size_t i = 0; i + 4 <= length; ++i)
+		if (memcmp(p + i, "OggS", 4) == 0)
+			return i;
+
+	return length;
+}
+
+static size_t
+mpeg_find_sync(const unsigned char *p, size_t length)
+{
+	for (size_t i = 0; i + 3 <= length; ++i)
+		/* frame sync, a valid bit rate index and a valid
+		   sample rate index */
+		if (p[i] == 0xff && (p[i + 1] & 0xe0) == 0xe0 &&
+		    (p[i + 2] & 0xf0) != 0xf0 && (p[i + 2] & 0x0c) != 0x0c)
+			return i;
+
+	return length;
+}
+
+static size_t
+flac_find_sync(const unsigned char *p, size_t length)
+{
+	for (size_t i = 0; i + 2 <= length; ++i)
+		if (p[i] == 0xff && (p[i + 1] & 0xfe) == 0xf8)
+			return i;
+
+	return length;
+}
+
+typedef size_t (*httpd_find_sync_t)(const unsigned char *p, size_t length);
+
+/**
+ * Returns the frame boundary scanner for the specified MIME type, or
+ * NULL if the backlog does not support it.
+ */
+static httpd_find_sync_t
+httpd_find_sync_for_type(const char *content_type)
+{
+	if (strcmp(content_type, "audio/ogg") == 0 ||
+	    strcmp(content_type, "application/ogg") == 0 ||
+	    strcmp(content_type, "application/x-ogg") == 0)
+		return ogg_find_sync;
+
+	if (strcmp(content_type, "audio/mpeg") == 0)
+		return mpeg_find_sync;
+
+	if (strcmp(content_type, "audio/flac") == 0)
+		return flac_find_sync;
+
+	return NULL;
+}
+
+/**
+ * Is the backlog enabled for this stream?
+ */
+static bool
+httpd_stream_has_backlog(const struct httpd_output *httpd,
+			 const struct httpd_stream *stream)
+{
+	return httpd->burst_time > 0 && stream->find_sync != NULL;
+}
+
+/**
+ * Removes the oldest page from the backlog.  Caller must lock the
+ * mutex.
+ */
+static void
+httpd_stream_backlog_pop(struct httpd_stream *stream)
+{
+	struct httpd_backlog_page *b = g_queue_pop_head(stream->backlog);
+
+	assert(b != NULL);
+	assert(stream->backlog_size >= b->page->size);
+
+	stream->backlog_size -= b->page->size;
+	page_unref(b->page);
+	g_free(b);
+}
+
+/**
+ * Discards the backlog, e.g. because the stream has been restarted.
+ * Caller must lock the mutex.
+ */
+static void
+httpd_stream_backlog_clear(struct httpd_stream *stream)
+{
+	while (!g_queue_is_empty(stream->backlog))
+		httpd_stream_backlog_pop(stream);
+}
+
+/**
+ * Discards the backlogs of all streams.  Caller must lock the mutex.
+ */
+static void
+httpd_output_backlog_clear(struct httpd_output *httpd)
+{
+	for (unsigned i = 0; i < httpd->num_streams; ++i)
+		httpd_stream_backlog_clear(&httpd->streams[i]);
+}
+
+/**
+ * Appends a page to the backlog, and drops old pages which exceed
+ * the configured duration.  Caller must lock the mutex.
+ */
+static void
+httpd_stream_backlog_push(const struct httpd_output *httpd,
+			  struct httpd_stream *stream, struct page *page)
+{
+	struct httpd_backlog_page *b = g_new(struct httpd_backlog_page, 1);
+
+	page_ref(page);
+	b->page = page;
+	b->input_position = httpd->input_position;
+	g_queue_push_tail(stream->backlog, b);
+	stream->backlog_size += page->size;
+
+	struct httpd_backlog_page *oldest;
+	while ((oldest = g_queue_peek_head(stream->backlog)) != NULL &&
+	       (httpd->input_position - oldest->input_position >
+		httpd->backlog_max_input ||
+		stream->backlog_size > HTTPD_BACKLOG_MAX_SIZE))
+		httpd_stream_backlog_pop(stream);
+
+	/* let the backlog start on a frame boundary, so the burst
+	   can be decoded */
+
+	while ((oldest = g_queue_peek_head(stream->backlog)) != NULL) {
+		size_t sync = stream->find_sync(oldest->page->data,
+						oldest->page->size);
+		if (sync == 0)
+			break;
+
+		if (sync >= oldest->page->size) {
+			httpd_stream_backlog_pop(stream);
+			continue;
+		}
+
+		struct page *tail = page_new_copy(oldest->page->data + sync,
+						  oldest->page->size - sync);
+		stream->backlog_size -= sync;
+		page_unref(oldest->page);
+		oldest->page = tail;
+		break;
+	}
+}
+
 static bool
 httpd_output_bind(struct httpd_output *httpd, GError **error_r)
 {
@@ -78,14 +248,155 @@ httpd_output_unbind(struct httpd_output *httpd)
 	g_mutex_unlock(httpd->mutex);
 }
 
+/**
+ * Initializes a #httpd_stream object.
+ *
+ * @param path the request path which selects the stream, or NULL for
+ * the default stream
+ * @param param the encoder configuration
+ */
+static bool
+httpd_stream_init(struct httpd_stream *stream, const char *path,
+		  const struct config_param *param, unsigned burst_time,
+		  GError **error)
+{
+	const char *encoder_name;
+	const struct encoder_plugin *encoder_plugin;
+
+	encoder_name = config_get_block_string(param, "encoder", "vorbis");
+	encoder_plugin = encoder_plugin_get(encoder_name);
+	if (encoder_plugin == NULL) {
+		g_set_error(error, httpd_output_quark(), 0,
+			    "No such encoder: %s", encoder_name);
+		return false;
+	}
+
+	stream->encoder = encoder_thread_init(encoder_plugin, param, error);
+	if (stream->encoder == NULL)
+		return false;
+
+	stream->encoder_tags = encoder_plugin->tag != NULL;
+
+	stream->path = g_strdup(path);
+	stream->unflushed_input = 0;
+	stream->header = NULL;
+	stream->num_clients = 0;
+
+	/* determine content type */
+	stream->content_type = encoder_get_mime_type(stream->encoder);
+	if (stream->content_type == NULL) {
+		stream->content_type = "application/octet-stream";
+	}
+
+	stream->find_sync = httpd_find_sync_for_type(stream->content_type);
+	if (burst_time > 0 && stream->find_sync == NULL)
+		g_warning("burst_time is not supported for %s streams",
+			  stream->content_type);
+
+	stream->backlog = g_queue_new();
+	stream->backlog_size = 0;
+
+	return true;
+}
+
+static void
+httpd_stream_finish(struct httpd_stream *stream)
+{
+	encoder_finish(stream->encoder);
+	g_queue_free(stream->backlog);
+	g_free(stream->path);
+}
+
+/**
+ * Parses the value of a "stream_NAME" parameter: the request path,
+ * followed by "key=value" pairs which configure the encoder, e.g.
+ * "/low.mp3 encoder=lame bitrate=64".  Settings which are missing
+ * are not inherited from the audio_output block, except for the
+ * encoder name.
+ */
+static bool
+httpd_output_init_extra_stream(struct httpd_output *httpd,
+			       const struct block_param *bp,
+			       const char *default_encoder, GError **error)
+{
+	char **words = g_strsplit_set(bp->value, " \t", -1);
+	struct config_param *param = config_new_param(NULL, bp->line);
+	const char *path = NULL;
+	bool success = true;
+
+	for (char **w = words; success && *w != NULL; ++w) {
+		if (**w == 0)
+			continue;
+
+		if (path == NULL) {
+			path = *w;
+			if (*path != '/' ||
+			    httpd_output_find_stream(httpd, path)->path != NULL) {
+				g_set_error(error, httpd_output_quark(), 0,
+					    "Invalid or duplicate stream path "
+					    "\"%s\" in line %i", path, bp->line);
+				success = false;
+			}
+
+			continue;
+		}
+
+		char *eq = strchr(*w, '=');
+		if (eq == NULL) {
+			g_set_error(error, httpd_output_quark(), 0,
+				    "\"key=value\" expected in line %i",
+				    bp->line);
+			success = false;
+			break;
+		}
+
+		*eq = 0;
+		success = config_add_block_param(param, *w, eq + 1, bp->line,
+						 error);
+	}
+
+	if (success && path == NULL) {
+		g_set_error(error, httpd_output_quark(), 0,
+			    "Stream path missing in line %i", bp->line);
+		success = false;
+	}
+
+	if (success && config_get_block_param(param, "encoder") == NULL)
+		config_add_block_param(param, "encoder", default_encoder,
+				       bp->line, NULL);
+
+	if (success) {
+		success = httpd_stream_init(&httpd->streams[httpd->num_streams],
+					    path, param, httpd->burst_time,
+					    error);
+		if (success)
+			++httpd->num_streams;
+	}
+
+	config_param_free(param);
+	g_strfreev(words);
+	return success;
+}
+
+/**
+ * Finishes all streams which have been initialized, and frees the
+ * array.
+ */
+static void
+httpd_output_free_streams(struct httpd_output *httpd)
+{
+	for (unsigned i = 0; i < httpd->num_streams; ++i)
+		httpd_stream_finish(&httpd->streams[i]);
+	g_free(httpd->streams);
+}
+
 static void *
 httpd_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 		  const struct config_param *param,
 		  GError **error)
 {
 	struct httpd_output *httpd = g_new(struct httpd_output, 1);
-	const char *encoder_name, *bind_to_address;
-	const struct encoder_plugin *encoder_plugin;
+	const char *bind_to_address;
 	guint port;
 
 	/* read configuration */
@@ -98,15 +409,8 @@ httpd_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 
 	port = config_get_block_unsigned(param, "port", 8000);
 
-	encoder_name = config_get_block_string(param, "encoder", "vorbis");
-	encoder_plugin = encoder_plugin_get(encoder_name);
-	if (encoder_plugin == NULL) {
-		g_set_error(error, httpd_output_quark(), 0,
-			    "No such encoder: %s", encoder_name);
-		return NULL;
-	}
-
 	httpd->clients_max = config_get_block_unsigned(param,"max_clients", 0);
+	httpd->burst_time = config_get_block_unsigned(param, "burst_time", 0);
 
 	/* set up bind_to_address */
 
@@ -120,27 +424,51 @@ httpd_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 					 port, error)
 		: server_socket_add_port(httpd->server_socket, port, error);
 	if (!success)
-		return NULL;
+		goto fail_socket;
 
 	/* initialize metadata */
 	httpd->metadata = NULL;
-	httpd->unflushed_input = 0;
 
-	/* initialize encoder */
+	/* initialize the encoders: the default stream, and one for
+	   each "stream_NAME" parameter */
 
-	httpd->encoder = encoder_init(encoder_plugin, param, error);
-	if (httpd->encoder == NULL)
-		return NULL;
+	const unsigned num_block_params =
+		param != NULL ? param->num_block_params : 0;
+	httpd->streams = g_new(struct httpd_stream, num_block_params + 1);
+	httpd->num_streams = 0;
 
-	/* determine content type */
-	httpd->content_type = encoder_get_mime_type(httpd->encoder);
-	if (httpd->content_type == NULL) {
-		httpd->content_type = "application/octet-stream";
+	if (!httpd_stream_init(&httpd->streams[0], NULL, param,
+			       httpd->burst_time, error))
+		goto fail_streams;
+
+	++httpd->num_streams;
+
+	const char *default_encoder =
+		config_get_block_string(param, "encoder", "vorbis");
+
+	for (unsigned i = 0; i < num_block_params; ++i) {
+		struct block_param *bp = &param->block_params[i];
+		if (!g_str_has_prefix(bp->name, "stream_"))
+			continue;
+
+		bp->used = true;
+
+		if (!httpd_output_init_extra_stream(httpd, bp, default_encoder,
+						    error))
+			goto fail_streams;
 	}
 
 	httpd->mutex = g_mutex_new();
 
 	return httpd;
+
+fail_streams:
+	/* finish the streams which were initialized so far */
+	httpd_output_free_streams(httpd);
+fail_socket:
+	server_socket_free(httpd->server_socket);
+	g_free(httpd);
+	return NULL;
 }
 
 static void
@@ -151,7 +479,8 @@ httpd_output_finish(void *data)
 	if (httpd->metadata)
 		page_unref(httpd->metadata);
 
-	encoder_finish(httpd->encoder);
+	httpd_output_free_streams(httpd);
+
 	server_socket_free(httpd->server_socket);
 	g_mutex_free(httpd->mutex);
 	g_free(httpd);
@@ -164,9 +493,15 @@ httpd_output_finish(void *data)
 static void
 httpd_client_add(struct httpd_output *httpd, int fd)
 {
-	struct httpd_client *client =
-		httpd_client_new(httpd, fd,
-				 httpd->encoder->plugin->tag == NULL);
+	struct httpd_client *client = httpd_client_new(httpd, fd);
+
+	GError *error = NULL;
+	if (!httpd_io_add(httpd->io, fd, client, &error)) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		httpd_client_free(client);
+		return;
+	}
 
 	httpd->clients = g_list_prepend(httpd->clients, client);
 	httpd->clients_cnt++;
@@ -234,25 +569,26 @@ httpd_listen_in_event(int fd, const struct sockaddr *address,
  * as a new #page object.
  */
 static struct page *
-httpd_output_read_page(struct httpd_output *httpd)
+httpd_output_read_page(struct httpd_output *httpd,
+		       struct httpd_stream *stream)
 {
 	size_t size = 0, nbytes;
 
-	if (httpd->unflushed_input >= 65536) {
+	if (stream->unflushed_input >= 65536) {
 		/* we have fed a lot of input into the encoder, but it
 		   didn't give anything back yet - flush now to avoid
 		   buffer underruns */
-		encoder_flush(httpd->encoder, NULL);
-		httpd->unflushed_input = 0;
+		encoder_flush(stream->encoder, NULL);
+		stream->unflushed_input = 0;
 	}
 
 	do {
-		nbytes = encoder_read(httpd->encoder, httpd->buffer + size,
+		nbytes = encoder_read(stream->encoder, httpd->buffer + size,
 				      sizeof(httpd->buffer) - size);
 		if (nbytes == 0)
 			break;
 
-		httpd->unflushed_input = 0;
+		stream->unflushed_input = 0;
 
 		size += nbytes;
 	} while (size < sizeof(httpd->buffer));
@@ -264,26 +600,87 @@ httpd_output_read_page(struct httpd_output *httpd)
 }
 
 static bool
-httpd_output_encoder_open(struct httpd_output *httpd,
+httpd_stream_encoder_open(struct httpd_output *httpd,
+			  struct httpd_stream *stream,
 			  struct audio_format *audio_format,
 			  GError **error)
 {
 	bool success;
 
-	success = encoder_open(httpd->encoder, audio_format, error);
+	success = encoder_open(stream->encoder, audio_format, error);
 	if (!success)
 		return false;
 
 	/* we have to remember the encoder header, i.e. the first
 	   bytes of encoder output after opening it, because it has to
 	   be sent to every new client */
-	httpd->header = httpd_output_read_page(httpd);
+	stream->header = httpd_output_read_page(httpd, stream);
+
+	stream->unflushed_input = 0;
+	stream->num_clients = 0;
+
+	return true;
+}
+
+static void
+httpd_stream_encoder_close(struct httpd_stream *stream)
+{
+	if (stream->header != NULL) {
+		page_unref(stream->header);
+		stream->header = NULL;
+	}
+
+	encoder_close(stream->encoder);
+}
+
+/**
+ * Opens the encoders of all streams.  They all get the same input
+ * format, because they share the PCM data.
+ */
+static bool
+httpd_output_encoder_open(struct httpd_output *httpd,
+			  struct audio_format *audio_format,
+			  GError **error)
+{
+	for (unsigned i = 0; i < httpd->num_streams; ++i) {
+		struct httpd_stream *stream = &httpd->streams[i];
+
+		/* the default stream may modify the audio format, and
+		   the others must accept it unchanged */
+		struct audio_format stream_format = *audio_format;
+		bool success =
+			httpd_stream_encoder_open(httpd, stream,
+						  i == 0
+						  ? audio_format
+						  : &stream_format,
+						  error);
+		if (success && i > 0 &&
+		    !audio_format_equals(&stream_format, audio_format)) {
+			httpd_stream_encoder_close(stream);
+			g_set_error(error, httpd_output_quark(), 0,
+				    "Stream \"%s\" does not support the "
+				    "audio format of the default stream",
+				    stream->path);
+			success = false;
+		}
 
-	httpd->unflushed_input = 0;
+		if (!success) {
+			while (i-- > 0)
+				httpd_stream_encoder_close(&httpd->streams[i]);
+			return false;
+		}
+	}
 
 	return true;
 }
 
+static void
+httpd_output_encoder_close(struct httpd_output *httpd)
+{
+	for (unsigned i = 0; i < httpd->num_streams; ++i)
+		httpd_stream_encoder_close(&httpd->streams[i]);
+}
+
 static bool
 httpd_output_enable(void *data, GError **error_r)
 {
@@ -319,10 +716,22 @@ httpd_output_open(void *data, struct audio_format *audio_format,
 
 	/* initialize other attributes */
 
+	httpd->io = httpd_io_new(httpd, error);
+	if (httpd->io == NULL) {
+		httpd_output_encoder_close(httpd);
+		g_mutex_unlock(httpd->mutex);
+		return false;
+	}
+
 	httpd->clients = NULL;
 	httpd->clients_cnt = 0;
 	httpd->timer = timer_new(audio_format);
 
+	httpd->input_position = 0;
+	httpd->backlog_max_input = (uint64_t)httpd->burst_time *
+		audio_format->sample_rate *
+		audio_format_frame_size(audio_format);
+
 	httpd->open = true;
 
 	g_mutex_unlock(httpd->mutex);
@@ -342,18 +751,22 @@ static void httpd_output_close(void *data)
 	struct httpd_output *httpd = data;
 
 	g_mutex_lock(httpd->mutex);
-
 	httpd->open = false;
+	g_mutex_unlock(httpd->mutex);
+
+	/* stop the I/O thread before the clients are freed; no new
+	   clients are accepted anymore */
+	httpd_io_free(httpd->io);
+
+	g_mutex_lock(httpd->mutex);
 
 	timer_free(httpd->timer);
 
 	g_list_foreach(httpd->clients, httpd_client_delete, NULL);
 	g_list_free(httpd->clients);
 
-	if (httpd->header != NULL)
-		page_unref(httpd->header);
-
-	encoder_close(httpd->encoder);
+	httpd_output_backlog_clear(httpd);
+	httpd_output_encoder_close(httpd);
 
 	g_mutex_unlock(httpd->mutex);
 }
@@ -367,14 +780,35 @@ httpd_output_remove_client(struct httpd_output *httpd,
 
 	httpd->clients = g_list_remove(httpd->clients, client);
 	httpd->clients_cnt--;
+
+	struct httpd_stream *stream = httpd_client_get_stream(client);
+	if (stream != NULL) {
+		assert(stream->num_clients > 0);
+		--stream->num_clients;
+	}
+}
+
+struct httpd_stream *
+httpd_output_find_stream(struct httpd_output *httpd, const char *path)
+{
+	for (unsigned i = 1; i < httpd->num_streams; ++i)
+		if (strcmp(httpd->streams[i].path, path) == 0)
+			return &httpd->streams[i];
+
+	return &httpd->streams[0];
 }
 
 void
-httpd_output_send_header(struct httpd_output *httpd,
+httpd_output_send_header(struct httpd_stream *stream,
 			 struct httpd_client *client)
 {
-	if (httpd->header != NULL)
-		httpd_client_send(client, httpd->header);
+	if (stream->header != NULL)
+		httpd_client_send(client, stream->header);
+
+	for (GList *i = stream->backlog->head; i != NULL; i = g_list_next(i)) {
+		struct httpd_backlog_page *b = i->data;
+		httpd_client_send(client, b->page);
+	}
 }
 
 static unsigned
@@ -387,70 +821,103 @@ httpd_output_delay(void *data)
 		: 0;
 }
 
+/**
+ * Sends a page to all clients of the specified stream.  Caller must
+ * lock the mutex.
+ */
 static void
-httpd_client_check_queue(gpointer data, G_GNUC_UNUSED gpointer user_data)
+httpd_stream_send_page(struct httpd_output *httpd,
+		       const struct httpd_stream *stream, struct page *page)
 {
-	struct httpd_client *client = data;
+	for (GList *i = httpd->clients; i != NULL; i = g_list_next(i)) {
+		struct httpd_client *client = i->data;
 
-	if (httpd_client_queue_size(client) > 256 * 1024) {
-		g_debug("client is too slow, flushing its queue");
-		httpd_client_cancel(client);
+		if (httpd_client_get_stream(client) == stream)
+			httpd_client_send(client, page);
 	}
 }
 
-static void
-httpd_client_send_page(gpointer data, gpointer user_data)
-{
-	struct httpd_client *client = data;
-	struct page *page = user_data;
-
-	httpd_client_send(client, page);
-}
-
 /**
- * Broadcasts a page struct to all clients.
+ * Broadcasts a page struct to all clients of the stream, and adds it
+ * to the backlog.
  */
 static void
-httpd_output_broadcast_page(struct httpd_output *httpd, struct page *page)
+httpd_output_broadcast_page(struct httpd_output *httpd,
+			    struct httpd_stream *stream, struct page *page)
 {
 	assert(page != NULL);
 
 	g_mutex_lock(httpd->mutex);
-	g_list_foreach(httpd->clients, httpd_client_send_page, page);
+	if (httpd_stream_has_backlog(httpd, stream))
+		httpd_stream_backlog_push(httpd, stream, page);
+	httpd_stream_send_page(httpd, stream, page);
+	httpd_io_wakeup(httpd->io);
 	g_mutex_unlock(httpd->mutex);
 }
 
 /**
- * Broadcasts data from the encoder to all clients.
+ * Broadcasts data from the encoder to all clients of the stream.
  */
 static void
-httpd_output_encoder_to_clients(struct httpd_output *httpd)
+httpd_output_encoder_to_clients(struct httpd_output *httpd,
+				struct httpd_stream *stream)
 {
 	struct page *page;
 
-	g_mutex_lock(httpd->mutex);
-	g_list_foreach(httpd->clients, httpd_client_check_queue, NULL);
-	g_mutex_unlock(httpd->mutex);
-
-	while ((page = httpd_output_read_page(httpd)) != NULL) {
-		httpd_output_broadcast_page(httpd, page);
+	while ((page = httpd_output_read_page(httpd, stream)) != NULL) {
+		httpd_output_broadcast_page(httpd, stream, page);
 		page_unref(page);
 	}
 }
 
+static void
+httpd_client_check_queue(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	struct httpd_client *client = data;
+
+	if (httpd_client_queue_size(client) > 256 * 1024) {
+		g_debug("client is too slow, flushing its queue");
+		httpd_client_cancel(client);
+	}
+}
+
+/**
+ * Feeds the PCM data into the encoders of all streams which have
+ * clients (or a backlog), and broadcasts their output.
+ */
 static bool
 httpd_output_encode_and_play(struct httpd_output *httpd,
 			     const void *chunk, size_t size, GError **error)
 {
 	bool success;
 
-	success = encoder_write(httpd->encoder, chunk, size, error);
-	if (!success)
-		return false;
+	g_mutex_lock(httpd->mutex);
+	g_list_foreach(httpd->clients, httpd_client_check_queue, NULL);
+	g_mutex_unlock(httpd->mutex);
 
-	httpd->unflushed_input += size;
+	httpd->input_position += size;
 
-	httpd_output_encoder_to_clients(httpd);
+	for (unsigned i = 0; i < httpd->num_streams; ++i) {
+		struct httpd_stream *stream = &httpd->streams[i];
+
+		g_mutex_lock(httpd->mutex);
+		bool has_clients = stream->num_clients > 0;
+		g_mutex_unlock(httpd->mutex);
+
+		/* with a backlog, the encoder keeps running without
+		   clients, so it is filled when the next one
+		   connects */
+		if (!has_clients && !httpd_stream_has_backlog(httpd, stream))
+			continue;
+
+		success = encoder_write(stream->encoder, chunk, size, error);
+		if (!success)
+			return false;
+
+		stream->unflushed_input += size;
+
+		httpd_output_encoder_to_clients(httpd, stream);
+	}
 
 	return true;
 }
@@ -465,7 +932,7 @@ httpd_output_play(void *data, const void *chunk, size_t size, GError **error)
 	has_clients = httpd->clients != NULL;
 	g_mutex_unlock(httpd->mutex);
 
-	if (has_clients) {
+	if (has_clients || httpd->burst_time > 0) {
 		bool success;
 
 		success = httpd_output_encode_and_play(httpd, chunk, size,
@@ -508,39 +975,67 @@ httpd_send_metadata(gpointer data, gpointer user_data)
 	httpd_client_send_metadata(client, icy_metadata);
 }
 
+/**
+ * Embeds the tag into the stream, by restarting the encoder.
+ */
 static void
-httpd_output_tag(void *data, const struct tag *tag)
+httpd_stream_tag(struct httpd_output *httpd, struct httpd_stream *stream,
+		 const struct tag *tag)
 {
-	struct httpd_output *httpd = data;
+	struct page *page;
 
-	assert(tag != NULL);
+	/* flush the current stream, and end it */
+
+	encoder_flush(stream->encoder, NULL);
+	httpd_output_encoder_to_clients(httpd, stream);
 
-	if (httpd->encoder->plugin->tag != NULL) {
-		/* embed encoder tags */
-		struct page *page;
+	/* send the tag to the encoder - which starts a new
+	   stream now */
 
-		/* flush the current stream, and end it */
+	encoder_tag(stream->encoder, tag, NULL);
 
-		encoder_flush(httpd->encoder, NULL);
-		httpd_output_encoder_to_clients(httpd);
+	/* the first page generated by the encoder will now be
+	   used as the new "header" page, which is sent to all
+	   new clients */
 
-		/* send the tag to the encoder - which starts a new
-		   stream now */
+	page = httpd_output_read_page(httpd, stream);
 
-		encoder_tag(httpd->encoder, tag, NULL);
+	g_mutex_lock(httpd->mutex);
 
-		/* the first page generated by the encoder will now be
-		   used as the new "header" page, which is sent to all
-		   new clients */
+	/* the backlog belongs to the old stream */
+	httpd_stream_backlog_clear(stream);
 
-		page = httpd_output_read_page(httpd);
-		if (page != NULL) {
-			if (httpd->header != NULL)
-				page_unref(httpd->header);
-			httpd->header = page;
-			httpd_output_broadcast_page(httpd, page);
-		}
-	} else {
+	if (page != NULL) {
+		if (stream->header != NULL)
+			page_unref(stream->header);
+		stream->header = page;
+
+		httpd_stream_send_page(httpd, stream, page);
+		httpd_io_wakeup(httpd->io);
+	}
+
+	g_mutex_unlock(httpd->mutex);
+}
+
+static void
+httpd_output_tag(void *data, const struct tag *tag)
+{
+	struct httpd_output *httpd = data;
+	bool icy = false;
+
+	assert(tag != NULL);
+
+	for (unsigned i = 0; i < httpd->num_streams; ++i) {
+		struct httpd_stream *stream = &httpd->streams[i];
+
+		if (stream->encoder_tags)
+			/* embed encoder tags */
+			httpd_stream_tag(httpd, stream, tag);
+		else
+			icy = true;
+	}
+
+	if (icy) {
 		/* use Icy-Metadata */
 
 		if (httpd->metadata != NULL)
@@ -574,6 +1069,7 @@ httpd_output_cancel(void *data)
 
 	g_mutex_lock(httpd->mutex);
 	g_list_foreach(httpd->clients, httpd_client_cancel_callback, NULL);
+	httpd_output_backlog_clear(httpd);
 	g_mutex_unlock(httpd->mutex);
 }
 
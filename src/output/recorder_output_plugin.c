@@ -21,6 +21,7 @@
 #include "output_api.h"
 #include "encoder_plugin.h"
 #include "encoder_list.h"
+#include "encoder_thread.h"
 #include "fd_util.h"
 #include "open.h"
 
@@ -91,7 +92,8 @@ recorder_output_init(G_GNUC_UNUSED const struct audio_format *audio_format,
 
 	/* initialize encoder */
 
-	recorder->encoder = encoder_init(encoder_plugin, param, error_r);
+	recorder->encoder = encoder_thread_init(encoder_plugin, param,
+						error_r);
 	if (recorder->encoder == NULL)
 		return NULL;
 
@@ -118,33 +120,34 @@ recorder_output_encoder_to_file(struct recorder_output *recorder,
 
 	assert(recorder->fd >= 0);
 
-	/* read from the encoder */
-
-	size = encoder_read(recorder->encoder, recorder->buffer,
-			    sizeof(recorder->buffer));
-	if (size == 0)
-		return true;
-
-	/* write everything into the file */
-
-	position = 0;
 	while (true) {
-		nbytes = write(recorder->fd, recorder->buffer + position,
-			       size - position);
-		if (nbytes > 0) {
-			position += (size_t)nbytes;
-			if (position >= size)
-				return true;
-		} else if (nbytes == 0) {
-			/* shouldn't happen for files */
-			g_set_error(error_r, recorder_output_quark(), 0,
-				    "write() returned 0");
-			return false;
-		} else if (errno != EINTR) {
-			g_set_error(error_r, recorder_output_quark(), 0,
-				    "Failed to write to '%s': %s",
-				    recorder->path, g_strerror(errno));
-			return false;
+		/* read from the encoder */
+
+		size = encoder_read(recorder->encoder, recorder->buffer,
+				    sizeof(recorder->buffer));
+		if (size == 0)
+			return true;
+
+		/* write everything into the file */
+
+		position = 0;
+		while (position < size) {
+			nbytes = write(recorder->fd,
+				       recorder->buffer + position,
+				       size - position);
+			if (nbytes > 0) {
+				position += (size_t)nbytes;
+			} else if (nbytes == 0) {
+				/* shouldn't happen for files */
+				g_set_error(error_r, recorder_output_quark(), 0,
+					    "write() returned 0");
+				return false;
+			} else if (errno != EINTR) {
+				g_set_error(error_r, recorder_output_quark(), 0,
+					    "Failed to write to '%s': %s",
+					    recorder->path, g_strerror(errno));
+				return false;
+			}
 		}
 	}
 }
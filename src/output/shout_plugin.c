@@ -21,6 +21,7 @@
 #include "output_api.h"
 #include "encoder_plugin.h"
 #include "encoder_list.h"
+#include "encoder_thread.h"
 #include "mpd_error.h"
 
 #include <shout/shout.h>
@@ -46,6 +47,12 @@ struct shout_data {
 
 	struct encoder *encoder;
 
+	/**
+	 * Does the encoder plugin support stream tags?  If not, the
+	 * tags are sent as icy-metadata.
+	 */
+	bool encoder_tags;
+
 	float quality;
 	int bitrate;
 
@@ -209,7 +216,8 @@ my_shout_init_driver(const struct audio_format *audio_format,
 		return NULL;
 	}
 
-	sd->encoder = encoder_init(encoder_plugin, param, error);
+	sd->encoder = encoder_thread_init(encoder_plugin, param, error);
+	sd->encoder_tags = encoder_plugin->tag != NULL;
 	if (sd->encoder == NULL)
 		return NULL;
 
@@ -344,16 +352,16 @@ write_page(struct shout_data *sd, GError **error)
 
 	assert(sd->encoder != NULL);
 
-	sd->buf.len = encoder_read(sd->encoder,
-				   sd->buf.data, sizeof(sd->buf.data));
-	if (sd->buf.len == 0)
-		return true;
-
-	err = shout_send(sd->shout_conn, sd->buf.data, sd->buf.len);
-	if (!handle_shout_error(sd, err, error))
-		return false;
+	while (true) {
+		sd->buf.len = encoder_read(sd->encoder, sd->buf.data,
+					   sizeof(sd->buf.data));
+		if (sd->buf.len == 0)
+			return true;
 
-	return true;
+		err = shout_send(sd->shout_conn, sd->buf.data, sd->buf.len);
+		if (!handle_shout_error(sd, err, error))
+			return false;
+	}
 }
 
 static void close_shout_conn(struct shout_data * sd)
@@ -511,7 +519,7 @@ static void my_shout_set_tag(void *data,
 	bool ret;
 	GError *error = NULL;
 
-	if (sd->encoder->plugin->tag != NULL) {
+	if (sd->encoder_tags) {
 		/* encoder plugin supports stream tags */
 
 		ret = encoder_flush(sd->encoder, &error);
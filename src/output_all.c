@@ -110,6 +110,10 @@ audio_output_all_init(struct player_control *pc)
 	notify_init(&audio_output_client_notify);
 
 	num_audio_outputs = audio_output_config_count();
+	if (num_audio_outputs > sizeof(gint) * 8)
+		MPD_ERROR("too many audio outputs configured (maximum %u)",
+			  (unsigned)(sizeof(gint) * 8));
+
 	audio_outputs = g_new(struct audio_output, num_audio_outputs);
 
 	for (i = 0; i < num_audio_outputs; i++)
@@ -130,6 +134,8 @@ audio_output_all_init(struct player_control *pc)
 				MPD_ERROR("%s", error->message);
 		}
 
+		output->consumer_mask = (gint)(1u << i);
+
 		/* require output names to be unique: */
 		for (j = 0; j < i; j++) {
 			if (!strcmp(output->name, audio_outputs[j].name)) {
@@ -278,6 +284,37 @@ audio_output_all_update(void)
 	return ret;
 }
 
+/**
+ * Determines which audio outputs are open, i.e. which of them must
+ * consume the chunks in the pipe.
+ *
+ * @param idle_r is set to true if at least one open output has not
+ * yet started to play from the pipe; no chunk may be recycled while
+ * this is the case
+ * @return the bit mask of all open outputs
+ */
+static gint
+audio_output_all_consumers(bool *idle_r)
+{
+	gint mask = 0;
+
+	*idle_r = false;
+
+	for (unsigned i = 0; i < num_audio_outputs; ++i) {
+		struct audio_output *ao = &audio_outputs[i];
+
+		g_mutex_lock(ao->mutex);
+		if (ao->open) {
+			mask |= ao->consumer_mask;
+			if (ao->chunk == NULL)
+				*idle_r = true;
+		}
+		g_mutex_unlock(ao->mutex);
+	}
+
+	return mask;
+}
+
 bool
 audio_output_all_play(struct music_chunk *chunk)
 {
@@ -293,6 +330,8 @@ audio_output_all_play(struct music_chunk *chunk)
 	if (!ret)
 		return false;
 
+	bool idle;
+	chunk->consumers = audio_output_all_consumers(&idle);
 	music_pipe_push(g_mp, chunk);
 
 	for (i = 0; i < num_audio_outputs; ++i)
@@ -368,11 +407,11 @@ chunk_is_consumed_in(const struct audio_output *ao,
 	assert(chunk == ao->chunk || music_pipe_contains(g_mp, ao->chunk));
 
 	if (chunk != ao->chunk) {
-		assert(chunk->next != NULL);
+		assert(music_pipe_next(g_mp, chunk) != NULL);
 		return true;
 	}
 
-	return ao->chunk_finished && chunk->next == NULL;
+	return ao->chunk_finished && music_pipe_next(g_mp, chunk) == NULL;
 }
 
 /**
@@ -403,7 +442,7 @@ chunk_is_consumed(const struct music_chunk *chunk)
 static void
 clear_tail_chunk(G_GNUC_UNUSED const struct music_chunk *chunk, bool *locked)
 {
-	assert(chunk->next == NULL);
+	assert(music_pipe_next(g_mp, chunk) == NULL);
 	assert(music_pipe_contains(g_mp, chunk));
 
 	for (unsigned i = 0; i < num_audio_outputs; ++i) {
@@ -432,14 +471,33 @@ audio_output_all_check(void)
 	bool is_tail;
 	struct music_chunk *shifted;
 	bool locked[num_audio_outputs];
+	bool idle;
+	gint mask;
 
 	assert(g_music_buffer != NULL);
 	assert(g_mp != NULL);
 
-	while ((chunk = music_pipe_peek(g_mp)) != NULL) {
+	chunk = music_pipe_peek(g_mp);
+	if (chunk == NULL)
+		return 0;
+
+	mask = audio_output_all_consumers(&idle);
+	if (idle)
+		/* at least one output has not started playing yet */
+		return music_pipe_size(g_mp);
+
+	do {
 		assert(!music_pipe_empty(g_mp));
 
-		if (!chunk_is_consumed(chunk))
+		is_tail = music_pipe_next(g_mp, chunk) == NULL;
+
+		/* the outputs clear their bit in a chunk when they
+		   move on to the next one; only the tail chunk, which
+		   they are still positioned on, needs to be checked
+		   the hard way */
+		if (is_tail
+		    ? !chunk_is_consumed(chunk)
+		    : (g_atomic_int_get(&chunk->consumers) & mask) != 0)
 			/* at least one output is not finished playing
 			   this chunk */
 			return music_pipe_size(g_mp);
@@ -449,7 +507,6 @@ audio_output_all_check(void)
 			   provides a defined value */
 			audio_output_all_elapsed_time = chunk->times;
 
-		is_tail = chunk->next == NULL;
 		if (is_tail)
 			/* this is the tail of the pipe - clear the
 			   chunk reference in all outputs */
@@ -468,7 +525,7 @@ audio_output_all_check(void)
 
 		/* return the chunk to the buffer */
 		music_buffer_return(g_music_buffer, shifted);
-	}
+	} while ((chunk = music_pipe_peek(g_mp)) != NULL);
 
 	return 0;
 }
@@ -22,6 +22,7 @@
 #include "output_api.h"
 #include "output_internal.h"
 #include "output_thread.h"
+#include "output_stage.h"
 #include "mixer_control.h"
 #include "mixer_plugin.h"
 #include "filter_plugin.h"
@@ -322,13 +323,7 @@ void audio_output_finish(struct audio_output *ao)
 	g_cond_free(ao->cond);
 	g_mutex_free(ao->mutex);
 
-	if (ao->replay_gain_filter != NULL)
-		filter_free(ao->replay_gain_filter);
-
-	if (ao->other_replay_gain_filter != NULL)
-		filter_free(ao->other_replay_gain_filter);
+	output_stage_put(ao->stage, ao->stage_member);
 
 	filter_free(ao->filter);
-
-	pcm_buffer_deinit(&ao->cross_fade_buffer);
 }
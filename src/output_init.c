@@ -22,16 +22,16 @@
 #include "output_api.h"
 #include "output_internal.h"
 #include "output_list.h"
+#include "output_stage.h"
 #include "audio_parser.h"
+#include "conf.h"
 #include "mixer_control.h"
 #include "mixer_type.h"
 #include "mixer_list.h"
 #include "mixer/software_mixer_plugin.h"
 #include "filter_plugin.h"
 #include "filter_registry.h"
-#include "filter_config.h"
 #include "filter/chain_filter_plugin.h"
-#include "filter/autoconvert_filter_plugin.h"
 #include "filter/replay_gain_filter_plugin.h"
 
 #include <glib.h>
@@ -44,7 +44,6 @@
 #define AUDIO_OUTPUT_TYPE	"type"
 #define AUDIO_OUTPUT_NAME	"name"
 #define AUDIO_OUTPUT_FORMAT	"format"
-#define AUDIO_FILTERS		"filters"
 
 static const struct audio_output_plugin *
 audio_output_detect(GError **error)
@@ -195,60 +194,14 @@ audio_output_init(struct audio_output *ao, const struct config_param *param,
 	ao->pause = false;
 	ao->fail_timer = NULL;
 
-	pcm_buffer_init(&ao->cross_fade_buffer);
+	/* set up the filter pipeline */
 
-	/* set up the filter chain */
+	ao->stage = output_stage_get(param, &ao->stage_member);
+	assert(ao->stage != NULL);
 
 	ao->filter = filter_chain_new();
 	assert(ao->filter != NULL);
 
-	/* create the replay_gain filter */
-
-	const char *replay_gain_handler =
-		config_get_block_string(param, "replay_gain_handler",
-					"software");
-
-	if (strcmp(replay_gain_handler, "none") != 0) {
-		ao->replay_gain_filter = filter_new(&replay_gain_filter_plugin,
-						    param, NULL);
-		assert(ao->replay_gain_filter != NULL);
-
-		ao->replay_gain_serial = 0;
-
-		ao->other_replay_gain_filter = filter_new(&replay_gain_filter_plugin,
-							  param, NULL);
-		assert(ao->other_replay_gain_filter != NULL);
-
-		ao->other_replay_gain_serial = 0;
-	} else {
-		ao->replay_gain_filter = NULL;
-		ao->other_replay_gain_filter = NULL;
-	}
-
-	/* create the normalization filter (if configured) */
-
-	if (config_get_bool(CONF_VOLUME_NORMALIZATION, false)) {
-		struct filter *normalize_filter =
-			filter_new(&normalize_filter_plugin, NULL, NULL);
-		assert(normalize_filter != NULL);
-
-		filter_chain_append(ao->filter,
-				    autoconvert_filter_new(normalize_filter));
-	}
-
-	filter_chain_parse(ao->filter,
-	                   config_get_block_string(param, AUDIO_FILTERS, ""),
-	                   &error
-	);
-
-	// It's not really fatal - Part of the filter chain has been set up already
-	// and even an empty one will work (if only with unexpected behaviour)
-	if (error != NULL) {
-		g_warning("Failed to initialize filter chain for '%s': %s",
-			  ao->name, error->message);
-		g_error_free(error);
-	}
-
 	ao->thread = NULL;
 	ao->command = AO_COMMAND_NONE;
 	ao->mutex = g_mutex_new();
@@ -272,14 +225,18 @@ audio_output_init(struct audio_output *ao, const struct config_param *param,
 
 	/* use the hardware mixer for replay gain? */
 
+	const char *replay_gain_handler =
+		config_get_block_string(param, "replay_gain_handler",
+					"software");
+
 	if (strcmp(replay_gain_handler, "mixer") == 0) {
 		if (ao->mixer != NULL)
-			replay_gain_filter_set_mixer(ao->replay_gain_filter,
+			replay_gain_filter_set_mixer(output_stage_get_replay_gain_filter(ao->stage),
 						     ao->mixer, 100);
 		else
 			g_warning("No such mixer for output '%s'", ao->name);
 	} else if (strcmp(replay_gain_handler, "software") != 0 &&
-		   ao->replay_gain_filter != NULL) {
+		   strcmp(replay_gain_handler, "none") != 0) {
 		g_set_error(error_r, audio_output_quark(), 0,
 			    "Invalid \"replay_gain_handler\" value");
 		return false;
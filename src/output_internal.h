@@ -21,7 +21,6 @@
 #define MPD_OUTPUT_INTERNAL_H
 
 #include "audio_format.h"
-#include "pcm_buffer.h"
 
 #include <glib.h>
 
@@ -136,40 +135,23 @@ struct audio_output {
 	struct audio_format out_audio_format;
 
 	/**
-	 * The buffer used to allocate the cross-fading result.
+	 * The shared part of the filter pipeline: replay gain,
+	 * cross-fading, normalization and the configured filters.
+	 * Outputs with the same configuration share one stage.
 	 */
-	struct pcm_buffer cross_fade_buffer;
+	struct output_stage *stage;
 
 	/**
-	 * The filter object of this audio output.  This is an
-	 * instance of chain_filter_plugin.
+	 * This output's member id within #stage.
 	 */
-	struct filter *filter;
-
-	/**
-	 * The replay_gain_filter_plugin instance of this audio
-	 * output.
-	 */
-	struct filter *replay_gain_filter;
-
-	/**
-	 * The serial number of the last replay gain info.  0 means no
-	 * replay gain info was available.
-	 */
-	unsigned replay_gain_serial;
+	unsigned stage_member;
 
 	/**
-	 * The replay_gain_filter_plugin instance of this audio
-	 * output, to be applied to the second chunk during
-	 * cross-fading.
+	 * The filter object of this audio output, applied after
+	 * #stage.  This is an instance of chain_filter_plugin, and
+	 * contains the software volume filter and the convert filter.
 	 */
-	struct filter *other_replay_gain_filter;
-
-	/**
-	 * The serial number of the last replay gain info by the
-	 * "other" chunk during cross-fading.
-	 */
-	unsigned other_replay_gain_serial;
+	struct filter *filter;
 
 	/**
 	 * The convert_filter_plugin instance of this audio output.
@@ -225,6 +207,11 @@ struct audio_output {
 	 * Has the output finished playing #chunk?
 	 */
 	bool chunk_finished;
+
+	/**
+	 * The bit of this output in music_chunk.consumers.
+	 */
+	gint consumer_mask;
 };
 
 /**
@@ -38,6 +38,7 @@ extern const struct audio_output_plugin mvp_output_plugin;
 extern const struct audio_output_plugin jack_output_plugin;
 extern const struct audio_output_plugin httpd_output_plugin;
 extern const struct audio_output_plugin recorder_output_plugin;
+extern const struct audio_output_plugin hls_output_plugin;
 extern const struct audio_output_plugin winmm_output_plugin;
 extern const struct audio_output_plugin ffado_output_plugin;
 
@@ -91,6 +92,9 @@ const struct audio_output_plugin *audio_output_plugins[] = {
 #ifdef ENABLE_RECORDER_OUTPUT
 	&recorder_output_plugin,
 #endif
+#ifdef ENABLE_HLS_OUTPUT
+	&hls_output_plugin,
+#endif
 #ifdef ENABLE_WINMM_OUTPUT
 	&winmm_output_plugin,
 #endif
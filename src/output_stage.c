@@ -0,0 +1,1023 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "output_stage.h"
+#include "audio_format.h"
+#include "chunk.h"
+#include "conf.h"
+#include "locked_memory.h"
+#include "pcm_buffer.h"
+#include "pcm_mix.h"
+#include "filter_plugin.h"
+#include "filter_config.h"
+#include "filter/chain_filter_plugin.h"
+#include "filter/autoconvert_filter_plugin.h"
+#include "filter/replay_gain_filter_plugin.h"
+
+#include <assert.h>
+#include <string.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "output"
+
+enum {
+	/**
+	 * The maximum number of outputs sharing one stage.  Member
+	 * sets are stored in a 32 bit mask.
+	 */
+	OUTPUT_STAGE_MAX_MEMBERS = 32,
+
+	/**
+	 * The maximum number of freed #output_stage_result objects
+	 * kept for reuse.
+	 */
+	OUTPUT_STAGE_MAX_FREE_RESULTS = 16,
+};
+
+/**
+ * The filtered data of one #music_chunk, kept until all members have
+ * fetched it.
+ */
+struct output_stage_result {
+	const struct music_chunk *chunk;
+
+	/**
+	 * The filters which produced this result.
+	 */
+	const struct output_stage_filters *filters;
+
+	/**
+	 * A copy of the filtered data.  This buffer is reused when
+	 * the object is recycled.
+	 */
+	void *data;
+
+	/**
+	 * The allocated size of #data.
+	 */
+	size_t capacity;
+
+	size_t length;
+
+	/**
+	 * The set of open members which have not yet fetched this
+	 * result.
+	 */
+	guint32 pending;
+
+	/**
+	 * The number of members which are currently playing this
+	 * result (see output_stage.current).
+	 */
+	unsigned users;
+};
+
+/**
+ * One instance of the stage's filters, opened with one audio format.
+ * Usually, all members use the same instance; while they are being
+ * reopened with a new audio format one after another, the members
+ * which have not been reopened yet keep using the instance which was
+ * opened with the old format.
+ */
+struct output_stage_filters {
+	/**
+	 * The set of open members using these filters.  The filters
+	 * are open if this is non-zero.
+	 */
+	guint32 members;
+
+	/**
+	 * The members which have called output_stage_cancel() since
+	 * these filters were used the last time.
+	 */
+	guint32 cancelled;
+
+	/**
+	 * The replay_gain_filter_plugin instance.
+	 */
+	struct filter *replay_gain_filter;
+
+	/**
+	 * The serial number of the last replay gain info.  0 means no
+	 * replay gain info was available.
+	 */
+	unsigned replay_gain_serial;
+
+	/**
+	 * The replay_gain_filter_plugin instance to be applied to
+	 * the second chunk during cross-fading.
+	 */
+	struct filter *other_replay_gain_filter;
+
+	/**
+	 * The serial number of the last replay gain info by the
+	 * "other" chunk during cross-fading.
+	 */
+	unsigned other_replay_gain_serial;
+
+	/**
+	 * The filter chain (normalization and the configured
+	 * "filters").  This is an instance of chain_filter_plugin.
+	 */
+	struct filter *filter;
+
+	/**
+	 * The audio format passed to output_stage_open() when these
+	 * filters were opened.  Members opening with the same format
+	 * will share them.
+	 */
+	struct audio_format request_audio_format;
+
+	/**
+	 * The input audio format, after the filters have modified it.
+	 */
+	struct audio_format in_audio_format;
+
+	/**
+	 * The output audio format of #filter.
+	 */
+	struct audio_format out_audio_format;
+};
+
+struct output_stage {
+	/**
+	 * The configuration key which identifies equivalent stages.
+	 * NULL if this stage must not be shared.
+	 */
+	char *key;
+
+	/**
+	 * The configuration block of the first member.  It is used
+	 * to create more #output_stage_filters instances.
+	 */
+	const struct config_param *param;
+
+	/**
+	 * The set of registered members.
+	 */
+	guint32 members;
+
+	/**
+	 * The set of members which have opened this stage.
+	 */
+	guint32 open_members;
+
+	/**
+	 * This mutex protects all attributes below; it is locked
+	 * while filtering a chunk, so all members see the filters'
+	 * state advance exactly once per chunk.
+	 */
+	GMutex *mutex;
+
+	/**
+	 * A list of #output_stage_filters objects.  The first one
+	 * is created with the stage; more are created when members
+	 * open the stage with different audio formats at the same
+	 * time.  Instances without members are closed, and are
+	 * reused by the next output_stage_open() call which needs
+	 * new filters.
+	 */
+	GSList *filters;
+
+	/**
+	 * The filters used by each open member.
+	 */
+	struct output_stage_filters *member_filters[OUTPUT_STAGE_MAX_MEMBERS];
+
+	/**
+	 * The buffer used to allocate the cross-fading result.
+	 */
+	struct pcm_buffer cross_fade_buffer;
+
+	/**
+	 * A memory-locked replacement for #cross_fade_buffer, which
+	 * is large enough for any chunk.  Its data pointer is NULL
+	 * unless "audio_buffer_lock" is enabled.  It is allocated by
+	 * the first output_stage_open() call, i.e. in an output
+	 * thread after MPD has daemonized, because memory locks are
+	 * not inherited by fork().
+	 */
+	struct locked_memory locked_cross_fade_buffer;
+
+	/**
+	 * A list of #output_stage_result objects, oldest first.  Only
+	 * used if the stage is shared.
+	 */
+	GQueue *results;
+
+	/**
+	 * Freed #output_stage_result objects, kept for reuse with
+	 * their buffers, so filtering a chunk does not allocate
+	 * memory.
+	 */
+	GSList *free_results;
+
+	unsigned num_free_results;
+
+	/**
+	 * The result which is currently being played by each member.
+	 */
+	struct output_stage_result *current[OUTPUT_STAGE_MAX_MEMBERS];
+};
+
+/**
+ * A list of all #output_stage objects.
+ */
+static GSList *output_stages;
+
+static inline guint32
+output_stage_bit(unsigned member)
+{
+	assert(member < OUTPUT_STAGE_MAX_MEMBERS);
+
+	return (guint32)1 << member;
+}
+
+static inline GQuark
+output_stage_quark(void)
+{
+	return g_quark_from_static_string("output_stage");
+}
+
+/**
+ * Is this stage used by more than one output?
+ */
+static inline bool
+output_stage_is_shared(const struct output_stage *stage)
+{
+	return (stage->members & (stage->members - 1)) != 0;
+}
+
+/**
+ * Determines the key for sharing the stage of the specified
+ * configuration block.  Returns NULL if it must not be shared.
+ */
+static char *
+output_stage_make_key(const struct config_param *param)
+{
+	const char *replay_gain_handler =
+		config_get_block_string(param, "replay_gain_handler",
+					"software");
+
+	if (strcmp(replay_gain_handler, "mixer") == 0)
+		/* replay gain is applied with the output's own
+		   hardware mixer */
+		return NULL;
+
+	return g_strconcat(replay_gain_handler, "\n",
+			   config_get_block_string(param, "filters", ""),
+			   NULL);
+}
+
+static struct output_stage_filters *
+output_stage_filters_new(const struct config_param *param)
+{
+	struct output_stage_filters *f = g_new(struct output_stage_filters, 1);
+	GError *error = NULL;
+
+	f->members = 0;
+	f->cancelled = 0;
+
+	/* create the replay_gain filter */
+
+	const char *replay_gain_handler =
+		config_get_block_string(param, "replay_gain_handler",
+					"software");
+
+	if (strcmp(replay_gain_handler, "none") != 0) {
+		f->replay_gain_filter =
+			filter_new(&replay_gain_filter_plugin, param, NULL);
+		assert(f->replay_gain_filter != NULL);
+
+		f->replay_gain_serial = 0;
+
+		f->other_replay_gain_filter =
+			filter_new(&replay_gain_filter_plugin, param, NULL);
+		assert(f->other_replay_gain_filter != NULL);
+
+		f->other_replay_gain_serial = 0;
+	} else {
+		f->replay_gain_filter = NULL;
+		f->other_replay_gain_filter = NULL;
+	}
+
+	/* set up the filter chain */
+
+	f->filter = filter_chain_new();
+	assert(f->filter != NULL);
+
+	/* create the normalization filter (if configured) */
+
+	if (config_get_bool(CONF_VOLUME_NORMALIZATION, false)) {
+		struct filter *normalize_filter =
+			filter_new(&normalize_filter_plugin, NULL, NULL);
+		assert(normalize_filter != NULL);
+
+		filter_chain_append(f->filter,
+				    autoconvert_filter_new(normalize_filter));
+	}
+
+	filter_chain_parse(f->filter,
+			   config_get_block_string(param, "filters", ""),
+			   &error);
+
+	/* It's not really fatal - Part of the filter chain has been
+	   set up already and even an empty one will work (if only
+	   with unexpected behaviour) */
+	if (error != NULL) {
+		g_warning("Failed to initialize filter chain for '%s': %s",
+			  config_get_block_string(param, "name", ""),
+			  error->message);
+		g_error_free(error);
+	}
+
+	return f;
+}
+
+static void
+output_stage_filters_free(struct output_stage_filters *f)
+{
+	assert(f->members == 0);
+
+	if (f->replay_gain_filter != NULL)
+		filter_free(f->replay_gain_filter);
+
+	if (f->other_replay_gain_filter != NULL)
+		filter_free(f->other_replay_gain_filter);
+
+	filter_free(f->filter);
+	g_free(f);
+}
+
+static struct output_stage *
+output_stage_new(const struct config_param *param, char *key)
+{
+	struct output_stage *stage = g_new(struct output_stage, 1);
+
+	stage->key = key;
+	stage->param = param;
+	stage->members = 0;
+	stage->open_members = 0;
+	stage->mutex = g_mutex_new();
+	stage->results = g_queue_new();
+	stage->free_results = NULL;
+	stage->num_free_results = 0;
+	memset(stage->current, 0, sizeof(stage->current));
+
+	pcm_buffer_init(&stage->cross_fade_buffer);
+
+	stage->locked_cross_fade_buffer.data = NULL;
+
+	stage->filters = g_slist_prepend(NULL, output_stage_filters_new(param));
+
+	return stage;
+}
+
+static void
+output_stage_free(struct output_stage *stage)
+{
+	assert(stage->members == 0);
+	assert(stage->open_members == 0);
+	assert(g_queue_is_empty(stage->results));
+
+	for (GSList *i = stage->free_results; i != NULL; i = g_slist_next(i)) {
+		struct output_stage_result *result = i->data;
+		g_free(result->data);
+		g_free(result);
+	}
+
+	g_slist_free(stage->free_results);
+
+	for (GSList *i = stage->filters; i != NULL; i = g_slist_next(i))
+		output_stage_filters_free(i->data);
+
+	g_slist_free(stage->filters);
+
+	pcm_buffer_deinit(&stage->cross_fade_buffer);
+
+	if (stage->locked_cross_fade_buffer.data != NULL)
+		locked_memory_free(&stage->locked_cross_fade_buffer);
+
+	g_queue_free(stage->results);
+	g_mutex_free(stage->mutex);
+	g_free(stage->key);
+	g_free(stage);
+}
+
+struct output_stage *
+output_stage_get(const struct config_param *param, unsigned *member_r)
+{
+	char *key = output_stage_make_key(param);
+	struct output_stage *stage = NULL;
+
+	if (key != NULL) {
+		for (GSList *i = output_stages; i != NULL;
+		     i = g_slist_next(i)) {
+			struct output_stage *s = i->data;
+
+			if (s->key != NULL && strcmp(s->key, key) == 0 &&
+			    s->members != G_MAXUINT32) {
+				stage = s;
+				break;
+			}
+		}
+	}
+
+	if (stage == NULL) {
+		stage = output_stage_new(param, key);
+		output_stages = g_slist_prepend(output_stages, stage);
+	} else {
+		g_free(key);
+		g_debug("sharing filters with another output");
+	}
+
+	unsigned member = 0;
+	while (stage->members & output_stage_bit(member))
+		++member;
+
+	stage->members |= output_stage_bit(member);
+	*member_r = member;
+	return stage;
+}
+
+void
+output_stage_put(struct output_stage *stage, unsigned member)
+{
+	assert(stage->members & output_stage_bit(member));
+	assert(!(stage->open_members & output_stage_bit(member)));
+
+	stage->members &= ~output_stage_bit(member);
+	if (stage->members != 0)
+		return;
+
+	output_stages = g_slist_remove(output_stages, stage);
+	output_stage_free(stage);
+}
+
+struct filter *
+output_stage_get_replay_gain_filter(struct output_stage *stage)
+{
+	assert(!output_stage_is_shared(stage));
+
+	/* a stage which is not shared never needs more than the
+	   first filters instance */
+	const struct output_stage_filters *f = stage->filters->data;
+	return f->replay_gain_filter;
+}
+
+/**
+ * Allocates a result object with a buffer of at least the specified
+ * size, preferably by recycling a freed one.
+ */
+static struct output_stage_result *
+output_stage_result_new(struct output_stage *stage, size_t length)
+{
+	struct output_stage_result *result;
+
+	if (stage->free_results != NULL) {
+		result = stage->free_results->data;
+		stage->free_results =
+			g_slist_delete_link(stage->free_results,
+					    stage->free_results);
+		--stage->num_free_results;
+	} else {
+		result = g_new(struct output_stage_result, 1);
+		result->data = NULL;
+		result->capacity = 0;
+	}
+
+	if (length > result->capacity) {
+		g_free(result->data);
+		result->data = g_malloc(length);
+		result->capacity = length;
+	}
+
+	return result;
+}
+
+static void
+output_stage_result_free(struct output_stage *stage,
+			 struct output_stage_result *result)
+{
+	if (stage->num_free_results < OUTPUT_STAGE_MAX_FREE_RESULTS) {
+		stage->free_results = g_slist_prepend(stage->free_results,
+						      result);
+		++stage->num_free_results;
+	} else {
+		g_free(result->data);
+		g_free(result);
+	}
+}
+
+/**
+ * Frees all results which are neither pending nor in use.
+ */
+static void
+output_stage_purge(struct output_stage *stage)
+{
+	GList *i = stage->results->head;
+
+	while (i != NULL) {
+		struct output_stage_result *result = i->data;
+		GList *next = i->next;
+
+		if (result->pending == 0 && result->users == 0) {
+			g_queue_delete_link(stage->results, i);
+			output_stage_result_free(stage, result);
+		}
+
+		i = next;
+	}
+}
+
+/**
+ * The member stops using its current result.
+ */
+static void
+output_stage_release(struct output_stage *stage, unsigned member)
+{
+	struct output_stage_result *result = stage->current[member];
+
+	if (result == NULL)
+		return;
+
+	stage->current[member] = NULL;
+
+	assert(result->users > 0);
+	if (--result->users == 0 && result->pending == 0) {
+		g_queue_remove(stage->results, result);
+		output_stage_result_free(stage, result);
+	}
+}
+
+/**
+ * Removes the specified members from the "pending" sets of all
+ * results.
+ */
+static void
+output_stage_drop_pending(struct output_stage *stage, guint32 mask)
+{
+	for (GList *i = stage->results->head; i != NULL; i = i->next) {
+		struct output_stage_result *result = i->data;
+
+		result->pending &= ~mask;
+	}
+
+	output_stage_purge(stage);
+}
+
+static void
+output_stage_filters_close(struct output_stage_filters *f)
+{
+	if (f->replay_gain_filter != NULL)
+		filter_close(f->replay_gain_filter);
+	if (f->other_replay_gain_filter != NULL)
+		filter_close(f->other_replay_gain_filter);
+
+	filter_close(f->filter);
+}
+
+static bool
+output_stage_filters_open(struct output_stage_filters *f,
+			  struct audio_format *audio_format,
+			  GError **error_r)
+{
+	assert(f->members == 0);
+	assert(audio_format_valid(audio_format));
+
+	const struct audio_format request_audio_format = *audio_format;
+
+	/* the replay_gain filter cannot fail here */
+	if (f->replay_gain_filter != NULL)
+		filter_open(f->replay_gain_filter, audio_format, error_r);
+	if (f->other_replay_gain_filter != NULL)
+		filter_open(f->other_replay_gain_filter, audio_format,
+			    error_r);
+
+	const struct audio_format *af
+		= filter_open(f->filter, audio_format, error_r);
+	if (af == NULL) {
+		if (f->replay_gain_filter != NULL)
+			filter_close(f->replay_gain_filter);
+		if (f->other_replay_gain_filter != NULL)
+			filter_close(f->other_replay_gain_filter);
+		return false;
+	}
+
+	f->request_audio_format = request_audio_format;
+	f->in_audio_format = *audio_format;
+	f->out_audio_format = *af;
+	f->cancelled = 0;
+	return true;
+}
+
+/**
+ * Returns filters for the specified audio format: open filters which
+ * other members use with the same format, or a closed instance which
+ * can be opened (possibly a new one).  The caller must hold the lock.
+ */
+static struct output_stage_filters *
+output_stage_filters_get(struct output_stage *stage,
+			 const struct audio_format *audio_format)
+{
+	struct output_stage_filters *closed = NULL;
+
+	for (GSList *i = stage->filters; i != NULL; i = g_slist_next(i)) {
+		struct output_stage_filters *f = i->data;
+
+		if (f->members == 0) {
+			if (closed == NULL)
+				closed = f;
+		} else if (audio_format_equals(audio_format,
+					       &f->request_audio_format))
+			return f;
+	}
+
+	if (closed == NULL) {
+		closed = output_stage_filters_new(stage->param);
+		stage->filters = g_slist_append(stage->filters, closed);
+	}
+
+	return closed;
+}
+
+const struct audio_format *
+output_stage_open(struct output_stage *stage, unsigned member,
+		  struct audio_format *audio_format,
+		  GError **error_r)
+{
+	const guint32 bit = output_stage_bit(member);
+
+	g_mutex_lock(stage->mutex);
+
+	assert(stage->members & bit);
+	assert(!(stage->open_members & bit));
+	assert(stage->current[member] == NULL);
+
+	if (locked_memory_enabled() &&
+	    stage->locked_cross_fade_buffer.data == NULL)
+		locked_memory_alloc(&stage->locked_cross_fade_buffer,
+				    CHUNK_SIZE_MAX);
+
+	/* members which are still open with another audio format
+	   keep their filters; they will usually be reopened with
+	   the new format soon, and then join this member */
+	struct output_stage_filters *f =
+		output_stage_filters_get(stage, audio_format);
+	if (f->members != 0) {
+		/* already open with this audio format */
+		*audio_format = f->in_audio_format;
+	} else if (!output_stage_filters_open(f, audio_format, error_r)) {
+		g_mutex_unlock(stage->mutex);
+		return NULL;
+	}
+
+	f->members |= bit;
+	stage->member_filters[member] = f;
+	stage->open_members |= bit;
+	g_mutex_unlock(stage->mutex);
+	return &f->out_audio_format;
+}
+
+void
+output_stage_close(struct output_stage *stage, unsigned member)
+{
+	const guint32 bit = output_stage_bit(member);
+
+	g_mutex_lock(stage->mutex);
+
+	output_stage_release(stage, member);
+
+	if (stage->open_members & bit) {
+		struct output_stage_filters *f = stage->member_filters[member];
+
+		stage->open_members &= ~bit;
+		stage->member_filters[member] = NULL;
+		output_stage_drop_pending(stage, bit);
+
+		f->members &= ~bit;
+		f->cancelled &= ~bit;
+		if (f->members == 0)
+			output_stage_filters_close(f);
+	}
+
+	g_mutex_unlock(stage->mutex);
+}
+
+void
+output_stage_cancel(struct output_stage *stage, unsigned member)
+{
+	const guint32 bit = output_stage_bit(member);
+
+	g_mutex_lock(stage->mutex);
+
+	assert(stage->open_members & bit);
+
+	output_stage_release(stage, member);
+
+	/* this member discards the rest of the pipe; the other
+	   members may still fetch their pending results */
+	output_stage_drop_pending(stage, bit);
+
+	/* the data buffered inside the filters belongs to the
+	   discarded chunks, but other members may still need the
+	   filters' state; reset them only after all of their
+	   members have cancelled */
+	struct output_stage_filters *f = stage->member_filters[member];
+	f->cancelled |= bit;
+	if (f->cancelled == f->members) {
+		filter_reset(f->filter);
+		f->cancelled = 0;
+	}
+
+	g_mutex_unlock(stage->mutex);
+}
+
+static const char *
+output_stage_chunk_data(const struct output_stage_filters *f,
+			const struct music_chunk *chunk,
+			struct filter *replay_gain_filter,
+			unsigned *replay_gain_serial_p,
+			size_t *length_r, GError **error_r)
+{
+	assert(chunk != NULL);
+	assert(!music_chunk_is_empty(chunk));
+	assert(music_chunk_check_format(chunk, &f->in_audio_format));
+
+	const char *data = chunk->data;
+	size_t length = chunk->length;
+
+	assert(length % audio_format_frame_size(&f->in_audio_format) == 0);
+
+	if (length > 0 && replay_gain_filter != NULL) {
+		if (chunk->replay_gain_serial != *replay_gain_serial_p) {
+			replay_gain_filter_set_info(replay_gain_filter,
+						    chunk->replay_gain_serial != 0
+						    ? &chunk->replay_gain_info
+						    : NULL);
+			*replay_gain_serial_p = chunk->replay_gain_serial;
+		}
+
+		data = filter_filter(replay_gain_filter, data, length,
+				     &length, error_r);
+		if (data == NULL)
+			return NULL;
+	}
+
+	*length_r = length;
+	return data;
+}
+
+/**
+ * Runs the chunk through the specified filters of this stage.  The
+ * caller must hold the lock.
+ */
+static const char *
+output_stage_filter_chunk(struct output_stage *stage,
+			  struct output_stage_filters *f,
+			  const struct music_chunk *chunk,
+			  size_t *length_r, GError **error_r)
+{
+	/* the filters are in use again */
+	f->cancelled = 0;
+
+	size_t length;
+	const char *data =
+		output_stage_chunk_data(f, chunk,
+					f->replay_gain_filter,
+					&f->replay_gain_serial,
+					&length, error_r);
+	if (data == NULL)
+		return NULL;
+
+	if (length == 0) {
+		/* empty chunk, nothing to do */
+		*length_r = 0;
+		return data;
+	}
+
+	/* cross-fade */
+
+	if (chunk->other != NULL) {
+		size_t other_length;
+		const char *other_data =
+			output_stage_chunk_data(f, chunk->other,
+						f->other_replay_gain_filter,
+						&f->other_replay_gain_serial,
+						&other_length, error_r);
+		if (other_data == NULL)
+			return NULL;
+
+		if (other_length == 0) {
+			*length_r = 0;
+			return data;
+		}
+
+		/* if the "other" chunk is longer, then that trailer
+		   is used as-is, without mixing; it is part of the
+		   "next" song being faded in, and if there's a rest,
+		   it means cross-fading ends here */
+
+		if (length > other_length)
+			length = other_length;
+
+		char *dest = stage->locked_cross_fade_buffer.data != NULL &&
+			other_length <= stage->locked_cross_fade_buffer.size
+			? stage->locked_cross_fade_buffer.data
+			: pcm_buffer_get(&stage->cross_fade_buffer,
+					 other_length);
+		memcpy(dest, other_data, other_length);
+		pcm_mix(dest, data, length, &f->in_audio_format,
+			1.0 - chunk->mix_ratio);
+
+		data = dest;
+		length = other_length;
+	}
+
+	/* apply filter chain */
+
+	data = filter_filter(f->filter, data, length, &length, error_r);
+	if (data == NULL)
+		return NULL;
+
+	*length_r = length;
+	return data;
+}
+
+static struct output_stage_result *
+output_stage_find(const struct output_stage *stage,
+		  const struct music_chunk *chunk,
+		  const struct output_stage_filters *f)
+{
+	for (GList *i = stage->results->head; i != NULL; i = i->next) {
+		struct output_stage_result *result = i->data;
+
+		if (result->chunk == chunk && result->filters == f)
+			return result;
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates a result object with a copy of the specified data, pending
+ * for all members of the filters.  The caller must hold the lock.
+ */
+static struct output_stage_result *
+output_stage_add_result(struct output_stage *stage,
+			const struct output_stage_filters *f,
+			const struct music_chunk *chunk,
+			const void *data, size_t length)
+{
+	struct output_stage_result *result =
+		output_stage_result_new(stage, length);
+
+	result->chunk = chunk;
+	result->filters = f;
+	if (length > 0)
+		memcpy(result->data, data, length);
+	result->length = length;
+	result->pending = f->members;
+	result->users = 0;
+	g_queue_push_tail(stage->results, result);
+	return result;
+}
+
+/**
+ * The member fetches a result; it is kept until the member's next
+ * call.  The caller must hold the lock.
+ */
+static void
+output_stage_use_result(struct output_stage *stage, unsigned member,
+			struct output_stage_result *result)
+{
+	result->pending &= ~output_stage_bit(member);
+	++result->users;
+	stage->current[member] = result;
+}
+
+const void *
+output_stage_filter(struct output_stage *stage, unsigned member,
+		    const struct music_chunk *chunk, size_t *length_r,
+		    GError **error_r)
+{
+	const guint32 bit = output_stage_bit(member);
+	const void *data;
+
+	g_mutex_lock(stage->mutex);
+
+	assert(stage->open_members & bit);
+
+	output_stage_release(stage, member);
+
+	struct output_stage_filters *f = stage->member_filters[member];
+
+	if (!output_stage_is_shared(stage)) {
+		/* fast path: nobody to share the result with */
+		data = output_stage_filter_chunk(stage, f, chunk, length_r,
+						 error_r);
+		g_mutex_unlock(stage->mutex);
+		return data;
+	}
+
+	struct output_stage_result *result =
+		output_stage_find(stage, chunk, f);
+	if (result == NULL) {
+		/* this member is the first one to see this chunk:
+		   filter it and keep a copy for the others */
+		size_t length;
+		data = output_stage_filter_chunk(stage, f, chunk, &length,
+						 error_r);
+		if (data == NULL) {
+			g_mutex_unlock(stage->mutex);
+			return NULL;
+		}
+
+		result = output_stage_add_result(stage, f, chunk,
+						 data, length);
+	}
+
+	output_stage_use_result(stage, member, result);
+
+	g_mutex_unlock(stage->mutex);
+
+	*length_r = result->length;
+	return result->length > 0
+		? result->data
+		: (const void *)chunk->data;
+}
+
+const void *
+output_stage_flush(struct output_stage *stage, unsigned member,
+		   size_t *length_r, GError **error_r)
+{
+	const guint32 bit = output_stage_bit(member);
+	struct output_stage_result *result = NULL;
+	const void *data;
+
+	g_mutex_lock(stage->mutex);
+
+	assert(stage->open_members & bit);
+
+	output_stage_release(stage, member);
+
+	struct output_stage_filters *f = stage->member_filters[member];
+
+	if (!output_stage_is_shared(stage)) {
+		data = filter_flush(f->filter, length_r, error_r);
+		g_mutex_unlock(stage->mutex);
+		return data;
+	}
+
+	/* the flushed data is stored as a result without a chunk;
+	   look for one which this member has not fetched yet */
+
+	for (GList *i = stage->results->head; i != NULL; i = i->next) {
+		struct output_stage_result *r = i->data;
+
+		if (r->chunk == NULL && r->filters == f &&
+		    (r->pending & bit) != 0) {
+			result = r;
+			break;
+		}
+	}
+
+	if (result == NULL) {
+		size_t length;
+		data = filter_flush(f->filter, &length, error_r);
+		if (data == NULL) {
+			g_mutex_unlock(stage->mutex);
+			return NULL;
+		}
+
+		result = output_stage_add_result(stage, f, NULL,
+						 data, length);
+	}
+
+	output_stage_use_result(stage, member, result);
+
+	g_mutex_unlock(stage->mutex);
+
+	*length_r = result->length;
+	return result->length > 0
+		? result->data
+		: (const void *)filter_empty_buffer;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * The "stage" is the part of an audio output's filter pipeline which
+ * does not depend on the output device: replay gain, cross-fading,
+ * volume normalization and the configured "filters".  Outputs with
+ * an identical configuration share one stage object, and each
+ * #music_chunk is filtered only once for all of them.
+ */
+
+#ifndef MPD_OUTPUT_STAGE_H
+#define MPD_OUTPUT_STAGE_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct config_param;
+struct audio_format;
+struct music_chunk;
+struct filter;
+
+struct output_stage;
+
+/**
+ * Looks up an existing stage with the same configuration, or creates
+ * a new one, and registers a new member.
+ *
+ * @param param the output's configuration block (may be NULL)
+ * @param member_r the member id of the caller is returned here; it
+ * must be passed to all other functions
+ * @return the stage object
+ */
+struct output_stage *
+output_stage_get(const struct config_param *param, unsigned *member_r);
+
+/**
+ * Unregisters a member.  The stage is freed after the last member is
+ * gone.  The member must be closed.
+ */
+void
+output_stage_put(struct output_stage *stage, unsigned member);
+
+/**
+ * Returns the replay gain filter of this stage, or NULL if replay
+ * gain is disabled.  Only to be used for stages which are not
+ * shared, i.e. when the replay gain handler is "mixer".
+ */
+struct filter *
+output_stage_get_replay_gain_filter(struct output_stage *stage);
+
+/**
+ * Opens the stage for one member.  If other members have opened it
+ * already with the same audio format, then the filters are shared;
+ * members which are open with another audio format keep their own
+ * filters.
+ *
+ * @param audio_format the input audio format; it may be modified by
+ * the filters
+ * @return the output audio format of the stage, or NULL on error
+ */
+const struct audio_format *
+output_stage_open(struct output_stage *stage, unsigned member,
+		  struct audio_format *audio_format,
+		  GError **error_r);
+
+/**
+ * Closes the stage for one member.  The filters are closed after the
+ * last member has closed it.
+ */
+void
+output_stage_close(struct output_stage *stage, unsigned member);
+
+/**
+ * Forgets all filtered chunks which have not been consumed yet by
+ * this member.  The data buffered inside the filters is discarded
+ * after all members using them have cancelled.  This is called when
+ * the music pipe is about to be cleared.
+ */
+void
+output_stage_cancel(struct output_stage *stage, unsigned member);
+
+/**
+ * Filters a #music_chunk.  If another member has already filtered
+ * this chunk, its result is returned without filtering it again.
+ *
+ * @return the filtered data (valid until the next call by this
+ * member, output_stage_cancel() or output_stage_close()), or NULL on
+ * error
+ */
+const void *
+output_stage_filter(struct output_stage *stage, unsigned member,
+		    const struct music_chunk *chunk, size_t *length_r,
+		    GError **error_r);
+
+/**
+ * Returns the data which is still buffered inside the filters at the
+ * end of the stream (see filter_flush()).  Like the results of
+ * output_stage_filter(), the data is shared by all members.
+ *
+ * @return the remaining data (valid until the next call by this
+ * member, output_stage_cancel() or output_stage_close()),
+ * #filter_empty_buffer if nothing was buffered (#length_r is 0 then),
+ * or NULL on error
+ */
+const void *
+output_stage_flush(struct output_stage *stage, unsigned member,
+		   size_t *length_r, GError **error_r);
+
+#endif
@@ -24,12 +24,12 @@
 #include "chunk.h"
 #include "pipe.h"
 #include "player_control.h"
-#include "pcm_mix.h"
+#include "output_stage.h"
 #include "filter_plugin.h"
 #include "filter/convert_filter_plugin.h"
-#include "filter/replay_gain_filter_plugin.h"
 #include "mpd_error.h"
 #include "notify.h"
+#include "thread_policy.h"
 
 #include <glib.h>
 
@@ -98,21 +98,16 @@ ao_filter_open(struct audio_output *ao,
 {
 	assert(audio_format_valid(audio_format));
 
-	/* the replay_gain filter cannot fail here */
-	if (ao->replay_gain_filter != NULL)
-		filter_open(ao->replay_gain_filter, audio_format, error_r);
-	if (ao->other_replay_gain_filter != NULL)
-		filter_open(ao->other_replay_gain_filter, audio_format,
-			    error_r);
-
-	const struct audio_format *af
-		= filter_open(ao->filter, audio_format, error_r);
-	if (af == NULL) {
-		if (ao->replay_gain_filter != NULL)
-			filter_close(ao->replay_gain_filter);
-		if (ao->other_replay_gain_filter != NULL)
-			filter_close(ao->other_replay_gain_filter);
-	}
+	const struct audio_format *af =
+		output_stage_open(ao->stage, ao->stage_member,
+				  audio_format, error_r);
+	if (af == NULL)
+		return NULL;
+
+	struct audio_format stage_audio_format = *af;
+	af = filter_open(ao->filter, &stage_audio_format, error_r);
+	if (af == NULL)
+		output_stage_close(ao->stage, ao->stage_member);
 
 	return af;
 }
@@ -120,11 +115,7 @@ ao_filter_open(struct audio_output *ao,
 static void
 ao_filter_close(struct audio_output *ao)
 {
-	if (ao->replay_gain_filter != NULL)
-		filter_close(ao->replay_gain_filter);
-	if (ao->other_replay_gain_filter != NULL)
-		filter_close(ao->other_replay_gain_filter);
-
+	output_stage_close(ao->stage, ao->stage_member);
 	filter_close(ao->filter);
 }
 
@@ -317,57 +308,27 @@ ao_wait(struct audio_output *ao)
 }
 
 static const char *
-ao_chunk_data(struct audio_output *ao, const struct music_chunk *chunk,
-	      struct filter *replay_gain_filter,
-	      unsigned *replay_gain_serial_p,
-	      size_t *length_r)
+ao_filter_chunk(struct audio_output *ao, const struct music_chunk *chunk,
+		size_t *length_r)
 {
+	GError *error = NULL;
+
 	assert(chunk != NULL);
 	assert(!music_chunk_is_empty(chunk));
 	assert(music_chunk_check_format(chunk, &ao->in_audio_format));
 
-	const char *data = chunk->data;
-	size_t length = chunk->length;
-
-	(void)ao;
-
-	assert(length % audio_format_frame_size(&ao->in_audio_format) == 0);
-
-	if (length > 0 && replay_gain_filter != NULL) {
-		if (chunk->replay_gain_serial != *replay_gain_serial_p) {
-			replay_gain_filter_set_info(replay_gain_filter,
-						    chunk->replay_gain_serial != 0
-						    ? &chunk->replay_gain_info
-						    : NULL);
-			*replay_gain_serial_p = chunk->replay_gain_serial;
-		}
-
-		GError *error = NULL;
-		data = filter_filter(replay_gain_filter, data, length,
-				     &length, &error);
-		if (data == NULL) {
-			g_warning("\"%s\" [%s] failed to filter: %s",
-				  ao->name, ao->plugin->name, error->message);
-			g_error_free(error);
-			return NULL;
-		}
-	}
-
-	*length_r = length;
-	return data;
-}
-
-static const char *
-ao_filter_chunk(struct audio_output *ao, const struct music_chunk *chunk,
-		size_t *length_r)
-{
-	GError *error = NULL;
+	/* apply the (possibly shared) stage: replay gain,
+	   cross-fading and the configured filters */
 
 	size_t length;
-	const char *data = ao_chunk_data(ao, chunk, ao->replay_gain_filter,
-					 &ao->replay_gain_serial, &length);
-	if (data == NULL)
+	const char *data = output_stage_filter(ao->stage, ao->stage_member,
+					       chunk, &length, &error);
+	if (data == NULL) {
+		g_warning("\"%s\" [%s] failed to filter: %s",
+			  ao->name, ao->plugin->name, error->message);
+		g_error_free(error);
 		return NULL;
+	}
 
 	if (length == 0) {
 		/* empty chunk, nothing to do */
@@ -375,42 +336,7 @@ ao_filter_chunk(struct audio_output *ao, const struct music_chunk *chunk,
 		return data;
 	}
 
-	/* cross-fade */
-
-	if (chunk->other != NULL) {
-		size_t other_length;
-		const char *other_data =
-			ao_chunk_data(ao, chunk->other,
-				      ao->other_replay_gain_filter,
-				      &ao->other_replay_gain_serial,
-				      &other_length);
-		if (other_data == NULL)
-			return NULL;
-
-		if (other_length == 0) {
-			*length_r = 0;
-			return data;
-		}
-
-		/* if the "other" chunk is longer, then that trailer
-		   is used as-is, without mixing; it is part of the
-		   "next" song being faded in, and if there's a rest,
-		   it means cross-fading ends here */
-
-		if (length > other_length)
-			length = other_length;
-
-		char *dest = pcm_buffer_get(&ao->cross_fade_buffer,
-					    other_length);
-		memcpy(dest, other_data, other_length);
-		pcm_mix(dest, data, length, &ao->in_audio_format,
-			1.0 - chunk->mix_ratio);
-
-		data = dest;
-		length = other_length;
-	}
-
-	/* apply filter chain */
+	/* apply this output's own filter chain */
 
 	data = filter_filter(ao->filter, data, length, &length, &error);
 	if (data == NULL) {
@@ -424,35 +350,23 @@ ao_filter_chunk(struct audio_output *ao, const struct music_chunk *chunk,
 	return data;
 }
 
+/**
+ * Sends filtered data to the output plugin.
+ *
+ * @param drain true when called for #AO_COMMAND_DRAIN: the data is
+ * played completely, without waiting for the plugin's delay
+ * @return false if the output has failed (and has been closed)
+ */
 static bool
-ao_play_chunk(struct audio_output *ao, const struct music_chunk *chunk)
+ao_play_data(struct audio_output *ao, const char *data, size_t size,
+	     bool drain)
 {
 	GError *error = NULL;
 
-	assert(ao != NULL);
-	assert(ao->filter != NULL);
-
-	if (chunk->tag != NULL) {
-		g_mutex_unlock(ao->mutex);
-		ao_plugin_send_tag(ao->plugin, ao->data, chunk->tag);
-		g_mutex_lock(ao->mutex);
-	}
-
-	size_t size;
-	const char *data = ao_filter_chunk(ao, chunk, &size);
-	if (data == NULL) {
-		ao_close(ao, false);
-
-		/* don't automatically reopen this device for 10
-		   seconds */
-		ao->fail_timer = g_timer_new();
-		return false;
-	}
-
-	while (size > 0 && ao->command == AO_COMMAND_NONE) {
+	while (size > 0 && (drain || ao->command == AO_COMMAND_NONE)) {
 		size_t nbytes;
 
-		if (!ao_wait(ao))
+		if (!drain && !ao_wait(ao))
 			break;
 
 		g_mutex_unlock(ao->mutex);
@@ -485,16 +399,107 @@ ao_play_chunk(struct audio_output *ao, const struct music_chunk *chunk)
 	return true;
 }
 
+static bool
+ao_play_chunk(struct audio_output *ao, const struct music_chunk *chunk)
+{
+	assert(ao != NULL);
+	assert(ao->filter != NULL);
+
+	if (chunk->tag != NULL) {
+		g_mutex_unlock(ao->mutex);
+		ao_plugin_send_tag(ao->plugin, ao->data, chunk->tag);
+		g_mutex_lock(ao->mutex);
+	}
+
+	size_t size;
+	const char *data = ao_filter_chunk(ao, chunk, &size);
+	if (data == NULL) {
+		ao_close(ao, false);
+
+		/* don't automatically reopen this device for 10
+		   seconds */
+		ao->fail_timer = g_timer_new();
+		return false;
+	}
+
+	return ao_play_data(ao, data, size, false);
+}
+
+/**
+ * Plays the data which is still buffered inside the filters (e.g. the
+ * delay line of a limiter) at the end of the stream.
+ */
+static void
+ao_flush_filters(struct audio_output *ao)
+{
+	GError *error = NULL;
+	size_t length;
+	const char *data = output_stage_flush(ao->stage, ao->stage_member,
+					      &length, &error);
+	if (data != NULL && length > 0)
+		data = filter_filter(ao->filter, data, length, &length,
+				     &error);
+
+	if (data == NULL) {
+		g_warning("\"%s\" [%s] failed to filter: %s",
+			  ao->name, ao->plugin->name, error->message);
+		g_error_free(error);
+
+		ao_close(ao, false);
+		ao->fail_timer = g_timer_new();
+		return;
+	}
+
+	if (length > 0 && !ao_play_data(ao, data, length, true))
+		return;
+
+	/* this output's own filters */
+
+	data = filter_flush(ao->filter, &length, &error);
+	if (data == NULL) {
+		g_warning("\"%s\" [%s] failed to filter: %s",
+			  ao->name, ao->plugin->name, error->message);
+		g_error_free(error);
+
+		ao_close(ao, false);
+		ao->fail_timer = g_timer_new();
+		return;
+	}
+
+	ao_play_data(ao, data, length, true);
+}
+
 static const struct music_chunk *
 ao_next_chunk(struct audio_output *ao)
 {
 	return ao->chunk != NULL
 		/* continue the previous play() call */
-		? ao->chunk->next
+		? music_pipe_next(ao->pipe, ao->chunk)
 		/* get the first chunk from the pipe */
 		: music_pipe_peek(ao->pipe);
 }
 
+/**
+ * Moves the position of this output to the specified chunk.  The bit
+ * of this output is set in the new chunk before it is cleared in the
+ * previous one, so the player never recycles a chunk this output is
+ * positioned on.
+ *
+ * @return true if the previous chunk has been released by the last
+ * consumer
+ */
+static bool
+ao_set_chunk(struct audio_output *ao, const struct music_chunk *chunk)
+{
+	const struct music_chunk *old = ao->chunk;
+
+	music_chunk_acquire(chunk, ao->consumer_mask);
+	ao->chunk = chunk;
+
+	return old != NULL && old != chunk &&
+		music_chunk_release(old, ao->consumer_mask);
+}
+
 /**
  * Plays all remaining chunks, until the tail of the pipe has been
  * reached (and no more chunks are queued), or until a command is
@@ -518,10 +523,15 @@ ao_play(struct audio_output *ao)
 
 	ao->chunk_finished = false;
 
+	/* wake up the player only if this call has freed a chunk, or
+	   if the tail has been reached */
+	bool freed = false;
+
 	while (chunk != NULL && ao->command == AO_COMMAND_NONE) {
 		assert(!ao->chunk_finished);
 
-		ao->chunk = chunk;
+		if (ao_set_chunk(ao, chunk))
+			freed = true;
 
 		success = ao_play_chunk(ao, chunk);
 		if (!success) {
@@ -530,14 +540,16 @@ ao_play(struct audio_output *ao)
 		}
 
 		assert(ao->chunk == chunk);
-		chunk = chunk->next;
+		chunk = music_pipe_next(ao->pipe, chunk);
 	}
 
 	ao->chunk_finished = true;
 
-	g_mutex_unlock(ao->mutex);
-	player_lock_signal(ao->player_control);
-	g_mutex_lock(ao->mutex);
+	if (freed || chunk == NULL) {
+		g_mutex_unlock(ao->mutex);
+		player_lock_signal(ao->player_control);
+		g_mutex_lock(ao->mutex);
+	}
 
 	return true;
 }
@@ -574,6 +586,8 @@ static gpointer audio_output_task(gpointer arg)
 {
 	struct audio_output *ao = arg;
 
+	thread_policy_apply(THREAD_ROLE_OUTPUT);
+
 	g_mutex_lock(ao->mutex);
 
 	while (1) {
@@ -631,6 +645,10 @@ static gpointer audio_output_task(gpointer arg)
 				assert(ao->chunk == NULL);
 				assert(music_pipe_peek(ao->pipe) == NULL);
 
+				ao_flush_filters(ao);
+			}
+
+			if (ao->open) {
 				g_mutex_unlock(ao->mutex);
 				ao_plugin_drain(ao->plugin, ao->data);
 				g_mutex_lock(ao->mutex);
@@ -641,8 +659,12 @@ static gpointer audio_output_task(gpointer arg)
 
 		case AO_COMMAND_CANCEL:
 			ao->chunk = NULL;
-			if (ao->open)
+			if (ao->open) {
+				output_stage_cancel(ao->stage,
+						    ao->stage_member);
+				filter_reset(ao->filter);
 				ao_plugin_cancel(ao->plugin, ao->data);
+			}
 			ao_command_finished(ao);
 
 			/* the player thread will now clear our music
@@ -69,8 +69,8 @@ pcm_convert_16(struct pcm_convert_state *state,
 	assert(dest_format->format == SAMPLE_FORMAT_S16);
 
 	buf = pcm_convert_to_16(&state->format_buffer, &state->dither,
-				src_format->format, src_buffer, src_size,
-				&len);
+				src_format->format, src_format->channels,
+				src_buffer, src_size, &len);
 	if (buf == NULL) {
 		g_set_error(error_r, pcm_convert_quark(), 0,
 			    "Conversion from %s to 16 bit is not implemented",
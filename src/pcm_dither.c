@@ -21,75 +21,239 @@
 #include "pcm_dither.h"
 #include "pcm_prng.h"
 
-static int16_t
-pcm_dither_sample_24_to_16(int32_t sample, struct pcm_dither *dither)
+#include <assert.h>
+#include <string.h>
+
+enum {
+	from_bits = 24,
+	to_bits = 16,
+	scale_bits = from_bits - to_bits,
+	round = 1 << (scale_bits - 1),
+	mask = (1 << scale_bits) - 1,
+	one = 1 << (from_bits - 1),
+	min_sample = -one,
+	max_sample = one - 1,
+
+	/**
+	 * The number of samples processed in one block.  Random
+	 * numbers are generated for a whole block at a time.
+	 */
+	PCM_DITHER_BLOCK = 480,
+};
+
+static enum pcm_dither_mode pcm_dither_default_mode = PCM_DITHER_SHAPED;
+
+bool
+pcm_dither_mode_parse(const char *name, enum pcm_dither_mode *mode_r)
 {
-	int32_t output, rnd;
+	if (strcmp(name, "none") == 0)
+		*mode_r = PCM_DITHER_NONE;
+	else if (strcmp(name, "tpdf") == 0)
+		*mode_r = PCM_DITHER_TPDF;
+	else if (strcmp(name, "shaped") == 0)
+		*mode_r = PCM_DITHER_SHAPED;
+	else
+		return false;
 
-	enum {
-		from_bits = 24,
-		to_bits = 16,
-		scale_bits = from_bits - to_bits,
-		round = 1 << (scale_bits - 1),
-		mask = (1 << scale_bits) - 1,
-		ONE = 1 << (from_bits - 1),
-		MIN = -ONE,
-		MAX = ONE - 1
-	};
+	return true;
+}
 
-	sample += dither->error[0] - dither->error[1] + dither->error[2];
+void
+pcm_dither_set_default_mode(enum pcm_dither_mode mode)
+{
+	pcm_dither_default_mode = mode;
+}
 
-	dither->error[2] = dither->error[1];
-	dither->error[1] = dither->error[0] / 2;
+void
+pcm_dither_init(struct pcm_dither *dither, enum pcm_dither_mode mode)
+{
+	memset(dither, 0, sizeof(*dither));
+	dither->mode = mode;
+}
 
-	/* round */
-	output = sample + round;
+void
+pcm_dither_24_init(struct pcm_dither *dither)
+{
+	pcm_dither_init(dither, pcm_dither_default_mode);
+}
 
-	rnd = pcm_prng(dither->random);
-	output += (rnd & mask) - (dither->random & mask);
+static inline int32_t
+pcm_dither_clip(int32_t sample)
+{
+	if (sample > max_sample)
+		return max_sample;
+	if (sample < min_sample)
+		return min_sample;
+	return sample;
+}
+
+/**
+ * Round without dithering.
+ */
+static void
+pcm_dither_block_none(int16_t *dest, const int32_t *src, unsigned n,
+		      unsigned shift)
+{
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = pcm_dither_clip((src[i] >> shift) + round)
+			>> scale_bits;
+}
+
+/**
+ * Fill the buffer with triangular noise in the range of one output
+ * LSB.
+ */
+static void
+pcm_dither_random_tpdf(struct pcm_dither *dither, int32_t *rnd, unsigned n)
+{
+	uint32_t state = dither->random;
 
-	dither->random = rnd;
+	for (unsigned i = 0; i < n; ++i) {
+		state = pcm_prng(state);
+		rnd[i] = (int32_t)(state & mask) - (int32_t)((state >> 16) & mask);
+	}
 
-	/* clip */
-	if (output > MAX) {
-		output = MAX;
+	dither->random = state;
+}
 
-		if (sample > MAX)
-			sample = MAX;
-	} else if (output < MIN) {
-		output = MIN;
+static void
+pcm_dither_block_tpdf(int16_t *dest, const int32_t *src,
+		      const int32_t *rnd, unsigned n, unsigned shift)
+{
+	/* no dependencies between samples, the compiler may
+	   vectorize this loop */
+	for (unsigned i = 0; i < n; ++i)
+		dest[i] = pcm_dither_clip((src[i] >> shift) + round + rnd[i])
+			>> scale_bits;
+}
 
-		if (sample < MIN)
-			sample = MIN;
+/**
+ * Fill the buffer with rectangular noise in the range of one output
+ * LSB.
+ */
+static void
+pcm_dither_random_rect(struct pcm_dither *dither, int32_t *rnd, unsigned n)
+{
+	uint32_t state = dither->random;
+
+	for (unsigned i = 0; i < n; ++i) {
+		state = pcm_prng(state);
+		rnd[i] = state & mask;
 	}
 
-	output &= ~mask;
+	dither->random = state;
+}
+
+static void
+pcm_dither_block_shaped(struct pcm_dither *dither,
+			int16_t *dest, const int32_t *src,
+			const int32_t *rnd, unsigned num_frames,
+			unsigned channels, unsigned shift)
+{
+	/* each channel has its own error feedback, so the channels
+	   of one frame can be computed in parallel; the samples are
+	   processed in order, because the caller may convert in
+	   place */
+	while (num_frames-- > 0) {
+		for (unsigned c = 0; c < channels; ++c) {
+			int32_t *error = dither->channels[c].error;
+			int32_t sample = (src[c] >> shift)
+				+ error[0] - error[1] + error[2];
+
+			error[2] = error[1];
+			error[1] = error[0] / 2;
+
+			/* round, add high-pass TPDF noise */
+			int32_t output = sample + round
+				+ rnd[c] - dither->channels[c].random;
+			dither->channels[c].random = rnd[c];
+
+			/* clip */
+			if (output > max_sample) {
+				output = max_sample;
 
-	dither->error[0] = sample - output;
+				if (sample > max_sample)
+					sample = max_sample;
+			} else if (output < min_sample) {
+				output = min_sample;
 
-	return (int16_t)(output >> scale_bits);
+				if (sample < min_sample)
+					sample = min_sample;
+			}
+
+			output &= ~mask;
+
+			error[0] = sample - output;
+
+			dest[c] = (int16_t)(output >> scale_bits);
+		}
+
+		dest += channels;
+		src += channels;
+		rnd += channels;
+	}
 }
 
-void
-pcm_dither_24_to_16(struct pcm_dither *dither,
-		    int16_t *dest, const int32_t *src,
-		    unsigned num_samples)
+static void
+pcm_dither_to_16(struct pcm_dither *dither,
+		 int16_t *dest, const int32_t *src,
+		 unsigned num_samples, unsigned channels,
+		 unsigned shift)
 {
-	while (num_samples-- > 0)
-		*dest++ = pcm_dither_sample_24_to_16(*src++, dither);
+	int32_t rnd[PCM_DITHER_BLOCK];
+
+	assert(channels > 0 && channels <= PCM_DITHER_MAX_CHANNELS);
+	assert(num_samples % channels == 0);
+
+	if (dither->mode == PCM_DITHER_NONE) {
+		pcm_dither_block_none(dest, src, num_samples, shift);
+		return;
+	}
+
+	const unsigned block_frames = PCM_DITHER_BLOCK / channels;
+	unsigned num_frames = num_samples / channels;
+
+	while (num_frames > 0) {
+		unsigned n = num_frames < block_frames
+			? num_frames : block_frames;
+		unsigned n_samples = n * channels;
+
+		switch (dither->mode) {
+		case PCM_DITHER_NONE:
+			assert(false);
+			break;
+
+		case PCM_DITHER_TPDF:
+			pcm_dither_random_tpdf(dither, rnd, n_samples);
+			pcm_dither_block_tpdf(dest, src, rnd, n_samples,
+					      shift);
+			break;
+
+		case PCM_DITHER_SHAPED:
+			pcm_dither_random_rect(dither, rnd, n_samples);
+			pcm_dither_block_shaped(dither, dest, src, rnd, n,
+						channels, shift);
+			break;
+		}
+
+		dest += n_samples;
+		src += n_samples;
+		num_frames -= n;
+	}
 }
 
-static int16_t
-pcm_dither_sample_32_to_16(int32_t sample, struct pcm_dither *dither)
+void
+pcm_dither_24_to_16(struct pcm_dither *dither,
+		    int16_t *dest, const int32_t *src,
+		    unsigned num_samples, unsigned channels)
 {
-	return pcm_dither_sample_24_to_16(sample >> 8, dither);
+	pcm_dither_to_16(dither, dest, src, num_samples, channels, 0);
 }
 
 void
 pcm_dither_32_to_16(struct pcm_dither *dither,
 		    int16_t *dest, const int32_t *src,
-		    unsigned num_samples)
+		    unsigned num_samples, unsigned channels)
 {
-	while (num_samples-- > 0)
-		*dest++ = pcm_dither_sample_32_to_16(*src++, dither);
+	pcm_dither_to_16(dither, dest, src, num_samples, channels, 8);
 }
@@ -20,28 +20,92 @@
 #ifndef MPD_PCM_DITHER_H
 #define MPD_PCM_DITHER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+enum {
+	/**
+	 * The maximum number of channels with independent dithering
+	 * state.
+	 */
+	PCM_DITHER_MAX_CHANNELS = 8,
+};
+
+enum pcm_dither_mode {
+	/**
+	 * No dithering, just round to the nearest value.
+	 */
+	PCM_DITHER_NONE,
+
+	/**
+	 * Add triangular (TPDF) noise before rounding.
+	 */
+	PCM_DITHER_TPDF,
+
+	/**
+	 * High-pass TPDF noise plus error feedback noise shaping,
+	 * which moves the quantization noise to higher frequencies.
+	 * This is the default.
+	 */
+	PCM_DITHER_SHAPED,
+};
+
 struct pcm_dither {
-	int32_t error[3];
-	int32_t random;
+	enum pcm_dither_mode mode;
+
+	/**
+	 * The state of the PRNG.
+	 */
+	uint32_t random;
+
+	/**
+	 * The noise shaping state of each channel.
+	 */
+	struct {
+		int32_t error[3];
+		int32_t random;
+	} channels[PCM_DITHER_MAX_CHANNELS];
 };
 
-static inline void
-pcm_dither_24_init(struct pcm_dither *dither)
-{
-	dither->error[0] = dither->error[1] = dither->error[2] = 0;
-	dither->random = 0;
-}
+/**
+ * Parses a dither mode name ("none", "tpdf" or "shaped").
+ *
+ * @return true on success, false if the name is not recognized
+ */
+bool
+pcm_dither_mode_parse(const char *name, enum pcm_dither_mode *mode_r);
+
+/**
+ * Sets the mode used by pcm_dither_24_init().  This is a global
+ * setting, which should be configured once during startup.
+ */
+void
+pcm_dither_set_default_mode(enum pcm_dither_mode mode);
+
+void
+pcm_dither_init(struct pcm_dither *dither, enum pcm_dither_mode mode);
+
+/**
+ * Initializes the object with the default mode, see
+ * pcm_dither_set_default_mode().
+ */
+void
+pcm_dither_24_init(struct pcm_dither *dither);
 
+/**
+ * Converts 24 bit samples (in 32 bit integers) to 16 bit.
+ *
+ * @param channels the number of channels; #num_samples must be a
+ * multiple of it
+ */
 void
 pcm_dither_24_to_16(struct pcm_dither *dither,
 		    int16_t *dest, const int32_t *src,
-		    unsigned num_samples);
+		    unsigned num_samples, unsigned channels);
 
 void
 pcm_dither_32_to_16(struct pcm_dither *dither,
 		    int16_t *dest, const int32_t *src,
-		    unsigned num_samples);
+		    unsigned num_samples, unsigned channels);
 
 #endif
@@ -36,17 +36,17 @@ pcm_convert_8_to_16(int16_t *out, const int8_t *in,
 static void
 pcm_convert_24_to_16(struct pcm_dither *dither,
 		     int16_t *out, const int32_t *in,
-		     unsigned num_samples)
+		     unsigned num_samples, unsigned channels)
 {
-	pcm_dither_24_to_16(dither, out, in, num_samples);
+	pcm_dither_24_to_16(dither, out, in, num_samples, channels);
 }
 
 static void
 pcm_convert_32_to_16(struct pcm_dither *dither,
 		     int16_t *out, const int32_t *in,
-		     unsigned num_samples)
+		     unsigned num_samples, unsigned channels)
 {
-	pcm_dither_32_to_16(dither, out, in, num_samples);
+	pcm_dither_32_to_16(dither, out, in, num_samples, channels);
 }
 
 static int32_t *
@@ -60,8 +60,8 @@ pcm_convert_24_to_24p32(struct pcm_buffer *buffer, const uint8_t *src,
 
 const int16_t *
 pcm_convert_to_16(struct pcm_buffer *buffer, struct pcm_dither *dither,
-		  enum sample_format src_format, const void *src,
-		  size_t src_size, size_t *dest_size_r)
+		  enum sample_format src_format, unsigned channels,
+		  const void *src, size_t src_size, size_t *dest_size_r)
 {
 	unsigned num_samples;
 	int16_t *dest;
@@ -95,7 +95,7 @@ pcm_convert_to_16(struct pcm_buffer *buffer, struct pcm_dither *dither,
 		/* convert to 16 bit in-place */
 		*dest_size_r = num_samples * sizeof(*dest);
 		pcm_convert_24_to_16(dither, dest, dest32,
-				     num_samples);
+				     num_samples, channels);
 		return dest;
 
 	case SAMPLE_FORMAT_S24_P32:
@@ -105,7 +105,7 @@ pcm_convert_to_16(struct pcm_buffer *buffer, struct pcm_dither *dither,
 
 		pcm_convert_24_to_16(dither, dest,
 				     (const int32_t *)src,
-				     num_samples);
+				     num_samples, channels);
 		return dest;
 
 	case SAMPLE_FORMAT_S32:
@@ -115,7 +115,7 @@ pcm_convert_to_16(struct pcm_buffer *buffer, struct pcm_dither *dither,
 
 		pcm_convert_32_to_16(dither, dest,
 				     (const int32_t *)src,
-				     num_samples);
+				     num_samples, channels);
 		return dest;
 	}
 
@@ -35,6 +35,7 @@ struct pcm_dither;
  * @param buffer a pcm_buffer object
  * @param dither a pcm_dither object for 24-to-16 conversion
  * @param bits the number of in the source buffer
+ * @param channels the number of channels (for dithering)
  * @param src the source PCM buffer
  * @param src_size the size of #src in bytes
  * @param dest_size_r returns the number of bytes of the destination buffer
@@ -42,8 +43,8 @@ struct pcm_dither;
  */
 const int16_t *
 pcm_convert_to_16(struct pcm_buffer *buffer, struct pcm_dither *dither,
-		  enum sample_format src_format, const void *src,
-		  size_t src_size, size_t *dest_size_r);
+		  enum sample_format src_format, unsigned channels,
+		  const void *src, size_t src_size, size_t *dest_size_r);
 
 /**
  * Converts PCM samples to 24 bit (32 bit alignment).
@@ -26,8 +26,11 @@
 #include <stdbool.h>
 
 enum {
+	/** the number of fractional bits of a volume value */
+	PCM_VOLUME_BITS = 10,
+
 	/** this value means "100% volume" */
-	PCM_VOLUME_1 = 1024,
+	PCM_VOLUME_1 = 1 << PCM_VOLUME_BITS,
 };
 
 struct audio_format;
@@ -26,20 +26,36 @@
 
 #include <assert.h>
 
+/**
+ * A single-producer/single-consumer queue of chunks.  It is a linked
+ * list (the audio outputs walk it with music_pipe_next()), but push
+ * and shift do not need a lock: the producer owns #tail, the consumer
+ * owns #head, and the only point where they meet - shifting the last
+ * chunk while another one is being pushed - is resolved with a
+ * compare-and-swap on #tail.
+ */
 struct music_pipe {
-	/** the first chunk */
+	/**
+	 * The first chunk.  Written by the consumer, and by the
+	 * producer only while the pipe is empty.
+	 */
 	struct music_chunk *head;
 
-	/** a pointer to the tail of the chunk */
-	struct music_chunk **tail_r;
+	/**
+	 * The last chunk, or NULL if the pipe is empty.  Written by
+	 * the producer, and by the consumer only when it removes the
+	 * last chunk.
+	 */
+	struct music_chunk *tail;
 
 	/** the current number of chunks */
-	unsigned size;
-
-	/** a mutex which protects #head and #tail_r */
-	GMutex *mutex;
+	volatile gint size;
 
 #ifndef NDEBUG
+	/**
+	 * The audio format of the chunks.  This is only written by
+	 * the producer.
+	 */
 	struct audio_format audio_format;
 #endif
 };
@@ -50,9 +66,8 @@ music_pipe_new(void)
 	struct music_pipe *mp = g_new(struct music_pipe, 1);
 
 	mp->head = NULL;
-	mp->tail_r = &mp->head;
+	mp->tail = NULL;
 	mp->size = 0;
-	mp->mutex = g_mutex_new();
 
 #ifndef NDEBUG
 	audio_format_clear(&mp->audio_format);
@@ -65,9 +80,8 @@ void
 music_pipe_free(struct music_pipe *mp)
 {
 	assert(mp->head == NULL);
-	assert(mp->tail_r == &mp->head);
+	assert(mp->tail == NULL);
 
-	g_mutex_free(mp->mutex);
 	g_free(mp);
 }
 
@@ -88,17 +102,10 @@ bool
 music_pipe_contains(const struct music_pipe *mp,
 		    const struct music_chunk *chunk)
 {
-	g_mutex_lock(mp->mutex);
-
-	for (const struct music_chunk *i = mp->head;
-	     i != NULL; i = i->next) {
-		if (i == chunk) {
-			g_mutex_unlock(mp->mutex);
+	for (const struct music_chunk *i = music_pipe_peek(mp);
+	     i != NULL; i = music_pipe_next(mp, i))
+		if (i == chunk)
 			return true;
-		}
-	}
-
-	g_mutex_unlock(mp->mutex);
 
 	return false;
 }
@@ -108,43 +115,51 @@ music_pipe_contains(const struct music_pipe *mp,
 const struct music_chunk *
 music_pipe_peek(const struct music_pipe *mp)
 {
-	return mp->head;
+	return g_atomic_pointer_get(&mp->head);
+}
+
+const struct music_chunk *
+music_pipe_next(G_GNUC_UNUSED const struct music_pipe *mp,
+		const struct music_chunk *chunk)
+{
+	return g_atomic_pointer_get(&chunk->next);
 }
 
 struct music_chunk *
 music_pipe_shift(struct music_pipe *mp)
 {
-	struct music_chunk *chunk;
+	struct music_chunk *chunk = g_atomic_pointer_get(&mp->head);
+	if (chunk == NULL)
+		return NULL;
 
-	g_mutex_lock(mp->mutex);
-
-	chunk = mp->head;
-	if (chunk != NULL) {
-		assert(!music_chunk_is_empty(chunk));
-
-		mp->head = chunk->next;
-		--mp->size;
-
-		if (mp->head == NULL) {
-			assert(mp->size == 0);
-			assert(mp->tail_r == &chunk->next);
+	assert(!music_chunk_is_empty(chunk));
 
-			mp->tail_r = &mp->head;
-		} else {
-			assert(mp->size > 0);
-			assert(mp->tail_r != &chunk->next);
+	struct music_chunk *next = g_atomic_pointer_get(&chunk->next);
+	if (next == NULL) {
+		/* this looks like the last chunk: detach it from the
+		   tail, unless the producer is just appending a new
+		   one */
+		g_atomic_pointer_set(&mp->head, NULL);
+
+		if (!g_atomic_pointer_compare_and_exchange((gpointer *)&mp->tail,
+							   chunk, NULL)) {
+			/* the producer has already replaced the
+			   tail, and it is about to link the new chunk
+			   to this one; wait for that */
+			while ((next = g_atomic_pointer_get(&chunk->next)) == NULL)
+				g_thread_yield();
+
+			g_atomic_pointer_set(&mp->head, next);
 		}
+	} else
+		g_atomic_pointer_set(&mp->head, next);
 
-#ifndef NDEBUG
-		/* poison the "next" reference */
-		chunk->next = (void*)0x01010101;
+	g_atomic_int_add(&mp->size, -1);
 
-		if (mp->size == 0)
-			audio_format_clear(&mp->audio_format);
+#ifndef NDEBUG
+	/* poison the "next" reference */
+	chunk->next = (void*)0x01010101;
 #endif
-	}
-
-	g_mutex_unlock(mp->mutex);
 
 	return chunk;
 }
@@ -164,28 +179,40 @@ music_pipe_push(struct music_pipe *mp, struct music_chunk *chunk)
 	assert(!music_chunk_is_empty(chunk));
 	assert(chunk->length == 0 || audio_format_valid(&chunk->audio_format));
 
-	g_mutex_lock(mp->mutex);
+#ifndef NDEBUG
+	if (music_pipe_empty(mp))
+		audio_format_clear(&mp->audio_format);
 
-	assert(mp->size > 0 || !audio_format_defined(&mp->audio_format));
 	assert(!audio_format_defined(&mp->audio_format) ||
 	       music_chunk_check_format(chunk, &mp->audio_format));
 
-#ifndef NDEBUG
 	if (!audio_format_defined(&mp->audio_format) && chunk->length > 0)
 		mp->audio_format = chunk->audio_format;
 #endif
 
 	chunk->next = NULL;
-	*mp->tail_r = chunk;
-	mp->tail_r = &chunk->next;
-
-	++mp->size;
 
-	g_mutex_unlock(mp->mutex);
+	/* count it first, so the size never drops below zero while
+	   the consumer shifts it */
+	g_atomic_int_inc(&mp->size);
+
+	/* the consumer may reset the tail to NULL concurrently
+	   (after it has shifted the last chunk) */
+	struct music_chunk *prev;
+	do {
+		prev = g_atomic_pointer_get(&mp->tail);
+	} while (!g_atomic_pointer_compare_and_exchange((gpointer *)&mp->tail,
+							prev, chunk));
+
+	if (prev == NULL)
+		/* the pipe was empty */
+		g_atomic_pointer_set(&mp->head, chunk);
+	else
+		g_atomic_pointer_set(&prev->next, chunk);
 }
 
 unsigned
 music_pipe_size(const struct music_pipe *mp)
 {
-	return mp->size;
+	return g_atomic_int_get(&mp->size);
 }
@@ -74,7 +74,17 @@ const struct music_chunk *
 music_pipe_peek(const struct music_pipe *mp);
 
 /**
- * Removes the first chunk from the head, and returns it.
+ * Returns the chunk following the specified one, or NULL if it is the
+ * last one.  The caller must ensure that the chunk is still in the
+ * pipe.
+ */
+const struct music_chunk *
+music_pipe_next(const struct music_pipe *mp, const struct music_chunk *chunk);
+
+/**
+ * Removes the first chunk from the head, and returns it.  Only one
+ * thread (the consumer) may call this function (and
+ * music_pipe_clear()) at a time.
  */
 struct music_chunk *
 music_pipe_shift(struct music_pipe *mp);
@@ -88,7 +98,9 @@ void
 music_pipe_clear(struct music_pipe *mp, struct music_buffer *buffer);
 
 /**
- * Pushes a chunk to the tail of the pipe.
+ * Pushes a chunk to the tail of the pipe.  Only one thread (the
+ * producer) may call this function at a time; it may run concurrently
+ * with the consumer.
  */
 void
 music_pipe_push(struct music_pipe *mp, struct music_chunk *chunk);
@@ -42,6 +42,7 @@ pc_new(unsigned buffer_chunks, unsigned int buffered_before_play)
 
 	pc->buffer_chunks = buffer_chunks;
 	pc->buffered_before_play = buffered_before_play;
+	pc->decoders = 1;
 
 	pc->mutex = g_mutex_new();
 	pc->cond = g_cond_new();
@@ -82,11 +82,28 @@ struct player_status {
 	float elapsed_time;
 };
 
+/**
+ * The maximum number of decoder threads; one for the current song,
+ * and one which may run ahead on the next song.
+ */
+#define PLAYER_MAX_DECODERS 2
+
 struct player_control {
 	unsigned buffer_chunks;
 
 	unsigned int buffered_before_play;
 
+	/**
+	 * The number of decoder threads, 1 to #PLAYER_MAX_DECODERS.
+	 */
+	unsigned decoders;
+
+	/**
+	 * The maximum size of the player's seek cache in bytes; 0
+	 * disables it.
+	 */
+	size_t seek_cache_size;
+
 	/** the handle of the player thread, or NULL if the player
 	    thread isn't running */
 	GThread *thread;
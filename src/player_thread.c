@@ -34,6 +34,8 @@
 #include "idle.h"
 #include "main.h"
 #include "buffer.h"
+#include "seek_cache.h"
+#include "thread_policy.h"
 #include "mpd_error.h"
 
 #include <glib.h>
@@ -50,8 +52,27 @@ enum xfade_state {
 struct player {
 	struct player_control *pc;
 
+	/**
+	 * The decoder of the next song if it has been started, or
+	 * else the decoder of the current song.
+	 */
 	struct decoder_control *dc;
 
+	/**
+	 * The decoder which is still decoding the current song into
+	 * #pipe, while #dc has already been started on the next song.
+	 * NULL if #dc has been started after the current song was
+	 * decoded completely.
+	 */
+	struct decoder_control *prev_dc;
+
+	/**
+	 * An idle decoder which may be started on the next song while
+	 * the current song is still being decoded.  NULL if there is
+	 * only one decoder, or if it is in use.
+	 */
+	struct decoder_control *spare_dc;
+
 	struct music_pipe *pipe;
 
 	/**
@@ -119,6 +140,11 @@ struct player {
 
 static struct music_buffer *player_buffer;
 
+/**
+ * The PCM data recently sent to the audio outputs; NULL if disabled.
+ */
+static struct seek_cache *player_seek_cache;
+
 static void
 player_command_finished_locked(struct player_control *pc)
 {
@@ -150,9 +176,87 @@ player_dc_start(struct player *player, struct music_pipe *pipe)
 	assert(player->queued || pc->command == PLAYER_COMMAND_SEEK);
 	assert(pc->next_song != NULL);
 
+	dc->max_chunks = 0;
 	dc_start(dc, pc->next_song, player_buffer, pipe);
 }
 
+/**
+ * Start the spare decoder on the queued song, while the current song
+ * is still being decoded.  The decoder of the current song becomes
+ * player.prev_dc.
+ *
+ * Player lock is not held.
+ */
+static void
+player_dc_start_ahead(struct player *player)
+{
+	struct player_control *pc = player->pc;
+	struct decoder_control *dc = player->dc;
+	struct decoder_control *next = player->spare_dc;
+
+	assert(player->queued);
+	assert(pc->next_song != NULL);
+	assert(next != NULL);
+	assert(player->prev_dc == NULL);
+	assert(dc->pipe == player->pipe);
+
+	/* the decoder thread passes MixRamp and ReplayGain data from
+	   its previous song to the next one; this decoder has not
+	   seen the current song, so copy it */
+	decoder_lock(dc);
+	char *mixramp_end = g_strdup(dc->mixramp_end);
+	float replay_gain_db = dc->replay_gain_db;
+	decoder_unlock(dc);
+
+	dc_mixramp_end(next, mixramp_end);
+	next->replay_gain_db = replay_gain_db;
+
+	/* leave at least half of the buffer to the current song */
+	next->max_chunks = music_buffer_size(player_buffer) / 2;
+
+	player->spare_dc = NULL;
+	player->prev_dc = dc;
+	player->dc = next;
+
+	dc_start(next, pc->next_song, player_buffer, music_pipe_new());
+}
+
+/**
+ * Has the current song been decoded completely?
+ *
+ * Player lock is not held.
+ */
+static bool
+player_prev_dc_finished(struct player *player)
+{
+	return player->prev_dc == NULL ||
+		decoder_lock_is_idle(player->prev_dc);
+}
+
+/**
+ * Stops the decoder of the current song if another one has been
+ * started on the next song already, and makes it the spare decoder.
+ * The caller is responsible for clearing player.pipe.
+ *
+ * Player lock is not held.
+ */
+static void
+player_prev_dc_stop(struct player *player)
+{
+	struct decoder_control *dc = player->prev_dc;
+
+	if (dc == NULL)
+		return;
+
+	assert(dc->pipe == player->pipe);
+
+	dc_stop(dc);
+	dc->pipe = NULL;
+
+	player->prev_dc = NULL;
+	player->spare_dc = dc;
+}
+
 /**
  * Is the decoder still busy on the same song as the player?
  *
@@ -203,6 +307,40 @@ player_dc_stop(struct player *player)
 	}
 }
 
+/**
+ * Stops the decoder which has begun decoding the next song, and
+ * continues with the decoder of the current song.
+ *
+ * Player lock is not held.
+ */
+static void
+player_dc_cancel_next(struct player *player)
+{
+	assert(player_dc_at_next_song(player));
+
+	player_dc_stop(player);
+
+	if (player->prev_dc != NULL) {
+		/* continue with the decoder of the current song */
+		player->spare_dc = player->dc;
+		player->dc = player->prev_dc;
+		player->prev_dc = NULL;
+	} else
+		/* the decoder has finished the current song, and may
+		   be started on the next one again */
+		player->dc->pipe = player->pipe;
+}
+
+/**
+ * Is the player replaying data from #player_seek_cache?
+ */
+static bool
+player_replaying(void)
+{
+	return player_seek_cache != NULL &&
+		seek_cache_is_reading(player_seek_cache);
+}
+
 /**
  * After the decoder has been started asynchronously, wait for the
  * "START" command to finish.  The decoder may not be initialized yet,
@@ -375,11 +513,14 @@ player_send_silence(struct player *player)
 	chunk->audio_format = player->play_audio_format;
 #endif
 
+	size_t chunk_size = music_chunk_size(&player->play_audio_format);
+	music_chunk_reserve(chunk, chunk_size);
+
 	size_t frame_size =
 		audio_format_frame_size(&player->play_audio_format);
 	/* this formula ensures that we don't send
 	   partial frames */
-	unsigned num_frames = sizeof(chunk->data) / frame_size;
+	unsigned num_frames = chunk_size / frame_size;
 
 	chunk->times = -1.0; /* undefined time stamp */
 	chunk->length = num_frames * frame_size;
@@ -393,6 +534,126 @@ player_send_silence(struct player *player)
 	return true;
 }
 
+/**
+ * Returns the seek position requested by the client, clipped to the
+ * song duration.
+ */
+static double
+player_seek_where(const struct player_control *pc)
+{
+	double where = pc->seek_where;
+	if (where > pc->total_time)
+		where = pc->total_time - 0.1;
+	if (where < 0.0)
+		where = 0.0;
+
+	return where;
+}
+
+/**
+ * Returns the chunk in the player's pipe which contains the specified
+ * position, or NULL if the decoder has not got there yet.
+ */
+static const struct music_chunk *
+player_pipe_find(const struct player *player, double where)
+{
+	const double byte_rate =
+		audio_format_time_to_size(&player->play_audio_format);
+
+	for (const struct music_chunk *chunk = music_pipe_peek(player->pipe);
+	     chunk != NULL; chunk = music_pipe_next(player->pipe, chunk))
+		if (chunk->length > 0 && chunk->times >= 0.0 &&
+		    where >= chunk->times &&
+		    where < chunk->times + chunk->length / byte_rate)
+			return chunk;
+
+	return NULL;
+}
+
+/**
+ * Attempts to serve a seek within the current song without the
+ * decoder: backwards (and into the part which was sent to the
+ * outputs, but not played yet) from #player_seek_cache, and forward
+ * by skipping chunks which are already in the pipe.
+ *
+ * The player lock is not held.
+ *
+ * @return true if the seek has been handled
+ */
+static bool
+player_seek_from_cache(struct player *player)
+{
+	struct player_control *pc = player->pc;
+	const struct song *song = pc->next_song;
+
+	if (player_seek_cache == NULL || song != player->song ||
+	    player->decoder_starting)
+		return false;
+
+	double where = player_seek_where(pc);
+	const struct music_chunk *target = NULL;
+
+	if (!seek_cache_seek(player_seek_cache, song, where) &&
+	    (target = player_pipe_find(player, where)) == NULL)
+		return false;
+
+	if (player_dc_at_next_song(player))
+		/* the queue will be updated after the seek */
+		player_dc_cancel_next(player);
+
+	pc->next_song = NULL;
+	player->queued = false;
+
+	audio_output_all_cancel();
+
+	if (target != NULL) {
+		/* move all chunks up to the target into the cache
+		   (they continue the chunks which were played
+		   already), and replay the target from there, so the
+		   seek is sample accurate */
+		struct music_chunk *chunk;
+		do {
+			chunk = music_pipe_shift(player->pipe);
+			assert(chunk != NULL);
+
+			seek_cache_add(player_seek_cache, song,
+				       &player->play_audio_format, chunk);
+
+			if (chunk->tag != NULL) {
+				/* postpone the tag, it will be sent
+				   with the next chunk */
+				player->cross_fade_tag =
+					tag_merge_replace(player->cross_fade_tag,
+							  chunk->tag);
+				chunk->tag = NULL;
+			}
+
+			music_buffer_return(player_buffer, chunk);
+		} while (chunk != target);
+
+		/* the cache is never smaller than one chunk, so the
+		   target is still there */
+		G_GNUC_UNUSED bool found =
+			seek_cache_seek(player_seek_cache, song, where);
+		assert(found);
+	}
+
+	if (player_dc_at_current_song(player))
+		/* keep the decoder from taking the chunks needed for
+		   replaying */
+		dc_set_max_chunks(player->dc,
+				  MAX(music_pipe_size(player->pipe), 1u));
+
+	g_debug("seek to %f served from the cache", where);
+
+	player->elapsed_time = where;
+	player->xfade = XFADE_UNKNOWN;
+
+	player_command_finished(pc);
+
+	return true;
+}
+
 /**
  * This is the handler for the #PLAYER_COMMAND_SEEK command.
  *
@@ -406,6 +667,18 @@ static bool player_seek_decoder(struct player *player)
 
 	assert(pc->next_song != NULL);
 
+	if (player_seek_from_cache(player))
+		return true;
+
+	/* the decoder will skip the cached range */
+	if (player_seek_cache != NULL)
+		seek_cache_clear(player_seek_cache);
+
+	/* the decoder of the current song is not needed anymore:
+	   either the current song gets restarted, or the decoder of
+	   the next song is reused */
+	player_prev_dc_stop(player);
+
 	if (decoder_current_song(dc) != song) {
 		/* the decoder is already decoding the "next" song -
 		   stop it and start the previous song again */
@@ -430,6 +703,8 @@ static bool player_seek_decoder(struct player *player)
 			music_pipe_clear(player->pipe, player_buffer);
 			music_pipe_free(player->pipe);
 			player->pipe = dc->pipe;
+
+			dc_set_max_chunks(dc, 0);
 		}
 
 		pc->next_song = NULL;
@@ -448,11 +723,11 @@ static bool player_seek_decoder(struct player *player)
 
 	/* send the SEEK command */
 
-	double where = pc->seek_where;
-	if (where > pc->total_time)
-		where = pc->total_time - 0.1;
-	if (where < 0.0)
-		where = 0.0;
+	double where = player_seek_where(pc);
+
+	/* the decoder may have been limited while replaying from
+	   the cache */
+	dc_set_max_chunks(dc, 0);
 
 	if (!dc_seek(dc, where + song->start_ms / 1000.0)) {
 		/* decoder failure */
@@ -557,7 +832,7 @@ static void player_process_command(struct player *player)
 			/* the decoder is already decoding the song -
 			   stop it and reset the position */
 			player_unlock(pc);
-			player_dc_stop(player);
+			player_dc_cancel_next(player);
 			player_lock(pc);
 		}
 
@@ -640,6 +915,25 @@ play_chunk(struct player_control *pc,
 	return true;
 }
 
+/**
+ * Wakes up the decoder if its pipe is running low.
+ *
+ * Player lock is not held.
+ */
+static void
+player_dc_refill(const struct player_control *pc, struct decoder_control *dc)
+{
+	/* this formula should prevent that the decoder gets woken up
+	   with each chunk; it is more efficient to make it decode a
+	   larger block at a time */
+	decoder_lock(dc);
+	if (!decoder_is_idle(dc) &&
+	    music_pipe_size(dc->pipe) <= (pc->buffered_before_play +
+					 music_buffer_size(player_buffer) * 3) / 4)
+		decoder_signal(dc);
+	decoder_unlock(dc);
+}
+
 /**
  * Obtains the next chunk from the music pipe, optionally applies
  * cross-fading, and sends it to all audio outputs.
@@ -659,8 +953,26 @@ play_next_chunk(struct player *player)
 
 	unsigned cross_fade_position;
 	struct music_chunk *chunk = NULL;
-	if (player->xfade == XFADE_ENABLED &&
+	const bool replay = player_replaying();
+	if (replay) {
+		/* a seek has been served by the cache */
+		chunk = music_buffer_allocate(player_buffer);
+		if (chunk == NULL) {
+			/* wait for the outputs to return a chunk */
+			audio_output_all_wait(pc, 1);
+			return true;
+		}
+
+		seek_cache_read(player_seek_cache, chunk);
+
+		if (!player_replaying() && player_dc_at_current_song(player))
+			/* finished; let the decoder continue */
+			dc_set_max_chunks(dc, 0);
+	} else if (player->xfade == XFADE_ENABLED &&
 	    player_dc_at_next_song(player) &&
+	    /* the current song may be short on chunks only because
+	       its decoder is slow, not because it ends */
+	    (player->cross_fading || player_prev_dc_finished(player)) &&
 	    (cross_fade_position = music_pipe_size(player->pipe))
 	    <= player->cross_fade_chunks) {
 		/* perform cross fade */
@@ -745,6 +1057,10 @@ play_next_chunk(struct player *player)
 		player->cross_fade_tag = NULL;
 	}
 
+	if (player_seek_cache != NULL && !replay)
+		seek_cache_add(player_seek_cache, player->song,
+			       &player->play_audio_format, chunk);
+
 	/* play the current chunk */
 
 	if (!play_chunk(player->pc, player->song, chunk,
@@ -765,19 +1081,46 @@ play_next_chunk(struct player *player)
 		return false;
 	}
 
-	/* this formula should prevent that the decoder gets woken up
-	   with each chunk; it is more efficient to make it decode a
-	   larger block at a time */
-	decoder_lock(dc);
-	if (!decoder_is_idle(dc) &&
-	    music_pipe_size(dc->pipe) <= (pc->buffered_before_play +
-					 music_buffer_size(player_buffer) * 3) / 4)
-		decoder_signal(dc);
-	decoder_unlock(dc);
+	player_dc_refill(pc, dc);
+	if (player->prev_dc != NULL)
+		player_dc_refill(pc, player->prev_dc);
 
 	return true;
 }
 
+/**
+ * The decoder has begun decoding the next song: enable cross fading?
+ * If yes, calculate how many chunks will be required for it.
+ *
+ * Player lock is not held.
+ */
+static void
+player_check_cross_fade(struct player *player)
+{
+	const struct player_control *pc = player->pc;
+	const struct decoder_control *dc = player->dc;
+
+	player->cross_fade_chunks =
+		cross_fade_calc(pc->cross_fade_seconds, dc->total_time,
+				pc->mixramp_db,
+				pc->mixramp_delay_seconds,
+				dc->replay_gain_db,
+				dc->replay_gain_prev_db,
+				dc->mixramp_start,
+				dc->mixramp_prev_end,
+				&dc->out_audio_format,
+				&player->play_audio_format,
+				music_buffer_size(player_buffer) -
+				pc->buffered_before_play);
+	if (player->cross_fade_chunks > 0) {
+		player->xfade = XFADE_ENABLED;
+		player->cross_fading = false;
+	} else
+		/* cross fading is disabled or the next song is too
+		   short */
+		player->xfade = XFADE_DISABLED;
+}
+
 /**
  * This is called at the border between two songs: the audio output
  * has consumed all chunks of the current song, and we should start
@@ -799,6 +1142,21 @@ player_song_border(struct player *player)
 	music_pipe_free(player->pipe);
 	player->pipe = player->dc->pipe;
 
+	if (player_seek_cache != NULL)
+		seek_cache_clear(player_seek_cache);
+
+	if (player->prev_dc != NULL) {
+		/* the decoder of the finished song is available for
+		   the next one */
+		assert(decoder_lock_is_idle(player->prev_dc));
+
+		player->prev_dc->pipe = NULL;
+		player->spare_dc = player->prev_dc;
+		player->prev_dc = NULL;
+
+		dc_set_max_chunks(player->dc, 0);
+	}
+
 	audio_output_all_song_border();
 
 	if (!player_wait_for_decoder(player))
@@ -812,11 +1170,14 @@ player_song_border(struct player *player)
  * basically a state machine, which multiplexes data between the
  * decoder thread and the output threads.
  */
-static void do_play(struct player_control *pc, struct decoder_control *dc)
+static void do_play(struct player_control *pc,
+		    struct decoder_control *decoders[PLAYER_MAX_DECODERS])
 {
 	struct player player = {
 		.pc = pc,
-		.dc = dc,
+		.dc = decoders[0],
+		.prev_dc = NULL,
+		.spare_dc = decoders[1],
 		.buffering = true,
 		.decoder_starting = false,
 		.paused = false,
@@ -865,7 +1226,7 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 			   prevent stuttering on slow machines */
 
 			if (music_pipe_size(player.pipe) < pc->buffered_before_play &&
-			    !decoder_lock_is_idle(dc)) {
+			    !decoder_lock_is_idle(player.dc)) {
 				/* not enough decoded buffer space yet */
 
 				if (!player.paused &&
@@ -874,10 +1235,10 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 				    !player_send_silence(&player))
 					break;
 
-				decoder_lock(dc);
+				decoder_lock(player.dc);
 				/* XXX race condition: check decoder again */
-				player_wait_decoder(pc, dc);
-				decoder_unlock(dc);
+				player_wait_decoder(pc, player.dc);
+				decoder_unlock(player.dc);
 				player_lock(pc);
 				continue;
 			} else {
@@ -893,13 +1254,13 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 				break;
 
 			/* seek to the beginning of the range */
-			const struct song *song = decoder_current_song(dc);
+			const struct song *song = decoder_current_song(player.dc);
 			if (song != NULL && song->start_ms > 0 &&
 			    /* we must not send a seek command until
 			       the decoder is initialized
 			       completely */
 			    !player.decoder_starting &&
-			    !dc_seek(dc, song->start_ms / 1000.0))
+			    !dc_seek(player.dc, song->start_ms / 1000.0))
 				player_dc_stop(&player);
 
 			player_lock(pc);
@@ -914,42 +1275,23 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 		*/
 #endif
 
-		if (decoder_lock_is_idle(dc) && player.queued &&
-		    dc->pipe == player.pipe) {
-			/* the decoder has finished the current song;
-			   make it decode the next song */
-
-			assert(dc->pipe == NULL || dc->pipe == player.pipe);
-
-			player_dc_start(&player, music_pipe_new());
+		if (player.queued && player.dc->pipe == player.pipe &&
+		    /* the chunks are needed for replaying */
+		    !player_replaying()) {
+			if (decoder_lock_is_idle(player.dc))
+				/* the decoder has finished the current
+				   song; make it decode the next song */
+				player_dc_start(&player, music_pipe_new());
+			else if (player.spare_dc != NULL &&
+				 !player.buffering)
+				/* decode the next song in parallel */
+				player_dc_start_ahead(&player);
 		}
 
 		if (player_dc_at_next_song(&player) &&
 		    player.xfade == XFADE_UNKNOWN &&
-		    !decoder_lock_is_starting(dc)) {
-			/* enable cross fading in this song?  if yes,
-			   calculate how many chunks will be required
-			   for it */
-			player.cross_fade_chunks =
-				cross_fade_calc(pc->cross_fade_seconds, dc->total_time,
-						pc->mixramp_db,
-						pc->mixramp_delay_seconds,
-						dc->replay_gain_db,
-						dc->replay_gain_prev_db,
-						dc->mixramp_start,
-						dc->mixramp_prev_end,
-						&dc->out_audio_format,
-						&player.play_audio_format,
-						music_buffer_size(player_buffer) -
-						pc->buffered_before_play);
-			if (player.cross_fade_chunks > 0) {
-				player.xfade = XFADE_ENABLED;
-				player.cross_fading = false;
-			} else
-				/* cross fading is disabled or the
-				   next song is too short */
-				player.xfade = XFADE_DISABLED;
-		}
+		    !decoder_lock_is_starting(player.dc))
+			player_check_cross_fade(&player);
 
 		if (player.paused) {
 			player_lock(pc);
@@ -957,7 +1299,8 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 			if (pc->command == PLAYER_COMMAND_NONE)
 				player_wait(pc);
 			continue;
-		} else if (!music_pipe_empty(player.pipe)) {
+		} else if (!music_pipe_empty(player.pipe) ||
+			   player_replaying()) {
 			/* at least one music chunk is ready - send it
 			   to the audio output */
 
@@ -972,9 +1315,17 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 		} else if (player_dc_at_next_song(&player)) {
 			/* at the beginning of a new song */
 
-			if (!player_song_border(&player))
+			if (!player_prev_dc_finished(&player)) {
+				/* the decoder of the current song is
+				   too busy */
+				if (!player_send_silence(&player))
+					break;
+			} else if (!music_pipe_empty(player.pipe)) {
+				/* the decoder of the current song has
+				   just added its last chunks */
+			} else if (!player_song_border(&player))
 				break;
-		} else if (decoder_lock_is_idle(dc)) {
+		} else if (decoder_lock_is_idle(player.dc)) {
 			/* check the size of the pipe again, because
 			   the decoder thread may have added something
 			   since we last checked */
@@ -995,11 +1346,18 @@ static void do_play(struct player_control *pc, struct decoder_control *dc)
 		player_lock(pc);
 	}
 
+	player_prev_dc_stop(&player);
 	player_dc_stop(&player);
 
 	music_pipe_clear(player.pipe, player_buffer);
 	music_pipe_free(player.pipe);
 
+	if (player_seek_cache != NULL)
+		seek_cache_clear(player_seek_cache);
+
+	decoders[0] = player.dc;
+	decoders[1] = player.spare_dc;
+
 	if (player.cross_fade_tag != NULL)
 		tag_free(player.cross_fade_tag);
 
@@ -1024,11 +1382,25 @@ player_task(gpointer arg)
 {
 	struct player_control *pc = arg;
 
-	struct decoder_control *dc = dc_new(pc->cond);
-	decoder_thread_start(dc);
+	struct decoder_control *decoders[PLAYER_MAX_DECODERS];
+
+	assert(pc->decoders >= 1 && pc->decoders <= PLAYER_MAX_DECODERS);
+
+	thread_policy_apply(THREAD_ROLE_PLAYER);
+
+	for (unsigned i = 0; i < PLAYER_MAX_DECODERS; ++i) {
+		if (i < pc->decoders) {
+			decoders[i] = dc_new(pc->cond);
+			decoder_thread_start(decoders[i]);
+		} else
+			decoders[i] = NULL;
+	}
 
 	player_buffer = music_buffer_new(pc->buffer_chunks);
 
+	if (pc->seek_cache_size > 0)
+		player_seek_cache = seek_cache_new(pc->seek_cache_size);
+
 	player_lock(pc);
 
 	while (1) {
@@ -1036,7 +1408,7 @@ player_task(gpointer arg)
 		case PLAYER_COMMAND_QUEUE:
 			assert(pc->next_song != NULL);
 
-			do_play(pc, dc);
+			do_play(pc, decoders);
 			break;
 
 		case PLAYER_COMMAND_STOP:
@@ -1080,11 +1452,21 @@ player_task(gpointer arg)
 		case PLAYER_COMMAND_EXIT:
 			player_unlock(pc);
 
-			dc_quit(dc);
-			dc_free(dc);
+			for (unsigned i = 0; i < PLAYER_MAX_DECODERS; ++i) {
+				if (decoders[i] != NULL) {
+					dc_quit(decoders[i]);
+					dc_free(decoders[i]);
+				}
+			}
+
 			audio_output_all_close();
 			music_buffer_free(player_buffer);
 
+			if (player_seek_cache != NULL) {
+				seek_cache_free(player_seek_cache);
+				player_seek_cache = NULL;
+			}
+
 			player_command_finished(pc);
 			return NULL;
 
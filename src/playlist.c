@@ -24,6 +24,8 @@
 #include "command.h"
 #include "tag.h"
 #include "song.h"
+#include "mapper.h"
+#include "input_prefetch.h"
 #include "conf.h"
 #include "stored_playlist.h"
 #include "idle.h"
@@ -71,6 +73,37 @@ playlist_finish(struct playlist *playlist)
 	queue_finish(&playlist->queue);
 }
 
+/**
+ * Tells the prefetch thread which songs will be played next,
+ * beginning with the specified one.
+ */
+static void
+playlist_prefetch(const struct playlist *playlist, unsigned order)
+{
+	char *uris[PREFETCH_MAX_SONGS];
+	unsigned n = 0;
+	int next = order;
+
+	while (n < input_prefetch_songs() && next >= 0) {
+		const struct song *song =
+			queue_get_order(&playlist->queue, next);
+
+		uris[n++] = song_is_file(song)
+			? map_song_fs(song)
+			: song_get_uri(song);
+
+		next = queue_next_order(&playlist->queue, next);
+		if (next == (int)order)
+			/* "repeat" with a short queue */
+			break;
+	}
+
+	input_prefetch_schedule(uris, n);
+
+	while (n > 0)
+		g_free(uris[--n]);
+}
+
 /**
  * Queue a song, addressed by its order number.
  */
@@ -91,6 +124,8 @@ playlist_queue_song_order(struct playlist *playlist, struct player_control *pc,
 	g_free(uri);
 
 	pc_enqueue_song(pc, song);
+
+	playlist_prefetch(playlist, order);
 }
 
 /**
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "seek_cache.h"
+#include "chunk.h"
+#include "audio_format.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <string.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "seek_cache"
+
+/**
+ * Time stamps may deviate by this amount (in seconds) from the end of
+ * the cached range, and still be considered contiguous.
+ */
+static const float SEEK_CACHE_TOLERANCE = 0.05;
+
+struct seek_cache_entry {
+	float times;
+
+	uint16_t bit_rate;
+
+	unsigned replay_gain_serial;
+	struct replay_gain_info replay_gain_info;
+
+	size_t length;
+
+	char data[];
+};
+
+struct seek_cache {
+	size_t max_size;
+
+	/** the number of PCM bytes in all entries */
+	size_t size;
+
+	/** the song all entries belong to */
+	const struct song *song;
+
+	struct audio_format audio_format;
+
+	/** a list of #seek_cache_entry objects, oldest first */
+	GQueue *entries;
+
+	/** the next entry to be read, NULL if not reading */
+	GList *cursor;
+
+	/** the read position within #cursor */
+	size_t cursor_offset;
+};
+
+struct seek_cache *
+seek_cache_new(size_t max_size)
+{
+	struct seek_cache *cache = g_new(struct seek_cache, 1);
+
+	assert(max_size > 0);
+
+	cache->max_size = max_size;
+	cache->size = 0;
+	cache->song = NULL;
+	cache->entries = g_queue_new();
+	cache->cursor = NULL;
+
+	return cache;
+}
+
+void
+seek_cache_free(struct seek_cache *cache)
+{
+	seek_cache_clear(cache);
+	g_queue_free(cache->entries);
+	g_free(cache);
+}
+
+void
+seek_cache_clear(struct seek_cache *cache)
+{
+	struct seek_cache_entry *entry;
+
+	while ((entry = g_queue_pop_head(cache->entries)) != NULL)
+		g_free(entry);
+
+	cache->size = 0;
+	cache->song = NULL;
+	cache->cursor = NULL;
+}
+
+static float
+seek_cache_entry_duration(const struct seek_cache *cache,
+			  const struct seek_cache_entry *entry)
+{
+	return entry->length / audio_format_time_to_size(&cache->audio_format);
+}
+
+float
+seek_cache_end(const struct seek_cache *cache, const struct song *song)
+{
+	const struct seek_cache_entry *last =
+		g_queue_peek_tail(cache->entries);
+
+	if (last == NULL || cache->song != song)
+		return -1.0;
+
+	return last->times + seek_cache_entry_duration(cache, last);
+}
+
+void
+seek_cache_add(struct seek_cache *cache, const struct song *song,
+	       const struct audio_format *audio_format,
+	       const struct music_chunk *chunk)
+{
+	assert(!seek_cache_is_reading(cache));
+
+	if (chunk->other != NULL) {
+		/* the outputs mix this chunk with the next song */
+		seek_cache_clear(cache);
+		return;
+	}
+
+	if (chunk->length == 0 || chunk->times < 0.0)
+		return;
+
+	if (!g_queue_is_empty(cache->entries)) {
+		float end = seek_cache_end(cache, song);
+
+		if (!audio_format_equals(audio_format, &cache->audio_format) ||
+		    end < 0.0 ||
+		    chunk->times < end - SEEK_CACHE_TOLERANCE ||
+		    chunk->times > end + SEEK_CACHE_TOLERANCE)
+			seek_cache_clear(cache);
+	}
+
+	if (g_queue_is_empty(cache->entries)) {
+		cache->song = song;
+		cache->audio_format = *audio_format;
+	}
+
+	struct seek_cache_entry *entry =
+		g_malloc(sizeof(*entry) + chunk->length);
+	entry->times = chunk->times;
+	entry->bit_rate = chunk->bit_rate;
+	entry->replay_gain_serial = chunk->replay_gain_serial;
+	entry->replay_gain_info = chunk->replay_gain_info;
+	entry->length = chunk->length;
+	memcpy(entry->data, chunk->data, chunk->length);
+
+	g_queue_push_tail(cache->entries, entry);
+	cache->size += entry->length;
+
+	/* evict the oldest entries */
+	while (cache->size > cache->max_size) {
+		entry = g_queue_pop_head(cache->entries);
+		cache->size -= entry->length;
+		g_free(entry);
+	}
+}
+
+bool
+seek_cache_seek(struct seek_cache *cache, const struct song *song,
+		float where)
+{
+	cache->cursor = NULL;
+
+	if (cache->song != song)
+		return false;
+
+	const size_t frame_size =
+		audio_format_frame_size(&cache->audio_format);
+
+	for (GList *i = cache->entries->head; i != NULL; i = i->next) {
+		const struct seek_cache_entry *entry = i->data;
+		float duration = seek_cache_entry_duration(cache, entry);
+
+		if (where < entry->times)
+			/* before the beginning of the cache */
+			return false;
+
+		if (where < entry->times + duration) {
+			/* round to the nearest frame */
+			size_t offset = (size_t)((where - entry->times) *
+						 cache->audio_format.sample_rate
+						 + 0.5) * frame_size;
+			if (offset >= entry->length)
+				offset = entry->length - frame_size;
+
+			cache->cursor = i;
+			cache->cursor_offset = offset;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+seek_cache_is_reading(const struct seek_cache *cache)
+{
+	return cache->cursor != NULL;
+}
+
+void
+seek_cache_read(struct seek_cache *cache, struct music_chunk *chunk)
+{
+	const struct seek_cache_entry *entry;
+	size_t length;
+
+	assert(seek_cache_is_reading(cache));
+	assert(music_chunk_is_empty(chunk));
+
+	entry = cache->cursor->data;
+	assert(cache->cursor_offset < entry->length);
+	length = entry->length - cache->cursor_offset;
+
+	music_chunk_reserve(chunk, length);
+	memcpy(chunk->data, entry->data + cache->cursor_offset, length);
+	chunk->length = length;
+	chunk->bit_rate = entry->bit_rate;
+	chunk->times = entry->times + cache->cursor_offset /
+		audio_format_time_to_size(&cache->audio_format);
+	chunk->replay_gain_serial = entry->replay_gain_serial;
+	chunk->replay_gain_info = entry->replay_gain_info;
+#ifndef NDEBUG
+	chunk->audio_format = cache->audio_format;
+#endif
+
+	cache->cursor = cache->cursor->next;
+	cache->cursor_offset = 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/** \file
+ *
+ * A bounded cache of the decoded PCM data which has recently been
+ * sent to the audio outputs.  It allows the player to serve seeks
+ * into the recently played part of the current song without asking
+ * the decoder.
+ */
+
+#ifndef MPD_SEEK_CACHE_H
+#define MPD_SEEK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct seek_cache;
+struct song;
+struct audio_format;
+struct music_chunk;
+
+/**
+ * Creates a new (empty) cache.
+ *
+ * @param max_size the maximum number of PCM bytes held in the cache
+ */
+struct seek_cache *
+seek_cache_new(size_t max_size);
+
+void
+seek_cache_free(struct seek_cache *cache);
+
+/**
+ * Removes all data from the cache.
+ */
+void
+seek_cache_clear(struct seek_cache *cache);
+
+/**
+ * Appends a copy of a chunk which is being sent to the audio outputs.
+ * If the chunk does not continue the cached range (different song,
+ * different audio format or a gap in the time stamps), the cache is
+ * cleared first.  Chunks without a time stamp are ignored, and chunks
+ * which are being cross-faded clear the cache.
+ */
+void
+seek_cache_add(struct seek_cache *cache, const struct song *song,
+	       const struct audio_format *audio_format,
+	       const struct music_chunk *chunk);
+
+/**
+ * Returns the time stamp where the cached range ends, or a negative
+ * value if the cache holds no data of the specified song.
+ */
+float
+seek_cache_end(const struct seek_cache *cache, const struct song *song);
+
+/**
+ * Prepares reading from the cache with seek_cache_read(), beginning
+ * at the specified position.
+ *
+ * @return false if that position is not in the cache
+ */
+bool
+seek_cache_seek(struct seek_cache *cache, const struct song *song,
+		float where);
+
+/**
+ * Is there data left to be read after seek_cache_seek()?
+ */
+bool
+seek_cache_is_reading(const struct seek_cache *cache);
+
+/**
+ * Copies the next cached block into the specified (empty) chunk.
+ * When the end of the cache is reached, reading stops.
+ */
+void
+seek_cache_read(struct seek_cache *cache, struct music_chunk *chunk);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+#include "seek_index.h"
+#include "text_file.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "seek_index"
+
+#define SEEK_INDEX_FORMAT_PREFIX "seek_index_format: "
+#define SEEK_INDEX_FILE_PREFIX "file: "
+#define SEEK_INDEX_MTIME_PREFIX "mtime: "
+#define SEEK_INDEX_SIZE_PREFIX "size: "
+#define SEEK_INDEX_POINT_PREFIX "point: "
+#define SEEK_INDEX_END "end"
+
+enum {
+	SEEK_INDEX_FORMAT = 1,
+};
+
+struct seek_index {
+	/** the absolute file system path of the song */
+	char *path;
+
+	/**
+	 * The modification time and the size of the file when it
+	 * was indexed.  If either changes, the index is discarded.
+	 */
+	time_t mtime;
+	gint64 size;
+
+	/** an array of struct seek_point, sorted by time */
+	GArray *points;
+
+	/**
+	 * Have points been added to this private copy since
+	 * seek_index_open()?
+	 */
+	bool modified;
+};
+
+static char *seek_index_path;
+
+/**
+ * This mutex protects #seek_index_files, #seek_index_lru and
+ * #seek_index_dirty.  Private copies returned by seek_index_open()
+ * are not protected.
+ */
+static GMutex *seek_index_mutex;
+
+/** maps file system paths to struct seek_index objects */
+static GHashTable *seek_index_files;
+
+/**
+ * All indexes in #seek_index_files, the least recently used one
+ * first.
+ */
+static GQueue *seek_index_lru;
+
+/** has the index changed since it was loaded? */
+static bool seek_index_dirty;
+
+static struct seek_index *
+seek_index_new(const char *path, time_t mtime, gint64 size)
+{
+	struct seek_index *index = g_new(struct seek_index, 1);
+
+	index->path = g_strdup(path);
+	index->mtime = mtime;
+	index->size = size;
+	index->points = g_array_new(false, false, sizeof(struct seek_point));
+	index->modified = false;
+
+	return index;
+}
+
+static void
+seek_index_free(struct seek_index *index)
+{
+	g_free(index->path);
+	g_array_free(index->points, true);
+	g_free(index);
+}
+
+static inline const struct seek_point *
+seek_index_point(const struct seek_index *index, unsigned i)
+{
+	return &g_array_index(index->points, struct seek_point, i);
+}
+
+/**
+ * Returns the position of the first point which is later than the
+ * specified time.
+ */
+static unsigned
+seek_index_upper_bound(const struct seek_index *index, double time)
+{
+	unsigned low = 0, high = index->points->len;
+
+	while (low < high) {
+		unsigned middle = (low + high) / 2;
+
+		if (seek_index_point(index, middle)->time <= time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/**
+ * Inserts an index into the global table, replacing an older index
+ * for the same file, and discards the least recently used indexes
+ * when the table is full.  Caller must lock the mutex.
+ */
+static void
+seek_index_insert(struct seek_index *index)
+{
+	struct seek_index *old =
+		g_hash_table_lookup(seek_index_files, index->path);
+
+	if (old != NULL) {
+		g_hash_table_remove(seek_index_files, old->path);
+		g_queue_remove(seek_index_lru, old);
+		seek_index_free(old);
+	}
+
+	g_hash_table_insert(seek_index_files, index->path, index);
+	g_queue_push_tail(seek_index_lru, index);
+
+	while (g_hash_table_size(seek_index_files) > SEEK_INDEX_MAX_FILES) {
+		old = g_queue_pop_head(seek_index_lru);
+		g_hash_table_remove(seek_index_files, old->path);
+		seek_index_free(old);
+	}
+}
+
+static bool
+seek_index_load(FILE *fp)
+{
+	GString *buffer = g_string_sized_new(1024);
+	struct seek_index *index = NULL;
+	char *line, *endptr;
+	bool success = false;
+
+	line = read_text_line(fp, buffer);
+	if (line == NULL || !g_str_has_prefix(line, SEEK_INDEX_FORMAT_PREFIX) ||
+	    atoi(line + sizeof(SEEK_INDEX_FORMAT_PREFIX) - 1) != SEEK_INDEX_FORMAT)
+		goto out;
+
+	while ((line = read_text_line(fp, buffer)) != NULL) {
+		if (g_str_has_prefix(line, SEEK_INDEX_FILE_PREFIX)) {
+			if (index != NULL)
+				goto out;
+
+			line += sizeof(SEEK_INDEX_FILE_PREFIX) - 1;
+			if (!g_path_is_absolute(line))
+				goto out;
+
+			index = seek_index_new(line, 0, 0);
+		} else if (index == NULL) {
+			goto out;
+		} else if (g_str_has_prefix(line, SEEK_INDEX_MTIME_PREFIX)) {
+			line += sizeof(SEEK_INDEX_MTIME_PREFIX) - 1;
+			index->mtime = (time_t)g_ascii_strtoll(line, NULL, 10);
+		} else if (g_str_has_prefix(line, SEEK_INDEX_SIZE_PREFIX)) {
+			line += sizeof(SEEK_INDEX_SIZE_PREFIX) - 1;
+			index->size = g_ascii_strtoll(line, NULL, 10);
+		} else if (g_str_has_prefix(line, SEEK_INDEX_POINT_PREFIX)) {
+			struct seek_point point;
+			gint64 ms;
+
+			line += sizeof(SEEK_INDEX_POINT_PREFIX) - 1;
+			ms = g_ascii_strtoll(line, &endptr, 10);
+			if (endptr == line || *endptr != ' ')
+				goto out;
+
+			point.time = ms / 1000.0;
+			point.offset = g_ascii_strtoll(endptr + 1, NULL, 10);
+			g_array_append_val(index->points, point);
+		} else if (strcmp(line, SEEK_INDEX_END) == 0) {
+			seek_index_insert(index);
+			index = NULL;
+		} else
+			goto out;
+	}
+
+	success = index == NULL;
+
+out:
+	if (index != NULL)
+		seek_index_free(index);
+	g_string_free(buffer, true);
+	return success;
+}
+
+static void
+seek_index_save(void)
+{
+	FILE *fp;
+
+	g_debug("Saving seek index %s", seek_index_path);
+
+	fp = fopen(seek_index_path, "w");
+	if (fp == NULL) {
+		g_warning("failed to create %s: %s",
+			  seek_index_path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, SEEK_INDEX_FORMAT_PREFIX "%u\n", SEEK_INDEX_FORMAT);
+
+	for (GList *i = seek_index_lru->head; i != NULL; i = i->next) {
+		const struct seek_index *index = i->data;
+
+		fprintf(fp, SEEK_INDEX_FILE_PREFIX "%s\n", index->path);
+		fprintf(fp, SEEK_INDEX_MTIME_PREFIX "%lli\n",
+			(long long)index->mtime);
+		fprintf(fp, SEEK_INDEX_SIZE_PREFIX "%lli\n",
+			(long long)index->size);
+
+		for (unsigned j = 0; j < index->points->len; ++j) {
+			const struct seek_point *point =
+				seek_index_point(index, j);
+
+			fprintf(fp, SEEK_INDEX_POINT_PREFIX "%lli %lli\n",
+				(long long)(point->time * 1000.0 + 0.5),
+				(long long)point->offset);
+		}
+
+		fprintf(fp, SEEK_INDEX_END "\n");
+	}
+
+	if (ferror(fp))
+		g_warning("failed to write %s: %s",
+			  seek_index_path, strerror(errno));
+
+	fclose(fp);
+}
+
+void
+seek_index_global_init(const char *path)
+{
+	FILE *fp;
+
+	assert(seek_index_path == NULL);
+
+	if (path == NULL)
+		return;
+
+	seek_index_path = g_strdup(path);
+	seek_index_mutex = g_mutex_new();
+	seek_index_files = g_hash_table_new(g_str_hash, g_str_equal);
+	seek_index_lru = g_queue_new();
+	seek_index_dirty = false;
+
+	fp = fopen(seek_index_path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			g_warning("failed to open %s: %s",
+				  seek_index_path, strerror(errno));
+		return;
+	}
+
+	if (!seek_index_load(fp))
+		g_warning("%s is corrupt, ignoring the rest of it",
+			  seek_index_path);
+
+	fclose(fp);
+}
+
+void
+seek_index_global_finish(void)
+{
+	struct seek_index *index;
+
+	if (seek_index_path == NULL)
+		return;
+
+	if (seek_index_dirty)
+		seek_index_save();
+
+	while ((index = g_queue_pop_head(seek_index_lru)) != NULL)
+		seek_index_free(index);
+
+	g_queue_free(seek_index_lru);
+	g_hash_table_destroy(seek_index_files);
+	g_mutex_free(seek_index_mutex);
+	g_free(seek_index_path);
+	seek_index_path = NULL;
+}
+
+struct seek_index *
+seek_index_open(const char *path_fs)
+{
+	struct seek_index *index, *old;
+	struct stat st;
+
+	if (seek_index_path == NULL || !g_path_is_absolute(path_fs) ||
+	    stat(path_fs, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	index = seek_index_new(path_fs, st.st_mtime, st.st_size);
+
+	g_mutex_lock(seek_index_mutex);
+
+	old = g_hash_table_lookup(seek_index_files, path_fs);
+	if (old != NULL && old->mtime == index->mtime &&
+	    old->size == index->size) {
+		g_array_append_vals(index->points, old->points->data,
+				    old->points->len);
+
+		/* mark it as recently used */
+		g_queue_remove(seek_index_lru, old);
+		g_queue_push_tail(seek_index_lru, old);
+	}
+
+	g_mutex_unlock(seek_index_mutex);
+
+	return index;
+}
+
+void
+seek_index_close(struct seek_index *index)
+{
+	assert(index != NULL);
+
+	if (!index->modified || index->points->len == 0 ||
+	    seek_index_point(index, index->points->len - 1)->time <
+	    SEEK_INDEX_MIN_TIME) {
+		seek_index_free(index);
+		return;
+	}
+
+	index->modified = false;
+
+	g_mutex_lock(seek_index_mutex);
+	seek_index_insert(index);
+	seek_index_dirty = true;
+	g_mutex_unlock(seek_index_mutex);
+}
+
+bool
+seek_index_lookup(const struct seek_index *index, double time,
+		  struct seek_point *point_r)
+{
+	unsigned i = seek_index_upper_bound(index, time);
+
+	if (i == 0)
+		return false;
+
+	*point_r = *seek_index_point(index, i - 1);
+	return true;
+}
+
+void
+seek_index_add(struct seek_index *index, double time, gint64 offset)
+{
+	unsigned i = seek_index_upper_bound(index, time);
+	struct seek_point point;
+
+	if (i > 0) {
+		const struct seek_point *prev = seek_index_point(index, i - 1);
+		if (time - prev->time < SEEK_INDEX_INTERVAL ||
+		    offset <= prev->offset)
+			return;
+	}
+
+	if (i < index->points->len) {
+		const struct seek_point *next = seek_index_point(index, i);
+		if (next->time - time < SEEK_INDEX_INTERVAL ||
+		    offset >= next->offset)
+			return;
+	}
+
+	point.time = time;
+	point.offset = offset;
+	g_array_insert_val(index->points, i, point);
+	index->modified = true;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * The seek index remembers byte offsets of decoder frames in long
+ * local files whose format cannot be seeked cheaply (e.g. MP3
+ * without a table of contents).  It is built while a song is being
+ * decoded, kept in memory and saved to a file on shutdown, so the
+ * next seek into a song which has been played before can jump close
+ * to its destination instead of scanning all frames from the start.
+ */
+
+#ifndef MPD_SEEK_INDEX_H
+#define MPD_SEEK_INDEX_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+/**
+ * The minimum distance between two seek points [seconds].
+ */
+#define SEEK_INDEX_INTERVAL 2.0
+
+/**
+ * Files shorter than this [seconds] are not saved in the index,
+ * because scanning them is fast enough.
+ */
+#define SEEK_INDEX_MIN_TIME 300.0
+
+/**
+ * The maximum number of files in the index.  When more are added,
+ * the least recently used ones are discarded.
+ */
+#define SEEK_INDEX_MAX_FILES 4096
+
+struct seek_point {
+	/** the time stamp of the frame [seconds] */
+	double time;
+
+	/** the byte offset of the frame within the file */
+	gint64 offset;
+};
+
+struct seek_index;
+
+/**
+ * Initializes the seek index, and loads it from the specified file.
+ *
+ * @param path the path of the index file; NULL disables the seek
+ * index
+ */
+void
+seek_index_global_init(const char *path);
+
+/**
+ * Saves the index (if it has been modified) and frees all memory.
+ */
+void
+seek_index_global_finish(void);
+
+/**
+ * Obtains a private copy of the seek index for a local file.  The
+ * caller may look up and add seek points without locking, and must
+ * pass it to seek_index_close() when done.
+ *
+ * @param path_fs the absolute file system path of the song
+ * @return the index, or NULL if the seek index is disabled or the
+ * file cannot be indexed
+ */
+struct seek_index *
+seek_index_open(const char *path_fs);
+
+/**
+ * Merges new seek points back into the global index, and frees the
+ * private copy.
+ */
+void
+seek_index_close(struct seek_index *index);
+
+/**
+ * Finds the last seek point at or before the specified time.
+ *
+ * @return true if a seek point was found
+ */
+bool
+seek_index_lookup(const struct seek_index *index, double time,
+		  struct seek_point *point_r);
+
+/**
+ * Adds a seek point.  The point is ignored if there is already a
+ * point closer than #SEEK_INDEX_INTERVAL, or if it is inconsistent
+ * with its neighbours.
+ */
+void
+seek_index_add(struct seek_index *index, double time, gint64 offset);
+
+#endif
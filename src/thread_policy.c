@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for cpu_set_t and sched_setaffinity() */
+#endif
+
+#include "config.h"
+#include "thread_policy.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#undef G_LOG_DOMAIN
+#define G_LOG_DOMAIN "thread_policy"
+
+/**
+ * The nice level which is tried when a real-time scheduler was
+ * configured, but MPD is not allowed to use it.
+ */
+static const int THREAD_POLICY_FALLBACK_NICE = -10;
+
+enum {
+	IOPRIO_CLASS_NONE,
+	IOPRIO_CLASS_RT,
+	IOPRIO_CLASS_BE,
+	IOPRIO_CLASS_IDLE,
+};
+
+static const char *const ioprio_class_names[] = {
+	[IOPRIO_CLASS_RT] = "realtime",
+	[IOPRIO_CLASS_BE] = "best-effort",
+	[IOPRIO_CLASS_IDLE] = "idle",
+};
+
+static const char *const thread_role_names[THREAD_ROLE_COUNT] = {
+	[THREAD_ROLE_PLAYER] = "player",
+	[THREAD_ROLE_DECODER] = "decoder",
+	[THREAD_ROLE_OUTPUT] = "output",
+	[THREAD_ROLE_UPDATE] = "update",
+};
+
+#ifdef HAVE_SCHED_H
+static const struct {
+	const char *name;
+	int policy;
+	bool realtime;
+} thread_schedulers[] = {
+	{ "other", SCHED_OTHER, false },
+#ifdef SCHED_BATCH
+	{ "batch", SCHED_BATCH, false },
+#endif
+#ifdef SCHED_IDLE
+	{ "idle", SCHED_IDLE, false },
+#endif
+	{ "fifo", SCHED_FIFO, true },
+	{ "rr", SCHED_RR, true },
+};
+#endif
+
+struct thread_policy {
+	bool configured;
+
+	/**
+	 * An index into thread_schedulers[], or -1 to leave the
+	 * scheduler unchanged.
+	 */
+	int scheduler;
+
+	/** the real-time priority for "fifo" and "rr" */
+	int priority;
+
+	bool have_nice;
+	int nice;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	/** the "cpu" setting, NULL if not configured */
+	char *cpu_list;
+
+	cpu_set_t cpus;
+#endif
+
+	/** one of the IOPRIO_CLASS_* constants */
+	int io_class;
+
+	int io_priority;
+};
+
+static struct thread_policy thread_policies[THREAD_ROLE_COUNT];
+
+/**
+ * Has the policy of this role been logged already?
+ */
+static volatile gint thread_policy_reported[THREAD_ROLE_COUNT];
+
+static inline GQuark
+thread_policy_quark(void)
+{
+	return g_quark_from_static_string("thread_policy");
+}
+
+static int
+thread_role_parse(const char *name)
+{
+	for (unsigned i = 0; i < THREAD_ROLE_COUNT; ++i)
+		if (strcmp(thread_role_names[i], name) == 0)
+			return i;
+
+	return -1;
+}
+
+static int
+ioprio_class_parse(const char *name)
+{
+	for (unsigned i = IOPRIO_CLASS_RT; i <= IOPRIO_CLASS_IDLE; ++i)
+		if (strcmp(ioprio_class_names[i], name) == 0)
+			return i;
+
+	return -1;
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+
+/**
+ * Parses a list of CPU numbers and ranges, e.g. "0,2-3".
+ */
+static bool
+cpu_list_parse(const char *p, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+
+	do {
+		char *endptr;
+		unsigned long first, last;
+
+		first = last = strtoul(p, &endptr, 10);
+		if (endptr == p)
+			return false;
+
+		p = endptr;
+		if (*p == '-') {
+			++p;
+			last = strtoul(p, &endptr, 10);
+			if (endptr == p || last < first)
+				return false;
+
+			p = endptr;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (unsigned long i = first; i <= last; ++i)
+			CPU_SET(i, cpus);
+
+		if (*p == ',')
+			++p;
+		else if (*p != 0)
+			return false;
+	} while (*p != 0);
+
+	return true;
+}
+
+#endif
+
+static bool
+thread_policy_parse(const struct config_param *param, GError **error_r)
+{
+	const char *value;
+	struct thread_policy *policy;
+	char *endptr;
+	int role;
+
+	value = config_get_block_string(param, "thread", NULL);
+	if (value == NULL) {
+		g_set_error(error_r, thread_policy_quark(), 0,
+			    "thread_policy without 'thread' name in line %d",
+			    param->line);
+		return false;
+	}
+
+	role = thread_role_parse(value);
+	if (role < 0) {
+		g_set_error(error_r, thread_policy_quark(), 0,
+			    "unknown thread '%s' in line %d",
+			    value, param->line);
+		return false;
+	}
+
+	policy = &thread_policies[role];
+	if (policy->configured) {
+		g_set_error(error_r, thread_policy_quark(), 0,
+			    "duplicate thread_policy for '%s' in line %d",
+			    value, param->line);
+		return false;
+	}
+
+	policy->configured = true;
+	policy->scheduler = -1;
+
+	value = config_get_block_string(param, "scheduler", NULL);
+	if (value != NULL) {
+#ifdef HAVE_SCHED_H
+		for (unsigned i = 0; i < G_N_ELEMENTS(thread_schedulers); ++i)
+			if (strcmp(thread_schedulers[i].name, value) == 0)
+				policy->scheduler = i;
+#endif
+
+		if (policy->scheduler < 0) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "unsupported scheduler '%s' in line %d",
+				    value, param->line);
+			return false;
+		}
+	}
+
+#ifdef HAVE_SCHED_H
+	if (policy->scheduler >= 0 &&
+	    thread_schedulers[policy->scheduler].realtime) {
+		int sched = thread_schedulers[policy->scheduler].policy;
+		int min = sched_get_priority_min(sched);
+		int max = sched_get_priority_max(sched);
+
+		policy->priority = config_get_block_unsigned(param, "priority",
+							     min);
+		if (policy->priority < min || policy->priority > max) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "priority must be between %d and %d "
+				    "in line %d",
+				    min, max, param->line);
+			return false;
+		}
+	}
+#endif
+
+	value = config_get_block_string(param, "nice", NULL);
+	if (value != NULL) {
+		policy->nice = strtol(value, &endptr, 10);
+		if (endptr == value || *endptr != 0 ||
+		    policy->nice < -20 || policy->nice > 19) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "nice must be between -20 and 19 "
+				    "in line %d", param->line);
+			return false;
+		}
+
+		policy->have_nice = true;
+	}
+
+	value = config_get_block_string(param, "cpu", NULL);
+	if (value != NULL) {
+#ifdef HAVE_SCHED_SETAFFINITY
+		if (!cpu_list_parse(value, &policy->cpus)) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "malformed cpu list '%s' in line %d",
+				    value, param->line);
+			return false;
+		}
+
+		policy->cpu_list = g_strdup(value);
+#else
+		g_warning("CPU affinity is not supported on this platform, "
+			  "ignoring line %d", param->line);
+#endif
+	}
+
+	policy->io_class = IOPRIO_CLASS_NONE;
+	value = config_get_block_string(param, "io_class", NULL);
+	if (value != NULL) {
+		policy->io_class = ioprio_class_parse(value);
+		if (policy->io_class < 0) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "unknown io_class '%s' in line %d",
+				    value, param->line);
+			return false;
+		}
+
+		policy->io_priority =
+			config_get_block_unsigned(param, "io_priority", 4);
+		if (policy->io_priority > 7) {
+			g_set_error(error_r, thread_policy_quark(), 0,
+				    "io_priority must be between 0 and 7 "
+				    "in line %d", param->line);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+thread_policy_global_init(GError **error_r)
+{
+	const struct config_param *param = NULL;
+
+	while ((param = config_get_next_param(CONF_THREAD_POLICY,
+					      param)) != NULL)
+		if (!thread_policy_parse(param, error_r))
+			return false;
+
+	return true;
+}
+
+void
+thread_policy_global_finish(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	for (unsigned i = 0; i < THREAD_ROLE_COUNT; ++i) {
+		g_free(thread_policies[i].cpu_list);
+		thread_policies[i].cpu_list = NULL;
+	}
+#endif
+}
+
+static void
+thread_apply_nice(int nice, GString *report)
+{
+#ifdef __linux__
+	/* on Linux, the nice level is a per-thread attribute */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) == 0)
+		g_string_append_printf(report, " nice %d;", nice);
+	else
+		g_string_append_printf(report, " nice %d failed (%s);",
+				       nice, g_strerror(errno));
+#else
+	g_string_append_printf(report, " nice %d not supported;", nice);
+#endif
+}
+
+static void
+thread_apply_scheduler(const struct thread_policy *policy, GString *report)
+{
+#ifdef HAVE_SCHED_H
+	const char *name = thread_schedulers[policy->scheduler].name;
+	bool realtime = thread_schedulers[policy->scheduler].realtime;
+	struct sched_param param;
+	int ret;
+
+	param.sched_priority = realtime ? policy->priority : 0;
+	ret = pthread_setschedparam(pthread_self(),
+				    thread_schedulers[policy->scheduler].policy,
+				    &param);
+	if (ret == 0) {
+		if (realtime)
+			g_string_append_printf(report, " scheduler %s:%d;",
+					       name, policy->priority);
+		else {
+			g_string_append_printf(report, " scheduler %s;",
+					       name);
+
+			if (policy->have_nice)
+				thread_apply_nice(policy->nice, report);
+		}
+
+		return;
+	}
+
+	g_string_append_printf(report, " scheduler %s failed (%s);",
+			       name, g_strerror(ret));
+
+	/* fall back to a nice level, which needs fewer privileges */
+	if (policy->have_nice)
+		thread_apply_nice(policy->nice, report);
+	else if (realtime)
+		thread_apply_nice(THREAD_POLICY_FALLBACK_NICE, report);
+#else
+	(void)policy;
+	g_string_append(report, " scheduler not supported;");
+#endif
+}
+
+static void
+thread_apply_affinity(const struct thread_policy *policy, GString *report)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	if (policy->cpu_list == NULL)
+		return;
+
+	if (sched_setaffinity(0, sizeof(policy->cpus), &policy->cpus) == 0)
+		g_string_append_printf(report, " cpu %s;", policy->cpu_list);
+	else
+		g_string_append_printf(report, " cpu %s failed (%s);",
+				       policy->cpu_list, g_strerror(errno));
+#else
+	(void)policy;
+	(void)report;
+#endif
+}
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+
+static bool
+ioprio_set(int io_class, int io_priority)
+{
+	/* IOPRIO_WHO_PROCESS with pid 0 means the calling thread */
+	return syscall(SYS_ioprio_set, 1, 0,
+		       (io_class << 13) | io_priority) == 0;
+}
+
+#endif
+
+static void
+thread_apply_ioprio(const struct thread_policy *policy, GString *report)
+{
+	const char *name;
+
+	if (policy->io_class == IOPRIO_CLASS_NONE)
+		return;
+
+	name = ioprio_class_names[policy->io_class];
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (ioprio_set(policy->io_class, policy->io_priority)) {
+		g_string_append_printf(report, " io %s:%d;",
+				       name, policy->io_priority);
+		return;
+	}
+
+	g_string_append_printf(report, " io %s:%d failed (%s);",
+			       name, policy->io_priority, g_strerror(errno));
+
+	/* the real-time class needs CAP_SYS_ADMIN; fall back to the
+	   highest best-effort priority */
+	if (policy->io_class == IOPRIO_CLASS_RT) {
+		if (ioprio_set(IOPRIO_CLASS_BE, 0))
+			g_string_append(report, " io best-effort:0;");
+		else
+			g_string_append_printf(report,
+					       " io best-effort:0 failed (%s);",
+					       g_strerror(errno));
+	}
+#else
+	g_string_append_printf(report, " io %s not supported;", name);
+#endif
+}
+
+void
+thread_policy_apply(enum thread_role role)
+{
+	const struct thread_policy *policy;
+	GString *report;
+
+	assert((unsigned)role < THREAD_ROLE_COUNT);
+
+	policy = &thread_policies[role];
+	if (!policy->configured)
+		return;
+
+	report = g_string_new(NULL);
+
+	if (policy->scheduler >= 0)
+		thread_apply_scheduler(policy, report);
+	else if (policy->have_nice)
+		thread_apply_nice(policy->nice, report);
+
+	thread_apply_affinity(policy, report);
+	thread_apply_ioprio(policy, report);
+
+	if (report->len > 0)
+		/* chop the trailing semicolon */
+		g_string_truncate(report, report->len - 1);
+
+	if (g_atomic_int_compare_and_exchange(&thread_policy_reported[role],
+					      0, 1))
+		g_message("%s thread policy:%s",
+			  thread_role_names[role], report->str);
+	else
+		g_debug("%s thread policy:%s",
+			thread_role_names[role], report->str);
+
+	g_string_free(report, true);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Scheduling policies for MPD's threads.  The "thread_policy" blocks
+ * in mpd.conf assign a scheduling class, a nice level, a CPU
+ * affinity and an I/O priority to each thread role.  Each thread
+ * applies the policy of its role when it starts.
+ */
+
+#ifndef MPD_THREAD_POLICY_H
+#define MPD_THREAD_POLICY_H
+
+#include <glib.h>
+
+#include <stdbool.h>
+
+enum thread_role {
+	/** the player thread, see player_thread.c */
+	THREAD_ROLE_PLAYER,
+
+	/** the decoder threads, see decoder_thread.c */
+	THREAD_ROLE_DECODER,
+
+	/** the audio output threads, see output_thread.c */
+	THREAD_ROLE_OUTPUT,
+
+	/** the database update thread, see update.c */
+	THREAD_ROLE_UPDATE,
+
+	THREAD_ROLE_COUNT
+};
+
+/**
+ * Parses the "thread_policy" blocks from the configuration.
+ *
+ * @return true on success, false on error (error_r is set)
+ */
+bool
+thread_policy_global_init(GError **error_r);
+
+/**
+ * Frees the parsed policies.  Must not be called while a thread may
+ * still call thread_policy_apply().
+ */
+void
+thread_policy_global_finish(void);
+
+/**
+ * Applies the policy of the specified role to the calling thread.
+ * When a setting cannot be applied (usually because MPD lacks the
+ * privileges), a weaker fallback is attempted.  The first time a
+ * policy is applied for a role, the result is logged.
+ */
+void
+thread_policy_apply(enum thread_role role);
+
+#endif
@@ -29,6 +29,7 @@
 #include "stats.h"
 #include "main.h"
 #include "mpd_error.h"
+#include "thread_policy.h"
 
 #include <glib.h>
 
@@ -61,6 +62,8 @@ static void * update_task(void *_path)
 {
 	const char *path = _path;
 
+	thread_policy_apply(THREAD_ROLE_UPDATE);
+
 	if (path != NULL && *path != 0)
 		g_debug("starting: %s", path);
 	else
@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * This program measures the throughput of the PCM kernels (volume,
+ * mixing, sample format and channel conversion, dithering,
+ * resampling, packing and byte swapping) on chunk sized buffers.
+ *
+ * With --save, the results are written to a baseline file; with
+ * --compare, they are compared with a previously saved baseline, and
+ * the program fails if a kernel has become slower than the tolerance
+ * allows.
+ *
+ */
+
+#include "config.h"
+#include "pcm_volume.h"
+#include "pcm_mix.h"
+#include "pcm_format.h"
+#include "pcm_channels.h"
+#include "pcm_dither.h"
+#include "pcm_resample_internal.h"
+#include "pcm_pack.h"
+#include "pcm_byteswap.h"
+#include "pcm_buffer.h"
+#include "audio_format.h"
+#include "chunk.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/**
+	 * The size of the buffers passed to the kernels: the smallest
+	 * chunk size, which is also what a CD quality stream uses.
+	 */
+	BENCH_SIZE = CHUNK_SIZE_MIN,
+};
+
+/**
+ * The parameters of one benchmark run.
+ */
+struct bench_context {
+	enum sample_format format;
+	unsigned channels, dest_channels;
+	int param;
+
+	/**
+	 * The number of input bytes passed to the kernel; a whole
+	 * number of frames not larger than #BENCH_SIZE.
+	 */
+	size_t size;
+};
+
+typedef void (*bench_function)(const struct bench_context *ctx);
+
+static double duration = 0.2;
+static double tolerance = 10;
+static char *save_path, *compare_path;
+
+/** the baseline results, name -> samples per second */
+static GHashTable *baseline;
+
+static FILE *save_file;
+
+static unsigned num_regressions;
+
+/** two chunks of input data, and two output buffers */
+static union {
+	int32_t align;
+	char data[BENCH_SIZE * 2];
+} src1, src2, dest;
+
+static struct pcm_buffer buffer;
+static struct pcm_dither dither;
+static struct pcm_resample_state resample;
+
+static void
+bench_fill(void)
+{
+	/* a random signal with some headroom */
+	uint32_t r = 1;
+	int32_t *p = (int32_t *)src1.data, *q = (int32_t *)src2.data;
+
+	for (unsigned i = 0; i < sizeof(src1.data) / sizeof(*p); ++i) {
+		r = pcm_prng(r);
+		p[i] = (int32_t)r >> 2;
+		r = pcm_prng(r);
+		q[i] = (int32_t)r >> 2;
+	}
+}
+
+static bool
+bench_load_baseline(const char *path, GError **error_r)
+{
+	char *contents;
+	if (!g_file_get_contents(path, &contents, NULL, error_r))
+		return false;
+
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for (char **i = lines; *i != NULL; ++i) {
+		char *line = g_strstrip(*i);
+		if (*line == 0 || *line == '#')
+			continue;
+
+		char *space = strrchr(line, ' ');
+		if (space == NULL)
+			continue;
+
+		*space = 0;
+		double *rate = g_new(double, 1);
+		*rate = g_ascii_strtod(space + 1, NULL);
+		g_hash_table_insert(baseline, g_strdup(g_strstrip(line)),
+				    rate);
+	}
+
+	g_strfreev(lines);
+	return true;
+}
+
+/**
+ * Runs the specified function repeatedly for the configured
+ * duration, and reports the number of samples per second.
+ *
+ * @param num_samples the number of samples processed by one call
+ */
+static void
+bench_run(const char *name, bench_function f, const struct bench_context *ctx,
+	  unsigned num_samples)
+{
+	GTimer *timer = g_timer_new();
+	unsigned long iterations = 0;
+	double elapsed;
+
+	/* warm up the caches and the buffers */
+	f(ctx);
+
+	g_timer_start(timer);
+	do {
+		for (unsigned i = 0; i < 64; ++i)
+			f(ctx);
+		iterations += 64;
+
+		elapsed = g_timer_elapsed(timer, NULL);
+	} while (elapsed < duration);
+
+	g_timer_destroy(timer);
+
+	const double rate = iterations * num_samples / elapsed;
+	printf("%-36s %10.2f Msamples/s", name, rate / 1e6);
+
+	if (baseline != NULL) {
+		const double *old = g_hash_table_lookup(baseline, name);
+		if (old != NULL) {
+			double change = (rate / *old - 1) * 100;
+			printf("  %+6.1f%%", change);
+
+			if (change < -tolerance) {
+				printf("  REGRESSION");
+				++num_regressions;
+			}
+		}
+	}
+
+	printf("\n");
+
+	if (save_file != NULL)
+		fprintf(save_file, "%s %.0f\n", name, rate);
+}
+
+/*
+ * pcm_volume
+ *
+ */
+
+static void
+bench_volume(const struct bench_context *ctx)
+{
+	struct audio_format af;
+	audio_format_init(&af, 44100, ctx->format, ctx->channels);
+
+	memcpy(dest.data, src1.data, ctx->size);
+	pcm_volume(dest.data, ctx->size, &af, PCM_VOLUME_1 / 2);
+}
+
+/*
+ * pcm_mix
+ *
+ */
+
+static void
+bench_mix(const struct bench_context *ctx)
+{
+	struct audio_format af;
+	audio_format_init(&af, 44100, ctx->format, ctx->channels);
+
+	memcpy(dest.data, src1.data, ctx->size);
+	pcm_mix(dest.data, src2.data, ctx->size, &af, 0.3);
+}
+
+/*
+ * pcm_format
+ *
+ */
+
+static void
+bench_format(const struct bench_context *ctx)
+{
+	size_t dest_size;
+
+	switch (ctx->param) {
+	case 16:
+		pcm_convert_to_16(&buffer, &dither, ctx->format,
+				  ctx->channels, src1.data, ctx->size,
+				  &dest_size);
+		break;
+
+	case 24:
+		pcm_convert_to_24(&buffer, ctx->format, src1.data,
+				  ctx->size, &dest_size);
+		break;
+
+	case 32:
+		pcm_convert_to_32(&buffer, ctx->format, src1.data,
+				  ctx->size, &dest_size);
+		break;
+	}
+}
+
+/*
+ * pcm_channels
+ *
+ */
+
+static void
+bench_channels(const struct bench_context *ctx)
+{
+	size_t dest_size;
+
+	switch (ctx->format) {
+	case SAMPLE_FORMAT_S16:
+		pcm_convert_channels_16(&buffer, ctx->dest_channels,
+					ctx->channels,
+					(const int16_t *)src1.data,
+					ctx->size, &dest_size);
+		break;
+
+	case SAMPLE_FORMAT_S24_P32:
+		pcm_convert_channels_24(&buffer, ctx->dest_channels,
+					ctx->channels,
+					(const int32_t *)src1.data,
+					ctx->size, &dest_size);
+		break;
+
+	case SAMPLE_FORMAT_S32:
+		pcm_convert_channels_32(&buffer, ctx->dest_channels,
+					ctx->channels,
+					(const int32_t *)src1.data,
+					ctx->size, &dest_size);
+		break;
+
+	default:
+		assert(false);
+	}
+}
+
+/*
+ * pcm_dither
+ *
+ */
+
+static void
+bench_dither(const struct bench_context *ctx)
+{
+	const unsigned num_samples = ctx->size / 4;
+
+	if (ctx->format == SAMPLE_FORMAT_S24_P32)
+		pcm_dither_24_to_16(&dither, (int16_t *)dest.data,
+				    (const int32_t *)src1.data,
+				    num_samples, ctx->channels);
+	else
+		pcm_dither_32_to_16(&dither, (int16_t *)dest.data,
+				    (const int32_t *)src1.data,
+				    num_samples, ctx->channels);
+}
+
+/*
+ * pcm_resample
+ *
+ */
+
+static void
+bench_resample(const struct bench_context *ctx)
+{
+	size_t dest_size;
+	GError *error = NULL;
+
+	switch (ctx->param) {
+	case 0:
+		if (ctx->format == SAMPLE_FORMAT_S16)
+			pcm_resample_fallback_16(&resample, ctx->channels,
+						 44100,
+						 (const int16_t *)src1.data,
+						 ctx->size, 48000,
+						 &dest_size);
+		else
+			pcm_resample_fallback_32(&resample, ctx->channels,
+						 44100,
+						 (const int32_t *)src1.data,
+						 ctx->size, 48000,
+						 &dest_size);
+		break;
+
+#ifdef HAVE_LIBSAMPLERATE
+	case 1:
+		if (ctx->format == SAMPLE_FORMAT_S16)
+			pcm_resample_lsr_16(&resample, ctx->channels, 44100,
+					    (const int16_t *)src1.data,
+					    ctx->size, 48000, &dest_size,
+					    &error);
+		else
+			pcm_resample_lsr_32(&resample, ctx->channels, 44100,
+					    (const int32_t *)src1.data,
+					    ctx->size, 48000, &dest_size,
+					    &error);
+		break;
+#endif
+	}
+
+	if (error != NULL) {
+		g_printerr("%s\n", error->message);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * pcm_pack
+ *
+ */
+
+static void
+bench_pack(const struct bench_context *ctx)
+{
+	const unsigned num_samples = BENCH_SIZE / 4;
+
+	if (ctx->param)
+		pcm_pack_24((uint8_t *)dest.data, (const int32_t *)src1.data,
+			    num_samples, false);
+	else
+		pcm_unpack_24((int32_t *)dest.data,
+			      (const uint8_t *)src1.data,
+			      num_samples, false);
+}
+
+/*
+ * pcm_byteswap
+ *
+ */
+
+static void
+bench_byteswap(const struct bench_context *ctx)
+{
+	if (ctx->format == SAMPLE_FORMAT_S16)
+		pcm_byteswap_16(&buffer, (const int16_t *)src1.data,
+				ctx->size);
+	else
+		pcm_byteswap_32(&buffer, (const int32_t *)src1.data,
+				ctx->size);
+}
+
+static const enum sample_format all_formats[] = {
+	SAMPLE_FORMAT_S8,
+	SAMPLE_FORMAT_S16,
+	SAMPLE_FORMAT_S24,
+	SAMPLE_FORMAT_S24_P32,
+	SAMPLE_FORMAT_S32,
+};
+
+static const enum sample_format unpacked_formats[] = {
+	SAMPLE_FORMAT_S8,
+	SAMPLE_FORMAT_S16,
+	SAMPLE_FORMAT_S24_P32,
+	SAMPLE_FORMAT_S32,
+};
+
+static const unsigned all_channels[] = { 1, 2, 6 };
+
+/**
+ * Sets up the input size for the context's format and channel
+ * count: #BENCH_SIZE rounded down to a whole number of frames, so
+ * kernels which process whole frames accept it.
+ *
+ * @return the number of samples in the input
+ */
+static unsigned
+bench_setup(struct bench_context *ctx)
+{
+	struct audio_format af;
+	audio_format_init(&af, 44100, ctx->format, ctx->channels);
+
+	const size_t frame_size = audio_format_frame_size(&af);
+	ctx->size = BENCH_SIZE / frame_size * frame_size;
+
+	return ctx->size / audio_format_sample_size(&af);
+}
+
+static void
+bench_all(void)
+{
+	struct bench_context ctx;
+	char name[64];
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(unpacked_formats); ++i) {
+		ctx.format = unpacked_formats[i];
+		ctx.channels = 2;
+
+		snprintf(name, sizeof(name), "volume/%s",
+			 sample_format_to_string(ctx.format));
+		bench_run(name, bench_volume, &ctx, bench_setup(&ctx));
+
+		snprintf(name, sizeof(name), "mix/%s",
+			 sample_format_to_string(ctx.format));
+		bench_run(name, bench_mix, &ctx, bench_setup(&ctx));
+	}
+
+	static const int format_bits[] = { 16, 24, 32 };
+	for (unsigned i = 0; i < G_N_ELEMENTS(all_formats); ++i) {
+		for (unsigned j = 0; j < G_N_ELEMENTS(format_bits); ++j) {
+			for (unsigned k = 0; k < G_N_ELEMENTS(all_channels);
+			     ++k) {
+				ctx.format = all_formats[i];
+				ctx.channels = all_channels[k];
+				ctx.param = format_bits[j];
+
+				snprintf(name, sizeof(name),
+					 "format/%s->%d/%uch",
+					 sample_format_to_string(ctx.format),
+					 ctx.param, ctx.channels);
+				bench_run(name, bench_format, &ctx,
+					  bench_setup(&ctx));
+			}
+		}
+	}
+
+	static const enum sample_format channels_formats[] = {
+		SAMPLE_FORMAT_S16,
+		SAMPLE_FORMAT_S24_P32,
+		SAMPLE_FORMAT_S32,
+	};
+	static const unsigned channel_pairs[][2] = {
+		{ 1, 2 }, { 2, 1 }, { 6, 2 }, { 2, 6 },
+	};
+	for (unsigned i = 0; i < G_N_ELEMENTS(channels_formats); ++i) {
+		for (unsigned j = 0; j < G_N_ELEMENTS(channel_pairs); ++j) {
+			ctx.format = channels_formats[i];
+			ctx.channels = channel_pairs[j][0];
+			ctx.dest_channels = channel_pairs[j][1];
+
+			snprintf(name, sizeof(name), "channels/%s/%u->%u",
+				 sample_format_to_string(ctx.format),
+				 ctx.channels, ctx.dest_channels);
+			bench_run(name, bench_channels, &ctx,
+				  bench_setup(&ctx));
+		}
+	}
+
+	static const struct {
+		const char *name;
+		enum pcm_dither_mode mode;
+	} dither_modes[] = {
+		{ "none", PCM_DITHER_NONE },
+		{ "tpdf", PCM_DITHER_TPDF },
+		{ "shaped", PCM_DITHER_SHAPED },
+	};
+	static const enum sample_format dither_formats[] = {
+		SAMPLE_FORMAT_S24_P32,
+		SAMPLE_FORMAT_S32,
+	};
+	for (unsigned i = 0; i < G_N_ELEMENTS(dither_modes); ++i) {
+		for (unsigned j = 0; j < G_N_ELEMENTS(dither_formats); ++j) {
+			for (unsigned k = 0; k < G_N_ELEMENTS(all_channels);
+			     ++k) {
+				ctx.format = dither_formats[j];
+				ctx.channels = all_channels[k];
+				pcm_dither_init(&dither, dither_modes[i].mode);
+
+				snprintf(name, sizeof(name),
+					 "dither/%s/%s/%uch",
+					 dither_modes[i].name,
+					 sample_format_to_string(ctx.format),
+					 ctx.channels);
+				bench_run(name, bench_dither, &ctx,
+					  bench_setup(&ctx));
+			}
+		}
+	}
+
+	pcm_dither_24_init(&dither);
+
+	static const char *const resamplers[] = {
+		"fallback",
+#ifdef HAVE_LIBSAMPLERATE
+		"libsamplerate",
+#endif
+	};
+	static const enum sample_format resample_formats[] = {
+		SAMPLE_FORMAT_S16,
+		SAMPLE_FORMAT_S32,
+	};
+	for (unsigned i = 0; i < G_N_ELEMENTS(resamplers); ++i) {
+		for (unsigned j = 0; j < G_N_ELEMENTS(resample_formats);
+		     ++j) {
+			for (unsigned k = 0; k < G_N_ELEMENTS(all_channels);
+			     ++k) {
+				ctx.format = resample_formats[j];
+				ctx.channels = all_channels[k];
+				ctx.param = i;
+
+				pcm_resample_init(&resample);
+
+				snprintf(name, sizeof(name),
+					 "resample/%s/%s/%uch",
+					 resamplers[i],
+					 sample_format_to_string(ctx.format),
+					 ctx.channels);
+				bench_run(name, bench_resample, &ctx,
+					  bench_setup(&ctx));
+
+				pcm_resample_deinit(&resample);
+			}
+		}
+	}
+
+	for (int pack = 0; pack <= 1; ++pack) {
+		ctx.param = pack;
+		bench_run(pack ? "pack/s24" : "unpack/s24", bench_pack, &ctx,
+			  BENCH_SIZE / 4);
+	}
+
+	static const enum sample_format byteswap_formats[] = {
+		SAMPLE_FORMAT_S16,
+		SAMPLE_FORMAT_S32,
+	};
+	for (unsigned i = 0; i < G_N_ELEMENTS(byteswap_formats); ++i) {
+		ctx.format = byteswap_formats[i];
+		ctx.channels = 2;
+
+		snprintf(name, sizeof(name), "byteswap/%s",
+			 sample_format_to_string(ctx.format));
+		bench_run(name, bench_byteswap, &ctx, bench_setup(&ctx));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	GError *error = NULL;
+
+	const GOptionEntry entries[] = {
+		{ "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &duration,
+		  "time per kernel in seconds (default 0.2)", NULL },
+		{ "save", 's', 0, G_OPTION_ARG_FILENAME, &save_path,
+		  "save the results as a baseline", "FILE" },
+		{ "compare", 'c', 0, G_OPTION_ARG_FILENAME, &compare_path,
+		  "compare with a saved baseline", "FILE" },
+		{ "tolerance", 't', 0, G_OPTION_ARG_DOUBLE, &tolerance,
+		  "allowed slowdown in percent (default 10)", NULL },
+		{ .long_name = NULL }
+	};
+
+	GOptionContext *context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_set_summary(context,
+				     "Measure the throughput of the PCM library.");
+
+	bool success = g_option_context_parse(context, &argc, &argv, &error);
+	g_option_context_free(context);
+
+	if (!success) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	if (compare_path != NULL) {
+		baseline = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, g_free);
+		if (!bench_load_baseline(compare_path, &error)) {
+			g_printerr("Failed to load the baseline: %s\n",
+				   error->message);
+			g_error_free(error);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (save_path != NULL) {
+		save_file = fopen(save_path, "w");
+		if (save_file == NULL) {
+			g_printerr("Failed to create %s\n", save_path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* the libsamplerate code reads its converter setting */
+	config_global_init();
+
+	bench_fill();
+	pcm_buffer_init(&buffer);
+	pcm_dither_24_init(&dither);
+
+	bench_all();
+
+	pcm_buffer_deinit(&buffer);
+	config_global_finish();
+
+	if (save_file != NULL)
+		fclose(save_file);
+
+	if (baseline != NULL)
+		g_hash_table_destroy(baseline);
+
+	if (num_regressions > 0) {
+		g_printerr("%u kernels are slower than the baseline\n",
+			   num_regressions);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
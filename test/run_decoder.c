@@ -105,6 +105,24 @@ void decoder_seek_error(G_GNUC_UNUSED struct decoder *decoder)
 {
 }
 
+bool
+decoder_seek_index_lookup(G_GNUC_UNUSED struct decoder *decoder,
+			  G_GNUC_UNUSED struct input_stream *is,
+			  G_GNUC_UNUSED double where,
+			  G_GNUC_UNUSED double *time_r,
+			  G_GNUC_UNUSED goffset *offset_r)
+{
+	return false;
+}
+
+void
+decoder_seek_index_add(G_GNUC_UNUSED struct decoder *decoder,
+		       G_GNUC_UNUSED struct input_stream *is,
+		       G_GNUC_UNUSED double time,
+		       G_GNUC_UNUSED goffset offset)
+{
+}
+
 size_t
 decoder_read(G_GNUC_UNUSED struct decoder *decoder,
 	     struct input_stream *is,
@@ -129,6 +147,24 @@ decoder_data(G_GNUC_UNUSED struct decoder *decoder,
 	return DECODE_COMMAND_NONE;
 }
 
+static void *data_buffer;
+
+void *
+decoder_data_begin(G_GNUC_UNUSED struct decoder *decoder,
+		   G_GNUC_UNUSED struct input_stream *is,
+		   size_t *length_r)
+{
+	data_buffer = g_realloc(data_buffer, *length_r);
+	return data_buffer;
+}
+
+enum decoder_command
+decoder_data_commit(struct decoder *decoder, struct input_stream *is,
+		    size_t length, uint16_t kbit_rate)
+{
+	return decoder_data(decoder, is, data_buffer, length, kbit_rate);
+}
+
 enum decoder_command
 decoder_tag(G_GNUC_UNUSED struct decoder *decoder,
 	    G_GNUC_UNUSED struct input_stream *is,
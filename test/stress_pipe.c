@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * This program stresses the music_pipe and music_buffer libraries: a
+ * producer thread allocates and pushes chunks, a consumer thread
+ * shifts and returns them, both as fast as possible, like the decoder
+ * and the player at a very high sample rate.  It verifies the order
+ * of the chunks, and reports the latency of each operation.
+ *
+ * The same test is run against a baseline which implements the pipe
+ * and the buffer the way they were before they became lock-free (a
+ * linked list and a free list, each protected by a mutex), and both
+ * results are printed side by side.
+ *
+ */
+
+#include "config.h"
+#include "pipe.h"
+#include "buffer.h"
+#include "chunk.h"
+#include "tag.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	NUM_CHUNKS = 64,
+	NUM_ITERATIONS = 1000000,
+};
+
+struct latency {
+	double total, max;
+	unsigned long count;
+};
+
+/**
+ * The operations of a pipe/buffer implementation under test.
+ */
+struct pipe_implementation {
+	const char *name;
+
+	void (*init)(void);
+	void (*finish)(void);
+
+	struct music_chunk *(*allocate)(void);
+	void (*push)(struct music_chunk *chunk);
+	struct music_chunk *(*shift)(void);
+	void (*return_chunk)(struct music_chunk *chunk);
+};
+
+/**
+ * The measurements of one run.
+ */
+struct run {
+	const struct pipe_implementation *implementation;
+
+	struct latency allocate, push, shift, return_chunk;
+
+	unsigned long num_errors;
+};
+
+/* chunks never carry a tag in this program */
+void
+tag_free(G_GNUC_UNUSED struct tag *tag)
+{
+}
+
+/*
+ * the real music_pipe and music_buffer
+ *
+ */
+
+static struct music_buffer *buffer;
+static struct music_pipe *mp;
+
+static void
+lockless_init(void)
+{
+	buffer = music_buffer_new(NUM_CHUNKS);
+	mp = music_pipe_new();
+}
+
+static void
+lockless_finish(void)
+{
+	music_pipe_free(mp);
+	music_buffer_free(buffer);
+}
+
+static struct music_chunk *
+lockless_allocate(void)
+{
+	return music_buffer_allocate(buffer);
+}
+
+static void
+lockless_push(struct music_chunk *chunk)
+{
+	music_pipe_push(mp, chunk);
+}
+
+static struct music_chunk *
+lockless_shift(void)
+{
+	return music_pipe_shift(mp);
+}
+
+static void
+lockless_return(struct music_chunk *chunk)
+{
+	music_buffer_return(buffer, chunk);
+}
+
+static const struct pipe_implementation lockless_implementation = {
+	.name = "lock-free",
+	.init = lockless_init,
+	.finish = lockless_finish,
+	.allocate = lockless_allocate,
+	.push = lockless_push,
+	.shift = lockless_shift,
+	.return_chunk = lockless_return,
+};
+
+/*
+ * the baseline: music_pipe and music_buffer as they were with a mutex
+ *
+ */
+
+static struct {
+	struct music_chunk *chunks;
+	struct music_chunk *available;
+
+	/** a mutex which protects #available */
+	GMutex *buffer_mutex;
+
+	struct music_chunk *head;
+	struct music_chunk **tail_r;
+
+	/** a mutex which protects #head and #tail_r */
+	GMutex *pipe_mutex;
+} locked;
+
+static void
+locked_init(void)
+{
+	locked.chunks = g_new(struct music_chunk, NUM_CHUNKS);
+	for (unsigned i = 0; i < NUM_CHUNKS - 1; ++i)
+		locked.chunks[i].next = &locked.chunks[i + 1];
+	locked.chunks[NUM_CHUNKS - 1].next = NULL;
+	locked.available = locked.chunks;
+	locked.buffer_mutex = g_mutex_new();
+
+	locked.head = NULL;
+	locked.tail_r = &locked.head;
+	locked.pipe_mutex = g_mutex_new();
+}
+
+static void
+locked_finish(void)
+{
+	g_mutex_free(locked.pipe_mutex);
+	g_mutex_free(locked.buffer_mutex);
+	g_free(locked.chunks);
+}
+
+static struct music_chunk *
+locked_allocate(void)
+{
+	g_mutex_lock(locked.buffer_mutex);
+
+	struct music_chunk *chunk = locked.available;
+	if (chunk != NULL) {
+		locked.available = chunk->next;
+		music_chunk_init(chunk);
+	}
+
+	g_mutex_unlock(locked.buffer_mutex);
+	return chunk;
+}
+
+static void
+locked_push(struct music_chunk *chunk)
+{
+	g_mutex_lock(locked.pipe_mutex);
+
+	chunk->next = NULL;
+	*locked.tail_r = chunk;
+	locked.tail_r = &chunk->next;
+
+	g_mutex_unlock(locked.pipe_mutex);
+}
+
+static struct music_chunk *
+locked_shift(void)
+{
+	g_mutex_lock(locked.pipe_mutex);
+
+	struct music_chunk *chunk = locked.head;
+	if (chunk != NULL) {
+		locked.head = chunk->next;
+		if (locked.head == NULL)
+			locked.tail_r = &locked.head;
+	}
+
+	g_mutex_unlock(locked.pipe_mutex);
+	return chunk;
+}
+
+static void
+locked_return(struct music_chunk *chunk)
+{
+	g_mutex_lock(locked.buffer_mutex);
+
+	music_chunk_free(chunk);
+	chunk->next = locked.available;
+	locked.available = chunk;
+
+	g_mutex_unlock(locked.buffer_mutex);
+}
+
+static const struct pipe_implementation locked_implementation = {
+	.name = "locked",
+	.init = locked_init,
+	.finish = locked_finish,
+	.allocate = locked_allocate,
+	.push = locked_push,
+	.shift = locked_shift,
+	.return_chunk = locked_return,
+};
+
+/*
+ * the test
+ *
+ */
+
+static void
+latency_add(struct latency *l, double t)
+{
+	l->total += t;
+	if (t > l->max)
+		l->max = t;
+	++l->count;
+}
+
+static void
+latency_print(const char *name, const struct latency *a,
+	      const struct latency *b)
+{
+	double mean_a = a->total / a->count, mean_b = b->total / b->count;
+
+	printf("%-10s mean=%8.3f us max=%10.3f us  "
+	       "mean=%8.3f us max=%10.3f us  %6.2fx\n", name,
+	       mean_a * 1e6, a->max * 1e6,
+	       mean_b * 1e6, b->max * 1e6,
+	       mean_b / mean_a);
+}
+
+static gpointer
+producer(gpointer data)
+{
+	struct run *run = data;
+	const struct pipe_implementation *impl = run->implementation;
+	GTimer *timer = g_timer_new();
+
+	for (unsigned i = 0; i < NUM_ITERATIONS; ++i) {
+		struct music_chunk *chunk;
+		double t;
+
+		while (true) {
+			g_timer_start(timer);
+			chunk = impl->allocate();
+			t = g_timer_elapsed(timer, NULL);
+
+			if (chunk != NULL)
+				break;
+
+			/* the buffer is full; wait for the consumer */
+			g_thread_yield();
+		}
+
+		latency_add(&run->allocate, t);
+
+		chunk->length = 4;
+		chunk->times = i;
+#ifndef NDEBUG
+		chunk->audio_format.sample_rate = 192000;
+		chunk->audio_format.format = SAMPLE_FORMAT_S32;
+		chunk->audio_format.channels = 8;
+#endif
+
+		g_timer_start(timer);
+		impl->push(chunk);
+		latency_add(&run->push, g_timer_elapsed(timer, NULL));
+	}
+
+	g_timer_destroy(timer);
+	return NULL;
+}
+
+static gpointer
+consumer(gpointer data)
+{
+	struct run *run = data;
+	const struct pipe_implementation *impl = run->implementation;
+	GTimer *timer = g_timer_new();
+
+	for (unsigned i = 0; i < NUM_ITERATIONS;) {
+		g_timer_start(timer);
+		struct music_chunk *chunk = impl->shift();
+		double t = g_timer_elapsed(timer, NULL);
+
+		if (chunk == NULL) {
+			/* the pipe is empty; wait for the producer */
+			g_thread_yield();
+			continue;
+		}
+
+		latency_add(&run->shift, t);
+
+		if (chunk->times != (float)i)
+			++run->num_errors;
+		++i;
+
+		g_timer_start(timer);
+		impl->return_chunk(chunk);
+		latency_add(&run->return_chunk, g_timer_elapsed(timer, NULL));
+	}
+
+	g_timer_destroy(timer);
+	return NULL;
+}
+
+static void
+run_test(struct run *run, const struct pipe_implementation *implementation)
+{
+	run->implementation = implementation;
+
+	implementation->init();
+
+	GThread *p = g_thread_create(producer, run, true, NULL);
+	GThread *c = g_thread_create(consumer, run, true, NULL);
+
+	g_thread_join(p);
+	g_thread_join(c);
+
+	implementation->finish();
+
+	if (run->num_errors > 0)
+		fprintf(stderr, "%s: %lu chunks out of order\n",
+			implementation->name, run->num_errors);
+}
+
+int main(void)
+{
+	static struct run lockless_run, locked_run;
+
+	g_thread_init(NULL);
+
+	run_test(&lockless_run, &lockless_implementation);
+	run_test(&locked_run, &locked_implementation);
+
+	printf("%-10s %-36s %-36s %s\n", "",
+	       lockless_implementation.name, locked_implementation.name,
+	       "locked/lock-free");
+	latency_print("allocate", &lockless_run.allocate, &locked_run.allocate);
+	latency_print("push", &lockless_run.push, &locked_run.push);
+	latency_print("shift", &lockless_run.shift, &locked_run.shift);
+	latency_print("return", &lockless_run.return_chunk,
+		      &locked_run.return_chunk);
+
+	return lockless_run.num_errors > 0 || locked_run.num_errors > 0
+		? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Unit test for seeking in bzip2 files: a file with many compressed
+ * blocks is generated, decoded sequentially, and then read again
+ * after random seeks (forward and backward, using the block
+ * checkpoints); the data must be identical to the sequential decode.
+ *
+ */
+
+#include "config.h"
+#include "archive/bz2_archive_plugin.h"
+#include "archive_api.h"
+#include "input_init.h"
+#include "input_stream.h"
+#include "tag_pool.h"
+#include "conf.h"
+
+#include <glib.h>
+
+#include <bzlib.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	/**
+	 * The size of the generated data; with a block size of
+	 * 100 kB, this results in about 15 compressed blocks.
+	 */
+	DATA_SIZE = 1536 * 1024,
+
+	NUM_SEEKS = 200,
+};
+
+static unsigned num_errors;
+
+static void
+check(bool condition, const char *message)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", message);
+		++num_errors;
+	}
+}
+
+/**
+ * Generates compressible data which does not repeat: "words" from a
+ * pseudo random generator.
+ */
+static char *
+generate_data(void)
+{
+	char *data = g_malloc(DATA_SIZE);
+	guint32 seed = 42;
+
+	for (size_t i = 0; i < DATA_SIZE; ++i) {
+		seed = seed * 1103515245 + 12345;
+		unsigned r = (seed >> 16) % 32;
+		data[i] = r < 26 ? (char)('a' + r) : ' ';
+	}
+
+	return data;
+}
+
+/**
+ * Compresses the data with the smallest block size, and writes it to
+ * the specified file.
+ */
+static bool
+write_bz2(const char *path, const char *data)
+{
+	unsigned int length = DATA_SIZE + DATA_SIZE / 100 + 600;
+	char *buffer = g_malloc(length);
+	GError *error = NULL;
+
+	int ret = BZ2_bzBuffToBuffCompress(buffer, &length, (char *)data,
+					   DATA_SIZE, 1, 0, 0);
+	bool success = ret == BZ_OK &&
+		g_file_set_contents(path, buffer, length, &error);
+	if (error != NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+	}
+
+	g_free(buffer);
+	return success;
+}
+
+/**
+ * Reads from the current offset until the buffer is full or the end
+ * of the stream is reached.
+ */
+static size_t
+read_full(struct input_stream *is, char *buffer, size_t size)
+{
+	GError *error = NULL;
+	size_t position = 0;
+
+	while (position < size) {
+		size_t nbytes = input_stream_read(is, buffer + position,
+						  size - position, &error);
+		if (nbytes == 0) {
+			if (error != NULL) {
+				g_warning("%s", error->message);
+				g_error_free(error);
+			}
+
+			break;
+		}
+
+		position += nbytes;
+	}
+
+	return position;
+}
+
+/**
+ * Seeks to random positions and compares the data read there with the
+ * sequential decode.
+ */
+static void
+random_seeks(struct input_stream *is, const char *sequential, size_t size)
+{
+	GError *error = NULL;
+	char *buffer = g_malloc(128 * 1024);
+	guint32 seed = 7;
+
+	for (unsigned i = 0; i < NUM_SEEKS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		goffset offset = (seed >> 8) % (size + 1);
+		seed = seed * 1103515245 + 12345;
+		int whence = (seed >> 16) % 3;
+		goffset argument = offset;
+
+		if (whence == SEEK_CUR)
+			argument = offset - is->offset;
+		else if (whence == SEEK_END)
+			argument = offset - (goffset)size;
+
+		if (!input_stream_seek(is, argument, whence, &error)) {
+			fprintf(stderr, "FAIL: seek to %lld: %s\n",
+				(long long)offset,
+				error != NULL ? error->message : "unknown");
+			if (error != NULL)
+				g_clear_error(&error);
+			++num_errors;
+			continue;
+		}
+
+		check(is->offset == offset, "offset after seek");
+
+		seed = seed * 1103515245 + 12345;
+		size_t length = (seed >> 8) % (128 * 1024);
+		if (length > size - offset)
+			length = size - offset;
+
+		size_t nbytes = read_full(is, buffer, length);
+		check(nbytes == length &&
+		      memcmp(buffer, sequential + offset, length) == 0,
+		      "data after seek differs from the sequential decode");
+	}
+
+	g_free(buffer);
+}
+
+static void
+test_seek(const char *path, const char *data)
+{
+	GError *error = NULL;
+	struct archive_file *file =
+		archive_file_open(&bz2_archive_plugin, path, &error);
+	if (file == NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		++num_errors;
+		return;
+	}
+
+	struct input_stream *is =
+		archive_file_open_stream(file, "data", &error);
+	if (is == NULL) {
+		g_warning("%s", error->message);
+		g_error_free(error);
+		archive_file_close(file);
+		++num_errors;
+		return;
+	}
+
+	check(is->seekable, "bz2 stream is seekable");
+
+	/* sequential decode */
+
+	char *sequential = g_malloc(DATA_SIZE + 1);
+	size_t size = read_full(is, sequential, DATA_SIZE + 1);
+	check(size == DATA_SIZE && memcmp(sequential, data, size) == 0,
+	      "sequential decode");
+	check(input_stream_eof(is), "end of stream");
+	check(is->size == (goffset)size, "size is known after decoding");
+
+	random_seeks(is, sequential, size);
+
+	/* a new stream on the same archive uses the checkpoints
+	   which were recorded by the first one */
+
+	struct input_stream *is2 =
+		archive_file_open_stream(file, "data", &error);
+	if (is2 != NULL) {
+		check(is2->size == (goffset)size, "second stream knows the size");
+		random_seeks(is2, sequential, size);
+		input_stream_close(is2);
+	} else {
+		g_warning("%s", error->message);
+		g_clear_error(&error);
+		++num_errors;
+	}
+
+	check(!input_stream_seek(is, size + 1, SEEK_SET, &error),
+	      "seek beyond the end fails");
+	g_clear_error(&error);
+
+	input_stream_close(is);
+	archive_file_close(file);
+	g_free(sequential);
+}
+
+int main(void)
+{
+	GError *error = NULL;
+	char tmp[] = "/tmp/mpd_test_bz2_seek.XXXXXX";
+
+	g_thread_init(NULL);
+
+	if (mkdtemp(tmp) == NULL)
+		g_error("mkdtemp() failed: %s", g_strerror(errno));
+
+	tag_pool_init();
+	config_global_init();
+
+	if (!input_stream_global_init(&error))
+		g_error("%s", error->message);
+
+	char *data = generate_data();
+	char *path = g_build_filename(tmp, "data.bz2", NULL);
+
+	if (write_bz2(path, data))
+		test_seek(path, data);
+	else
+		check(false, "failed to create the bz2 file");
+
+	unlink(path);
+	rmdir(tmp);
+	g_free(path);
+	g_free(data);
+
+	input_stream_global_finish();
+	config_global_finish();
+	tag_pool_deinit();
+
+	if (num_errors > 0) {
+		fprintf(stderr, "%u error(s)\n", num_errors);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
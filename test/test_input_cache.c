@@ -0,0 +1,796 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Unit test for the input cache: a small HTTP server on a loopback
+ * socket serves generated resources, and the requests it receives
+ * are compared with what the cache should still have to fetch.  The
+ * cache index is reloaded between the steps, and its contents are
+ * checked as well.
+ *
+ */
+
+#include "config.h"
+#include "input_init.h"
+#include "input_stream.h"
+#include "input/cache_input_plugin.h"
+#include "tag_pool.h"
+#include "conf.h"
+
+#ifdef ENABLE_ARCHIVE
+#include "archive_list.h"
+#endif
+
+#include <glib.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	KIB = 1024,
+};
+
+struct resource {
+	const char *path;
+
+	/**
+	 * The size of the generated body.
+	 */
+	goffset size;
+
+	/**
+	 * The name of the validator header: "ETag" or
+	 * "Last-Modified".
+	 */
+	const char *validator;
+
+	char version[32];
+
+	/**
+	 * Send "Accept-Ranges"?  Without it, the stream is not
+	 * seekable.
+	 */
+	bool ranges;
+
+	/**
+	 * If not NULL, then the server redirects to this path, and
+	 * sends a bogus validator with the redirect.
+	 */
+	const char *location;
+};
+
+static struct resource resources[] = {
+	{ "/a", 512 * KIB, "ETag", "\"a1\"", true, NULL },
+	{ "/b", 384 * KIB, "ETag", "\"b1\"", true, NULL },
+	{ "/c", 384 * KIB, "ETag", "\"c1\"", true, NULL },
+	{ "/n", 256 * KIB, "Last-Modified", "Sat, 01 Jan 2011 00:00:00 GMT",
+	  false, NULL },
+	{ "/r", 0, "ETag", "\"redirect\"", true, "/n" },
+};
+
+#define RESOURCE_A (&resources[0])
+#define RESOURCE_B (&resources[1])
+#define RESOURCE_C (&resources[2])
+#define RESOURCE_N (&resources[3])
+#define RESOURCE_R (&resources[4])
+
+struct request {
+	const struct resource *resource;
+
+	/**
+	 * The start of the "Range" header, 0 if there was none.
+	 */
+	goffset start;
+};
+
+static GMutex *server_mutex;
+static GArray *requests;
+static unsigned server_port;
+static char *cache_dir;
+static unsigned num_errors;
+
+static void
+check(bool condition, const char *message)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", message);
+		++num_errors;
+	}
+}
+
+static unsigned char
+resource_byte(const struct resource *r, goffset offset)
+{
+	return (unsigned char)(offset ^ (offset >> 9) ^ r->path[1]);
+}
+
+static const struct resource *
+find_resource(const char *path)
+{
+	for (unsigned i = 0; i < G_N_ELEMENTS(resources); ++i)
+		if (strcmp(resources[i].path, path) == 0)
+			return &resources[i];
+
+	return NULL;
+}
+
+static bool
+write_full(int fd, const void *data, size_t length)
+{
+	const char *p = data;
+
+	while (length > 0) {
+		ssize_t nbytes = write(fd, p, length);
+		if (nbytes <= 0)
+			return false;
+
+		p += nbytes;
+		length -= nbytes;
+	}
+
+	return true;
+}
+
+/**
+ * Handles one HTTP request on a new connection.
+ */
+static gpointer
+server_connection(gpointer data)
+{
+	int fd = GPOINTER_TO_INT(data);
+	char buffer[4096], path[256];
+	size_t length = 0;
+	ssize_t nbytes;
+
+	/* read the request header */
+
+	do {
+		nbytes = read(fd, buffer + length, sizeof(buffer) - 1 - length);
+		if (nbytes <= 0) {
+			close(fd);
+			return NULL;
+		}
+
+		length += nbytes;
+		buffer[length] = 0;
+	} while (strstr(buffer, "\r\n\r\n") == NULL &&
+		 length < sizeof(buffer) - 1);
+
+	if (sscanf(buffer, "GET %255s", path) != 1) {
+		close(fd);
+		return NULL;
+	}
+
+	long long start = 0;
+	const char *range = strstr(buffer, "\nRange: bytes=");
+	if (range != NULL)
+		start = strtoll(range + 14, NULL, 10);
+
+	g_mutex_lock(server_mutex);
+
+	const struct resource *r = find_resource(path);
+	struct resource copy;
+	if (r != NULL) {
+		struct request request = { r, start };
+		g_array_append_val(requests, request);
+		copy = *r;
+	}
+
+	g_mutex_unlock(server_mutex);
+
+	if (r == NULL) {
+		static const char not_found[] =
+			"HTTP/1.1 404 Not Found\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+		write_full(fd, not_found, sizeof(not_found) - 1);
+		close(fd);
+		return NULL;
+	}
+
+	if (copy.location != NULL) {
+		length = g_snprintf(buffer, sizeof(buffer),
+				    "HTTP/1.1 302 Found\r\n"
+				    "Location: http://127.0.0.1:%u%s\r\n"
+				    "%s: %s\r\n"
+				    "Content-Length: 0\r\n"
+				    "Connection: close\r\n\r\n",
+				    server_port, copy.location,
+				    copy.validator, copy.version);
+		write_full(fd, buffer, length);
+		close(fd);
+		return NULL;
+	}
+
+	if (start > copy.size)
+		start = copy.size;
+
+	length = g_snprintf(buffer, sizeof(buffer),
+			    "HTTP/1.1 %s\r\n"
+			    "%s"
+			    "%s: %s\r\n"
+			    "Content-Type: application/octet-stream\r\n"
+			    "Content-Length: %lld\r\n"
+			    "Connection: close\r\n\r\n",
+			    range != NULL ? "206 Partial Content" : "200 OK",
+			    copy.ranges ? "Accept-Ranges: bytes\r\n" : "",
+			    copy.validator, copy.version,
+			    (long long)copy.size - start);
+	if (!write_full(fd, buffer, length)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* send the body; the client closes the connection when it
+	   seeks */
+
+	goffset offset = start;
+	while (offset < copy.size) {
+		length = sizeof(buffer);
+		if ((goffset)length > copy.size - offset)
+			length = (size_t)(copy.size - offset);
+
+		for (size_t i = 0; i < length; ++i)
+			buffer[i] = resource_byte(&copy, offset + i);
+
+		if (!write_full(fd, buffer, length))
+			break;
+
+		offset += length;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static gpointer
+server_run(gpointer data)
+{
+	int listen_fd = GPOINTER_TO_INT(data);
+
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			break;
+
+		g_thread_create(server_connection, GINT_TO_POINTER(fd),
+				false, NULL);
+	}
+
+	return NULL;
+}
+
+static void
+server_start(void)
+{
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+	int fd;
+
+	/* the client closes connections while data is still being
+	   sent */
+	signal(SIGPIPE, SIG_IGN);
+
+	server_mutex = g_mutex_new();
+	requests = g_array_new(false, false, sizeof(struct request));
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		g_error("socket() failed: %s", g_strerror(errno));
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+	    listen(fd, 8) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&address, &address_length) < 0)
+		g_error("failed to listen: %s", g_strerror(errno));
+
+	server_port = ntohs(address.sin_port);
+
+	g_thread_create(server_run, GINT_TO_POINTER(fd), false, NULL);
+}
+
+static char *
+resource_uri(const struct resource *r)
+{
+	return g_strdup_printf("http://127.0.0.1:%u%s", server_port, r->path);
+}
+
+/**
+ * Returns the number of requests received so far.
+ */
+static unsigned
+request_mark(void)
+{
+	g_mutex_lock(server_mutex);
+	unsigned n = requests->len;
+	g_mutex_unlock(server_mutex);
+	return n;
+}
+
+/**
+ * Copies the request with the specified index, if it exists.
+ */
+static bool
+get_request(unsigned i, struct request *request_r)
+{
+	g_mutex_lock(server_mutex);
+	bool found = i < requests->len;
+	if (found)
+		*request_r = g_array_index(requests, struct request, i);
+	g_mutex_unlock(server_mutex);
+	return found;
+}
+
+static struct input_stream *
+open_resource(const struct resource *r)
+{
+	GError *error = NULL;
+	char *uri = resource_uri(r);
+	struct input_stream *is = input_stream_open(uri, &error);
+	g_free(uri);
+
+	if (is == NULL) {
+		g_error("failed to open %s: %s", r->path,
+			error != NULL ? error->message : "unknown error");
+		return NULL;
+	}
+
+	while (!is->ready) {
+		int ret = input_stream_buffer(is, &error);
+		if (ret < 0)
+			g_error("%s", error->message);
+
+		if (ret == 0)
+			g_usleep(1000);
+	}
+
+	return is;
+}
+
+/**
+ * Reads a range of the resource and compares the data with what
+ * the server has generated.
+ */
+static bool
+read_range(struct input_stream *is, const struct resource *r,
+	   goffset offset, size_t length)
+{
+	GError *error = NULL;
+	unsigned char buffer[7000];
+
+	if (is->offset != offset &&
+	    !input_stream_seek(is, offset, SEEK_SET, &error)) {
+		if (error != NULL)
+			g_error_free(error);
+		return false;
+	}
+
+	while (length > 0) {
+		size_t nbytes = length < sizeof(buffer)
+			? length : sizeof(buffer);
+
+		nbytes = input_stream_read(is, buffer, nbytes, &error);
+		if (nbytes == 0) {
+			if (error != NULL) {
+				fprintf(stderr, "%s: %s\n",
+					r->path, error->message);
+				g_error_free(error);
+				return false;
+			}
+
+			if (input_stream_eof(is))
+				return false;
+
+			continue;
+		}
+
+		for (size_t i = 0; i < nbytes; ++i) {
+			if (buffer[i] != resource_byte(r, offset + i)) {
+				fprintf(stderr, "%s: wrong data at %lld\n",
+					r->path, (long long)(offset + i));
+				return false;
+			}
+		}
+
+		offset += nbytes;
+		length -= nbytes;
+	}
+
+	return true;
+}
+
+/**
+ * Saves the cache index and loads it again.  Returns the index file
+ * contents.
+ */
+static char *
+reload(void)
+{
+	char *path = g_build_filename(cache_dir, "index", NULL);
+	char *contents = NULL;
+
+	input_cache_global_finish();
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		contents = g_strdup("");
+
+	input_cache_global_init();
+
+	g_free(path);
+	return contents;
+}
+
+/**
+ * Extracts the index entry of the specified resource.  Returns NULL
+ * if it is not in the index.
+ */
+static char *
+index_entry(const char *index, const struct resource *r)
+{
+	char *uri = resource_uri(r);
+	char *needle = g_strconcat("uri: ", uri, "\n", NULL);
+	const char *begin = strstr(index, needle), *end;
+
+	g_free(needle);
+	g_free(uri);
+
+	if (begin == NULL)
+		return NULL;
+
+	end = strstr(begin, "\nend\n");
+	return end != NULL
+		? g_strndup(begin, end - begin + 1)
+		: NULL;
+}
+
+static unsigned
+count_lines(const char *s, const char *prefix)
+{
+	unsigned n = 0;
+
+	while ((s = strstr(s, prefix)) != NULL) {
+		++n;
+		++s;
+	}
+
+	return n;
+}
+
+/**
+ * Checks the index entry of a resource.  The size and ETag are
+ * compared with the resource; the ranges must be exactly the ones
+ * specified (an empty string if the entry must not exist).
+ */
+static void
+check_entry(const char *index, const struct resource *r,
+	    const char *ranges, const char *message)
+{
+	char *entry = index_entry(index, r);
+
+	if (*ranges == 0) {
+		check(entry == NULL, message);
+		g_free(entry);
+		return;
+	}
+
+	if (entry == NULL) {
+		check(false, message);
+		return;
+	}
+
+	char *version = g_strdup_printf("version: %s\n", r->version);
+	char *size = g_strdup_printf("size: %lld\n", (long long)r->size);
+
+	check(strstr(entry, version) != NULL &&
+	      strstr(entry, size) != NULL &&
+	      strstr(entry, ranges) != NULL &&
+	      count_lines(entry, "range: ") == count_lines(ranges, "range: "),
+	      message);
+
+	g_free(size);
+	g_free(version);
+	g_free(entry);
+}
+
+/**
+ * Step 1: the second read of a resource is served from the cache;
+ * the server sees only the request which validates the entry.
+ */
+static void
+test_second_read(void)
+{
+	struct input_stream *is = open_resource(RESOURCE_A);
+	check(read_range(is, RESOURCE_A, 0, RESOURCE_A->size),
+	      "first read");
+	input_stream_close(is);
+
+	unsigned mark = request_mark();
+	is = open_resource(RESOURCE_A);
+	check(read_range(is, RESOURCE_A, 300 * KIB, 100 * KIB) &&
+	      read_range(is, RESOURCE_A, 0, RESOURCE_A->size),
+	      "second read");
+	input_stream_close(is);
+
+	struct request request;
+	check(get_request(mark, &request) && request.start == 0 &&
+	      !get_request(mark + 1, &request),
+	      "second read was served from the cache");
+}
+
+/**
+ * Step 2: ranges which were read after seeking are stored
+ * separately, and merged when the data in between arrives.
+ */
+static void
+test_seek_merge(void)
+{
+	struct input_stream *is = open_resource(RESOURCE_B);
+	check(read_range(is, RESOURCE_B, 0, 64 * KIB) &&
+	      read_range(is, RESOURCE_B, 256 * KIB, 64 * KIB),
+	      "read after seek");
+	input_stream_close(is);
+
+	char *index = reload();
+	check_entry(index, RESOURCE_B,
+		    "range: 0 65536\nrange: 262144 327680\n",
+		    "two separate ranges");
+	g_free(index);
+
+	is = open_resource(RESOURCE_B);
+	check(read_range(is, RESOURCE_B, 64 * KIB, 192 * KIB),
+	      "read between the ranges");
+	input_stream_close(is);
+
+	index = reload();
+	check_entry(index, RESOURCE_B, "range: 0 327680\n",
+		    "adjacent ranges are merged");
+	g_free(index);
+}
+
+/**
+ * Step 3: a sequential read requests only the missing data from
+ * the server.  The CURL buffer (64 kB) is too small to skip the
+ * cached ranges, so the gap needs a new request.
+ */
+static void
+test_gap(void)
+{
+	unsigned mark = request_mark();
+
+	struct input_stream *is = open_resource(RESOURCE_B);
+	check(read_range(is, RESOURCE_B, 0, RESOURCE_B->size),
+	      "sequential read with gap");
+	input_stream_close(is);
+
+	struct request request;
+	unsigned n = 0;
+	for (unsigned i = mark + 1; get_request(i, &request); ++i) {
+		check(request.start >= 320 * KIB,
+		      "only the gap is requested");
+		++n;
+	}
+
+	check(n > 0, "the gap is requested");
+
+	char *index = reload();
+	check_entry(index, RESOURCE_B, "range: 0 393216\n",
+		    "the gap has been filled");
+	g_free(index);
+}
+
+/**
+ * Step 4: the least recently used entry is evicted when the cache
+ * size (1 MiB) is exceeded.
+ */
+static void
+test_eviction(void)
+{
+	struct input_stream *is = open_resource(RESOURCE_C);
+	check(read_range(is, RESOURCE_C, 0, RESOURCE_C->size),
+	      "read third resource");
+	input_stream_close(is);
+
+	char *index = reload();
+	check_entry(index, RESOURCE_A, "", "LRU entry has been evicted");
+	check_entry(index, RESOURCE_B, "range: 0 393216\n",
+		    "recent entry is kept");
+	check_entry(index, RESOURCE_C, "range: 0 393216\n",
+		    "new entry is stored");
+	g_free(index);
+}
+
+/**
+ * Step 5: a modified resource (different ETag or size) invalidates
+ * its entry.
+ */
+static void
+test_invalidation(void)
+{
+	g_mutex_lock(server_mutex);
+	strcpy(RESOURCE_B->version, "\"b2\"");
+	RESOURCE_C->size = 300 * KIB;
+	g_mutex_unlock(server_mutex);
+
+	struct input_stream *is = open_resource(RESOURCE_B);
+	check(read_range(is, RESOURCE_B, 0, 1000), "read modified resource");
+	input_stream_close(is);
+
+	is = open_resource(RESOURCE_C);
+	check(is->size == RESOURCE_C->size, "new size");
+	check(read_range(is, RESOURCE_C, 0, 1000), "read resized resource");
+	input_stream_close(is);
+
+	char *index = reload();
+	check_entry(index, RESOURCE_B, "range: 0 1000\n",
+		    "ETag change invalidates the entry");
+	check_entry(index, RESOURCE_C, "range: 0 1000\n",
+		    "size change invalidates the entry");
+	g_free(index);
+
+	/* the reloaded entry is used */
+	unsigned mark = request_mark();
+	is = open_resource(RESOURCE_B);
+	check(read_range(is, RESOURCE_B, 0, RESOURCE_B->size),
+	      "read after reload");
+	input_stream_close(is);
+
+	struct request request;
+	for (unsigned i = mark + 1; get_request(i, &request); ++i)
+		check(request.start >= 1000,
+		      "reloaded range is not requested again");
+}
+
+/**
+ * Step 6: a stream which is not seekable skips forward by reading
+ * (and storing) the data in between, and seeks back into the
+ * cache.  The validator of a redirect response is not used for the
+ * target resource.
+ */
+static void
+test_not_seekable(void)
+{
+	unsigned mark = request_mark();
+
+	struct input_stream *is = open_resource(RESOURCE_R);
+	check(read_range(is, RESOURCE_N, 0, 1000) &&
+	      read_range(is, RESOURCE_N, 200000, 1000),
+	      "skip forward in a stream which is not seekable");
+	check(read_range(is, RESOURCE_N, 0, 1000) &&
+	      read_range(is, RESOURCE_N, 100000, 1000),
+	      "seek back into the cache");
+	input_stream_close(is);
+
+	struct request request;
+	check(get_request(mark + 1, &request) &&
+	      request.resource == RESOURCE_N &&
+	      !get_request(mark + 2, &request),
+	      "stream which is not seekable is requested once");
+
+	char *index = reload();
+	char *entry = index_entry(index, RESOURCE_R);
+	check(entry != NULL && strstr(entry, RESOURCE_N->version) != NULL,
+	      "validator of the redirect is ignored");
+	check(entry != NULL && strstr(entry, "range: 0 201000\n") != NULL,
+	      "skipped data is stored");
+	g_free(entry);
+	g_free(index);
+}
+
+static void
+remove_directory(const char *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	if (dir != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *child = g_build_filename(path, name, NULL);
+			unlink(child);
+			g_free(child);
+		}
+
+		g_dir_close(dir);
+	}
+
+	rmdir(path);
+}
+
+int main(void)
+{
+	GError *error = NULL;
+	char tmp[] = "/tmp/mpd_test_input_cache.XXXXXX";
+
+	g_thread_init(NULL);
+
+	if (mkdtemp(tmp) == NULL)
+		g_error("mkdtemp() failed: %s", g_strerror(errno));
+
+	cache_dir = g_build_filename(tmp, "cache", NULL);
+
+	char *config_path = g_build_filename(tmp, "mpd.conf", NULL);
+	char *config = g_strdup_printf("input_cache_directory \"%s\"\n"
+				       "input_cache_size \"1\"\n"
+				       "input {\n"
+				       "  plugin \"curl\"\n"
+				       "  buffer_size \"64\"\n"
+				       "}\n",
+				       cache_dir);
+	if (!g_file_set_contents(config_path, config, -1, &error))
+		g_error("%s", error->message);
+	g_free(config);
+
+	tag_pool_init();
+	config_global_init();
+
+	if (!config_read_file(config_path, &error))
+		g_error("%s", error->message);
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_init_all();
+#endif
+
+	if (!input_stream_global_init(&error))
+		g_error("%s", error->message);
+
+	input_cache_global_init();
+
+	server_start();
+
+	test_second_read();
+	test_seek_merge();
+	test_gap();
+	test_eviction();
+	test_invalidation();
+	test_not_seekable();
+
+	input_cache_global_finish();
+	input_stream_global_finish();
+
+#ifdef ENABLE_ARCHIVE
+	archive_plugin_deinit_all();
+#endif
+
+	config_global_finish();
+	tag_pool_deinit();
+
+	remove_directory(cache_dir);
+	unlink(config_path);
+	rmdir(tmp);
+	g_free(config_path);
+	g_free(cache_dir);
+
+	if (num_errors > 0) {
+		fprintf(stderr, "%u error(s)\n", num_errors);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * This program measures the quality of the dithering library
+ * (pcm_dither.c).  It converts a 24 bit sine wave to 16 bit with all
+ * dithering modes, and checks the level of the quantization noise.
+ *
+ */
+
+#include "config.h"
+#include "pcm_dither.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+enum {
+	CHANNELS = 2,
+	FRAMES = 48000,
+	SAMPLES = FRAMES * CHANNELS,
+
+	/**
+	 * The length of the moving average used to estimate the
+	 * low-frequency part of the noise.
+	 */
+	LOWPASS = 16,
+};
+
+struct dither_result {
+	/** the mean error in 16 bit LSB */
+	double mean;
+
+	/** the total noise in 16 bit LSB RMS */
+	double rms;
+
+	/** the low-frequency noise in 16 bit LSB RMS */
+	double lowpass_rms;
+};
+
+static void
+make_sine(int32_t *dest)
+{
+	/* 997 Hz at -20 dBFS; the right channel is inverted */
+	for (unsigned i = 0; i < FRAMES; ++i) {
+		double value = 0.1 * sin(2 * M_PI * 997.0 * i / 48000.0);
+		int32_t sample = (int32_t)(value * (1 << 23));
+
+		dest[i * CHANNELS] = sample;
+		dest[i * CHANNELS + 1] = -sample;
+	}
+}
+
+static void
+measure(enum pcm_dither_mode mode, const int32_t *src,
+	struct dither_result *result)
+{
+	static int16_t dest[SAMPLES];
+	struct pcm_dither dither;
+
+	pcm_dither_init(&dither, mode);
+
+	/* convert in blocks of varying size, like the decoder
+	   does */
+	for (unsigned i = 0, n = 1; i < FRAMES; i += n, n = n * 3 % 1031) {
+		if (i + n > FRAMES)
+			n = FRAMES - i;
+
+		pcm_dither_24_to_16(&dither, dest + i * CHANNELS,
+				    src + i * CHANNELS, n * CHANNELS,
+				    CHANNELS);
+	}
+
+	double sum = 0, sum2 = 0, lowpass_sum2 = 0;
+	unsigned lowpass_count = 0;
+
+	for (unsigned c = 0; c < CHANNELS; ++c) {
+		double window = 0;
+
+		for (unsigned i = 0; i < FRAMES; ++i) {
+			unsigned j = i * CHANNELS + c;
+			double error = dest[j] - src[j] / 256.0;
+
+			sum += error;
+			sum2 += error * error;
+
+			window += error;
+			if (i % LOWPASS == LOWPASS - 1) {
+				window /= LOWPASS;
+				lowpass_sum2 += window * window;
+				++lowpass_count;
+				window = 0;
+			}
+		}
+	}
+
+	result->mean = sum / SAMPLES;
+	result->rms = sqrt(sum2 / SAMPLES);
+	result->lowpass_rms = sqrt(lowpass_sum2 / lowpass_count);
+}
+
+static bool
+check(const char *name, const struct dither_result *result,
+      double min_rms, double max_rms)
+{
+	printf("%-8s mean=%+.4f rms=%.4f lowpass_rms=%.4f LSB\n",
+	       name, result->mean, result->rms, result->lowpass_rms);
+
+	if (fabs(result->mean) > 0.05 ||
+	    result->rms < min_rms || result->rms > max_rms) {
+		fprintf(stderr, "%s: noise level out of range\n", name);
+		return false;
+	}
+
+	return true;
+}
+
+int main(void)
+{
+	static int32_t src[SAMPLES];
+	struct dither_result none, tpdf, shaped;
+	bool success = true;
+
+	make_sine(src);
+
+	measure(PCM_DITHER_NONE, src, &none);
+	measure(PCM_DITHER_TPDF, src, &tpdf);
+	measure(PCM_DITHER_SHAPED, src, &shaped);
+
+	/* rounding: uniform error, 1/sqrt(12) LSB */
+	success = check("none", &none, 0.25, 0.33) && success;
+
+	/* rounding plus TPDF noise: 1/2 LSB */
+	success = check("tpdf", &tpdf, 0.45, 0.55) && success;
+
+	/* noise shaping increases the total noise ... */
+	success = check("shaped", &shaped, 0.45, 1.5) && success;
+
+	/* ... but moves it away from the low frequencies */
+	if (shaped.lowpass_rms >= tpdf.lowpass_rms) {
+		fprintf(stderr, "shaped: no noise shaping effect\n");
+		success = false;
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2003-2011 The Music Player Daemon Project
+ * http://www.musicpd.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/*
+ * Unit test for the seek cache: contiguous chunks are appended, the
+ * oldest ones are evicted, a gap clears the cache, and reading after
+ * a seek returns sample accurate data.
+ *
+ */
+
+#include "config.h"
+#include "seek_cache.h"
+#include "chunk.h"
+#include "audio_format.h"
+#include "tag.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	SAMPLE_RATE = 1000,
+
+	/** frames per chunk; each chunk is 0.1s long */
+	FRAMES = 100,
+};
+
+static unsigned num_errors;
+
+/* chunks never carry a tag in this program */
+void
+tag_free(G_GNUC_UNUSED struct tag *tag)
+{
+}
+
+static void
+check(bool condition, const char *message)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", message);
+		++num_errors;
+	}
+}
+
+static void
+init_chunk(struct music_chunk *chunk)
+{
+	/* the music_buffer would manage the data buffer */
+	chunk->data = NULL;
+	chunk->capacity = 0;
+	chunk->locked = false;
+	music_chunk_init(chunk);
+}
+
+static void
+free_chunk(struct music_chunk *chunk)
+{
+	music_chunk_free(chunk);
+	g_free(chunk->data);
+}
+
+/**
+ * Fills a chunk with 16 bit mono samples counting up from the first
+ * frame number.
+ */
+static void
+make_chunk(struct music_chunk *chunk, unsigned first_frame)
+{
+	init_chunk(chunk);
+	music_chunk_reserve(chunk, FRAMES * sizeof(int16_t));
+
+	int16_t *p = (int16_t *)chunk->data;
+	for (unsigned i = 0; i < FRAMES; ++i)
+		p[i] = (int16_t)(first_frame + i);
+
+	chunk->length = FRAMES * sizeof(int16_t);
+	chunk->times = (float)first_frame / SAMPLE_RATE;
+}
+
+/**
+ * Reads the next block from the cache, and returns its first sample.
+ */
+static int
+read_first_sample(struct seek_cache *cache, float *times_r)
+{
+	struct music_chunk chunk;
+
+	init_chunk(&chunk);
+	seek_cache_read(cache, &chunk);
+	*times_r = chunk.times;
+
+	int sample = ((const int16_t *)chunk.data)[0];
+	free_chunk(&chunk);
+	return sample;
+}
+
+int main(void)
+{
+	const struct song *song = (const struct song *)&num_errors;
+	struct audio_format audio_format;
+	struct music_chunk chunk;
+	float times;
+
+	audio_format_init(&audio_format, SAMPLE_RATE, SAMPLE_FORMAT_S16, 1);
+
+	/* room for 5 chunks */
+	struct seek_cache *cache =
+		seek_cache_new(5 * FRAMES * sizeof(int16_t));
+
+	for (unsigned i = 0; i < 8; ++i) {
+		make_chunk(&chunk, i * FRAMES);
+		seek_cache_add(cache, song, &audio_format, &chunk);
+		free_chunk(&chunk);
+	}
+
+	check(seek_cache_end(cache, song) > 0.79 &&
+	      seek_cache_end(cache, song) < 0.81, "end of cache");
+	check(seek_cache_end(cache, NULL) < 0, "other song");
+
+	/* the first 3 chunks have been evicted */
+	check(!seek_cache_seek(cache, song, 0.25), "evicted range");
+	check(!seek_cache_seek(cache, song, 0.85), "beyond the end");
+	check(!seek_cache_seek(cache, NULL, 0.5), "seek in other song");
+
+	check(seek_cache_seek(cache, song, 0.35), "seek into the cache");
+	check(read_first_sample(cache, &times) == 350, "first sample");
+	check(times > 0.349 && times < 0.351, "time stamp");
+
+	unsigned blocks = 1;
+	while (seek_cache_is_reading(cache)) {
+		int sample = read_first_sample(cache, &times);
+		check(sample == (int)(400 + (blocks - 1) * FRAMES),
+		      "contiguous read");
+		++blocks;
+	}
+
+	check(blocks == 5, "number of blocks read");
+
+	/* a gap clears the cache */
+	make_chunk(&chunk, 10 * FRAMES);
+	seek_cache_add(cache, song, &audio_format, &chunk);
+	free_chunk(&chunk);
+	check(!seek_cache_seek(cache, song, 0.75), "cleared after gap");
+	check(seek_cache_seek(cache, song, 1.05), "new range");
+
+	seek_cache_free(cache);
+
+	if (num_errors > 0) {
+		fprintf(stderr, "%u errors\n", num_errors);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}